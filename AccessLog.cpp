@@ -0,0 +1,117 @@
+#include <cstdio>
+#include <cstdlib>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "AccessLog.h"
+
+namespace raster
+{
+
+class AccessLog
+{
+public:
+    AccessLog() : m_file(nullptr), m_open(false)
+    {
+        const char* path = getenv("RASTER_ACCESS_LOG");
+        if (path != nullptr && path[0] != '\0')
+            open(path);
+    }
+    ~AccessLog() { close(); }
+
+    int open(const char* path)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_file)
+            fclose(m_file);
+        m_file = (path == nullptr) ? nullptr : fopen(path, "a");
+        m_open = (m_file != nullptr);
+        return (path != nullptr && m_file == nullptr) ? NC_EIO : NC_NOERR;
+    }
+
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_file)
+            fclose(m_file);
+        m_file = nullptr;
+        m_open = false;
+    }
+
+    bool enabled() const { return m_open; }
+
+    void write(const std::string& line)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_file == nullptr)
+            return;
+        fputs(line.c_str(), m_file);
+        fflush(m_file); // keep the log usable if the reader crashes
+    }
+
+private:
+    FILE*               m_file;
+    std::atomic<bool>   m_open;     // checked on every read without the lock
+    std::mutex          m_mutex;
+};
+
+static AccessLog access_log;
+
+AccessScope::AccessScope(const char* op, int var_grp_id, int mask_id, int ndims, const size_t* start, const size_t* count)
+    : m_enabled(op != nullptr && access_log.enabled()), m_op(op), m_var_grp_id(var_grp_id), m_mask_id(mask_id)
+{
+    if (!m_enabled)
+        return;
+    if (ndims < 0 && nc_get_att_int(var_grp_id, NC_GLOBAL, "_ndims_", &ndims) != NC_NOERR)
+    {
+        m_enabled = false;
+        return;
+    }
+    m_start.assign(ndims, 0);
+    if (start != nullptr)
+        m_start.assign(start, start + ndims);
+    m_count.assign(count, count + ndims);
+    m_begin = std::chrono::steady_clock::now();
+}
+
+AccessScope::~AccessScope()
+{
+    if (!m_enabled)
+        return;
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_begin).count();
+    log_access(m_op, m_var_grp_id, m_mask_id, m_start.size(), m_start.data(), m_count.data(), seconds);
+}
+
+} // namespace raster
+
+int set_access_log(const char* path)
+{
+    return raster::access_log.open(path);
+}
+
+int access_log_enabled(void)
+{
+    return raster::access_log.enabled() ? 1 : 0;
+}
+
+void log_access(const char* op, int var_grp_id, int mask_id, int ndims, const size_t* start, const size_t* count,
+                double seconds)
+{
+    char name[NC_MAX_NAME + 1], number[64];
+    size_t pathlen;
+    if (!raster::access_log.enabled() || nc_inq_grpname(var_grp_id, name) != NC_NOERR ||
+        nc_inq_path(var_grp_id, &pathlen, nullptr) != NC_NOERR)
+        return;
+    std::vector<char> path(pathlen + 1);
+    if (nc_inq_path(var_grp_id, nullptr, path.data()) != NC_NOERR)
+        return;
+    std::string line = std::string(op) + " " + name + " " + std::to_string(mask_id) + " " + std::to_string(ndims);
+    for (int i = 0; i < ndims; i++)
+        line += " " + std::to_string(start[i]);
+    for (int i = 0; i < ndims; i++)
+        line += " " + std::to_string(count[i]);
+    snprintf(number, sizeof(number), " %.9f ", seconds);
+    raster::access_log.write(line + number + path.data() + "\n");
+}
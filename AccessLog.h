@@ -0,0 +1,50 @@
+#ifndef __ACCESS_LOG_H__
+#define __ACCESS_LOG_H__
+#include <stdlib.h>
+#include <netcdf.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Access log: when enabled, every region and variable read appends one line to a text file
+//   <op> <variable> <mask id> <ndims> <start[ndims]> <count[ndims]> <seconds> <path>
+// where op is `region`, `var` or `vara`, the mask id is -1 unless op is `region`, and the path is
+// that of the file as opened, up to the end of the line.
+// It is enabled by `RASTER_ACCESS_LOG=<path>` or `set_access_log`, and read by test/relayout.cpp
+int set_access_log(const char* path);
+int access_log_enabled(void);
+void log_access(const char* op, int var_grp_id, int mask_id, int ndims, const size_t* start, const size_t* count,
+                double seconds);
+
+#ifdef __cplusplus
+}
+
+#include <chrono>
+#include <vector>
+
+namespace raster
+{
+
+// logs one access when it goes out of scope, the start is all zeros if `start` is null, and
+// `ndims` is read from the variable if it is negative. A null `op` logs nothing
+class AccessScope
+{
+public:
+    AccessScope(const char* op, int var_grp_id, int mask_id, int ndims, const size_t* start, const size_t* count);
+    ~AccessScope();
+
+private:
+    bool                m_enabled;
+    const char*         m_op;
+    int                 m_var_grp_id;
+    int                 m_mask_id;
+    std::vector<size_t> m_start;
+    std::vector<size_t> m_count;
+    std::chrono::steady_clock::time_point m_begin;
+};
+
+} // namespace raster
+#endif
+
+#endif
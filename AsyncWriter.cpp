@@ -0,0 +1,369 @@
+#include <memory>
+#include <map>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <numeric>
+#include <cstring>
+
+#include "AsyncWriter.h"
+#include "ChunkDataWriter.h"
+#include "RegionalRead.h"
+#include "config.h"
+
+namespace raster
+{
+
+struct write_job_t
+{
+    int                         m_request;
+    int                         m_ncid;
+    int                         m_var_grp_id;
+    nc_type                     m_xtype;
+    int                         m_ndims;
+    bool                        m_append;
+    bool                        m_prefetch;     // loads region `m_mask_id` into the caches, writes nothing
+    int                         m_mask_id;
+    bool                        m_detached;     // nobody waits for it, its status is not kept
+    size_t                      m_start;
+    size_t                      m_nsteps;
+    std::vector<size_t>         m_shape;
+    std::vector<unsigned char>  m_buffer;
+};
+
+// A single background thread owns all netCDF calls of queued jobs, jobs run in submission order,
+// so appends to one variable stay in step order and a prefetch sees the writes queued before it.
+class AsyncWriter
+{
+public:
+    AsyncWriter(size_t budget) : m_budget(budget), m_inflight(0), m_next_request(1), m_stop(false) {};
+    ~AsyncWriter();
+
+    int     submit(write_job_t&& job, const void* data, size_t nbytes, int* request);
+    int     wait(int request);
+    int     wait_all(int ncid);
+    void    wait_writes(int ncid);
+    void    drain();
+    void    set_budget(size_t budget);
+    std::mutex& io_mutex() { return m_io_mutex; }
+
+private:
+    void    run();
+    int     execute(write_job_t& job);
+
+private:
+    std::thread                 m_thread;
+    std::mutex                  m_mutex;
+    std::mutex                  m_io_mutex;
+    std::condition_variable     m_job_cv;
+    std::condition_variable     m_done_cv;
+    std::deque<write_job_t>     m_jobs;
+    std::map<int, int>          m_pending;      // request -> ncid, queued or being written
+    std::map<int, int>          m_file_writes;  // file id -> writes (not prefetches) among them
+    std::map<int, std::pair<int, int> > m_done; // request -> (ncid, status), not waited yet
+    size_t                      m_budget;
+    size_t                      m_inflight;     // bytes held by staging buffers
+    int                         m_next_request;
+    bool                        m_stop;
+};
+
+std::unique_ptr<AsyncWriter> async_writer(new AsyncWriter(WRITE_BUFFER_BYTES));
+
+// netCDF-4 ids carry the file in their upper 16 bits
+static inline bool same_file(int lhs, int rhs) { return (lhs >> 16) == (rhs >> 16); }
+
+AsyncWriter::~AsyncWriter()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_job_cv.notify_all();
+    if (m_thread.joinable())
+        m_thread.join();
+}
+
+int AsyncWriter::submit(write_job_t&& job, const void* data, size_t nbytes, int* request)
+{
+    {
+        // wait for budget before staging, a buffer larger than the budget goes alone
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_done_cv.wait(lock, [&]{ return m_inflight == 0 || m_inflight + nbytes <= m_budget; });
+        m_inflight += nbytes;
+    }
+    job.m_buffer.resize(nbytes);
+    if (nbytes > 0)
+        memcpy(job.m_buffer.data(), data, nbytes);
+    {
+        // the request id and the place in the queue are taken together, so jobs run in id order
+        std::lock_guard<std::mutex> lock(m_mutex);
+        job.m_request = m_next_request++;
+        m_pending.insert({job.m_request, job.m_ncid});
+        if (!job.m_prefetch)
+            m_file_writes[job.m_ncid >> 16]++;
+        if (request != nullptr)
+            *request = job.m_request;
+        m_jobs.push_back(std::move(job));
+        if (!m_thread.joinable())
+            m_thread = std::thread(&AsyncWriter::run, this);
+    }
+    m_job_cv.notify_one();
+    return NC_NOERR;
+}
+
+void AsyncWriter::run()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true)
+    {
+        m_job_cv.wait(lock, [&]{ return m_stop || !m_jobs.empty(); });
+        if (m_jobs.empty()) // stopped and drained
+            return;
+        write_job_t job = std::move(m_jobs.front());
+        m_jobs.pop_front();
+        lock.unlock();
+
+        int status = execute(job);
+        size_t nbytes = job.m_buffer.size();
+        job.m_buffer = std::vector<unsigned char>();
+
+        lock.lock();
+        m_inflight -= nbytes;
+        m_pending.erase(job.m_request);
+        if (!job.m_prefetch && --m_file_writes[job.m_ncid >> 16] == 0)
+            m_file_writes.erase(job.m_ncid >> 16);
+        if (!job.m_detached)
+            m_done.insert({job.m_request, {job.m_ncid, status}});
+        m_done_cv.notify_all();
+    }
+}
+
+// set while this thread runs a prefetch, which lets go of the io lock while it decodes
+static thread_local bool prefetching = false;
+
+int AsyncWriter::execute(write_job_t& job)
+{
+    std::lock_guard<std::mutex> io_lock(m_io_mutex);
+    int status = NC_NOERR;
+    const void* data = job.m_buffer.data();
+    size_t* shape = job.m_shape.data();
+    try
+    {
+        if (job.m_prefetch)
+        {
+            prefetching = true;
+            status = prefetch_region_var(job.m_var_grp_id, job.m_mask_id, job.m_xtype, shape);
+            prefetching = false;
+            return status;
+        }
+        switch (job.m_xtype)
+        {
+        case NC_INT:
+            status = job.m_append ? append_var_int(job.m_ncid, job.m_var_grp_id, (const int*)data, job.m_start, job.m_nsteps, job.m_ndims, shape)
+                                  : write_var_int(job.m_ncid, job.m_var_grp_id, (const int*)data, shape);
+            break;
+        case NC_FLOAT:
+            status = job.m_append ? append_var_float(job.m_ncid, job.m_var_grp_id, (const float*)data, job.m_start, job.m_nsteps, job.m_ndims, shape)
+                                  : write_var_float(job.m_ncid, job.m_var_grp_id, (const float*)data, shape);
+            break;
+        case NC_DOUBLE:
+            status = job.m_append ? append_var_double(job.m_ncid, job.m_var_grp_id, (const double*)data, job.m_start, job.m_nsteps, job.m_ndims, shape)
+                                  : write_var_double(job.m_ncid, job.m_var_grp_id, (const double*)data, shape);
+            break;
+        case NC_CHAR:
+            status = job.m_append ? append_var_char(job.m_ncid, job.m_var_grp_id, (const char*)data, job.m_start, job.m_nsteps, job.m_ndims, shape)
+                                  : write_var_char(job.m_ncid, job.m_var_grp_id, (const char*)data, shape);
+            break;
+        default:
+            status = NC_EBADTYPE;
+        }
+    }
+    catch (const std::bad_alloc&)
+    {
+        prefetching = false;
+        // nobody can catch it on this thread, it is reported through the request status
+        status = NC_ENOMEM;
+    }
+    catch (const std::exception&)
+    {
+        prefetching = false;
+        status = NC_EIO;
+    }
+    return status;
+}
+
+int AsyncWriter::wait(int request)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (m_pending.find(request) == m_pending.end() && m_done.find(request) == m_done.end())
+        return NC_EINVAL; // unknown, or already waited
+    m_done_cv.wait(lock, [&]{ return m_done.find(request) != m_done.end(); });
+    int status = m_done[request].second;
+    m_done.erase(request);
+    return status;
+}
+
+int AsyncWriter::wait_all(int ncid)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    auto matches = [&](int id){ return ncid < 0 || same_file(id, ncid); };
+    m_done_cv.wait(lock, [&]{
+        for (auto& kv : m_pending)
+            if (matches(kv.second))
+                return false;
+        return true;
+    });
+    int status = NC_NOERR;
+    for (auto it = m_done.begin(); it != m_done.end(); )
+    {
+        if (!matches(it->second.first))
+        {
+            it++;
+            continue;
+        }
+        if (status == NC_NOERR)
+            status = it->second.second;
+        it = m_done.erase(it);
+    }
+    return status;
+}
+
+void AsyncWriter::wait_writes(int ncid)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_done_cv.wait(lock, [&]{ return m_file_writes.find(ncid >> 16) == m_file_writes.end(); });
+}
+
+void AsyncWriter::drain()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_done_cv.wait(lock, [&]{ return m_pending.empty(); });
+}
+
+void AsyncWriter::set_budget(size_t budget)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_budget = budget;
+    m_done_cv.notify_all();
+}
+
+static size_t type_size(nc_type xtype)
+{
+    switch (xtype)
+    {
+        case NC_INT: return sizeof(int);
+        case NC_FLOAT: return sizeof(float);
+        case NC_DOUBLE: return sizeof(double);
+        case NC_CHAR: return sizeof(char);
+        default: return 0;
+    }
+}
+
+} // namespace raster
+
+using namespace raster;
+
+int iwrite_var(int ncid, int var_grp_id, nc_type xtype, const void* data, int ndims, size_t* data_shape, int* request)
+{
+    size_t nelems = std::accumulate(data_shape, data_shape + ndims, (size_t)1, [](size_t a, size_t b){ return a * b; });
+    if (type_size(xtype) == 0)
+        return NC_EBADTYPE;
+    write_job_t job;
+    job.m_ncid = ncid;
+    job.m_var_grp_id = var_grp_id;
+    job.m_xtype = xtype;
+    job.m_ndims = ndims;
+    job.m_append = job.m_prefetch = job.m_detached = false;
+    job.m_mask_id = -1;
+    job.m_start = job.m_nsteps = 0;
+    job.m_shape.assign(data_shape, data_shape + ndims);
+    return async_writer->submit(std::move(job), data, nelems * type_size(xtype), request);
+}
+
+int iappend_var(int ncid, int var_grp_id, nc_type xtype, const void* data, size_t start, size_t nsteps,
+                int ndims, size_t* data_shape, int* request)
+{
+    size_t nelems = std::accumulate(data_shape + 1, data_shape + ndims, nsteps, [](size_t a, size_t b){ return a * b; });
+    if (type_size(xtype) == 0)
+        return NC_EBADTYPE;
+    write_job_t job;
+    job.m_ncid = ncid;
+    job.m_var_grp_id = var_grp_id;
+    job.m_xtype = xtype;
+    job.m_ndims = ndims;
+    job.m_append = true;
+    job.m_prefetch = job.m_detached = false;
+    job.m_mask_id = -1;
+    job.m_start = start;
+    job.m_nsteps = nsteps;
+    job.m_shape.assign(data_shape, data_shape + ndims);
+    return async_writer->submit(std::move(job), data, nelems * type_size(xtype), request);
+}
+
+int iprefetch_region(int ncid, int var_grp_id, nc_type xtype, int mask_id, int ndims, size_t* data_shape, int* request)
+{
+    write_job_t job;
+    job.m_ncid = ncid;
+    job.m_var_grp_id = var_grp_id;
+    job.m_xtype = xtype;
+    job.m_ndims = ndims;
+    job.m_append = false;
+    job.m_prefetch = true;
+    job.m_mask_id = mask_id;
+    job.m_detached = (request == nullptr);
+    job.m_start = job.m_nsteps = 0;
+    job.m_shape.assign(data_shape, data_shape + ndims);
+    return async_writer->submit(std::move(job), nullptr, 0, request);
+}
+
+int wait_write(int request)
+{
+    return async_writer->wait(request);
+}
+
+int wait_all_writes(int ncid)
+{
+    return async_writer->wait_all(ncid);
+}
+
+void wait_file_writes(int ncid)
+{
+    async_writer->wait_writes(ncid);
+}
+
+void drain_writes(void)
+{
+    async_writer->drain();
+}
+
+int set_write_budget(size_t nbytes)
+{
+    if (nbytes == 0)
+        return NC_EINVAL;
+    async_writer->set_budget(nbytes);
+    return NC_NOERR;
+}
+
+void lock_io(void)
+{
+    async_writer->io_mutex().lock();
+}
+
+void unlock_io(void)
+{
+    async_writer->io_mutex().unlock();
+}
+
+void yield_io_begin(void)
+{
+    if (prefetching)
+        async_writer->io_mutex().unlock();
+}
+
+void yield_io_end(void)
+{
+    if (prefetching)
+        async_writer->io_mutex().lock();
+}
@@ -0,0 +1,46 @@
+#ifndef __ASYNC_WRITER_H__
+#define __ASYNC_WRITER_H__
+#include <stdlib.h>
+#include <netcdf.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Asynchronous writes: the user buffer is copied into a staging buffer and the call returns,
+// a background thread then writes it with `write_var_*` / `append_var_*`. Staging buffers
+// in flight never exceed the write budget, a submit blocks until enough of them are written.
+int iwrite_var(int ncid, int var_grp_id, nc_type xtype, const void* data, int ndims, size_t* data_shape, int* request);
+int iappend_var(int ncid, int var_grp_id, nc_type xtype, const void* data, size_t start, size_t nsteps,
+                int ndims, size_t* data_shape, int* request);
+
+// Prefetch: queued like a write, the background thread loads the metadata of a region and, with
+// the chunk cache on, its decoded chunks, then a read of it is served from memory. A null
+// `request` detaches it, its status is then dropped. Reads do not wait for prefetches, see
+// `wait_file_writes`
+int iprefetch_region(int ncid, int var_grp_id, nc_type xtype, int mask_id, int ndims, size_t* data_shape, int* request);
+
+// returns the status of the write or prefetch `request`, blocks until it is done
+int wait_write(int request);
+// blocks until all jobs on file `ncid` are done (all files if `ncid` < 0), returns the first error
+int wait_all_writes(int ncid);
+// blocks until all writes and prefetches are done, their status is kept for `wait_write`
+void drain_writes(void);
+// blocks until the writes queued for the file `ncid` are done, not its prefetches; reads then
+// hold the io lock while they call netCDF
+void wait_file_writes(int ncid);
+int set_write_budget(size_t nbytes);
+
+// the background writer holds this lock while it calls netCDF
+void lock_io(void);
+void unlock_io(void);
+// between these calls a prefetch lets go of the io lock, it decodes chunks without calling netCDF.
+// They do nothing on other threads
+void yield_io_begin(void);
+void yield_io_end(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef __CACHE_REGISTRY_H__
+#define __CACHE_REGISTRY_H__
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+
+namespace raster
+{
+
+// Caches owned by single open files, by file id (the upper 16 bits of a netCDF-4 group id, as
+// `ext_ncid`). Other files use the shared cache, and lookups skip the lock while no file owns one.
+// Lookups return a reference the caller holds while it uses the cache, as a file closing meanwhile
+// detaches its cache
+template <typename C>
+class CacheRegistry
+{
+public:
+    explicit CacheRegistry(std::shared_ptr<C>& shared) : m_shared(shared), m_nowned(0) {}
+
+    std::shared_ptr<C> of(int grp_id)
+    {
+        if (m_nowned.load(std::memory_order_acquire) == 0)
+            return m_shared;
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+        auto res = m_owned.find(grp_id >> 16);
+        return (res != m_owned.end()) ? res->second : m_shared;
+    }
+
+    // the cache owned by the file of `grp_id`, null if it has none
+    std::shared_ptr<C> owned(int grp_id)
+    {
+        if (m_nowned.load(std::memory_order_acquire) == 0)
+            return nullptr;
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+        auto res = m_owned.find(grp_id >> 16);
+        return (res != m_owned.end()) ? res->second : nullptr;
+    }
+
+    void attach(int ncid, std::shared_ptr<C> cache)
+    {
+        std::unique_lock<std::shared_mutex> lock(m_mutex);
+        m_owned[ncid >> 16] = cache;
+        m_nowned.store(m_owned.size(), std::memory_order_release);
+    }
+
+    void detach(int ncid)
+    {
+        std::unique_lock<std::shared_mutex> lock(m_mutex);
+        m_owned.erase(ncid >> 16);
+        m_nowned.store(m_owned.size(), std::memory_order_release);
+    }
+
+private:
+    std::shared_ptr<C>&                             m_shared;
+    std::shared_mutex                               m_mutex;
+    std::unordered_map<int, std::shared_ptr<C> >    m_owned;
+    std::atomic<size_t>                             m_nowned;
+};
+
+} // namespace raster
+#endif
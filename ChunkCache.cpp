@@ -0,0 +1,179 @@
+#include <cstdlib>
+
+#include "ChunkCache.h"
+#include "CacheRegistry.h"
+#include "config.h"
+
+namespace raster
+{
+
+static size_t env_chunk_cache_bytes()
+{
+    const char* value = getenv("RASTER_CHUNK_CACHE");
+    return (value != nullptr && value[0] != '\0') ? strtoull(value, nullptr, 10) : CHUNK_CACHE_BYTES;
+}
+
+std::shared_ptr<ChunkCache> chunk_cache(new ChunkCache(env_chunk_cache_bytes(), RASTER_CACHE_LRU));
+static CacheRegistry<ChunkCache> file_caches(chunk_cache);
+
+size_t ChunkCache::key_hash_t::operator()(const chunk_key_t& key) const
+{
+    uint64_t h = ((uint64_t)(uint32_t)key.m_grp << 32) | (uint32_t)key.m_chunk;
+    h ^= (uint64_t)(uint32_t)key.m_part * 0x9e3779b97f4a7c15ULL;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return (size_t)h;
+}
+
+ChunkCache::ChunkCache(size_t capacity_bytes, int policy)
+    : m_capacity(capacity_bytes), m_policy(policy), m_bytes(0), m_hits(0), m_misses(0), m_evictions(0)
+{
+}
+
+ChunkCache::lookup_t ChunkCache::acquire(const chunk_key_t& key)
+{
+    lookup_t res{nullptr, std::shared_future<value_t>(), false};
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto found = m_map.find(key);
+    if (found != m_map.end())
+    {
+        m_hits++;
+        if (m_policy == RASTER_CACHE_LRU)
+            m_order.splice(m_order.begin(), m_order, found->second);
+        res.m_value = found->second->m_value;
+        return res;
+    }
+    m_misses++;
+    auto loading = m_loading.find(key);
+    if (loading != m_loading.end())
+    {
+        res.m_pending = loading->second.m_future;
+        return res;
+    }
+    load_t& load = m_loading[key];
+    load.m_future = load.m_promise.get_future().share();
+    load.m_keep = true;
+    res.m_load = true;
+    return res;
+}
+
+void ChunkCache::put(const chunk_key_t& key, value_t value)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto loading = m_loading.find(key);
+    if (loading == m_loading.end())
+        return;
+    size_t nbytes = value->size() + sizeof(entry_t);
+    size_t capacity = m_capacity;
+    if (loading->second.m_keep && nbytes <= capacity && m_map.find(key) == m_map.end())
+    {
+        evict(capacity - nbytes);
+        m_order.push_front(entry_t{key, value, nbytes});
+        m_map.emplace(key, m_order.begin());
+        m_bytes += nbytes;
+    }
+    loading->second.m_promise.set_value(value);
+    m_loading.erase(loading);
+}
+
+void ChunkCache::cancel(const chunk_key_t& key)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto loading = m_loading.find(key);
+    if (loading == m_loading.end())
+        return;
+    // waiters see a null chunk and load it themselves
+    loading->second.m_promise.set_value(nullptr);
+    m_loading.erase(loading);
+}
+
+void ChunkCache::evict(size_t capacity)
+{
+    // the caller holds the lock
+    while (m_bytes > capacity && !m_order.empty())
+    {
+        entry_t& victim = m_order.back();
+        m_bytes -= victim.m_bytes;
+        m_evictions++;
+        m_map.erase(victim.m_key);
+        m_order.pop_back();
+    }
+}
+
+void ChunkCache::invalidate_file(int ncid)
+{
+    int file = ncid >> 16;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (auto it = m_order.begin(); it != m_order.end();)
+    {
+        if ((it->m_key.m_grp >> 16) != file)
+        {
+            ++it;
+            continue;
+        }
+        m_bytes -= it->m_bytes;
+        m_map.erase(it->m_key);
+        it = m_order.erase(it);
+    }
+    for (auto& loading : m_loading)
+        if ((loading.first.m_grp >> 16) == file)
+            loading.second.m_keep = false;
+}
+
+int ChunkCache::configure(size_t nbytes, int policy)
+{
+    if (policy != RASTER_CACHE_LRU && policy != RASTER_CACHE_FIFO)
+        return NC_EINVAL;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_capacity = nbytes;
+    m_policy = policy;
+    evict(nbytes);
+    return NC_NOERR;
+}
+
+void ChunkCache::get_stats(raster_cache_stats_t& stats) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    stats.hits = m_hits;
+    stats.misses = m_misses;
+    stats.evictions = m_evictions;
+    stats.entries = m_map.size();
+    stats.bytes = m_bytes;
+    stats.capacity = m_capacity;
+}
+
+std::shared_ptr<ChunkCache> chunk_cache_of(int grp_id)
+{
+    return file_caches.of(grp_id);
+}
+
+void attach_chunk_cache(int ncid, std::shared_ptr<ChunkCache> cache)
+{
+    file_caches.attach(ncid, cache);
+}
+
+void detach_chunk_cache(int ncid)
+{
+    file_caches.detach(ncid);
+}
+
+} // namespace raster
+
+int set_chunk_cache(size_t nbytes, int policy)
+{
+    return raster::chunk_cache->configure(nbytes, policy);
+}
+
+int inq_chunk_cache(raster_cache_stats_t* stats)
+{
+    if (stats == nullptr)
+        return NC_EINVAL;
+    raster::chunk_cache->get_stats(*stats);
+    return NC_NOERR;
+}
+
+void invalidate_chunk_cache(int ncid)
+{
+    raster::chunk_cache_of(ncid)->invalidate_file(ncid);
+}
@@ -0,0 +1,123 @@
+#ifndef __CHUNK_CACHE_H__
+#define __CHUNK_CACHE_H__
+#include <stdlib.h>
+#include <netcdf.h>
+#include "raster.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Chunk cache: decoded chunks (and parts of split mixed chunks) kept across region and box reads,
+// so that repeated reads skip both netCDF and the codec. It is off until given a budget, by
+// `set_chunk_cache` or `RASTER_CHUNK_CACHE=<bytes>` at startup. Writing a variable or closing
+// a file drops the chunks of that file, so does meeting its id with another path, as netCDF reuses
+// the ids of closed files. The budget and counters are those of the shared cache, a file opened as
+// a `raster::File` has a cache of its own, which `invalidate_chunk_cache` acts on while it is open
+int set_chunk_cache(size_t nbytes, int policy);
+int inq_chunk_cache(raster_cache_stats_t* stats);
+void invalidate_chunk_cache(int ncid);
+
+#ifdef __cplusplus
+}
+
+#include <atomic>
+#include <cstdint>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace raster
+{
+
+// a chunk of a region group, `m_part` is the index of the part of a split chunk in the layout, or -1
+struct chunk_key_t
+{
+    int m_grp;
+    int m_chunk;
+    int m_part;
+    bool operator==(const chunk_key_t& other) const
+    {
+        return m_grp == other.m_grp && m_chunk == other.m_chunk && m_part == other.m_part;
+    }
+};
+
+// Loads are coalesced: the first reader missing a chunk is told to load it, and others asking
+// for it meanwhile get a future of that load. A reader must `put` or `cancel` each chunk it was
+// told to load, and must not wait on another load while it holds loads of its own, or two
+// readers could wait on each other
+class ChunkCache
+{
+public:
+    typedef std::shared_ptr<const std::vector<unsigned char> > value_t;
+
+    struct lookup_t
+    {
+        value_t                     m_value;    // the decoded chunk on a hit
+        std::shared_future<value_t> m_pending;  // valid if another reader is loading it, null if it gives up
+        bool                        m_load;     // the caller loads it
+    };
+
+    ChunkCache(size_t capacity_bytes, int policy);
+    bool enabled() const { return m_capacity.load(std::memory_order_relaxed) > 0; }
+
+    lookup_t acquire(const chunk_key_t& key);
+    void put(const chunk_key_t& key, value_t value);
+    void cancel(const chunk_key_t& key);
+
+    // drops all chunks of the file `ncid`, loads in flight still reach their waiters but are not kept
+    void invalidate_file(int ncid);
+    // `RASTER_CACHE_LRU` or `RASTER_CACHE_FIFO`, a zero budget turns the cache off
+    int configure(size_t nbytes, int policy);
+    void get_stats(raster_cache_stats_t& stats) const;
+
+private:
+    struct key_hash_t
+    {
+        size_t operator()(const chunk_key_t& key) const;
+    };
+
+    struct entry_t
+    {
+        chunk_key_t m_key;
+        value_t     m_value;
+        size_t      m_bytes;
+    };
+
+    struct load_t
+    {
+        std::promise<value_t>       m_promise;
+        std::shared_future<value_t> m_future;
+        bool                        m_keep;     // false once its file is invalidated
+    };
+
+    void evict(size_t capacity);
+
+private:
+    std::atomic<size_t>     m_capacity;
+    int                     m_policy;
+    mutable std::mutex      m_mutex;
+    std::list<entry_t>      m_order;    // next to evict last
+    std::unordered_map<chunk_key_t, std::list<entry_t>::iterator, key_hash_t>   m_map;
+    std::unordered_map<chunk_key_t, load_t, key_hash_t>                         m_loading;
+    size_t                  m_bytes;
+    uint64_t                m_hits;
+    uint64_t                m_misses;
+    uint64_t                m_evictions;
+};
+
+extern std::shared_ptr<ChunkCache> chunk_cache;
+
+// cache of the file of `grp_id`: its own one while attached, `chunk_cache` otherwise
+std::shared_ptr<ChunkCache> chunk_cache_of(int grp_id);
+// gives the file `ncid` a cache of its own until detached, as a `raster::File` does while open
+void attach_chunk_cache(int ncid, std::shared_ptr<ChunkCache> cache);
+void detach_chunk_cache(int ncid);
+
+} // namespace raster
+#endif
+
+#endif
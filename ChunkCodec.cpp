@@ -0,0 +1,411 @@
+#include <string.h>
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <zlib.h>
+#ifdef RASTER_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "ChunkCodec.h"
+#include "VarCompress.h"
+
+namespace raster
+{
+
+// --- byte shuffle filter ---
+
+template <int ES>
+static void shuffle_fixed(const unsigned char* src, size_t nelems, unsigned char* dst)
+{
+    for (size_t i = 0; i < nelems; i++)
+        for (int b = 0; b < ES; b++)
+            dst[b * nelems + i] = src[i * ES + b];
+}
+
+template <int ES>
+static void unshuffle_fixed(const unsigned char* src, size_t nelems, unsigned char* dst)
+{
+    for (size_t i = 0; i < nelems; i++)
+        for (int b = 0; b < ES; b++)
+            dst[i * ES + b] = src[b * nelems + i];
+}
+
+static void shuffle(const unsigned char* src, size_t nbytes, int elemsize, unsigned char* dst)
+{
+    size_t nelems = nbytes / elemsize;
+    switch (elemsize)
+    {
+        case 2: shuffle_fixed<2>(src, nelems, dst); break;
+        case 4: shuffle_fixed<4>(src, nelems, dst); break;
+        case 8: shuffle_fixed<8>(src, nelems, dst); break;
+        default:
+            for (size_t i = 0; i < nelems; i++)
+                for (int b = 0; b < elemsize; b++)
+                    dst[b * nelems + i] = src[i * elemsize + b];
+    }
+    memcpy(dst + nelems * elemsize, src + nelems * elemsize, nbytes - nelems * elemsize);
+}
+
+static void unshuffle(const unsigned char* src, size_t nbytes, int elemsize, unsigned char* dst)
+{
+    size_t nelems = nbytes / elemsize;
+    switch (elemsize)
+    {
+        case 2: unshuffle_fixed<2>(src, nelems, dst); break;
+        case 4: unshuffle_fixed<4>(src, nelems, dst); break;
+        case 8: unshuffle_fixed<8>(src, nelems, dst); break;
+        default:
+            for (size_t i = 0; i < nelems; i++)
+                for (int b = 0; b < elemsize; b++)
+                    dst[i * elemsize + b] = src[b * nelems + i];
+    }
+    memcpy(dst + nelems * elemsize, src + nelems * elemsize, nbytes - nelems * elemsize);
+}
+
+
+// --- RLZ: a byte-oriented LZ77 codec in the style of LZ4 ---
+// A block is a list of sequences: token(literal length:4 | match length - 4:4), optional
+// literal length extension bytes, literals, 16-bit little-endian match offset, optional
+// match length extension bytes. The last sequence carries literals only.
+
+#define RLZ_HASH_BITS   16
+#define RLZ_MIN_MATCH   4
+#define RLZ_LAST_LITERALS 5
+#define RLZ_MAX_OFFSET  65535
+
+static inline uint32_t rlz_read32(const unsigned char* p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t rlz_hash(uint32_t seq, int bits)
+{
+    return (seq * 2654435761u) >> (32 - bits);
+}
+
+static inline void rlz_put_length(unsigned char* &op, size_t len)
+{
+    while (len >= 255)
+    {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (unsigned char)len;
+}
+
+static size_t rlz_bound(size_t nbytes)
+{
+    return nbytes + nbytes / 255 + 16;
+}
+
+static size_t rlz_compress(const unsigned char* src, size_t nbytes, unsigned char* dst)
+{
+    // the table is sized to the input so small chunks and codec trials clear little of it,
+    // positions are kept modulo 2^32, which is safe as every match is checked against the input
+    int bits = 1;
+    while (bits < RLZ_HASH_BITS && ((size_t)1 << bits) < nbytes)
+        bits++;
+    static thread_local std::vector<uint32_t> table;
+    table.assign((size_t)1 << bits, 0);
+    unsigned char* op = dst;
+    size_t ip = 0, anchor = 0;
+    size_t match_limit = nbytes > RLZ_LAST_LITERALS ? nbytes - RLZ_LAST_LITERALS : 0;
+
+    auto emit = [&](size_t literals, size_t offset, size_t match_len) {
+        unsigned char* token = op++;
+        *token = (unsigned char)((literals >= 15 ? 15 : literals) << 4);
+        if (literals >= 15)
+            rlz_put_length(op, literals - 15);
+        memcpy(op, src + anchor, literals);
+        op += literals;
+        if (match_len == 0)
+            return;
+        *op++ = (unsigned char)(offset & 0xff);
+        *op++ = (unsigned char)(offset >> 8);
+        size_t ml = match_len - RLZ_MIN_MATCH;
+        *token |= (unsigned char)(ml >= 15 ? 15 : ml);
+        if (ml >= 15)
+            rlz_put_length(op, ml - 15);
+    };
+
+    while (ip + RLZ_MIN_MATCH <= match_limit)
+    {
+        uint32_t seq = rlz_read32(src + ip);
+        uint32_t h = rlz_hash(seq, bits);
+        size_t offset = (uint32_t)ip - table[h];
+        table[h] = (uint32_t)ip;
+        if (offset == 0 || offset > RLZ_MAX_OFFSET || offset > ip || rlz_read32(src + ip - offset) != seq)
+        {
+            ip++;
+            continue;
+        }
+        size_t ref = ip - offset;
+        // extend the match 8 bytes at a time
+        size_t len = RLZ_MIN_MATCH;
+        bool mismatch = false;
+        while (!mismatch && ip + len + 8 <= match_limit)
+        {
+            uint64_t a, b;
+            memcpy(&a, src + ref + len, 8);
+            memcpy(&b, src + ip + len, 8);
+            if (a != b)
+            {
+                len += __builtin_ctzll(a ^ b) / 8;
+                mismatch = true;
+            }
+            else
+                len += 8;
+        }
+        while (!mismatch && ip + len < match_limit && src[ref + len] == src[ip + len])
+            len++;
+        emit(ip - anchor, ip - ref, len);
+        ip += len;
+        anchor = ip;
+    }
+    emit(nbytes - anchor, 0, 0);
+    return op - dst;
+}
+
+static size_t rlz_decompress(const unsigned char* src, size_t nbytes, unsigned char* dst, size_t capacity)
+{
+    size_t ip = 0, op = 0;
+    auto get_length = [&](size_t len) {
+        unsigned char b;
+        do
+        {
+            if (ip >= nbytes)
+                throw std::runtime_error("RLZ - Error: truncated input");
+            b = src[ip++];
+            len += b;
+        } while (b == 255);
+        return len;
+    };
+
+    while (ip < nbytes)
+    {
+        unsigned char token = src[ip++];
+        size_t literals = token >> 4;
+        if (literals == 15)
+            literals = get_length(literals);
+        if (ip + literals > nbytes || op + literals > capacity)
+            throw std::runtime_error("RLZ - Error: literals out of range");
+        memcpy(dst + op, src + ip, literals);
+        ip += literals;
+        op += literals;
+        if (ip >= nbytes)
+            break; // last sequence
+
+        if (ip + 2 > nbytes)
+            throw std::runtime_error("RLZ - Error: truncated offset");
+        size_t offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        size_t len = token & 0xf;
+        if (len == 15)
+            len = get_length(len);
+        len += RLZ_MIN_MATCH;
+        if (offset == 0 || offset > op || op + len > capacity)
+            throw std::runtime_error("RLZ - Error: match out of range");
+        unsigned char* out = dst + op;
+        const unsigned char* ref = out - offset;
+        if (offset >= len)
+            memcpy(out, ref, len);
+        else
+            for (size_t i = 0; i < len; i++) out[i] = ref[i]; // overlapping copy, e.g. runs
+        op += len;
+    }
+    return op;
+}
+
+
+// --- codec dispatch ---
+
+bool codec_available(CODEC codec)
+{
+    switch (codec)
+    {
+        case CODEC::NONE:
+        case CODEC::RLZ:
+        case CODEC::ZLIB: return true;
+#ifdef RASTER_HAVE_ZSTD
+        case CODEC::ZSTD: return true;
+#endif
+        default: return false;
+    }
+}
+
+std::vector<codec_t> codec_candidates()
+{
+    std::vector<codec_t> ret = {
+        codec_t(CODEC::RLZ, CODEC_FILTER_SHUFFLE, 0),
+        codec_t(CODEC::ZLIB, CODEC_FILTER_SHUFFLE, ZLEVEL_LOW),
+        codec_t(CODEC::ZLIB, CODEC_FILTER_SHUFFLE, ZLEVEL_MID),
+        codec_t(CODEC::ZLIB, CODEC_FILTER_SHUFFLE, ZLEVEL_HIGH),
+    };
+    if (codec_available(CODEC::ZSTD))
+    {
+        ret.push_back(codec_t(CODEC::ZSTD, CODEC_FILTER_SHUFFLE, 1));
+        ret.push_back(codec_t(CODEC::ZSTD, CODEC_FILTER_SHUFFLE, 3));
+    }
+    return ret;
+}
+
+codec_t strongest_codec()
+{
+    if (codec_available(CODEC::ZSTD))
+        return codec_t(CODEC::ZSTD, CODEC_FILTER_SHUFFLE, 19);
+    return codec_t(CODEC::ZLIB, CODEC_FILTER_SHUFFLE, 9);
+}
+
+void encode_chunk(const unsigned char* src, size_t nbytes, int elemsize, const codec_t& codec,
+                  std::vector<unsigned char>& dst)
+{
+    static thread_local std::vector<unsigned char> shuffled;
+    const unsigned char* input = src;
+    codec_header_t header;
+    size_t payload = 0, bound = nbytes;
+
+    header.m_magic = CODEC_MAGIC;
+    header.m_version = CODEC_VERSION;
+    header.m_codec = (uint8_t)codec.m_codec;
+    header.m_filter = (uint8_t)codec.m_filter;
+    header.m_elemsize = (uint8_t)elemsize;
+    header.m_level = (uint8_t)codec.m_level;
+    header.m_reserved = 0;
+    header.m_rawsize = nbytes;
+
+    if ((codec.m_filter & CODEC_FILTER_SHUFFLE) && elemsize > 1 && codec.m_codec != CODEC::NONE)
+    {
+        shuffled.resize(nbytes);
+        shuffle(src, nbytes, elemsize, shuffled.data());
+        input = shuffled.data();
+    }
+    else
+        header.m_filter = CODEC_FILTER_NONE;
+
+    switch (codec.m_codec)
+    {
+        case CODEC::RLZ: bound = rlz_bound(nbytes); break;
+        case CODEC::ZLIB: bound = compressBound(nbytes); break;
+#ifdef RASTER_HAVE_ZSTD
+        case CODEC::ZSTD: bound = ZSTD_compressBound(nbytes); break;
+#endif
+        default: break;
+    }
+    dst.resize(sizeof(codec_header_t) + std::max(bound, nbytes));
+    unsigned char* out = dst.data() + sizeof(codec_header_t);
+
+    switch (codec.m_codec)
+    {
+        case CODEC::NONE:
+            payload = nbytes;
+            break;
+        case CODEC::RLZ:
+            payload = rlz_compress(input, nbytes, out);
+            break;
+        case CODEC::ZLIB:
+        {
+            uLongf zipped = bound;
+            payload = (compress2(out, &zipped, input, nbytes, codec.m_level) == Z_OK) ? zipped : nbytes;
+            break;
+        }
+#ifdef RASTER_HAVE_ZSTD
+        case CODEC::ZSTD:
+        {
+            size_t zipped = ZSTD_compress(out, bound, input, nbytes, codec.m_level);
+            payload = ZSTD_isError(zipped) ? nbytes : zipped;
+            break;
+        }
+#endif
+        default:
+            throw std::runtime_error("Encode_chunk - Error: codec " + std::to_string((int)codec.m_codec) + " is not available");
+    }
+
+    // store incompressible chunks as they are
+    if (payload >= nbytes)
+    {
+        header.m_codec = (uint8_t)CODEC::NONE;
+        header.m_filter = CODEC_FILTER_NONE;
+        header.m_level = 0;
+        payload = nbytes;
+        memcpy(out, src, nbytes);
+    }
+    memcpy(dst.data(), &header, sizeof(codec_header_t));
+    dst.resize(sizeof(codec_header_t) + payload);
+}
+
+// blobs come from netCDF buffers at any alignment, so the header is copied out of them
+static codec_header_t check_header(const unsigned char* src, size_t nbytes)
+{
+    codec_header_t header;
+    if (nbytes < sizeof(codec_header_t))
+        throw std::runtime_error("Decode_chunk - Error: invalid chunk header");
+    memcpy(&header, src, sizeof(codec_header_t));
+    if (header.m_magic != CODEC_MAGIC)
+        throw std::runtime_error("Decode_chunk - Error: invalid chunk header");
+    if (header.m_version > CODEC_VERSION)
+        throw std::runtime_error("Decode_chunk - Error: unsupported codec version " + std::to_string(header.m_version));
+    return header;
+}
+
+size_t decoded_size(const unsigned char* src, size_t nbytes)
+{
+    return check_header(src, nbytes).m_rawsize;
+}
+
+size_t decode_chunk(const unsigned char* src, size_t nbytes, unsigned char* dst, size_t capacity)
+{
+    static thread_local std::vector<unsigned char> shuffled;
+    const codec_header_t header = check_header(src, nbytes);
+    const unsigned char* input = src + sizeof(codec_header_t);
+    size_t input_size = nbytes - sizeof(codec_header_t), rawsize = header.m_rawsize;
+    bool unshuffle_needed = (header.m_filter & CODEC_FILTER_SHUFFLE) && header.m_elemsize > 1;
+    unsigned char* out = dst;
+
+    if (rawsize > capacity)
+        throw std::runtime_error("Decode_chunk - Error: output buffer too small");
+    if (unshuffle_needed)
+    {
+        shuffled.resize(rawsize);
+        out = shuffled.data();
+    }
+
+    switch ((CODEC)header.m_codec)
+    {
+        case CODEC::NONE:
+            if (input_size != rawsize)
+                throw std::runtime_error("Decode_chunk - Error: raw chunk size mismatch");
+            memcpy(out, input, rawsize);
+            break;
+        case CODEC::RLZ:
+            if (rlz_decompress(input, input_size, out, rawsize) != rawsize)
+                throw std::runtime_error("Decode_chunk - Error: RLZ chunk size mismatch");
+            break;
+        case CODEC::ZLIB:
+        {
+            uLongf unzipped = rawsize;
+            if (uncompress(out, &unzipped, input, input_size) != Z_OK || unzipped != rawsize)
+                throw std::runtime_error("Decode_chunk - Error: corrupted zlib chunk");
+            break;
+        }
+#ifdef RASTER_HAVE_ZSTD
+        case CODEC::ZSTD:
+        {
+            size_t unzipped = ZSTD_decompress(out, rawsize, input, input_size);
+            if (ZSTD_isError(unzipped) || unzipped != rawsize)
+                throw std::runtime_error("Decode_chunk - Error: corrupted zstd chunk");
+            break;
+        }
+#endif
+        default:
+            throw std::runtime_error("Decode_chunk - Error: codec " + std::to_string(header.m_codec) + " is not available");
+    }
+
+    if (unshuffle_needed)
+        unshuffle(shuffled.data(), rawsize, header.m_elemsize, dst);
+    return rawsize;
+}
+
+} // namespace raster
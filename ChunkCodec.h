@@ -0,0 +1,69 @@
+#ifndef __CHUNK_CODEC_H__
+#define __CHUNK_CODEC_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+namespace raster
+{
+
+// Codecs applied by RASTER itself to chunk blobs, before `nc_put_var_ubyte` and after
+// `nc_get_var_ubyte`. Regions written with a codec carry a `_codec_` attribute, and every
+// chunk blob in them starts with a `codec_header_t`.
+enum class CODEC : uint8_t {NONE = 0, RLZ = 1, ZLIB = 2, ZSTD = 3};
+
+#define CODEC_FILTER_NONE       0x0
+#define CODEC_FILTER_SHUFFLE    0x1     // transpose bytes by element size before compression
+
+#define CODEC_MAGIC             0x52    // 'R'
+#define CODEC_VERSION           1
+
+struct codec_t
+{
+    codec_t() : m_codec(CODEC::NONE), m_filter(CODEC_FILTER_NONE), m_level(0) {};
+    codec_t(CODEC codec, int filter, int level) : m_codec(codec), m_filter(filter), m_level(level) {};
+
+    CODEC   m_codec;
+    int     m_filter;
+    int     m_level;
+};
+
+// fixed 16-byte header in front of each encoded chunk
+struct codec_header_t
+{
+    uint8_t     m_magic;
+    uint8_t     m_version;
+    uint8_t     m_codec;
+    uint8_t     m_filter;
+    uint8_t     m_elemsize;
+    uint8_t     m_level;
+    uint16_t    m_reserved;
+    uint64_t    m_rawsize;
+};
+static_assert(sizeof(codec_header_t) == 16, "codec header must be 16 bytes");
+
+// returns true if `codec` was compiled into this build of RASTER
+bool codec_available(CODEC codec);
+
+// all codec configurations the zip level detector should try, cheapest first
+std::vector<codec_t> codec_candidates();
+
+// the codec configuration with the best ratio in this build, for rarely read data
+codec_t strongest_codec();
+
+// encode `nbytes` bytes from `src` into `dst` (header included), elements are `elemsize` bytes wide.
+// Falls back to CODEC::NONE if the encoded payload would not be smaller than the input.
+void encode_chunk(const unsigned char* src, size_t nbytes, int elemsize, const codec_t& codec,
+                  std::vector<unsigned char>& dst);
+
+// decode an encoded chunk blob of `nbytes` bytes into `dst`, which holds `capacity` bytes.
+// Returns the number of decoded bytes.
+size_t decode_chunk(const unsigned char* src, size_t nbytes, unsigned char* dst, size_t capacity);
+
+// size of the raw chunk stored in an encoded blob
+size_t decoded_size(const unsigned char* src, size_t nbytes);
+
+} // namespace raster
+
+#endif // __CHUNK_CODEC_H__
@@ -1,13 +1,25 @@
 #include <random>
+#include <cmath>
 #include <netcdf.h>
+#include <netcdf_par.h>
+#include <mpi.h>
 #include <zlib.h>
 #include <chrono>
+#include <atomic>
+#include <thread>
+#include <omp.h>
+#include <map>
+#include <set>
+#include <unordered_map>
 
 #include "ChunkDataWriter.h"
+#include "ChunkCodec.h"
 #include "IndexManager.h"
 #include "MetaCache.h"
+#include "MetadataHandler.h"
 #include "VarCompress.h"
 #include "config.h"
+#include "raster.h"
 
 using namespace raster;
 using namespace std::chrono;
@@ -31,7 +43,7 @@ static void memcpy_chk3d(T* dest, const T* src, size_t* start, size_t* varshape,
 
     for (size_t layer = 0; layer < chkshape[0]; layer++)
     {
-        memcpy_chk2d<T>(dest + layer * chkshape[1] * chkshape[2], src + layer * varshape[1] * varshape[2], 
+        memcpy_chk2d<T>(dest + layer * chkshape[1] * chkshape[2], src + (layer + start[0]) * varshape[1] * varshape[2], 
                         start + 1, varshape + 1, chkshape + 1);
     }
 }
@@ -44,184 +56,1096 @@ static void memcpy_chk4d(T* dest, const T* src, size_t* start, size_t* varshape,
 
     for (size_t layer = 0; layer < chkshape[0]; layer++)
     {
-        memcpy_chk3d<T>(dest + layer * chkshape[1] * chkshape[2] * chkshape[3], src + layer * varshape[1] * varshape[2] * varshape[3], 
+        memcpy_chk3d<T>(dest + layer * chkshape[1] * chkshape[2] * chkshape[3], src + (layer + start[0]) * varshape[1] * varshape[2] * varshape[3], 
                         start + 1, varshape + 1, chkshape + 1);
     }
 }
 
+template <typename T>
+static void gather_chunk(T* dest, const T* data, int ndims, uint64_t* chunk_meta, size_t* data_shape)
+{
+    switch (ndims)
+    {
+        case 2: memcpy_chk2d<T>(dest, data, &chunk_meta[1], data_shape, &chunk_meta[1 + ndims]); break;
+        case 3: memcpy_chk3d<T>(dest, data, &chunk_meta[1], data_shape, &chunk_meta[1 + ndims]); break;
+        case 4: memcpy_chk4d<T>(dest, data, &chunk_meta[1], data_shape, &chunk_meta[1 + ndims]); break;
+        default: throw std::runtime_error("Unsupported dimension: " + std::to_string(ndims));
+    }
+}
+
+// returns true if all elements of the chunk share one bit pattern, e.g. `_FillValue` or zeros
+template <typename T>
+static bool is_uniform_chunk(const T* chunk, size_t chunksize)
+{
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(chunk);
+    return chunksize > 0 && memcmp(bytes, bytes + sizeof(T), (chunksize - 1) * sizeof(T)) == 0;
+}
+
+// value range of a chunk, see `chunk_stats_t`
+template <typename T>
+static chunk_stats_t compute_chunk_stats(int chunk_id, const T* chunk, size_t chunksize, double fill)
+{
+    chunk_stats_t stats = {(double)chunk_id, NAN, NAN, 0, 0};
+    double lo = INFINITY, hi = -INFINITY;
+    for (size_t i = 0; i < chunksize; i++)
+    {
+        double value = (double)chunk[i];
+        if (value != value)
+            stats.m_nnan++;
+        else if (value == fill)
+            stats.m_nfill++;
+        else
+        {
+            lo = std::min(lo, value);
+            hi = std::max(hi, value);
+        }
+    }
+    if (lo <= hi)
+    {
+        stats.m_min = lo;
+        stats.m_max = hi;
+    }
+    return stats;
+}
+
+// `_chunk_stats_` holds one `chunk_stats_t` row per chunk of the region, in metadata order
+static int def_chunk_stats(int region_grp_id, size_t nrows, int* varid)
+{
+    int status, dimids[2];
+    status = nc_def_dim(region_grp_id, "_chunk_stats_rows_", nrows, &dimids[0]);
+    status = nc_def_dim(region_grp_id, "_chunk_stats_cols_", sizeof(chunk_stats_t) / sizeof(double), &dimids[1]);
+    return nc_def_var(region_grp_id, "_chunk_stats_", NC_DOUBLE, 2, dimids, varid);
+}
+
+// A mixed chunk split by region (see `LayoutIndex::m_parts`) is stored as the blobs of its parts
+// back to back, each part holding the cells of one region, layer by layer along its runs. Their
+// lengths go to `part_sizes`, indexed like `m_parts`
+template <typename T>
+static void encode_chunk_parts(const T* chunk, size_t chunksize, size_t plane, const LayoutIndex& parts, int row,
+                               const codec_t& codec, std::vector<unsigned char>& blob, unsigned long long* part_sizes)
+{
+    static thread_local std::vector<T> cells;
+    static thread_local std::vector<unsigned char> encoded;
+    size_t nlayers = chunksize / plane;
+    blob.clear();
+    for (size_t p = parts.m_part_offsets[row]; p < parts.m_part_offsets[row + 1]; p++)
+    {
+        const cell_part_t& part = parts.m_parts[p];
+        const uint32_t* runs = &parts.m_runs[part.m_run_offset];
+        T* pos;
+        cells.resize(part.m_ncells * nlayers);
+        pos = cells.data();
+        for (size_t layer = 0; layer < nlayers; layer++)
+        {
+            for (int r = 0; r < part.m_nruns; r++)
+            {
+                memcpy(pos, chunk + layer * plane + runs[2 * r], runs[2 * r + 1] * sizeof(T));
+                pos += runs[2 * r + 1];
+            }
+        }
+        encode_chunk(reinterpret_cast<const unsigned char*>(cells.data()), cells.size() * sizeof(T), sizeof(T), codec, encoded);
+        blob.insert(blob.end(), encoded.begin(), encoded.end());
+        part_sizes[p] = encoded.size();
+    }
+}
+
+// `_part_table_` rows (chunk id, region id, offset in the chunk blob, length) of the split chunks of a
+// region group marked `_split_`, uniform chunks have no blob and no rows
+static std::vector<uint64_t> make_part_table(const uint64_t* region_meta, int meta_rows, int meta_cols, const LayoutIndex& parts,
+                                             const unsigned long long* part_sizes, const unsigned char* uniform)
+{
+    std::vector<uint64_t> table;
+    for (int i = 0; i < meta_rows; i++)
+    {
+        uint64_t offset = 0;
+        if (uniform[i])
+            continue;
+        for (size_t p = parts.m_part_offsets[i]; p < parts.m_part_offsets[i + 1]; p++)
+        {
+            table.insert(table.end(), {region_meta[i * meta_cols], (uint64_t)parts.m_parts[p].m_region, offset, part_sizes[p]});
+            offset += part_sizes[p];
+        }
+    }
+    return table;
+}
+
+static int def_part_table(int region_grp_id, size_t nrows, int* varid)
+{
+    int status, dimids[2];
+    status = nc_def_dim(region_grp_id, "_part_table_rows_", nrows, &dimids[0]);
+    status = nc_def_dim(region_grp_id, "_part_table_cols_", 4, &dimids[1]);
+    return nc_def_var(region_grp_id, "_part_table_", NC_UINT64, 2, dimids, varid);
+}
+
+// ids and raw values of the uniform chunks of a region group, as the attributes `_uniform_chunks_` and
+// `_uniform_values_`, or as variables of the same names past UNIFORM_ATT_BYTES, as HDF5 keeps attributes
+// in the object header of at most 64 KiB. In a parallel write all ranks call it, only `writer` puts values
+static int put_uniform_chunks(int region_grp_id, const std::vector<int>& ids, const unsigned char* values, size_t nbytes,
+                              bool par=false, bool writer=true)
+{
+    int status, dimids[2], varids[2];
+    if (ids.size() * sizeof(int) + nbytes <= UNIFORM_ATT_BYTES)
+    {
+        status = nc_put_att_int(region_grp_id, NC_GLOBAL, "_uniform_chunks_", NC_INT, ids.size(), ids.data());
+        if (status != NC_NOERR)
+            return status;
+        return nc_put_att_ubyte(region_grp_id, NC_GLOBAL, "_uniform_values_", NC_UBYTE, nbytes, values);
+    }
+    status = nc_def_dim(region_grp_id, "_uniform_chunks_rows_", ids.size(), &dimids[0]);
+    status = nc_def_dim(region_grp_id, "_uniform_values_bytes_", nbytes, &dimids[1]);
+    status = nc_def_var(region_grp_id, "_uniform_chunks_", NC_INT, 1, &dimids[0], &varids[0]);
+    status = nc_def_var(region_grp_id, "_uniform_values_", NC_UBYTE, 1, &dimids[1], &varids[1]);
+    if (status != NC_NOERR)
+        return status;
+    for (int v = 0; par && v < 2; v++)
+        status = nc_var_par_access(region_grp_id, varids[v], NC_INDEPENDENT);
+    if (!writer)
+        return status;
+    status = nc_put_var_int(region_grp_id, varids[0], ids.data());
+    if (status != NC_NOERR)
+        return status;
+    return nc_put_var_ubyte(region_grp_id, varids[1], values);
+}
+
+// Stores the encoded chunks of one region, either as one variable per chunk (`chunk_<id>`),
+// or packed back to back into a single `_data_` variable, located by the `_chunk_table_`
+// rows (chunk id, offset, length). Only the netCDF-owning thread may use it.
+class RegionChunkWriter
+{
+public:
+    RegionChunkWriter(int region_grp_id, int storage) : m_grp_id(region_grp_id), m_storage(storage), 
+                                                         m_data_id(-1), m_offset(0) {};
+
+    int put(int chunk_id, const std::vector<unsigned char>& blob)
+    {
+        int status = NC_NOERR;
+        char buffer[128];
+        if (m_storage != RASTER_STORAGE_PACKED)
+        {
+            int varsize_dimid, varid;
+            sprintf(buffer, "_chunk_%d_size_", chunk_id);
+            status = nc_def_dim(m_grp_id, buffer, blob.size(), &varsize_dimid);
+            sprintf(buffer, "chunk_%d", chunk_id);
+            status = nc_def_var(m_grp_id, buffer, NC_UBYTE, 1, &varsize_dimid, &varid);
+            return nc_put_var_ubyte(m_grp_id, varid, blob.data());
+        }
+        if (m_data_id < 0)
+        {
+            int data_dimid;
+            size_t hdf5_chunk = PACKED_CHUNK_BYTES;
+            status = nc_def_dim(m_grp_id, "_data_size_", NC_UNLIMITED, &data_dimid);
+            status = nc_def_var(m_grp_id, "_data_", NC_UBYTE, 1, &data_dimid, &m_data_id);
+            status = nc_def_var_chunking(m_grp_id, m_data_id, NC_CHUNKED, &hdf5_chunk);
+        }
+        size_t start = m_offset, count = blob.size();
+        status = nc_put_vara_ubyte(m_grp_id, m_data_id, &start, &count, blob.data());
+        m_table.insert(m_table.end(), {(uint64_t)chunk_id, m_offset, blob.size()});
+        m_offset += blob.size();
+        return status;
+    }
+
+    int finish()
+    {
+        int status = NC_NOERR, dimids[2], table_id;
+        if (m_storage != RASTER_STORAGE_PACKED || m_table.empty())
+            return status;
+        status = nc_def_dim(m_grp_id, "_chunk_table_rows_", m_table.size() / 3, &dimids[0]);
+        status = nc_def_dim(m_grp_id, "_chunk_table_cols_", 3, &dimids[1]);
+        status = nc_def_var(m_grp_id, "_chunk_table_", NC_UINT64, 2, dimids, &table_id);
+        return nc_put_var_ulonglong(m_grp_id, table_id, (unsigned long long*)m_table.data());
+    }
+
+private:
+    int m_grp_id, m_storage, m_data_id;
+    size_t m_offset;
+    std::vector<uint64_t> m_table;
+};
+
+// Codec detection, our algorithm will compress those regions with a high compress ratio
+// which indicates that region has a high probability to be a invalid region (at least it
+// has a low information entropy). Each candidate codec is tried on the sampled chunks, and
+// the one with the lowest estimated cost (encoding and decoding time + writing and reading
+// back the encoded bytes once) is chosen for the whole region.
+template <typename T>
+static codec_t detect_codec(uint64_t* region_meta, int meta_rows, int meta_cols, const std::vector<size_t>& chunk_sizes,
+                            const T* data, size_t* data_shape, float* avg_ratio)
+{
+    int ndims = (meta_cols - 1) / 2;
+    codec_t codec;
+    std::vector<codec_t> candidates = codec_candidates();
+    std::vector<double> zip_bytes(candidates.size(), 0), zip_seconds(candidates.size(), 0);
+    double raw_bytes = 0;
+    std::uniform_int_distribution<unsigned> unif(0, meta_rows - 1);
+    std::vector<T> sample_buffer;
+    std::vector<unsigned char> zip_buffer, unzip_buffer;
+    for (int i = 0; i < ZIP_DETECT_NSAMPLES; i++)
+    {
+        // select a sample chunk from chunks randomly, chunks are not gathered yet so copy it here
+        unsigned sample_id = unif(random_engine);
+        sample_buffer.resize(chunk_sizes[sample_id]);
+        gather_chunk<T>(sample_buffer.data(), data, ndims, &region_meta[sample_id * meta_cols], data_shape);
+        const unsigned char* sample_ptr = reinterpret_cast<const unsigned char*>(sample_buffer.data());
+        size_t sample_bytes = std::min<size_t>(chunk_sizes[sample_id] * sizeof(T), ZIP_DETECT_MAX_BYTES);
+        unzip_buffer.resize(sample_bytes);
+        raw_bytes += sample_bytes;
+        for (size_t c = 0; c < candidates.size(); c++)
+        {
+            auto t1 = high_resolution_clock::now();
+            encode_chunk(sample_ptr, sample_bytes, sizeof(T), candidates[c], zip_buffer);
+            decode_chunk(zip_buffer.data(), zip_buffer.size(), unzip_buffer.data(), sample_bytes);
+            auto t2 = high_resolution_clock::now();
+            zip_bytes[c] += zip_buffer.size();
+            zip_seconds[c] += duration_cast<nanoseconds>(t2 - t1).count() / 1e9;
+        }
+    }
+    if (raw_bytes > 0)
+    {
+        double best_seconds = 2 * raw_bytes / (ZIP_IO_BANDWIDTH_MBPS * 1e6); // cost of storing it uncompressed
+        for (size_t c = 0; c < candidates.size(); c++)
+        {
+            float ratio = zip_bytes[c] / raw_bytes;
+            if (ratio >= ZIP_MAX_RATIO)
+                continue; // not worth compressing at all
+            double seconds = zip_seconds[c] + 2 * zip_bytes[c] / (ZIP_IO_BANDWIDTH_MBPS * 1e6);
+            if (seconds < best_seconds)
+            {
+                best_seconds = seconds;
+                codec = candidates[c];
+                *avg_ratio = ratio;
+            }
+        }
+    }
+    return codec;
+}
+
+// codec of a region: detected from sampled chunks, unless `raster_def_region_codec` set a policy
+template <typename T>
+static codec_t choose_codec(int codec_policy, uint64_t* region_meta, int meta_rows, int meta_cols,
+                            const std::vector<size_t>& chunk_sizes, const T* data, size_t* data_shape, float* avg_ratio)
+{
+    if (codec_policy == RASTER_CODEC_NONE)
+        return codec_t();
+    if (codec_policy == RASTER_CODEC_MAX)
+        return strongest_codec();
+    return detect_codec<T>(region_meta, meta_rows, meta_cols, chunk_sizes, data, data_shape, avg_ratio);
+}
+
 template <typename T>
 static int do_write_region(int maskid, uint64_t* region_meta, int meta_rows, int meta_cols,
-                               const T* data, size_t* data_shape, int var_grp_id, int* dimids, int var_type)
+                               const T* data, size_t* data_shape, int var_grp_id, int* dimids, int var_type,
+                               int storage, int codec_policy, double fill, const LayoutIndex* parts = nullptr)
 {
     int ndims = (meta_cols - 1) / 2, status = NC_NOERR, region_grp_id;
-    int normal_height = data_shape[ndims - 2] / CHUNKSIZE_NX;
     std::string region_name = "region_" + std::to_string(maskid);
     assert(meta_rows >= 1);
     status = nc_def_grp(var_grp_id, region_name.c_str(), &region_grp_id);
-    std::vector<T*> chunk_ptrs(meta_rows); // save pointers to each chunk
-    std::vector<int> chunk_ids(meta_rows); // save chunk variable ids
+    std::vector<std::vector<unsigned char> > chunk_blobs(meta_rows); // encoded chunks
+    std::vector<size_t> chunk_sizes(meta_rows);
+    std::vector<unsigned char> uniform(meta_rows, 0); // chunks holding a single repeated value
+    std::vector<T> uniform_values(meta_rows);
+    std::vector<chunk_stats_t> stats(meta_rows);
+    std::vector<unsigned long long> part_sizes(parts != nullptr ? parts->m_parts.size() : 0);
 
-    // Pass 1: memory copy + variable definition
     for (int i = 0; i < meta_rows; i++)
     {
-        size_t* start = &region_meta[i * meta_cols + 1];
         size_t* count = &region_meta[i * meta_cols + 1 + ndims];
-        size_t chunksize = std::accumulate(&count[0], &count[ndims], 1, [&](size_t a, size_t b){ return a * b; } );
-        int varsize_dimid, old_dimid;
-        char buffer[128];
-
-        chunk_ptrs[i] = new T[chunksize];
-        sprintf(buffer, "_chunk_%d_size_", (int)region_meta[i * meta_cols]);
-        status = nc_def_dim(region_grp_id, buffer, chunksize * sizeof(T), &varsize_dimid);
-        status = sprintf(buffer, "chunk_%d", (int)region_meta[i * meta_cols]);
-        status = nc_def_var(region_grp_id, buffer, NC_UBYTE, 1, &varsize_dimid, &chunk_ids[i]);
+        chunk_sizes[i] = std::accumulate(&count[0], &count[ndims], 1, [&](size_t a, size_t b){ return a * b; } );
     }
 
-    // pass 2: do memory copy in parallel
-    // #pragma omp parallel for
+    float avg_ratio = 1;
+    codec_t codec = choose_codec<T>(codec_policy, region_meta, meta_rows, meta_cols, chunk_sizes, data, data_shape, &avg_ratio);
+    int codec_attrs[3] = {(int)codec.m_codec, codec.m_filter, codec.m_level};
+    status = nc_put_att_int(region_grp_id, NC_GLOBAL, "_codec_", NC_INT, 3, codec_attrs);
+    status = nc_put_att_float(region_grp_id, NC_GLOBAL, "_zratio_", NC_FLOAT, 1, &avg_ratio);
+
+    // Gather and encode chunks on all threads while the master thread, the only one calling
+    // netCDF, defines and writes them. Chunks are written strictly in metadata order, so the
+    // file is identical to the one produced by a serial write.
+    // Workers stay at most `WRITE_PIPELINE_DEPTH` chunks per thread ahead of the writer,
+    // which bounds the memory held by encoded but unwritten chunks.
+    int nthreads = omp_get_max_threads();
+    int depth = WRITE_PIPELINE_DEPTH * nthreads;
+    std::unique_ptr<std::atomic<bool>[]> ready(new std::atomic<bool>[meta_rows]);
+    std::atomic<int> next_chunk(0), nwritten(0);
+    std::atomic<bool> failed(false);
+    std::string error_msg;
+    RegionChunkWriter chunk_writer(region_grp_id, storage);
     for (int i = 0; i < meta_rows; i++)
+        ready[i].store(false, std::memory_order_relaxed);
+
+    auto gather = [&](int i) {
+        static thread_local std::vector<T> chunk;
+        try
+        {
+            chunk.resize(chunk_sizes[i]);
+            gather_chunk<T>(chunk.data(), data, ndims, &region_meta[i * meta_cols], data_shape);
+            stats[i] = compute_chunk_stats<T>((int)region_meta[i * meta_cols], chunk.data(), chunk_sizes[i], fill);
+            if (is_uniform_chunk<T>(chunk.data(), chunk_sizes[i]))
+            {
+                uniform[i] = 1;
+                uniform_values[i] = chunk[0];
+            }
+            else if (parts != nullptr)
+                encode_chunk_parts<T>(chunk.data(), chunk_sizes[i], region_meta[i * meta_cols + 2 * ndims - 1] * region_meta[i * meta_cols + 2 * ndims],
+                                      *parts, i, codec, chunk_blobs[i], part_sizes.data());
+            else
+                encode_chunk(reinterpret_cast<const unsigned char*>(chunk.data()), chunk_sizes[i] * sizeof(T),
+                             sizeof(T), codec, chunk_blobs[i]);
+        }
+        catch (std::exception& e)
+        {
+            #pragma omp critical (raster_write_error)
+            error_msg = e.what();
+            failed.store(true);
+        }
+        ready[i].store(true, std::memory_order_release);
+    };
+
+    #pragma omp parallel num_threads(nthreads)
     {
-        switch (ndims)
+        if (omp_get_thread_num() == 0)
         {
-            case 2: memcpy_chk2d<T>(chunk_ptrs[i], data, &region_meta[i * meta_cols + 1], data_shape, 
-                                    &region_meta[i * meta_cols + 1 + ndims]); break;
-            case 3: memcpy_chk3d<T>(chunk_ptrs[i], data, &region_meta[i * meta_cols + 1], data_shape, 
-                                    &region_meta[i * meta_cols + 1 + ndims]); break;
-            case 4: memcpy_chk4d<T>(chunk_ptrs[i], data, &region_meta[i * meta_cols + 1], data_shape, 
-                                    &region_meta[i * meta_cols + 1 + ndims]); break;
-            default: throw std::runtime_error("Unsupported dimension: " + std::to_string(ndims));
+            for (int i = 0; i < meta_rows; i++)
+            {
+                // help gathering instead of spinning while the next chunk is not ready
+                while (!ready[i].load(std::memory_order_acquire))
+                {
+                    int j = next_chunk.fetch_add(1);
+                    if (j < meta_rows)
+                        gather(j);
+                    else
+                        std::this_thread::yield();
+                }
+                // uniform chunks are not stored, their value is kept in the region attributes
+                if (!failed.load() && status == NC_NOERR && !uniform[i])
+                    status = chunk_writer.put((int)region_meta[i * meta_cols], chunk_blobs[i]);
+                std::vector<unsigned char>().swap(chunk_blobs[i]);
+                nwritten.store(i + 1, std::memory_order_release);
+            }
         }
+        else
+        {
+            for (int j = next_chunk.fetch_add(1); j < meta_rows; j = next_chunk.fetch_add(1))
+            {
+                while (j - nwritten.load(std::memory_order_acquire) >= depth)
+                    std::this_thread::yield();
+                gather(j);
+            }
+        }
+    }
+    if (failed.load())
+        throw std::runtime_error(error_msg);
+    if (status == NC_NOERR)
+        status = chunk_writer.finish();
+    if (status == NC_NOERR)
+    {
+        int stats_id;
+        status = def_chunk_stats(region_grp_id, meta_rows, &stats_id);
+        status = nc_put_var_double(region_grp_id, stats_id, reinterpret_cast<const double*>(stats.data()));
+    }
+    std::vector<uint64_t> part_table;
+    if (status == NC_NOERR && parts != nullptr)
+    {
+        int split = 1;
+        status = nc_put_att_int(region_grp_id, NC_GLOBAL, "_split_", NC_INT, 1, &split);
+        part_table = make_part_table(region_meta, meta_rows, meta_cols, *parts, part_sizes.data(), uniform.data());
+    }
+    if (status == NC_NOERR && !part_table.empty())
+    {
+        int table_id;
+        status = def_part_table(region_grp_id, part_table.size() / 4, &table_id);
+        status = nc_put_var_ulonglong(region_grp_id, table_id, (unsigned long long*)part_table.data());
     }
 
-    // Ziplevel detection, our algorithm will compress those regions with a high compress ratio
-    // which indicates that region has a high probability to be a invalid region (at least it
-    // has a low information entropy)
-    int zlevel = 0;
-    float avg_ratio = 1;
-    std::uniform_int_distribution<unsigned> unif(0, meta_rows - 1);
-    for (int i = 0; i < ZIP_DETECT_NSAMPLES; i++)
+    std::vector<int> uniform_ids;
+    std::vector<T> uniform_data;
+    for (int i = 0; i < meta_rows; i++)
     {
-        // select a sample chunk from chunks randomly
-        T* sample_ptr = chunk_ptrs[unif(random_engine)];
-        // TODO
+        if (!uniform[i])
+            continue;
+        uniform_ids.push_back((int)region_meta[i * meta_cols]);
+        uniform_data.push_back(uniform_values[i]);
     }
-    if (avg_ratio < 0.05)       // [0, 0.05)
-        zlevel = ZLEVEL_HIGH;
-    else if (avg_ratio < 0.1)   // [0.05, 0.1)
-        zlevel = ZLEVEL_MID;
-    else if (avg_ratio < 0.2)   // [0.1, 0.2)
-        zlevel = ZLEVEL_LOW;
-    else                        // [0.2, 1]
-        zlevel = ZLEVEL_NOZIP;
+    if (status == NC_NOERR && uniform_ids.size() > 0)
+        status = put_uniform_chunks(region_grp_id, uniform_ids, reinterpret_cast<const unsigned char*>(uniform_data.data()),
+                                    uniform_data.size() * sizeof(T));
+    return status;
+}
+
+// MPI-parallel version of `do_write_region` for a file opened with `nc_create_par`, every rank
+// holds the whole `data`. Chunks are assigned to ranks by size, largest first to the least
+// loaded rank. Ranks encode their own chunks, exchange blob sizes and uniform values, define all
+// chunk variables collectively, then write their own blobs independently. The layout is the
+// same as the one produced by a serial write.
+template <typename T>
+static int do_write_region_par(int maskid, uint64_t* region_meta, int meta_rows, int meta_cols,
+                               const T* data, size_t* data_shape, int var_grp_id, int storage, int codec_policy,
+                               double fill, MPI_Comm comm, const LayoutIndex* parts = nullptr)
+{
+    int ndims = (meta_cols - 1) / 2, status = NC_NOERR, region_grp_id, rank, nranks;
+    std::string region_name = "region_" + std::to_string(maskid);
+    assert(meta_rows >= 1);
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &nranks);
+    status = nc_def_grp(var_grp_id, region_name.c_str(), &region_grp_id);
+    std::vector<std::vector<unsigned char> > chunk_blobs(meta_rows);
+    std::vector<size_t> chunk_sizes(meta_rows);
+    std::vector<unsigned long long> blob_sizes(meta_rows, 0);
+    std::vector<unsigned char> uniform(meta_rows, 0);
+    std::vector<T> uniform_values(meta_rows);
+    std::vector<chunk_stats_t> stats(meta_rows, chunk_stats_t{0, 0, 0, 0, 0}); // rows of other ranks stay zero
+    std::vector<unsigned long long> part_sizes(parts != nullptr ? parts->m_parts.size() : 0, 0);
 
-    // Pass 3: write data according to detected zip level
     for (int i = 0; i < meta_rows; i++)
     {
         size_t* count = &region_meta[i * meta_cols + 1 + ndims];
-        if (zlevel != 0)
+        chunk_sizes[i] = std::accumulate(&count[0], &count[ndims], 1, [&](size_t a, size_t b){ return a * b; } );
+    }
+
+    // attributes are metadata, all ranks must write the same values, so rank 0 decides the codec
+    float avg_ratio = 1;
+    int codec_attrs[3] = {0, 0, 0};
+    if (rank == 0)
+    {
+        codec_t detected = choose_codec<T>(codec_policy, region_meta, meta_rows, meta_cols, chunk_sizes, data, data_shape,
+                                           &avg_ratio);
+        codec_attrs[0] = (int)detected.m_codec;
+        codec_attrs[1] = detected.m_filter;
+        codec_attrs[2] = detected.m_level;
+    }
+    MPI_Bcast(codec_attrs, 3, MPI_INT, 0, comm);
+    MPI_Bcast(&avg_ratio, 1, MPI_FLOAT, 0, comm);
+    codec_t codec((CODEC)codec_attrs[0], codec_attrs[1], codec_attrs[2]);
+    status = nc_put_att_int(region_grp_id, NC_GLOBAL, "_codec_", NC_INT, 3, codec_attrs);
+    status = nc_put_att_float(region_grp_id, NC_GLOBAL, "_zratio_", NC_FLOAT, 1, &avg_ratio);
+
+    // greedy assignment, identical on all ranks
+    std::vector<int> order(meta_rows), owner(meta_rows), mine;
+    std::vector<size_t> load(nranks, 0);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](int l, int r) { return chunk_sizes[l] > chunk_sizes[r]; });
+    for (int i : order)
+    {
+        int target = std::min_element(load.begin(), load.end()) - load.begin();
+        owner[i] = target;
+        load[target] += chunk_sizes[i];
+    }
+    for (int i = 0; i < meta_rows; i++)
+        if (owner[i] == rank)
+            mine.push_back(i);
+
+    int failed = 0;
+    std::string error_msg;
+    #pragma omp parallel for schedule(dynamic)
+    for (int k = 0; k < (int)mine.size(); k++)
+    {
+        static thread_local std::vector<T> chunk;
+        int i = mine[k];
+        try
+        {
+            chunk.resize(chunk_sizes[i]);
+            gather_chunk<T>(chunk.data(), data, ndims, &region_meta[i * meta_cols], data_shape);
+            stats[i] = compute_chunk_stats<T>((int)region_meta[i * meta_cols], chunk.data(), chunk_sizes[i], fill);
+            if (is_uniform_chunk<T>(chunk.data(), chunk_sizes[i]))
+            {
+                uniform[i] = 1;
+                uniform_values[i] = chunk[0];
+            }
+            else
+            {
+                if (parts != nullptr)
+                    encode_chunk_parts<T>(chunk.data(), chunk_sizes[i], region_meta[i * meta_cols + 2 * ndims - 1] * region_meta[i * meta_cols + 2 * ndims],
+                                          *parts, i, codec, chunk_blobs[i], part_sizes.data());
+                else
+                    encode_chunk(reinterpret_cast<const unsigned char*>(chunk.data()), chunk_sizes[i] * sizeof(T),
+                                 sizeof(T), codec, chunk_blobs[i]);
+                blob_sizes[i] = chunk_blobs[i].size();
+            }
+        }
+        catch (std::exception& e)
+        {
+            #pragma omp critical (raster_write_error)
+            {
+                error_msg = e.what();
+                failed = 1;
+            }
+        }
+    }
+    // a rank must not leave the collective defines alone
+    MPI_Allreduce(MPI_IN_PLACE, &failed, 1, MPI_INT, MPI_LOR, comm);
+    if (failed)
+        throw std::runtime_error(error_msg.empty() ? "Error on another rank while encoding region " + std::to_string(maskid) : error_msg);
+    MPI_Allreduce(MPI_IN_PLACE, blob_sizes.data(), meta_rows, MPI_UNSIGNED_LONG_LONG, MPI_SUM, comm);
+    MPI_Allreduce(MPI_IN_PLACE, uniform.data(), meta_rows, MPI_UNSIGNED_CHAR, MPI_BOR, comm);
+    MPI_Allreduce(MPI_IN_PLACE, uniform_values.data(), meta_rows * sizeof(T), MPI_BYTE, MPI_BOR, comm);
+    // each row is only set by its owner, NaN ranges survive the sum
+    MPI_Allreduce(MPI_IN_PLACE, stats.data(), meta_rows * sizeof(chunk_stats_t) / sizeof(double), MPI_DOUBLE, MPI_SUM, comm);
+    if (parts != nullptr)
+        MPI_Allreduce(MPI_IN_PLACE, part_sizes.data(), part_sizes.size(), MPI_UNSIGNED_LONG_LONG, MPI_SUM, comm);
+
+    // collective defines, in metadata order
+    char buffer[128];
+    std::vector<int> chunk_varids(meta_rows, -1);
+    std::vector<uint64_t> table, offsets(meta_rows, 0);
+    int data_id = -1;
+    if (storage != RASTER_STORAGE_PACKED)
+    {
+        for (int i = 0; i < meta_rows; i++)
+        {
+            int varsize_dimid, chunk_id = (int)region_meta[i * meta_cols];
+            if (uniform[i])
+                continue;
+            sprintf(buffer, "_chunk_%d_size_", chunk_id);
+            status = nc_def_dim(region_grp_id, buffer, blob_sizes[i], &varsize_dimid);
+            sprintf(buffer, "chunk_%d", chunk_id);
+            status = nc_def_var(region_grp_id, buffer, NC_UBYTE, 1, &varsize_dimid, &chunk_varids[i]);
+            status = nc_var_par_access(region_grp_id, chunk_varids[i], NC_INDEPENDENT);
+        }
+    }
+    else
+    {
+        uint64_t offset = 0;
+        for (int i = 0; i < meta_rows; i++)
+        {
+            if (uniform[i])
+                continue;
+            offsets[i] = offset;
+            table.insert(table.end(), {region_meta[i * meta_cols], offset, blob_sizes[i]});
+            offset += blob_sizes[i];
+        }
+        if (!table.empty())
+        {
+            int data_dimid, dimids[2], table_id;
+            size_t hdf5_chunk = std::min<size_t>(PACKED_CHUNK_BYTES, offset);
+            status = nc_def_dim(region_grp_id, "_data_size_", offset, &data_dimid);
+            status = nc_def_var(region_grp_id, "_data_", NC_UBYTE, 1, &data_dimid, &data_id);
+            status = nc_def_var_chunking(region_grp_id, data_id, NC_CHUNKED, &hdf5_chunk);
+            status = nc_var_par_access(region_grp_id, data_id, NC_INDEPENDENT);
+            status = nc_def_dim(region_grp_id, "_chunk_table_rows_", table.size() / 3, &dimids[0]);
+            status = nc_def_dim(region_grp_id, "_chunk_table_cols_", 3, &dimids[1]);
+            status = nc_def_var(region_grp_id, "_chunk_table_", NC_UINT64, 2, dimids, &table_id);
+            status = nc_var_par_access(region_grp_id, table_id, NC_INDEPENDENT);
+            if (rank == 0)
+                status = nc_put_var_ulonglong(region_grp_id, table_id, (unsigned long long*)table.data());
+        }
+    }
+
+    std::vector<int> uniform_ids;
+    std::vector<T> uniform_data;
+    for (int i = 0; i < meta_rows; i++)
+    {
+        if (!uniform[i])
+            continue;
+        uniform_ids.push_back((int)region_meta[i * meta_cols]);
+        uniform_data.push_back(uniform_values[i]);
+    }
+    if (uniform_ids.size() > 0)
+        status = put_uniform_chunks(region_grp_id, uniform_ids, reinterpret_cast<const unsigned char*>(uniform_data.data()),
+                                    uniform_data.size() * sizeof(T), true, rank == 0);
+    int stats_id;
+    status = def_chunk_stats(region_grp_id, meta_rows, &stats_id);
+    status = nc_var_par_access(region_grp_id, stats_id, NC_INDEPENDENT);
+    if (rank == 0)
+        status = nc_put_var_double(region_grp_id, stats_id, reinterpret_cast<const double*>(stats.data()));
+    std::vector<uint64_t> part_table;
+    if (parts != nullptr)
+    {
+        int split = 1;
+        status = nc_put_att_int(region_grp_id, NC_GLOBAL, "_split_", NC_INT, 1, &split);
+        part_table = make_part_table(region_meta, meta_rows, meta_cols, *parts, part_sizes.data(), uniform.data());
+    }
+    if (!part_table.empty())
+    {
+        int table_id;
+        status = def_part_table(region_grp_id, part_table.size() / 4, &table_id);
+        status = nc_var_par_access(region_grp_id, table_id, NC_INDEPENDENT);
+        if (rank == 0)
+            status = nc_put_var_ulonglong(region_grp_id, table_id, (unsigned long long*)part_table.data());
+    }
+
+    // independent writes of the chunks owned by this rank
+    for (int i : mine)
+    {
+        if (uniform[i] || status != NC_NOERR)
+            continue;
+        if (storage != RASTER_STORAGE_PACKED)
+        {
+            status = nc_put_var_ubyte(region_grp_id, chunk_varids[i], chunk_blobs[i].data());
+        }
+        else
+        {
+            size_t start = offsets[i], count = chunk_blobs[i].size();
+            status = nc_put_vara_ubyte(region_grp_id, data_id, &start, &count, chunk_blobs[i].data());
+        }
+        std::vector<unsigned char>().swap(chunk_blobs[i]);
+    }
+    return status;
+}
+
+static void merge_region_stats(region_stats_t& into, const region_stats_t& from)
+{
+    into.m_count += from.m_count;
+    into.m_sum += from.m_sum;
+    into.m_sum_squares += from.m_sum_squares;
+    into.m_min = std::min(into.m_min, from.m_min);
+    into.m_max = std::max(into.m_max, from.m_max);
+}
+
+// Aggregates the cells of every region at each step of `data` into `_region_stats_` of `data_grp_id`,
+// one row per (region, step), regions in the order of `_region_stats_ids_`. Parents of a region
+// hierarchy aggregate all their descendants. Layouts written without a `_mask_` get no aggregates.
+// In an MPI write, every rank defines them and rank 0 computes and writes them
+template <typename T>
+static int write_region_stats(int var_grp_id, int data_grp_id, const T* data, size_t* data_shape, int ndims,
+                              double fill, MPI_Comm comm)
+{
+    int status, rank = 0, slab_grp_id = (data_grp_id == var_grp_id) ? -1 : data_grp_id;
+    size_t rows, cols;
+    std::vector<int> mask, children, parents;
+    if (load_layout_mask(var_grp_id, mask, &rows, &cols, slab_grp_id) != NC_NOERR)
+        return NC_NOERR;
+    status = load_region_links(var_grp_id, children, parents, slab_grp_id);
+    if (status != NC_NOERR)
+        return status;
+    if (comm != MPI_COMM_NULL)
+        MPI_Comm_rank(comm, &rank);
+
+    // regions of the mask and all their ancestors, numbered in ascending id order
+    std::unordered_map<int, int> parent_of, slot_of;
+    for (size_t i = 0; i < children.size(); i++)
+        parent_of[children[i]] = parents[i];
+    std::set<int> mask_ids(mask.begin(), mask.end()), all_ids;
+    for (int id : mask_ids)
+    {
+        int up = id;
+        while (all_ids.insert(up).second && parent_of.count(up))
+            up = parent_of[up];
+    }
+    std::vector<int> ids(all_ids.begin(), all_ids.end());
+    for (size_t k = 0; k < ids.size(); k++)
+        slot_of[ids[k]] = k;
+    std::vector<int> cell_slots(mask.size());
+    for (size_t c = 0; c < mask.size(); c++)
+        cell_slots[c] = slot_of[mask[c]];
+
+    size_t nslots = ids.size(), nsteps = (ndims > 2) ? data_shape[0] : 1;
+    size_t step_rows = std::accumulate(&data_shape[ndims > 2 ? 1 : 0], &data_shape[ndims - 1], 1, [&](size_t a, size_t b){ return a * b; } );
+    std::vector<region_stats_t> stats(nslots * nsteps, region_stats_t{0, 0, 0, INFINITY, -INFINITY});
+    if (rank == 0)
+    {
+        // cells of each region, in blocks of rows of a step summed on any thread and merged in block
+        // order, so that sums do not depend on the number of threads
+        size_t nblocks = (step_rows + REGION_STATS_BLOCK_ROWS - 1) / REGION_STATS_BLOCK_ROWS;
+        std::vector<region_stats_t> partial(nblocks * nslots);
+        for (size_t step = 0; step < nsteps; step++)
         {
-            status = nc_def_var_chunking(region_grp_id, chunk_ids[i], NC_CHUNKED, count);
-            status = nc_def_var_deflate(region_grp_id, chunk_ids[i], NC_NOSHUFFLE, 1, zlevel);            
+            std::fill(partial.begin(), partial.end(), region_stats_t{0, 0, 0, INFINITY, -INFINITY});
+            #pragma omp parallel for schedule(dynamic)
+            for (long long block = 0; block < (long long)nblocks; block++)
+            {
+                region_stats_t* block_stats = &partial[(size_t)block * nslots];
+                size_t end = std::min((size_t)(block + 1) * REGION_STATS_BLOCK_ROWS, step_rows);
+                for (size_t r = (size_t)block * REGION_STATS_BLOCK_ROWS; r < end; r++)
+                {
+                    const T* row = data + (step * step_rows + r) * cols;
+                    const int* row_slots = &cell_slots[(r % rows) * cols];
+                    for (size_t j = 0; j < cols; j++)
+                    {
+                        double value = (double)row[j];
+                        if (value != value || value == fill)
+                            continue;
+                        region_stats_t& acc = block_stats[row_slots[j]];
+                        acc.m_count++;
+                        acc.m_sum += value;
+                        acc.m_sum_squares += value * value;
+                        acc.m_min = std::min(acc.m_min, value);
+                        acc.m_max = std::max(acc.m_max, value);
+                    }
+                }
+            }
+            for (size_t block = 0; block < nblocks; block++)
+                for (size_t k = 0; k < nslots; k++)
+                    merge_region_stats(stats[step * nslots + k], partial[block * nslots + k]);
         }
-        
-        status = nc_put_var_ubyte(region_grp_id, chunk_ids[i], reinterpret_cast<unsigned char*>(chunk_ptrs[i]));
-        delete[] chunk_ptrs[i];
+
+        // the cells of a region count for all its ancestors
+        std::vector<region_stats_t> own(stats);
+        for (int id : mask_ids)
+            for (auto p = parent_of.find(id); p != parent_of.end(); p = parent_of.find(p->second))
+                for (size_t step = 0; step < nsteps; step++)
+                    merge_region_stats(stats[step * nslots + slot_of[p->second]], own[step * nslots + slot_of[id]]);
+        for (auto& acc : stats)
+            if (acc.m_count == 0)
+                acc.m_min = acc.m_max = NAN;
     }
+
+    // rows are (region, step)
+    std::vector<region_stats_t> region_rows(stats.size());
+    for (size_t k = 0; k < nslots; k++)
+        for (size_t step = 0; step < nsteps; step++)
+            region_rows[k * nsteps + step] = stats[step * nslots + k];
+    int dimids[3], stats_id;
+    status = nc_def_dim(data_grp_id, "_region_stats_regions_", nslots, &dimids[0]);
+    status = nc_def_dim(data_grp_id, "_region_stats_steps_", nsteps, &dimids[1]);
+    status = nc_def_dim(data_grp_id, "_region_stats_cols_", sizeof(region_stats_t) / sizeof(double), &dimids[2]);
+    status = nc_def_var(data_grp_id, "_region_stats_", NC_DOUBLE, 3, dimids, &stats_id);
+    if (status != NC_NOERR)
+        return status;
+    status = nc_put_att_int(data_grp_id, NC_GLOBAL, "_region_stats_ids_", NC_INT, ids.size(), ids.data());
+    if (comm != MPI_COMM_NULL)
+        status = nc_var_par_access(data_grp_id, stats_id, NC_INDEPENDENT);
+    if (rank == 0)
+        status = nc_put_var_double(data_grp_id, stats_id, reinterpret_cast<const double*>(region_rows.data()));
     return status;
 }
 
+// Writes the variable (or a slab of it along the leading dimension) region by region. Region
+// metadata is read from `var_grp_id`, or from the layout of the slab's epoch for a time-varying
+// mask, region groups are created in `data_grp_id`, which is the variable group itself for
+// whole-variable writes and a `slab_<k>` group for appended slabs.
 template<typename T>
-int do_write_var(int ncid, int var_grp_id, const T* data, size_t* data_shape, int var_type)
+int do_write_var(int ncid, int var_grp_id, int data_grp_id, const T* data, size_t* data_shape, int var_type,
+                 MPI_Comm comm = MPI_COMM_NULL)
 {
     // (1) query region mask ids
-    int mask_dimid, mask_varid, status, *mask_buffer = nullptr, *dimids = nullptr;
-    size_t num_regions;
-    status = nc_inq_dimid(var_grp_id, "_meta_region_maskid_", &mask_dimid);
-    status = nc_inq_dimlen(var_grp_id, mask_dimid, &num_regions);
-    status = nc_inq_varid(var_grp_id, "_meta_region_maskid_", &mask_varid);
-    mask_buffer = new int[num_regions + 1];
-    status = nc_get_var_int(var_grp_id, mask_varid, mask_buffer);
-    mask_buffer[num_regions] = REGION_MIXED_ID; // mixed region chunks
+    int status, *dimids = nullptr;
+    int storage = RASTER_STORAGE_CHUNKED;
+    int slab_grp_id = (data_grp_id == var_grp_id) ? -1 : data_grp_id;
+    std::vector<int> mask_buffer;
+    nc_get_att_int(var_grp_id, NC_GLOBAL, "_storage_", &storage); // keep default if unset
+    double fill = get_fill_value(var_grp_id);
+    status = load_region_ids(var_grp_id, mask_buffer, slab_grp_id);
+    if (status != NC_NOERR)
+        return status;
+    mask_buffer.push_back(REGION_MIXED_ID); // mixed region chunks
 
     // sorting the masks in a desending order will significantly improve write performance
     // I don't know why it works, maybe the internal region chunks are organized in a desending order??
-    std::sort(&mask_buffer[0], &mask_buffer[num_regions+1], [](int l, int r) { return l > r; } );
+    std::sort(mask_buffer.begin(), mask_buffer.end(), [](int l, int r) { return l > r; } );
 
     // for each region, (a) query metadata; (b) copy data to chunk buffers; (c) write chunks to filesystem
-    for (int i = 0; i < num_regions + 1; i++)
+    for (int i = 0; i < mask_buffer.size(); i++)
     {
-        char name_buffer[128];
-        int meta_id, meta_dimids[2];
-        size_t nrows, ncols, *meta_buffer;
-        auto blkptr = meta_cache->get_region(var_grp_id, mask_buffer[i]);
-        int use_cache = false;
+        region_meta_t region;
+        std::vector<size_t> slab_meta;
+        status = load_region_meta(var_grp_id, mask_buffer[i], data_shape, region, slab_grp_id);
+        if (status != NC_NOERR)
+            return status;
+        size_t nrows = region.m_nrows, ncols = region.m_ncols, *meta_buffer = region.m_data;
+        if (nrows == 0) 
+            continue; // skip empty regions
 
-        if (blkptr != nullptr)
+        // an appended slab only covers `data_shape[0]` steps of the leading dimension
+        if (data_grp_id != var_grp_id)
         {
-            // cache hit, get data from cache
-            use_cache = true;
-            nrows = blkptr->m_nrows; 
-            ncols = blkptr->m_ncols;
-            meta_buffer = blkptr->m_data;
-            if (nrows == 0) 
-                continue; // skip empty regions
+            slab_meta = rebase_region_meta(meta_buffer, nrows, ncols, 0, data_shape[0]);
+            meta_buffer = slab_meta.data();
         }
+
+        int codec_policy = RASTER_CODEC_AUTO;
+        std::string policy_name = "_region_codec_" + std::to_string(mask_buffer[i]) + "_";
+        nc_get_att_int(var_grp_id, NC_GLOBAL, policy_name.c_str(), &codec_policy); // keep default if unset
+
+        // mixed chunks are split by region when the layout has their cells
+        const LayoutIndex* parts = nullptr;
+        if (mask_buffer[i] == REGION_MIXED_ID && region.m_index != nullptr && !region.m_index->m_parts.empty())
+            parts = region.m_index.get();
+
+        if (comm != MPI_COMM_NULL)
+            status = do_write_region_par<T>(mask_buffer[i], meta_buffer, nrows, ncols, data, data_shape, data_grp_id, storage,
+                                            codec_policy, fill, comm, parts);
         else
-        {
-            // cache miss, get data from file
-            sprintf(name_buffer, "_meta_region_%d_chunks_", mask_buffer[i]);
-            status = nc_inq_varid(var_grp_id, name_buffer, &meta_id);
-            status = nc_inq_vardimid(var_grp_id, meta_id, meta_dimids);
-            status = nc_inq_dimlen(var_grp_id, meta_dimids[0], &nrows);
-            status = nc_inq_dimlen(var_grp_id, meta_dimids[1], &ncols);
-            if (nrows == 0) 
-                continue; // skip empty regions
-            meta_buffer = new uint64_t[nrows * ncols + 1];
-            nc_get_var_ulonglong(var_grp_id, meta_id, (unsigned long long*)meta_buffer);
-
-            int* relation_chunks, relation_dimid;
-            size_t num_chunks;
-            sprintf(name_buffer, "_meta_region_%d_relations_", mask_buffer[i]);
-            status = nc_inq_dimid(var_grp_id, name_buffer, &relation_dimid);
-            status = nc_inq_dimlen(var_grp_id, relation_dimid, &num_chunks);
-            relation_chunks = new int[num_chunks];
-            status = nc_inq_varid(var_grp_id, name_buffer, &meta_id);
-            status = nc_get_var_int(var_grp_id, meta_id, relation_chunks);
-            // add data to cache
-            meta_cache->add_region(var_grp_id, mask_buffer[i], nrows, ncols, num_chunks, relation_chunks, meta_buffer);
-        }
-
-        status = do_write_region<T>(mask_buffer[i], meta_buffer, nrows, ncols, data, data_shape, var_grp_id, dimids, var_type);
-
-        if (!use_cache)
-            delete[] meta_buffer;
+            status = do_write_region<T>(mask_buffer[i], meta_buffer, nrows, ncols, data, data_shape, data_grp_id, dimids, var_type,
+                                        storage, codec_policy, fill, parts);
 
         if (status != NC_NOERR)
             throw std::runtime_error("Error while writing region " + std::to_string(mask_buffer[i]) + ": " + nc_strerror(status));
     }
     if (dimids != NULL) delete[] dimids;
-    if (mask_buffer != NULL) delete[] mask_buffer;
+
+    int ndims;
+    status = nc_get_att_int(var_grp_id, NC_GLOBAL, "_ndims_", &ndims);
+    if (status == NC_NOERR)
+        status = write_region_stats<T>(var_grp_id, data_grp_id, data, data_shape, ndims, fill, comm);
+    return status;
+}
+
+
+// --- appending slabs along the leading dimension ---
+
+// Steps given to `append_var_*` are staged until `m_slab_steps` of them are available, then
+// written as one slab: a `slab_<k>` group holding its own region groups, with the covered
+// steps in its `_slab_range_` attribute. The variable group records the number of slabs in
+// `_nslabs_` and the number of written steps in `_nsteps_`. A slab never crosses the boundary of
+// an epoch of a time-varying mask, so that all its steps share one layout.
+struct append_state_t
+{
+    std::vector<unsigned char>  m_buffer;       // staged steps
+    size_t                      m_buffered;     // number of staged steps
+    size_t                      m_nsteps;       // number of steps written to the file
+    size_t                      m_slab_steps;   // number of steps per slab
+    int                         m_nslabs;
+    int                         m_ndims;
+    int                         m_xtype;
+    std::vector<size_t>         m_shape;        // shape of the variable, m_shape[0] is unused
+    std::vector<epoch_t>        m_epochs;       // empty unless the mask varies over time
+};
+
+static std::map<int, append_state_t> append_states; // key: var group id
+
+// resumes from what the file already holds
+static append_state_t make_append_state(int var_grp_id, int ndims, size_t* data_shape, int xtype)
+{
+    append_state_t state;
+    unsigned long long nsteps = 0;
+    int slab_steps = APPEND_DEFAULT_STEPS;
+    state.m_nslabs = 0;
+    nc_get_att_ulonglong(var_grp_id, NC_GLOBAL, "_nsteps_", &nsteps);
+    nc_get_att_int(var_grp_id, NC_GLOBAL, "_nslabs_", &state.m_nslabs);
+    nc_get_att_int(var_grp_id, NC_GLOBAL, "_append_steps_", &slab_steps);
+    state.m_buffered = 0;
+    state.m_nsteps = nsteps;
+    state.m_slab_steps = std::max(slab_steps, 1);
+    state.m_ndims = ndims;
+    state.m_xtype = xtype;
+    state.m_shape.assign(data_shape, data_shape + ndims);
+    load_var_epochs(var_grp_id, state.m_epochs);
+    return state;
+}
+
+static append_state_t& get_append_state(int var_grp_id, int ndims, size_t* data_shape, int xtype)
+{
+    auto it = append_states.find(var_grp_id);
+    if (it != append_states.end())
+    {
+        unsigned long long nsteps = 0;
+        nc_get_att_ulonglong(var_grp_id, NC_GLOBAL, "_nsteps_", &nsteps);
+        if (nsteps == it->second.m_nsteps)
+            return it->second;
+        // the file was written by another session since, its staged steps no longer follow on
+        append_states.erase(it);
+    }
+    // first append in this session
+    return append_states.insert({var_grp_id, make_append_state(var_grp_id, ndims, data_shape, xtype)}).first->second;
+}
+
+template<typename T>
+static int write_slab(int ncid, int var_grp_id, append_state_t& state, const T* data, size_t nsteps,
+                      MPI_Comm comm = MPI_COMM_NULL)
+{
+    int status = NC_NOERR, slab_grp_id;
+    size_t step_size = std::accumulate(&state.m_shape[1], &state.m_shape[state.m_ndims], 1, [&](size_t a, size_t b){ return a * b; } );
+    while (nsteps > 0)
+    {
+        char name_buffer[64];
+        const epoch_t* epoch = nullptr;
+        size_t count = nsteps;
+        if (!state.m_epochs.empty())
+        {
+            for (auto& e : state.m_epochs)
+                if (state.m_nsteps >= e.m_start && state.m_nsteps < e.m_start + e.m_count)
+                    epoch = &e;
+            if (epoch == nullptr)
+                return NC_EINVALCOORDS; // the mask does not cover this step
+            count = std::min(count, epoch->m_start + epoch->m_count - state.m_nsteps);
+        }
+        unsigned long long range[2] = {state.m_nsteps, count}, total;
+        std::vector<size_t> slab_shape(state.m_shape);
+        slab_shape[0] = count;
+
+        sprintf(name_buffer, "slab_%d", state.m_nslabs);
+        status = nc_def_grp(var_grp_id, name_buffer, &slab_grp_id);
+        if (status != NC_NOERR)
+            return status;
+        status = nc_put_att_ulonglong(slab_grp_id, NC_GLOBAL, "_slab_range_", NC_UINT64, 2, range);
+        if (epoch != nullptr)
+            status = nc_put_att_text(slab_grp_id, NC_GLOBAL, "_layout_", epoch->m_layout.size(), epoch->m_layout.c_str());
+        status = do_write_var<T>(ncid, var_grp_id, slab_grp_id, data, slab_shape.data(), state.m_xtype, comm);
+        if (status != NC_NOERR)
+            return status;
+
+        state.m_nsteps += count;
+        state.m_nslabs++;
+        total = state.m_nsteps;
+        status = nc_put_att_int(var_grp_id, NC_GLOBAL, "_nslabs_", NC_INT, 1, &state.m_nslabs);
+        status = nc_put_att_ulonglong(var_grp_id, NC_GLOBAL, "_nsteps_", NC_UINT64, 1, &total);
+        data += count * step_size;
+        nsteps -= count;
+    }
+    return status;
+}
+
+// Writes a whole variable. A variable with a time-varying mask is written as one slab per epoch,
+// any other variable keeps its region groups in the variable group
+template<typename T>
+static int write_whole_var(int ncid, int var_grp_id, const T* data, size_t* data_shape, int var_type,
+                           MPI_Comm comm = MPI_COMM_NULL)
+{
+    int status, ndims;
+    std::vector<epoch_t> epochs;
+    status = load_var_epochs(var_grp_id, epochs);
+    if (status != NC_NOERR)
+        return status;
+    if (epochs.empty())
+        return do_write_var<T>(ncid, var_grp_id, var_grp_id, data, data_shape, var_type, comm);
+
+    status = nc_get_att_int(var_grp_id, NC_GLOBAL, "_ndims_", &ndims);
+    append_state_t state = make_append_state(var_grp_id, ndims, data_shape, var_type);
+    if (state.m_nsteps != 0)
+        return NC_EINVAL; // steps were already written
+    return write_slab<T>(ncid, var_grp_id, state, data, data_shape[0], comm);
+}
+
+template<typename T>
+static int flush_state(int ncid, int var_grp_id, append_state_t& state)
+{
+    int status = NC_NOERR;
+    if (state.m_buffered == 0)
+        return status;
+    status = write_slab<T>(ncid, var_grp_id, state, reinterpret_cast<const T*>(state.m_buffer.data()), state.m_buffered);
+    state.m_buffered = 0;
+    return status;
+}
+
+static int flush_state(int ncid, int var_grp_id, append_state_t& state)
+{
+    switch (state.m_xtype)
+    {
+        case NC_INT: return flush_state<int>(ncid, var_grp_id, state);
+        case NC_FLOAT: return flush_state<float>(ncid, var_grp_id, state);
+        case NC_DOUBLE: return flush_state<double>(ncid, var_grp_id, state);
+        case NC_CHAR: return flush_state<char>(ncid, var_grp_id, state);
+        default: return NC_EBADTYPE;
+    }
+}
+
+template<typename T>
+int do_append_var(int ncid, int var_grp_id, const T* data, size_t start, size_t nsteps, int ndims, 
+                  size_t* data_shape, int var_type)
+{
+    if (ndims < 3)
+        return NC_EINVAL; // a 2D variable has no leading dimension to append along
+    append_state_t& state = get_append_state(var_grp_id, ndims, data_shape, var_type);
+    if (state.m_xtype != var_type || start != state.m_nsteps + state.m_buffered)
+        return NC_EINVAL; // only appending right after the last step is supported
+
+    int status = NC_NOERR;
+    size_t step_size = std::accumulate(&state.m_shape[1], &state.m_shape[ndims], 1, [&](size_t a, size_t b){ return a * b; } );
+    while (nsteps > 0 && status == NC_NOERR)
+    {
+        // whole slabs are written straight from the user buffer
+        if (state.m_buffered == 0 && nsteps >= state.m_slab_steps)
+        {
+            status = write_slab<T>(ncid, var_grp_id, state, data, state.m_slab_steps);
+            data += state.m_slab_steps * step_size;
+            nsteps -= state.m_slab_steps;
+            continue;
+        }
+        size_t n = std::min(nsteps, state.m_slab_steps - state.m_buffered);
+        state.m_buffer.resize(state.m_slab_steps * step_size * sizeof(T));
+        memcpy(&state.m_buffer[state.m_buffered * step_size * sizeof(T)], data, n * step_size * sizeof(T));
+        state.m_buffered += n;
+        data += n * step_size;
+        nsteps -= n;
+        if (state.m_buffered == state.m_slab_steps)
+            status = flush_state<T>(ncid, var_grp_id, state);
+    }
     return status;
 }
 
 
 int write_var_int(int ncid, int var_grp_id, const int* data, size_t* data_shape)
 {
-    return do_write_var<int>(ncid, var_grp_id, data, data_shape, NC_INT);
+    return write_whole_var<int>(ncid, var_grp_id, data, data_shape, NC_INT);
 }
 
 int write_var_char(int ncid, int var_grp_id, const char* data, size_t* data_shape)
 {
-    return do_write_var<char>(ncid, var_grp_id, data, data_shape, NC_CHAR);
+    return write_whole_var<char>(ncid, var_grp_id, data, data_shape, NC_CHAR);
 }
 
 int write_var_double(int ncid, int var_grp_id, const double* data, size_t* data_shape)
 {
-    return do_write_var<double>(ncid, var_grp_id, data, data_shape, NC_DOUBLE);
+    return write_whole_var<double>(ncid, var_grp_id, data, data_shape, NC_DOUBLE);
 }
 
 int write_var_float(int ncid, int var_grp_id, const float* data, size_t* data_shape)
 {
-    return do_write_var<float>(ncid, var_grp_id, data, data_shape, NC_FLOAT);
+    return write_whole_var<float>(ncid, var_grp_id, data, data_shape, NC_FLOAT);
+}
+
+int write_var_par_int(int ncid, int var_grp_id, MPI_Comm comm, const int* data, size_t* data_shape)
+{
+    return write_whole_var<int>(ncid, var_grp_id, data, data_shape, NC_INT, comm);
+}
+
+int write_var_par_char(int ncid, int var_grp_id, MPI_Comm comm, const char* data, size_t* data_shape)
+{
+    return write_whole_var<char>(ncid, var_grp_id, data, data_shape, NC_CHAR, comm);
+}
+
+int write_var_par_double(int ncid, int var_grp_id, MPI_Comm comm, const double* data, size_t* data_shape)
+{
+    return write_whole_var<double>(ncid, var_grp_id, data, data_shape, NC_DOUBLE, comm);
+}
+
+int write_var_par_float(int ncid, int var_grp_id, MPI_Comm comm, const float* data, size_t* data_shape)
+{
+    return write_whole_var<float>(ncid, var_grp_id, data, data_shape, NC_FLOAT, comm);
+}
+
+int append_var_int(int ncid, int var_grp_id, const int* data, size_t start, size_t nsteps, int ndims, size_t* data_shape)
+{
+    return do_append_var<int>(ncid, var_grp_id, data, start, nsteps, ndims, data_shape, NC_INT);
+}
+
+int append_var_char(int ncid, int var_grp_id, const char* data, size_t start, size_t nsteps, int ndims, size_t* data_shape)
+{
+    return do_append_var<char>(ncid, var_grp_id, data, start, nsteps, ndims, data_shape, NC_CHAR);
+}
+
+int append_var_double(int ncid, int var_grp_id, const double* data, size_t start, size_t nsteps, int ndims, size_t* data_shape)
+{
+    return do_append_var<double>(ncid, var_grp_id, data, start, nsteps, ndims, data_shape, NC_DOUBLE);
 }
 
+int append_var_float(int ncid, int var_grp_id, const float* data, size_t start, size_t nsteps, int ndims, size_t* data_shape)
+{
+    return do_append_var<float>(ncid, var_grp_id, data, start, nsteps, ndims, data_shape, NC_FLOAT);
+}
+
+int flush_var(int ncid, int var_grp_id)
+{
+    auto it = append_states.find(var_grp_id);
+    if (it == append_states.end())
+        return NC_NOERR;
+    return flush_state(ncid, var_grp_id, it->second);
+}
+
+// flushes every appended variable of the file `ncid`, and forgets their staging buffers.
+// netCDF-4 ids carry the file in their upper 16 bits, shared by all groups of that file
+int flush_file(int ncid)
+{
+    int status = NC_NOERR;
+    for (auto it = append_states.begin(); it != append_states.end(); )
+    {
+        if ((it->first >> 16) != (ncid >> 16))
+        {
+            it++;
+            continue;
+        }
+        int ret = flush_state(ncid, it->first, it->second);
+        if (status == NC_NOERR)
+            status = ret;
+        it = append_states.erase(it);
+    }
+    return status;
+}
+
+// forgets the staged steps of every appended variable of the file `ncid` without writing them,
+// once its id belongs to another file
+void discard_file(int ncid)
+{
+    for (auto it = append_states.begin(); it != append_states.end(); )
+        it = ((it->first >> 16) == (ncid >> 16)) ? append_states.erase(it) : std::next(it);
+}
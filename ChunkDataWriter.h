@@ -1,6 +1,7 @@
 #ifndef __WRITE_VAR_H__
 #define __WRITE_VAR_H__
 #include <netcdf.h>
+#include <mpi.h>
 #include <assert.h>
 
 #ifdef __cplusplus
@@ -12,6 +13,19 @@ int write_var_char(int ncid, int var_grp_id, const char* data, size_t* data_shap
 int write_var_double(int ncid, int var_grp_id, const double* data, size_t* data_shape);
 int write_var_float(int ncid, int var_grp_id, const float* data, size_t* data_shape);
 
+int append_var_int(int ncid, int var_grp_id, const int* data, size_t start, size_t nsteps, int ndims, size_t* data_shape);
+int append_var_char(int ncid, int var_grp_id, const char* data, size_t start, size_t nsteps, int ndims, size_t* data_shape);
+int append_var_double(int ncid, int var_grp_id, const double* data, size_t start, size_t nsteps, int ndims, size_t* data_shape);
+int append_var_float(int ncid, int var_grp_id, const float* data, size_t start, size_t nsteps, int ndims, size_t* data_shape);
+int flush_var(int ncid, int var_grp_id);
+int flush_file(int ncid);
+void discard_file(int ncid);
+
+int write_var_par_int(int ncid, int var_grp_id, MPI_Comm comm, const int* data, size_t* data_shape);
+int write_var_par_char(int ncid, int var_grp_id, MPI_Comm comm, const char* data, size_t* data_shape);
+int write_var_par_double(int ncid, int var_grp_id, MPI_Comm comm, const double* data, size_t* data_shape);
+int write_var_par_float(int ncid, int var_grp_id, MPI_Comm comm, const float* data, size_t* data_shape);
+
 #ifdef __cplusplus
 }
 #endif
@@ -1,3 +1,9 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <stdexcept>
+
 #include "IndexManager.h"
 
 namespace raster
@@ -44,7 +50,7 @@ const std::vector<int>& Region::get_related_ids() const { return m_related_chunk
 // --- end of implementation of region index management module ---
 
 
-// blklist: a list of chunk information, generated by Mesh.partition()
+// info_list: chunks and their histograms, generated by Mesh.partition()
 // mask_ids: a vector contains all mask values
 // varndims: number of dimensions of this variable
 // original_size: original (un-partitioned) chunksize, such as (32, 32, 128) for a 3D var
@@ -59,27 +65,24 @@ std::vector<Region> construct_region_chunks(const chunk_info_list& info_list, st
     for (int i = 0; i < mask_ids.size(); i++)
         regions.insert({mask_ids[i], Region(mask_ids[i], varndims)});
 
-    for (auto& row : info_list)
+    for (auto& chunk : info_list.m_chunks)
     {
-        for (auto& blkptr : row)
-        {
-            curr_start[varndims - 2] = blkptr->m_start_row;
-            curr_start[varndims - 1] = blkptr->m_start_col;
-            curr_shape[varndims - 2] = blkptr->m_size_row;
-            curr_shape[varndims - 1] = blkptr->m_size_col;
+        curr_start[varndims - 2] = chunk.m_start_row;
+        curr_start[varndims - 1] = chunk.m_start_col;
+        curr_shape[varndims - 2] = chunk.m_size_row;
+        curr_shape[varndims - 1] = chunk.m_size_col;
 
-            if (blkptr->m_type != BLOCK_TYPE::MIXED)
-            {
-                regions[blkptr->get_major_index()].add_region(file_chunk_t(varndims, curr_start, curr_shape), curr_blkid, false);
-            }
-            else
-            {
-                regions[REGION_MIXED_ID].add_region(file_chunk_t(varndims, curr_start, curr_shape), curr_blkid, false);
-                for (auto& key : blkptr->keys())
-                    regions[key].add_region(file_chunk_t(varndims, curr_start, curr_shape), curr_blkid, true);
-            }
-            curr_blkid++;
+        if (chunk.m_type != BLOCK_TYPE::MIXED)
+        {
+            regions[chunk.m_major].add_region(file_chunk_t(varndims, curr_start, curr_shape), curr_blkid, false);
         }
+        else
+        {
+            regions[REGION_MIXED_ID].add_region(file_chunk_t(varndims, curr_start, curr_shape), curr_blkid, false);
+            for (const hist_entry_t* entry = info_list.hist_begin(chunk); entry != info_list.hist_end(chunk); entry++)
+                regions[entry->first].add_region(file_chunk_t(varndims, curr_start, curr_shape), curr_blkid, true);
+        }
+        curr_blkid++;
     }
     std::vector<Region> ret;
     for (auto& kv : regions)
@@ -118,5 +121,330 @@ void construct_region_relation(Region& region, int* nrelated_chks, int* &related
     memcpy(related_ids, &relations[0], sizeof(int) * (*nrelated_chks));
 }
 
+// an appended slab holds steps [start0, start0 + count0) of the leading dimension, chunks of
+// each slab span all of its steps, the spatial partition is shared by all slabs
+std::vector<size_t> rebase_region_meta(const size_t* metadata, int nrows, int ncols, size_t start0, size_t count0)
+{
+    int ndims = (ncols - 1) / 2;
+    std::vector<size_t> rebased(metadata, metadata + (size_t)nrows * ncols);
+    for (int i = 0; i < nrows; i++)
+    {
+        rebased[(size_t)i * ncols + 1] = start0;
+        rebased[(size_t)i * ncols + 1 + ndims] = count0;
+    }
+    return rebased;
+}
+
+// splits the footprint of every mixed chunk into the runs of cells of each region
+static void build_cell_parts(LayoutIndex& index, const int* mask, int mask_cols)
+{
+    const region_entry_t& mixed = index.m_regions.at(REGION_MIXED_ID);
+    index.m_part_offsets.assign(1, 0);
+    for (int i = 0; i < mixed.m_nrows; i++)
+    {
+        const size_t* row = &index.m_rows[mixed.m_row_offset + (size_t)i * index.m_ncols];
+        int ndims = (index.m_ncols - 1) / 2;
+        size_t y0 = row[ndims - 1], x0 = row[ndims], h = row[2 * ndims - 1], w = row[2 * ndims];
+        std::map<int, std::vector<uint32_t> > runs;
+        for (size_t y = 0; y < h; y++)
+        {
+            const int* cells = &mask[(y0 + y) * mask_cols + x0];
+            size_t x = 0;
+            while (x < w)
+            {
+                size_t end = x + 1;
+                while (end < w && cells[end] == cells[x])
+                    end++;
+                runs[cells[x]].insert(runs[cells[x]].end(), {(uint32_t)(y * w + x), (uint32_t)(end - x)});
+                x = end;
+            }
+        }
+        for (auto& kv : runs)
+        {
+            cell_part_t part = {kv.first, index.m_runs.size(), (int)kv.second.size() / 2, 0};
+            for (size_t r = 1; r < kv.second.size(); r += 2)
+                part.m_ncells += kv.second[r];
+            index.m_runs.insert(index.m_runs.end(), kv.second.begin(), kv.second.end());
+            index.m_parts.push_back(part);
+        }
+        index.m_part_offsets.push_back(index.m_parts.size());
+    }
+}
+
+LayoutIndex build_layout_index(std::vector<Region>& regions, const std::vector<int>& children, const std::vector<int>& parents,
+                               const int* mask, int mask_cols)
+{
+    LayoutIndex index;
+    std::unordered_map<int, int> mixed_rows; // mixed chunk id -> row in the mixed region
+    index.m_ncols = 0;
+    index.m_children = children;
+    index.m_parents = parents;
+    for (auto& region : regions)
+    {
+        if (region.get_maskid() != REGION_MIXED_ID)
+            continue;
+        for (int i = 0; i < region.get_nchunks(); i++)
+            mixed_rows[region.get_id(i)] = i;
+    }
+
+    // the mixed region goes last, after the ascending mask ids
+    std::sort(regions.begin(), regions.end(), [](const Region& l, const Region& r) {
+        return (l.get_maskid() == REGION_MIXED_ID) < (r.get_maskid() == REGION_MIXED_ID) ||
+               ((l.get_maskid() == REGION_MIXED_ID) == (r.get_maskid() == REGION_MIXED_ID) && l.get_maskid() < r.get_maskid());
+    });
+    for (auto& region : regions)
+    {
+        region_entry_t entry;
+        index.m_ncols = 2 * region.get_ndims() + 1;
+        entry.m_nrows = region.get_nchunks();
+        entry.m_row_offset = index.m_rows.size();
+        for (int i = 0; i < entry.m_nrows; i++)
+        {
+            const file_chunk_t& blk = region.get_region(i);
+            index.m_rows.push_back(region.get_id(i));
+            index.m_rows.insert(index.m_rows.end(), blk.m_start.begin(), blk.m_start.end());
+            index.m_rows.insert(index.m_rows.end(), blk.m_chunksize.begin(), blk.m_chunksize.end());
+        }
+        entry.m_nrelations = region.get_related_ids().size();
+        entry.m_relation_offset = index.m_relation_chunks.size();
+        for (int chunk : region.get_related_ids())
+        {
+            index.m_relation_chunks.push_back(chunk);
+            index.m_relation_rows.push_back(mixed_rows[chunk]);
+        }
+        if (region.get_maskid() != REGION_MIXED_ID)
+            index.m_mask_ids.push_back(region.get_maskid());
+        index.m_regions[region.get_maskid()] = entry;
+    }
+    if (mask != nullptr)
+        build_cell_parts(index, mask, mask_cols);
+    return index;
+}
+
+static void put_varint(std::vector<unsigned char>& out, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        out.push_back((unsigned char)(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back((unsigned char)value);
+}
+
+static uint64_t get_varint(const unsigned char*& pos, const unsigned char* end)
+{
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        if (pos == end)
+            throw std::runtime_error("Truncated region index");
+        unsigned char byte = *pos++;
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0)
+            return value;
+    }
+    throw std::runtime_error("Invalid varint in region index");
+}
+
+std::vector<unsigned char> encode_layout_index(const LayoutIndex& index)
+{
+    std::vector<unsigned char> out = {'R', 'I', 'X'};
+    std::vector<int> ids(index.m_mask_ids);
+    ids.push_back(REGION_MIXED_ID);
+    put_varint(out, LAYOUT_INDEX_VERSION);
+    put_varint(out, index.m_ncols);
+    put_varint(out, ids.size());
+    for (int id : ids)
+    {
+        const region_entry_t& entry = index.m_regions.at(id);
+        const size_t* rows = &index.m_rows[entry.m_row_offset];
+        uint64_t prev_chunk = 0;
+        put_varint(out, id);
+        put_varint(out, entry.m_nrows);
+        for (int i = 0; i < entry.m_nrows; i++)
+        {
+            // chunk ids of a region ascend, ids of other regions fall in between
+            put_varint(out, rows[0] - prev_chunk);
+            prev_chunk = rows[0];
+            for (int c = 1; c < index.m_ncols; c++)
+                put_varint(out, rows[c]);
+            rows += index.m_ncols;
+        }
+        put_varint(out, entry.m_nrelations);
+        for (int i = 0; i < entry.m_nrelations; i++)
+        {
+            put_varint(out, index.m_relation_chunks[entry.m_relation_offset + i]);
+            put_varint(out, index.m_relation_rows[entry.m_relation_offset + i]);
+        }
+    }
+    put_varint(out, index.m_children.size());
+    for (size_t i = 0; i < index.m_children.size(); i++)
+    {
+        put_varint(out, index.m_children[i]);
+        put_varint(out, index.m_parents[i]);
+    }
+    size_t nmixed = index.m_part_offsets.empty() ? 0 : index.m_part_offsets.size() - 1;
+    put_varint(out, nmixed);
+    for (size_t i = 0; i < nmixed; i++)
+    {
+        put_varint(out, index.m_part_offsets[i + 1] - index.m_part_offsets[i]);
+        for (size_t p = index.m_part_offsets[i]; p < index.m_part_offsets[i + 1]; p++)
+        {
+            const cell_part_t& part = index.m_parts[p];
+            const uint32_t* runs = &index.m_runs[part.m_run_offset];
+            uint32_t prev_end = 0;
+            put_varint(out, part.m_region);
+            put_varint(out, part.m_nruns);
+            for (int r = 0; r < part.m_nruns; r++)
+            {
+                put_varint(out, runs[2 * r] - prev_end);
+                put_varint(out, runs[2 * r + 1]);
+                prev_end = runs[2 * r] + runs[2 * r + 1];
+            }
+        }
+    }
+    return out;
+}
+
+void decode_layout_index(const unsigned char* bytes, size_t nbytes, LayoutIndex& index)
+{
+    const unsigned char *pos = bytes, *end = bytes + nbytes;
+    if (nbytes < 3 || memcmp(bytes, "RIX", 3) != 0)
+        throw std::runtime_error("Not a region index");
+    pos += 3;
+    uint64_t version = get_varint(pos, end);
+    if (version < 1 || version > LAYOUT_INDEX_VERSION)
+        throw std::runtime_error("Unsupported region index version " + std::to_string(version));
+    index = LayoutIndex();
+    index.m_ncols = get_varint(pos, end);
+    size_t nregions = get_varint(pos, end);
+    // each region takes at least one byte, a corrupt count must not reserve more
+    index.m_regions.reserve(std::min(nregions, nbytes));
+    index.m_mask_ids.reserve(std::min(nregions, nbytes));
+    for (size_t r = 0; r < nregions; r++)
+    {
+        region_entry_t entry;
+        int id = get_varint(pos, end);
+        uint64_t chunk = 0;
+        entry.m_nrows = get_varint(pos, end);
+        entry.m_row_offset = index.m_rows.size();
+        for (int i = 0; i < entry.m_nrows; i++)
+        {
+            chunk += get_varint(pos, end);
+            index.m_rows.push_back(chunk);
+            for (int c = 1; c < index.m_ncols; c++)
+                index.m_rows.push_back(get_varint(pos, end));
+        }
+        entry.m_nrelations = get_varint(pos, end);
+        entry.m_relation_offset = index.m_relation_chunks.size();
+        for (int i = 0; i < entry.m_nrelations; i++)
+        {
+            index.m_relation_chunks.push_back(get_varint(pos, end));
+            index.m_relation_rows.push_back(get_varint(pos, end));
+        }
+        if (id != REGION_MIXED_ID)
+            index.m_mask_ids.push_back(id);
+        index.m_regions[id] = entry;
+    }
+    size_t nlinks = get_varint(pos, end);
+    for (size_t i = 0; i < nlinks; i++)
+    {
+        index.m_children.push_back(get_varint(pos, end));
+        index.m_parents.push_back(get_varint(pos, end));
+    }
+    if (version < 2)
+        return;
+    size_t nmixed = get_varint(pos, end);
+    if (nmixed == 0)
+        return;
+    index.m_part_offsets.assign(1, 0);
+    for (size_t i = 0; i < nmixed; i++)
+    {
+        size_t nparts = get_varint(pos, end);
+        for (size_t p = 0; p < nparts; p++)
+        {
+            cell_part_t part;
+            uint32_t prev_end = 0;
+            part.m_region = get_varint(pos, end);
+            part.m_nruns = get_varint(pos, end);
+            part.m_run_offset = index.m_runs.size();
+            part.m_ncells = 0;
+            for (int r = 0; r < part.m_nruns; r++)
+            {
+                uint32_t start = prev_end + get_varint(pos, end), length = get_varint(pos, end);
+                index.m_runs.insert(index.m_runs.end(), {start, length});
+                part.m_ncells += length;
+                prev_end = start + length;
+            }
+            index.m_parts.push_back(part);
+        }
+        index.m_part_offsets.push_back(index.m_parts.size());
+    }
+}
+
+SpatialIndex::SpatialIndex(std::vector<entry_t>&& entries) : m_entries(std::move(entries))
+{
+    size_t extent[2] = {1, 1};
+    for (auto& e : m_entries)
+        for (int d = 0; d < 2; d++)
+            extent[d] = std::max(extent[d], e.m_end[d]);
+    size_t side = std::max<size_t>(1, (size_t)std::sqrt((double)m_entries.size()));
+    for (int d = 0; d < 2; d++)
+    {
+        m_nbuckets[d] = std::min(side, extent[d]);
+        m_bucket_size[d] = (extent[d] + m_nbuckets[d] - 1) / m_nbuckets[d];
+    }
+    m_buckets.resize(m_nbuckets[0] * m_nbuckets[1]);
+    for (size_t i = 0; i < m_entries.size(); i++)
+    {
+        const entry_t& e = m_entries[i];
+        if (e.m_end[0] <= e.m_start[0] || e.m_end[1] <= e.m_start[1])
+            continue; // empty chunk
+        for (size_t by = e.m_start[0] / m_bucket_size[0]; by <= (e.m_end[0] - 1) / m_bucket_size[0]; by++)
+            for (size_t bx = e.m_start[1] / m_bucket_size[1]; bx <= (e.m_end[1] - 1) / m_bucket_size[1]; bx++)
+                m_buckets[by * m_nbuckets[1] + bx].push_back(i);
+    }
+}
+
+size_t SpatialIndex::bytes() const
+{
+    size_t nbytes = sizeof(SpatialIndex) + m_entries.size() * sizeof(entry_t) + m_buckets.size() * sizeof(m_buckets[0]);
+    for (auto& bucket : m_buckets)
+        nbytes += bucket.size() * sizeof(int);
+    return nbytes;
+}
+
+void SpatialIndex::query(const size_t* start, const size_t* count, std::vector<const entry_t*>& hits) const
+{
+    std::vector<int> found;
+    hits.clear();
+    if (count[0] == 0 || count[1] == 0)
+        return;
+    size_t end[2] = {start[0] + count[0], start[1] + count[1]};
+    size_t last[2];
+    for (int d = 0; d < 2; d++)
+    {
+        if (start[d] / m_bucket_size[d] >= m_nbuckets[d])
+            return; // beyond every chunk
+        last[d] = std::min((end[d] - 1) / m_bucket_size[d], m_nbuckets[d] - 1);
+    }
+    for (size_t by = start[0] / m_bucket_size[0]; by <= last[0]; by++)
+    {
+        for (size_t bx = start[1] / m_bucket_size[1]; bx <= last[1]; bx++)
+        {
+            for (int i : m_buckets[by * m_nbuckets[1] + bx])
+            {
+                const entry_t& e = m_entries[i];
+                if (e.m_start[0] < end[0] && start[0] < e.m_end[0] && e.m_start[1] < end[1] && start[1] < e.m_end[1])
+                    found.push_back(i);
+            }
+        }
+    }
+    std::sort(found.begin(), found.end());
+    found.erase(std::unique(found.begin(), found.end()), found.end());
+    for (int i : found)
+        hits.push_back(&m_entries[i]);
+}
+
 
 } // end namespace raster
\ No newline at end of file
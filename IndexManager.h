@@ -2,6 +2,7 @@
 #define __CONSTRUCT_REGION_H__
 
 #include <iostream>
+#include <unordered_map>
 #include <vector>
 #include <netcdf.h>
 #include "MeshBuilder.h"
@@ -61,5 +62,87 @@ void construct_region_meta(Region& region, int* nrows, int* ncols, size_t* &meta
 
 void construct_region_relation(Region& region, int* nrelated_blks, int* &related_ids);
 
+// Region index of a layout, stored as the single byte variable `_index_` and decoded in one read.
+// `m_rows` holds the rows (chunk id, start[ndims], count[ndims]) of all regions back to back, and
+// each relation of a region is kept both as the mixed chunk id and as its row in the mixed region.
+// Encoded as LEB128 varints: magic "RIX", version, ncols, then per region (ascending ids, the mixed
+// region last) id, nrows, rows with delta coded chunk ids, nrelations, (chunk id, mixed row) pairs,
+// and the hierarchy as nlinks, (child, parent) pairs. Version 2 appends the cells of each mixed
+// chunk split by region: per mixed row nparts, then per part region id, nruns and the runs as
+// (gap after the previous run, length).
+struct region_entry_t
+{
+    int     m_nrows;
+    size_t  m_row_offset;       // offset of its first row in `m_rows`
+    int     m_nrelations;
+    size_t  m_relation_offset;  // first relation in `m_relation_chunks` / `m_relation_rows`
+};
+
+// cells of one region in a mixed chunk, as runs along the rows of the chunk's 2D footprint
+struct cell_part_t
+{
+    int     m_region;
+    size_t  m_run_offset;       // first run in `m_runs`
+    int     m_nruns;
+    size_t  m_ncells;           // cells of one 2D layer
+};
+
+struct LayoutIndex
+{
+    int                                     m_ncols;
+    std::vector<int>                        m_mask_ids;         // excluding `REGION_MIXED_ID`
+    std::unordered_map<int, region_entry_t> m_regions;
+    std::vector<size_t>                     m_rows;
+    std::vector<int>                        m_relation_chunks;
+    std::vector<int>                        m_relation_rows;
+    std::vector<int>                        m_children;
+    std::vector<int>                        m_parents;
+    std::vector<size_t>                     m_part_offsets;     // parts of mixed row i: [m_part_offsets[i], m_part_offsets[i + 1])
+    std::vector<cell_part_t>                m_parts;            // empty before version 2
+    std::vector<uint32_t>                   m_runs;             // (start, length) pairs, starts row-major in the footprint
+};
+
+constexpr int LAYOUT_INDEX_VERSION = 2;
+
+// `mask`, `mask_cols` wide, splits the mixed chunks by region; without it they are not split
+LayoutIndex build_layout_index(std::vector<Region>& regions, const std::vector<int>& children, const std::vector<int>& parents,
+                               const int* mask = nullptr, int mask_cols = 0);
+
+std::vector<unsigned char> encode_layout_index(const LayoutIndex& index);
+
+// throws on a truncated index or an unknown version
+void decode_layout_index(const unsigned char* bytes, size_t nbytes, LayoutIndex& index);
+
+// Box queries over the chunks of all regions of one layout. Chunks are bucketed in a uniform grid
+// over the two spatial dimensions, about one chunk per bucket, and a chunk spanning several
+// buckets is listed in each of them.
+class SpatialIndex
+{
+public:
+    struct entry_t
+    {
+        int     m_region;       // mask id, or `REGION_MIXED_ID`
+        int     m_row;          // row in the metadata of its region
+        size_t  m_start[2];
+        size_t  m_end[2];
+    };
+
+    SpatialIndex(std::vector<entry_t>&& entries);
+    // entries intersecting [start, start + count) of the two spatial dimensions, in entry order
+    void query(const size_t* start, const size_t* count, std::vector<const entry_t*>& hits) const;
+    size_t size() const { return m_entries.size(); }
+    // estimated heap bytes, as counted by the metadata cache
+    size_t bytes() const;
+
+private:
+    std::vector<entry_t>            m_entries;
+    size_t                          m_bucket_size[2];
+    size_t                          m_nbuckets[2];
+    std::vector<std::vector<int> >  m_buckets;
+};
+
+// copy of region metadata whose chunks cover steps [start0, start0 + count0) of the leading dimension
+std::vector<size_t> rebase_region_meta(const size_t* metadata, int nrows, int ncols, size_t start0, size_t count0);
+
 } // end of namespace raster
 #endif
\ No newline at end of file
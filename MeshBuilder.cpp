@@ -1,230 +1,512 @@
+#include <climits>
+
 #include "MeshBuilder.h"
 
 namespace raster
 {
 
-// implementation of RASTER chunk
-RASTER_chunk_t::RASTER_chunk_t() : m_start_row(0), m_start_col(0), m_size_row(0), m_size_col(0), 
-                   m_type(BLOCK_TYPE::PURE)
-{}
-
-RASTER_chunk_t::RASTER_chunk_t(int r, int c, int size_r, int size_c)
-            : m_start_row(r), m_start_col(c), m_size_row(size_r), m_size_col(size_c),
-              m_type(BLOCK_TYPE::PURE)
-{}
-
-RASTER_chunk_t& RASTER_chunk_t::operator=(const RASTER_chunk_t&& other)
+// sets the type and major region of `chunk` from its histogram
+static void classify_chunk(RASTER_chunk_t& chunk, const hist_entry_t* hist)
 {
-    this->m_size_col = other.m_size_col;
-    this->m_size_row = other.m_size_row;
-    this->m_start_col = other.m_start_col;
-    this->m_start_row = other.m_size_row;
-    this->m_type = other.m_type;
-    this->m_maskid2nelems = other.m_maskid2nelems;
-    return *this;
+    // the first of equal counts, i.e. the smallest id
+    const hist_entry_t* max = std::max_element(hist, hist + chunk.m_hist_size,
+                                               [](const hist_entry_t& l, const hist_entry_t& r) { return l.second < r.second; });
+    double share = double(max->second) / (double(chunk.m_size_row) * chunk.m_size_col);
+    if (share == 1.0)
+        chunk.m_type = BLOCK_TYPE::PURE;
+    else if (share > RASTER_chunk_t::REGION_MAJOR_THRESHOLD)
+        chunk.m_type = BLOCK_TYPE::MAJOR;
+    else
+        chunk.m_type = BLOCK_TYPE::MIXED;
+    chunk.m_major = (share < RASTER_chunk_t::REGION_MAJOR_THRESHOLD) ? RASTER_chunk_t::REGION_NO_MAJOR : max->first;
 }
 
-RASTER_chunk_t& RASTER_chunk_t::operator=(const RASTER_chunk_t& other)
+void chunk_info_list::print_chunk(const RASTER_chunk_t& chunk, std::ostream& os) const
 {
-    *this = std::move(other);
-    return *this;
+    os << "<RASTER_chunk_t start: (" << chunk.m_start_row << "," << chunk.m_start_col << "), ";
+    os << "size: (" << chunk.m_size_row << "," << chunk.m_size_col << "), content = {";
+    for (const hist_entry_t* entry = hist_begin(chunk); entry != hist_end(chunk); entry++)
+        os << (entry == hist_begin(chunk) ? "" : ", ") << entry->first << ": " << entry->second;
+    os << "}, major = " << chunk.m_major << ">";
 }
 
-RASTER_chunk_t::RASTER_chunk_t(RASTER_chunk_t&& other)
-{
-    *this = other;
-}
 
-RASTER_chunk_t::RASTER_chunk_t(RASTER_chunk_t& other)
-{
-    *this = other;
-}
+// implementation of Mesh
 
-int& RASTER_chunk_t::operator[](int maskId)
+Mesh::Mesh(int* mask, int mask_rows, int mask_cols, size_t rows_in_grid, size_t cols_in_grid, double merge_threshold,
+           size_t max_chunk_cells)
+           : m_cols_in_grid(cols_in_grid), m_rows_in_grid(rows_in_grid), m_nrows(mask_rows), m_ncols(mask_cols), 
+             m_mask(nullptr), m_merge_threshold(merge_threshold), m_max_chunk_cells(max_chunk_cells), m_done(false)
 {
-    return m_maskid2nelems[maskId];
+    // copy the given mask
+    m_mask = new int[m_nrows * m_ncols];
+    memcpy(m_mask, mask, m_nrows * m_ncols * sizeof(int));
 }
 
-std::ostream& operator<<(std::ostream& os, RASTER_chunk_t& b)
+Mesh::~Mesh()
 {
-    os << "<RASTER_chunk_t start: (" << b.m_start_row << "," << b.m_start_col << "), ";
-    os << "size: (" << b.m_size_row << "," << b.m_size_col << "), content = ";
-    b.print_info(os);
-    os << ">";
-    return os;
+    if (m_mask)
+        delete[] m_mask;
 }
 
-void RASTER_chunk_t::print_info(std::ostream& os) const
+// Chunks live in one array per grid row, with their histograms over dense ids in another, so that
+// counting and merging allocate nothing per chunk. Rows are built and merged horizontally in
+// parallel, merged vertically in order, then copied into `m_partitions` with mask ids
+const chunk_info_list& Mesh::partition()
 {
-    os << "{";
-    os << std::accumulate(m_maskid2nelems.begin(), m_maskid2nelems.end(), std::string(""), 
-                    [&](auto& item, auto& other) -> std::string {
-                        return item + (item.size() == 0 ? "" : ", ")
-                             + std::to_string(other.first) + ": " + std::to_string(other.second); 
-                    } );
-    os << "}, major = " << get_major_index();
+    if (m_done)
+        return m_partitions;
+
+    remap_mask();
+    grid_cuts(m_row_cuts, m_col_cuts);
+    const std::vector<int>& row_cuts = m_row_cuts;
+    const std::vector<int>& col_cuts = m_col_cuts;
+    std::vector<grid_row_t> rows(row_cuts.size() - 1);
+
+    // grid rows are independent until the vertical merge
+    #pragma omp parallel
+    {
+        std::vector<int> counts(m_ids.size(), 0), touched;
+        #pragma omp for schedule(dynamic)
+        for (size_t i = 0; i < rows.size(); i++)
+        {
+            grid_row_t& row = rows[i];
+            row.m_chunks.resize(col_cuts.size() - 1);
+            for (size_t j = 0; j + 1 < col_cuts.size(); j++)
+            {
+                RASTER_chunk_t& chunk = row.m_chunks[j];
+                chunk.m_start_row = row_cuts[i];
+                chunk.m_start_col = col_cuts[j];
+                chunk.m_size_row = row_cuts[i + 1] - row_cuts[i];
+                chunk.m_size_col = col_cuts[j + 1] - col_cuts[j];
+                count_chunk(row, chunk, counts, touched);
+            }
+            merge_chunks(row);
+        }
+    }
+    merge_rows(rows);
+    flatten(rows);
+    m_done = true;
+    return m_partitions;
 }
 
-int RASTER_chunk_t::get_major_index() const
+// Partition of a mask close to the one of `base`, already partitioned with the same shape and
+// grid. Chunks of `base` whose cells are all unchanged are kept with their histograms, the others
+// are cut again along the grid lines of `base` and merged within each of them, horizontally only.
+// Only changed chunks are counted, at the cost of chunks a full partition might have merged
+const chunk_info_list& Mesh::partition_from(const Mesh& base)
 {
-    auto maxPair = *std::max_element(m_maskid2nelems.begin(), m_maskid2nelems.end(), 
-                                        [&](auto& l, auto& r) {return l.second < r.second; }
-                                    );
-    if ((double(maxPair.second) / double(m_size_row * m_size_col)) < RASTER_chunk_t::REGION_MAJOR_THRESHOLD)
-        return RASTER_chunk_t::REGION_NO_MAJOR;
-    return maxPair.first;
+    if (m_done)
+        return m_partitions;
+    if (!base.m_done || base.m_nrows != m_nrows || base.m_ncols != m_ncols || base.m_rows_in_grid != m_rows_in_grid ||
+        base.m_cols_in_grid != m_cols_in_grid || base.m_merge_threshold != m_merge_threshold ||
+        base.m_max_chunk_cells != m_max_chunk_cells)
+        return partition();
+
+    remap_mask();
+    m_row_cuts = base.m_row_cuts;
+    m_col_cuts = base.m_col_cuts;
+    std::vector<grid_row_t> rows(m_row_cuts.size() - 1);
+    std::vector<int> counts(m_ids.size(), 0), touched;
+    for (const RASTER_chunk_t& old : base.m_partitions.m_chunks)
+    {
+        bool same = true;
+        for (int i = old.m_start_row; same && i < old.m_start_row + old.m_size_row; i++)
+        {
+            size_t offset = size_t(i) * m_ncols + old.m_start_col;
+            same = memcmp(&m_mask[offset], &base.m_mask[offset], sizeof(int) * old.m_size_col) == 0;
+        }
+        size_t r = std::lower_bound(m_row_cuts.begin(), m_row_cuts.end(), old.m_start_row) - m_row_cuts.begin();
+        if (same)
+        {
+            // the same cells, only the ids of its histogram become dense ones
+            grid_row_t& row = rows[r];
+            RASTER_chunk_t chunk = old;
+            chunk.m_hist_begin = row.m_hist.size();
+            for (const hist_entry_t* entry = base.m_partitions.hist_begin(old); entry != base.m_partitions.hist_end(old); entry++)
+                row.m_hist.emplace_back(std::lower_bound(m_ids.begin(), m_ids.end(), entry->first) - m_ids.begin(), entry->second);
+            classify_chunk(chunk, &row.m_hist[chunk.m_hist_begin]);
+            row.m_chunks.push_back(chunk);
+            continue;
+        }
+        size_t c0 = std::lower_bound(m_col_cuts.begin(), m_col_cuts.end(), old.m_start_col) - m_col_cuts.begin();
+        for (; r + 1 < m_row_cuts.size() && m_row_cuts[r] < old.m_start_row + old.m_size_row; r++)
+        {
+            grid_row_t piece;
+            for (size_t c = c0; c + 1 < m_col_cuts.size() && m_col_cuts[c] < old.m_start_col + old.m_size_col; c++)
+            {
+                RASTER_chunk_t chunk = {};
+                chunk.m_start_row = m_row_cuts[r];
+                chunk.m_start_col = m_col_cuts[c];
+                chunk.m_size_row = m_row_cuts[r + 1] - m_row_cuts[r];
+                chunk.m_size_col = m_col_cuts[c + 1] - m_col_cuts[c];
+                count_chunk(piece, chunk, counts, touched);
+                piece.m_chunks.push_back(chunk);
+            }
+            merge_chunks(piece);
+            grid_row_t& row = rows[r];
+            for (RASTER_chunk_t chunk : piece.m_chunks)
+            {
+                size_t begin = row.m_hist.size();
+                row.m_hist.insert(row.m_hist.end(), piece.m_hist.begin() + chunk.m_hist_begin,
+                                  piece.m_hist.begin() + chunk.m_hist_begin + chunk.m_hist_size);
+                chunk.m_hist_begin = begin;
+                row.m_chunks.push_back(chunk);
+            }
+        }
+    }
+    for (grid_row_t& row : rows)
+        std::sort(row.m_chunks.begin(), row.m_chunks.end(),
+                  [](const RASTER_chunk_t& l, const RASTER_chunk_t& r) { return l.m_start_col < r.m_start_col; });
+    flatten(rows);
+    m_done = true;
+    return m_partitions;
 }
 
-void RASTER_chunk_t::set_type()
+// Replaces mask values by dense indices into the sorted `m_ids`, so that histograms are plain arrays
+void Mesh::remap_mask()
 {
-    auto maxPair = *std::max_element(m_maskid2nelems.begin(), m_maskid2nelems.end(), 
-                                        [&](auto& l, auto& r) {return l.second < r.second; }
-                                    );
-    double percentage = (double(maxPair.second) / double(m_size_row * m_size_col));
-    if (percentage == 1.0)
-        m_type = BLOCK_TYPE::PURE;
-    else if (percentage > RASTER_chunk_t::REGION_MAJOR_THRESHOLD)
-        m_type = BLOCK_TYPE::MAJOR;
+    size_t ncells = m_nrows * m_ncols;
+    if (ncells == 0)
+        return;
+    int min_id = m_mask[0], max_id = m_mask[0];
+    #pragma omp parallel for reduction(min: min_id) reduction(max: max_id)
+    for (size_t k = 0; k < ncells; k++)
+    {
+        min_id = std::min(min_id, m_mask[k]);
+        max_id = std::max(max_id, m_mask[k]);
+    }
+
+    m_dense.resize(ncells);
+    size_t range = size_t((long long)max_id - min_id) + 1;
+    if (range <= std::max(ncells, MAX_DENSE_RANGE))
+    {
+        // ids in a small range, look them up in a table
+        std::vector<int> table(range, -1);
+        for (size_t k = 0; k < ncells; k++)
+            table[m_mask[k] - min_id] = 0;
+        m_ids.clear();
+        for (size_t v = 0; v < range; v++)
+        {
+            if (table[v] == 0)
+            {
+                table[v] = m_ids.size();
+                m_ids.push_back(int(min_id + (long long)v));
+            }
+        }
+        #pragma omp parallel for
+        for (size_t k = 0; k < ncells; k++)
+            m_dense[k] = table[m_mask[k] - min_id];
+    }
     else
-        m_type = BLOCK_TYPE::MIXED;
+    {
+        // sparse ids, sort one id per run of equal cells and search each run
+        m_ids.clear();
+        for (size_t k = 0; k < ncells; k++)
+            if (k == 0 || m_mask[k] != m_mask[k - 1])
+                m_ids.push_back(m_mask[k]);
+        std::sort(m_ids.begin(), m_ids.end());
+        m_ids.erase(std::unique(m_ids.begin(), m_ids.end()), m_ids.end());
+        #pragma omp parallel for
+        for (size_t i = 0; i < m_nrows; i++)
+        {
+            for (size_t k = i * m_ncols; k < (i + 1) * m_ncols; k++)
+            {
+                if (k > i * m_ncols && m_mask[k] == m_mask[k - 1])
+                    m_dense[k] = m_dense[k - 1];
+                else
+                    m_dense[k] = std::lower_bound(m_ids.begin(), m_ids.end(), m_mask[k]) - m_ids.begin();
+            }
+        }
+    }
 }
 
-std::vector<int> RASTER_chunk_t::keys() const
+// Appends the histogram of `chunk` to the array of `row`. Each line of the chunk is first checked
+// for a single id, a loop the compiler vectorizes, other lines are counted run by run. `counts` is
+// a zeroed scratch array over dense ids, it is zeroed again on return
+void Mesh::count_chunk(grid_row_t& row, RASTER_chunk_t& chunk, std::vector<int>& counts, std::vector<int>& touched) const
 {
-    std::vector<int> ret;
-    for (auto& kv : m_maskid2nelems)
-        ret.push_back(kv.first);
-    return ret;
+    touched.clear();
+    for (int i = 0; i < chunk.m_size_row; i++)
+    {
+        const int* cell = &m_dense[size_t(i + chunk.m_start_row) * m_ncols + chunk.m_start_col];
+        const int* end = cell + chunk.m_size_col;
+        int first = *cell, diff = 0;
+        for (int j = 0; j < chunk.m_size_col; j++)
+            diff |= cell[j] ^ first;
+        if (diff == 0)
+        {
+            if (counts[first] == 0)
+                touched.push_back(first);
+            counts[first] += chunk.m_size_col;
+            continue;
+        }
+        while (cell < end)
+        {
+            const int* run = cell + 1;
+            while (run < end && *run == *cell)
+                run++;
+            if (counts[*cell] == 0)
+                touched.push_back(*cell);
+            counts[*cell] += run - cell;
+            cell = run;
+        }
+    }
+    std::sort(touched.begin(), touched.end()); // dense ids sort like mask ids
+    chunk.m_hist_begin = row.m_hist.size();
+    chunk.m_hist_size = touched.size();
+    for (int index : touched)
+    {
+        row.m_hist.emplace_back(index, counts[index]);
+        counts[index] = 0;
+    }
+    classify_chunk(chunk, &row.m_hist[chunk.m_hist_begin]);
 }
 
-std::vector<int> RASTER_chunk_t::values() const
+// Grid lines of the partition. They start evenly spaced, then each inner line moves to the
+// nearest edge of a region bounding box within a quarter of a grid cell, so that chunks
+// along straight region borders stay pure
+void Mesh::grid_cuts(std::vector<int>& row_cuts, std::vector<int>& col_cuts) const
 {
-    std::vector<int> ret;
-    for (auto& kv : m_maskid2nelems)
-        ret.push_back(kv.second);
-    return ret;
-}
-
+    int row_length = m_nrows / m_rows_in_grid;
+    int col_length = m_ncols / m_cols_in_grid;
+    for (size_t i = 0; i * row_length < m_nrows; i++)
+        row_cuts.push_back(i * row_length);
+    row_cuts.push_back(m_nrows);
+    for (size_t j = 0; j < m_cols_in_grid; j++)
+        col_cuts.push_back(j * col_length);
+    col_cuts.push_back(m_ncols);
 
-// implementation of Mesh
+    // bounding boxes of all regions by dense id, as (top, left, bottom, right), the end is exclusive
+    size_t nids = m_ids.size();
+    std::vector<std::array<int, 4> > boxes(nids, std::array<int, 4>{INT_MAX, INT_MAX, INT_MIN, INT_MIN});
+    #pragma omp parallel
+    {
+        std::vector<std::array<int, 4> > local(boxes);
+        #pragma omp for schedule(static)
+        for (int i = 0; i < (int)m_nrows; i++)
+        {
+            const int* row = &m_dense[size_t(i) * m_ncols];
+            for (int j = 0; j < (int)m_ncols; j++)
+            {
+                auto& box = local[row[j]];
+                box[0] = std::min(box[0], i);
+                box[1] = std::min(box[1], j);
+                box[2] = std::max(box[2], i + 1);
+                box[3] = std::max(box[3], j + 1);
+            }
+        }
+        #pragma omp critical (raster_mesh_boxes)
+        for (size_t k = 0; k < nids; k++)
+        {
+            boxes[k][0] = std::min(boxes[k][0], local[k][0]);
+            boxes[k][1] = std::min(boxes[k][1], local[k][1]);
+            boxes[k][2] = std::max(boxes[k][2], local[k][2]);
+            boxes[k][3] = std::max(boxes[k][3], local[k][3]);
+        }
+    }
+    std::set<int> row_edges, col_edges;
+    for (auto& box : boxes)
+    {
+        row_edges.insert(box[0]);
+        row_edges.insert(box[2]);
+        col_edges.insert(box[1]);
+        col_edges.insert(box[3]);
+    }
+    snap_cuts(row_cuts, row_edges, row_length / 4);
+    snap_cuts(col_cuts, col_edges, col_length / 4);
+}
 
-Mesh::Mesh(int* mask, int mask_rows, int mask_cols, size_t rows_in_grid, size_t cols_in_grid, double merge_threshold)
-           : m_cols_in_grid(cols_in_grid), m_rows_in_grid(rows_in_grid), m_nrows(mask_rows), m_ncols(mask_cols), 
-             m_mask(nullptr), m_merge_threshold(merge_threshold), m_done(false)
+// moves inner `cuts` to the nearest of `edges` within `tolerance`, cuts stay strictly increasing
+void Mesh::snap_cuts(std::vector<int>& cuts, const std::set<int>& edges, int tolerance)
 {
-    // copy the given mask
-    m_mask = new int[m_nrows * m_ncols];
-    memcpy(m_mask, mask, m_nrows * m_ncols * sizeof(int));
+    for (size_t k = 1; k + 1 < cuts.size(); k++)
+    {
+        int best = cuts[k];
+        for (auto it = edges.lower_bound(cuts[k] - tolerance); it != edges.end() && *it <= cuts[k] + tolerance; it++)
+        {
+            if (best == cuts[k] || std::abs(*it - cuts[k]) < std::abs(best - cuts[k]))
+                best = *it;
+            if (best == cuts[k])
+                break; // already on an edge
+        }
+        if (best > cuts[k - 1] && best < cuts[k + 1])
+            cuts[k] = best;
+    }
 }
 
-Mesh::~Mesh()
+// whether chunk `b` can be merged into chunk `a`, making a chunk of `merged_cells` cells
+bool Mesh::can_merge(const grid_row_t& row_a, const RASTER_chunk_t& a, const grid_row_t& row_b, const RASTER_chunk_t& b,
+                     size_t merged_cells) const
 {
-    if (m_mask)
-        delete[] m_mask;
+    const hist_entry_t* ha = &row_a.m_hist[a.m_hist_begin];
+    const hist_entry_t* hb = &row_b.m_hist[b.m_hist_begin];
+    auto same_key = [](const hist_entry_t& l, const hist_entry_t& r) { return l.first == r.first; };
+    if (m_max_chunk_cells > 0 && merged_cells > m_max_chunk_cells)
+        return false; // large pure regions still split, so they can be read in parallel
+    if (a.m_type == BLOCK_TYPE::MIXED && (a.m_hist_size != b.m_hist_size || !std::equal(ha, ha + a.m_hist_size, hb, same_key)))
+        return false; // mixed chunks with different components can not be merged together
+    if (a.m_major != b.m_major)
+        return false; // chunks with different majors cannot be merged
+
+    // count the union of both key sets, both are sorted
+    size_t nkeys = 0;
+    const hist_entry_t *ia = ha, *ib = hb, *ea = ha + a.m_hist_size, *eb = hb + b.m_hist_size;
+    while (ia != ea || ib != eb)
+    {
+        if (ib == eb || (ia != ea && ia->first < ib->first))
+            ia++;
+        else if (ia == ea || ib->first < ia->first)
+            ib++;
+        else
+            ia++, ib++;
+        if (++nkeys >= 3)
+            return false; // reject chunks with >= 3 regions
+    }
+    return true;
 }
 
-const chunk_info_list& Mesh::partition()
+// merges chunk `b` into chunk `a`, the caller resizes `a`. The union of both histograms is
+// appended to `hist_a`, the array of `a`, its old one is left unused. `hist_b` may be `hist_a`
+static void absorb_chunk(std::vector<hist_entry_t>& hist_a, RASTER_chunk_t& a, const std::vector<hist_entry_t>& hist_b,
+                         const RASTER_chunk_t& b)
 {
-    int row_length = m_nrows / m_rows_in_grid;
-    int col_length = m_ncols / m_cols_in_grid;
-    if (m_done)
-        return m_partitions;
+    size_t begin = hist_a.size();
+    // no reallocation below, both ranges stay valid
+    if (hist_a.capacity() < begin + a.m_hist_size + b.m_hist_size)
+        hist_a.reserve(std::max(2 * hist_a.capacity(), begin + a.m_hist_size + b.m_hist_size));
+    const hist_entry_t *ia = &hist_a[a.m_hist_begin], *ea = ia + a.m_hist_size;
+    const hist_entry_t *ib = &hist_b[b.m_hist_begin], *eb = ib + b.m_hist_size;
+    while (ia != ea || ib != eb)
+    {
+        if (ib == eb || (ia != ea && ia->first < ib->first))
+            hist_a.push_back(*ia++);
+        else if (ia == ea || ib->first < ia->first)
+            hist_a.push_back(*ib++);
+        else
+        {
+            hist_a.emplace_back(ia->first, ia->second + ib->second);
+            ia++, ib++;
+        }
+    }
+    a.m_hist_begin = begin;
+    a.m_hist_size = hist_a.size() - begin;
+    classify_chunk(a, &hist_a[begin]);
+}
 
-    for (size_t i = 0; i*row_length < m_nrows; i++)
+void Mesh::merge_chunks(grid_row_t& row) const
+{
+    // histograms of the chunks are filled by `count_chunk`. Each chunk is merged into the last
+    // one kept, or kept as the next one to merge into
+    size_t last = 0;
+    for (size_t k = 1; k < row.m_chunks.size(); k++)
     {
-        int sr = ((i + 1) * row_length > m_nrows) ? m_nrows - i * row_length : row_length;
-        std::list<std::shared_ptr<RASTER_chunk_t> > chunks_in_row;
-        for (size_t j = 0; j < m_cols_in_grid; j++)
+        RASTER_chunk_t& curr = row.m_chunks[last];
+        const RASTER_chunk_t& next = row.m_chunks[k];
+        size_t merged_cells = size_t(curr.m_size_col + next.m_size_col) * curr.m_size_row;
+        // chunks with more than `threshold * total` columns are not merged further, to improve
+        // performance of out of order reads
+        if (curr.m_size_col > m_ncols * m_merge_threshold || !can_merge(row, curr, row, next, merged_cells))
         {
-            int sc = (j == m_cols_in_grid - 1) ? m_ncols - j * col_length : col_length;
-            chunks_in_row.emplace_back(std::shared_ptr<RASTER_chunk_t>(new RASTER_chunk_t(i * row_length, j * col_length, sr, sc)));
+            row.m_chunks[++last] = next;
+            continue;
         }
-        merge_chunks(chunks_in_row);
-        m_partitions.push_back(chunks_in_row);
+        curr.m_size_col += next.m_size_col;
+        absorb_chunk(row.m_hist, curr, row.m_hist, next);
     }
-    m_done = true;
-    return m_partitions;
+    row.m_chunks.resize(row.m_chunks.empty() ? 0 : last + 1);
 }
 
-void Mesh::merge_chunks(std::list<std::shared_ptr<RASTER_chunk_t> >& chunks_in_row)
+// Merges chunks vertically once all rows are merged horizontally: a chunk joins the chunk right
+// above it when both span the same columns, so a tall region becomes a few rectangles instead of
+// one strip per grid row. A merged chunk stays in the row it starts in.
+void Mesh::merge_rows(std::vector<grid_row_t>& rows) const
 {
-    // Pre-processing, calculate the distribution of each chunk
-    for (auto& r : chunks_in_row)
+    // chunks whose bottom edge is the top of the current row, by start column: (row, index)
+    struct bottom_t
+    {
+        int     m_start_col;
+        size_t  m_row;
+        size_t  m_index;
+    };
+    std::vector<bottom_t> above, bottom;
+    for (size_t r = 0; r < rows.size(); r++)
     {
-        for (int i = 0; i < r->m_size_row; i++)
+        grid_row_t& row = rows[r];
+        size_t kept = 0;
+        bottom.clear();
+        for (size_t k = 0; k < row.m_chunks.size(); k++)
         {
-            for (int j = 0; j < r->m_size_col; j++)
+            const RASTER_chunk_t& chunk = row.m_chunks[k];
+            auto top = std::lower_bound(above.begin(), above.end(), chunk.m_start_col,
+                                        [](const bottom_t& b, int col) { return b.m_start_col < col; });
+            if (top != above.end() && top->m_start_col == chunk.m_start_col)
             {
-                int offset = (i + r->m_start_row) * m_ncols + j + r->m_start_col;
-                (*r)[m_mask[offset]] ++;
+                grid_row_t& top_row = rows[top->m_row];
+                RASTER_chunk_t& top_chunk = top_row.m_chunks[top->m_index];
+                if (top_chunk.m_size_col == chunk.m_size_col && top_chunk.m_size_row <= m_nrows * m_merge_threshold &&
+                    can_merge(top_row, top_chunk, row, chunk, size_t(top_chunk.m_size_row + chunk.m_size_row) * chunk.m_size_col))
+                {
+                    top_chunk.m_size_row += chunk.m_size_row;
+                    absorb_chunk(top_row.m_hist, top_chunk, row.m_hist, chunk);
+                    bottom.push_back(*top);
+                    continue;
+                }
             }
+            bottom.push_back({chunk.m_start_col, r, kept});
+            row.m_chunks[kept++] = chunk;
         }
-        r->set_type();
+        row.m_chunks.resize(kept);
+        above.swap(bottom);
     }
+}
 
-    // Do merge
-    auto curr_chunk = chunks_in_row.begin();
-    auto last_chunk = --chunks_in_row.end();
-
-    #define NEXT_ITERATION {  /* std::cout << "Skip:\n    " << (**curr_chunk) << std::endl; */  curr_chunk++; continue;}
-    while (curr_chunk != last_chunk && curr_chunk != chunks_in_row.end())
+// copies the chunks of all rows into `m_partitions`, histograms with mask ids
+void Mesh::flatten(const std::vector<grid_row_t>& rows)
+{
+    m_partitions.m_chunks.clear();
+    m_partitions.m_hist.clear();
+    for (const grid_row_t& row : rows)
     {
-        if ((*curr_chunk)->m_size_col > m_ncols * m_merge_threshold)
-            NEXT_ITERATION; // chunks with more than `threshold * total` columns will be rejected
-                            // This is to improve performance of out of order read
-        auto next_chunk = std::next(curr_chunk);
-        if ((*curr_chunk)->m_type == BLOCK_TYPE::MIXED && (*curr_chunk)->keys() != (*next_chunk)->keys())
-            NEXT_ITERATION; // mixed chunks with different components can not be merged together
-        if ((*curr_chunk)->get_major_index() != (*next_chunk)->get_major_index())
-            NEXT_ITERATION; // chunks with different majors cannot be merged
-        
-        // merge keys
-        auto curr_key = (*curr_chunk)->keys();
-        auto next_key = (*next_chunk)->keys();
-        int original_size = curr_key.size();
-        for (int& k : next_key)
+        for (RASTER_chunk_t chunk : row.m_chunks)
         {
-            bool exists = false;
-            for (int i = 0; i < original_size; i++)
-                if (curr_key[i] == k) exists = true;
-            if (!exists)
-                curr_key.push_back(k);
+            size_t begin = m_partitions.m_hist.size();
+            for (size_t e = chunk.m_hist_begin; e < chunk.m_hist_begin + chunk.m_hist_size; e++)
+                m_partitions.m_hist.emplace_back(m_ids[row.m_hist[e].first], row.m_hist[e].second);
+            chunk.m_hist_begin = begin;
+            if (chunk.m_major != RASTER_chunk_t::REGION_NO_MAJOR)
+                chunk.m_major = m_ids[chunk.m_major];
+            m_partitions.m_chunks.push_back(chunk);
         }
-        if (curr_key.size() >= 3)
-            NEXT_ITERATION; // reject chunks with >= 3 regions
-
-        // std::cout << "Merge: \n    " << (**curr_chunk) << "\n    " << (**next_chunk) << std::endl;
-
-        // start merge !
-        (*curr_chunk)->m_size_col += (*next_chunk)->m_size_col; // reset size
-        for (auto& nextKV : (*next_chunk)->m_maskid2nelems)
-            (**curr_chunk)[nextKV.first] += nextKV.second; // merge keys and values
-        (*curr_chunk)->set_type(); // reset type
-        chunks_in_row.erase(next_chunk); // remove next chunk
-        last_chunk = --chunks_in_row.end(); // update list tail
     }
-#undef NEXT_ITERATION
 }
 
 void Mesh::export_to(EXPORT_TYPE type, std::ostream& os) const
 {
     if (type == EXPORT_TYPE::HUMAN)
     {
-        int i = 0;
-        for (auto& row : m_partitions)
+        int i = -1, start_row = -1;
+        for (auto& chunk : m_partitions.m_chunks)
         {
-            os << "ROW " << i++ << std::endl;
-            std::for_each(row.begin(), row.end(), [&](auto& item){ os << "  " << (*item) << "\n"; });
-            os << std::endl;
+            if (chunk.m_start_row != start_row)
+            {
+                if (i >= 0)
+                    os << std::endl;
+                os << "ROW " << ++i << std::endl;
+                start_row = chunk.m_start_row;
+            }
+            os << "  ";
+            m_partitions.print_chunk(chunk, os);
+            os << "\n";
         }
+        os << std::endl;
     }
     else
     {
-        for (auto& row : m_partitions)
-            for (auto& chunk : row)
-                os << chunk->m_start_col << " " << chunk->m_start_row << " "
-                << chunk->m_size_col << " " << chunk->m_size_row
-                << " " << chunk->get_major_index() << std::endl;         
+        for (auto& chunk : m_partitions.m_chunks)
+            os << chunk.m_start_col << " " << chunk.m_start_row << " "
+            << chunk.m_size_col << " " << chunk.m_size_row
+            << " " << chunk.m_major << std::endl;
     }
 }
 
@@ -234,14 +516,9 @@ size_t Mesh::cols() const { return m_ncols; }
 
 std::vector<int> Mesh::get_all_mask_id()
 {
-    std::set<int> indexs;
     if (!m_done)
         this->partition();
-    for (auto& row : m_partitions)
-        for (auto& chunk : row)
-            for (int& index : chunk->keys())
-                indexs.insert(index);
-    return std::vector<int>(indexs.begin(), indexs.end());
+    return m_ids; // chunks cover the whole mask
 }
 
 } // namspace raster
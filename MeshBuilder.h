@@ -11,6 +11,8 @@
 #include <algorithm>
 #include <set>
 #include <map>
+#include <array>
+#include <cstdint>
 
 #include <netcdf.h>
 
@@ -20,54 +22,68 @@ namespace raster
 enum class BLOCK_TYPE : char {PURE = 'P', MAJOR = 'M', MIXED = 'X'};
 enum class EXPORT_TYPE : int {PYTHON = 0, HUMAN = 1};
 
-// A single RASTER chunk
+// A single RASTER chunk: its box, and its histogram, the cells of each region in it as
+// (mask id, cells) pairs sorted by mask id, `m_hist_size` of them from `m_hist_begin` in the
+// histogram array of its partition
 struct RASTER_chunk_t
 {
-    RASTER_chunk_t();
-    RASTER_chunk_t(int r, int c, int sizeR, int sizeC);
-    RASTER_chunk_t(RASTER_chunk_t& other);
-    RASTER_chunk_t(RASTER_chunk_t&& other);
-
-    int& operator[](int maskId);
-    std::ostream& operator<<(std::ostream& os);
-    RASTER_chunk_t& operator=(const RASTER_chunk_t&& other);
-    RASTER_chunk_t& operator=(const RASTER_chunk_t& other);
-
-    void print_info(std::ostream& os=std::cout) const;
-    int  get_major_index() const;
-    void set_type();
-    
-    std::vector<int> keys() const;
-    std::vector<int> values() const;
-
-    int m_start_row, m_start_col;
-    int m_size_row, m_size_col;
-    std::map<int, int> m_maskid2nelems;
-    BLOCK_TYPE m_type;
+    int         m_start_row, m_start_col;
+    int         m_size_row, m_size_col;
+    uint32_t    m_hist_begin, m_hist_size;
+    int         m_major;    // the region of more than half of the cells, or `REGION_NO_MAJOR`
+    BLOCK_TYPE  m_type;
 
     static constexpr int    REGION_NO_MAJOR = -10000;
     static constexpr double REGION_MAJOR_THRESHOLD = 0.5;
 };
 
-// mesh for data partitioning
-using chunk_info_list = std::vector<std::list<std::shared_ptr<RASTER_chunk_t> > >;
+using hist_entry_t = std::pair<int, int>;
+
+// Chunks of a partition, grid row by grid row and by start column within a row; a chunk merged
+// vertically stays in the row it starts in. Histograms of all chunks share one array
+struct chunk_info_list
+{
+    std::vector<RASTER_chunk_t> m_chunks;
+    std::vector<hist_entry_t>   m_hist;
+
+    const hist_entry_t* hist_begin(const RASTER_chunk_t& chunk) const { return m_hist.data() + chunk.m_hist_begin; }
+    const hist_entry_t* hist_end(const RASTER_chunk_t& chunk) const { return hist_begin(chunk) + chunk.m_hist_size; }
+    void print_chunk(const RASTER_chunk_t& chunk, std::ostream& os=std::cout) const;
+};
 
 // mesh for data partitioning
 class Mesh
 {
 public:
     Mesh() = default;
-    Mesh(int* mask, int mask_rows, int mask_cols, size_t rows_in_grid, size_t cols_in_grid, double merge_threshold=1);     
+    Mesh(int* mask, int mask_rows, int mask_cols, size_t rows_in_grid, size_t cols_in_grid, double merge_threshold=1,
+         size_t max_chunk_cells=0);     
     ~Mesh();
 
     void export_to(EXPORT_TYPE type=EXPORT_TYPE::HUMAN, std::ostream& os=std::cout) const;
     std::vector<int> get_all_mask_id();
     const chunk_info_list& partition();
+    const chunk_info_list& partition_from(const Mesh& base);
     size_t rows() const;
     size_t cols() const;
     
 private:
-    void merge_chunks(std::list<std::shared_ptr<RASTER_chunk_t> >& chunks_in_row);
+    // chunks of one grid row while they are merged, histograms over dense ids in an array of the row
+    struct grid_row_t
+    {
+        std::vector<RASTER_chunk_t> m_chunks;
+        std::vector<hist_entry_t>   m_hist;
+    };
+
+    void remap_mask();
+    void count_chunk(grid_row_t& row, RASTER_chunk_t& chunk, std::vector<int>& counts, std::vector<int>& touched) const;
+    void grid_cuts(std::vector<int>& row_cuts, std::vector<int>& col_cuts) const;
+    static void snap_cuts(std::vector<int>& cuts, const std::set<int>& edges, int tolerance);
+    bool can_merge(const grid_row_t& row_a, const RASTER_chunk_t& a, const grid_row_t& row_b, const RASTER_chunk_t& b,
+                   size_t merged_cells) const;
+    void merge_chunks(grid_row_t& row) const;
+    void merge_rows(std::vector<grid_row_t>& rows) const;
+    void flatten(const std::vector<grid_row_t>& rows);
     
 private:
     size_t m_cols_in_grid;
@@ -77,8 +93,14 @@ private:
     int m_ncid;
     int* m_mask;
     double m_merge_threshold;
+    size_t m_max_chunk_cells; // merged chunks never exceed it, 0 means unlimited
+    std::vector<int> m_row_cuts, m_col_cuts; // grid lines of the partition
+    std::vector<int> m_ids;     // sorted mask ids
+    std::vector<int> m_dense;   // mask of indices into `m_ids`
     chunk_info_list m_partitions;
     bool m_done;
+
+    static constexpr size_t MAX_DENSE_RANGE = 1 << 22; // mask ids within it are remapped by a table
 };
 
 }; 
@@ -1,55 +1,274 @@
 #include "MetaCache.h"
+#include "CacheRegistry.h"
+#include "IndexManager.h"
+#include "MetadataHandler.h"
 
 namespace raster
 {
 
-std::unique_ptr<MetaCache> meta_cache(new MetaCache(CACHE_DEFAULT_CAPACITY));
+std::shared_ptr<MetaCache> meta_cache(new MetaCache(META_CACHE_BYTES));
+static CacheRegistry<MetaCache> file_caches(meta_cache);
 
-void MetaCache::add_region(int varid, int mask_id, int nrows, int ncols, int nrelations, int* relation, size_t* data)
+// estimated heap bytes of the cached values, what the budget is counted in
+static size_t index_bytes(const LayoutIndex& index)
 {
-    // use (varid ^ maskid) to be cache key
-    int key = mask_id ^ varid;
-    // already in cache
-    if (m_region_cache.find(key) != m_region_cache.end())
-        return; 
-    // need to evict
-    if (m_region_cache.size() >= m_size)
-        this->evict();
-    m_region_cache.insert({key, std::shared_ptr<CacheBlock>(new CacheBlock(nrows, ncols, nrelations, relation, data))}); 
+    return sizeof(LayoutIndex) + index.m_mask_ids.size() * sizeof(int)
+         + index.m_regions.size() * (sizeof(int) + sizeof(region_entry_t) + 2 * sizeof(void*))
+         + index.m_rows.size() * sizeof(size_t)
+         + (index.m_relation_chunks.size() + index.m_relation_rows.size()) * sizeof(int)
+         + (index.m_children.size() + index.m_parents.size()) * sizeof(int)
+         + index.m_part_offsets.size() * sizeof(size_t) + index.m_parts.size() * sizeof(cell_part_t)
+         + index.m_runs.size() * sizeof(uint32_t);
 }
 
-void MetaCache::evict()
+size_t MetaCache::key_hash_t::operator()(const key_t& key) const
 {
-    // always remove the chunk with smallest maskid, it may be similar to random policy in practice
-    m_region_cache.erase(m_region_cache.begin()->first);
+    uint64_t h = ((uint64_t)(uint32_t)key.m_grp << 32) | (uint32_t)key.m_region;
+    h ^= (uint64_t)key.m_kind * 0x9e3779b97f4a7c15ULL;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return (size_t)h;
 }
 
-const std::shared_ptr<CacheBlock> MetaCache::get_region(int varid, int mask_id) const
+MetaCache::MetaCache(size_t capacity_bytes)
+    : m_capacity(capacity_bytes), m_next_victim(0), m_hits(0), m_misses(0), m_evictions(0), m_entries(0), m_bytes(0)
 {
-    auto res = m_region_cache.find(mask_id ^ varid);
-    // return nullptr if not found
-    if (res == m_region_cache.end())
-        return nullptr;
-    // return the region if found
-    return res->second;
 }
 
-void MetaCache::add_mixed_table(int varid, int nrows, int ncols, size_t* data)
+MetaCache::key_t MetaCache::make_key(entry_kind_t kind, int grp_id, int region)
 {
-    if (m_vartable_cache.find(varid) != m_vartable_cache.end())
-        return; 
-    m_vartable_cache.insert({varid, std::shared_ptr<MixedBlockTable>(new MixedBlockTable(nrows, ncols, data))}); 
+    // netCDF-4 group ids carry their file id in the upper 16 bits, as `ext_ncid`
+    return key_t{kind, grp_id >> 16, grp_id, region};
 }
 
-const std::shared_ptr<MixedBlockTable> MetaCache::get_mixed_table(int varid) const
+MetaCache::shard_t& MetaCache::shard_of(const key_t& key)
 {
-    auto res = m_vartable_cache.find(varid);
-    // return nullptr if not found
-    if (res == m_vartable_cache.end())
+    // high bits of the hash, the low ones pick the bucket within the shard
+    return m_shards[(key_hash_t()(key) >> 32) % NUM_SHARDS];
+}
+
+std::shared_ptr<void> MetaCache::get(const key_t& key)
+{
+    shard_t& shard = shard_of(key);
+    std::lock_guard<std::mutex> lock(shard.m_mutex);
+    auto res = shard.m_map.find(key);
+    if (res == shard.m_map.end())
+    {
+        m_misses++;
         return nullptr;
-    // return the table if found
-    return res->second;
+    }
+    m_hits++;
+    shard.m_lru.splice(shard.m_lru.begin(), shard.m_lru, res->second);
+    return res->second->m_value;
+}
+
+std::shared_ptr<void> MetaCache::add(const key_t& key, std::shared_ptr<void> value, size_t nbytes)
+{
+    shard_t& shard = shard_of(key);
+    size_t capacity = m_capacity;
+    // the list and map nodes of the entry count too, small entries are mostly those
+    nbytes += sizeof(entry_t) + sizeof(key_t) + 4 * sizeof(void*);
+    {
+        std::lock_guard<std::mutex> lock(shard.m_mutex);
+        auto res = shard.m_map.find(key);
+        // added by another reader in the meantime
+        if (res != shard.m_map.end())
+        {
+            shard.m_lru.splice(shard.m_lru.begin(), shard.m_lru, res->second);
+            return res->second->m_value;
+        }
+        // larger than the whole budget, handed back to the caller without caching it
+        if (nbytes > capacity)
+            return value;
+        shard.m_lru.push_front(entry_t{key, value, nbytes});
+        shard.m_map.emplace(key, shard.m_lru.begin());
+        shard.m_bytes += nbytes;
+        m_entries++;
+        m_bytes += nbytes;
+        // room is made in its own shard first, keeping the new entry
+        evict(shard, capacity, 1);
+    }
+    evict_all(capacity);
+    return value;
+}
+
+void MetaCache::evict(shard_t& shard, size_t capacity, size_t keep)
+{
+    // least recently used first until the whole cache fits, the caller holds the shard lock
+    while (m_bytes > capacity && shard.m_lru.size() > keep)
+    {
+        entry_t& victim = shard.m_lru.back();
+        shard.m_bytes -= victim.m_bytes;
+        m_bytes -= victim.m_bytes;
+        m_entries--;
+        m_evictions++;
+        shard.m_map.erase(victim.m_key);
+        shard.m_lru.pop_back();
+    }
+}
+
+void MetaCache::evict_all(size_t capacity)
+{
+    // the other shards in turn, one lock at a time, so that no shard is always the one emptied
+    for (int i = 0; i < NUM_SHARDS && m_bytes > capacity; i++)
+    {
+        shard_t& shard = m_shards[m_next_victim++ % NUM_SHARDS];
+        std::lock_guard<std::mutex> lock(shard.m_mutex);
+        evict(shard, capacity, 0);
+    }
+}
+
+std::shared_ptr<CacheBlock> MetaCache::add_region(int varid, int mask_id, int nrows, int ncols, int nrelations, int* relation,
+                                                  size_t* data)
+{
+    // the block takes the ownership of both buffers, also when it is not the one kept
+    auto block = std::make_shared<CacheBlock>(nrows, ncols, nrelations, relation, data);
+    size_t nbytes = sizeof(CacheBlock) + (size_t)nrows * ncols * sizeof(size_t) + (size_t)nrelations * sizeof(int);
+    return std::static_pointer_cast<CacheBlock>(add(make_key(KIND_REGION, varid, mask_id), block, nbytes));
+}
+
+std::shared_ptr<CacheBlock> MetaCache::get_region(int varid, int mask_id)
+{
+    return std::static_pointer_cast<CacheBlock>(get(make_key(KIND_REGION, varid, mask_id)));
+}
+
+std::shared_ptr<MixedBlockTable> MetaCache::add_mixed_table(int varid, int nrows, int ncols, size_t* data)
+{
+    auto table = std::make_shared<MixedBlockTable>(nrows, ncols, data);
+    size_t nbytes = sizeof(MixedBlockTable) + (size_t)nrows * ncols * sizeof(size_t);
+    return std::static_pointer_cast<MixedBlockTable>(add(make_key(KIND_MIXED_TABLE, varid, 0), table, nbytes));
+}
+
+std::shared_ptr<MixedBlockTable> MetaCache::get_mixed_table(int varid)
+{
+    return std::static_pointer_cast<MixedBlockTable>(get(make_key(KIND_MIXED_TABLE, varid, 0)));
+}
+
+std::shared_ptr<LayoutIndex> MetaCache::add_index(int grp_id, std::shared_ptr<LayoutIndex> index)
+{
+    size_t nbytes = index_bytes(*index);
+    return std::static_pointer_cast<LayoutIndex>(add(make_key(KIND_INDEX, grp_id, 0), index, nbytes));
+}
+
+std::shared_ptr<LayoutIndex> MetaCache::get_index(int grp_id)
+{
+    return std::static_pointer_cast<LayoutIndex>(get(make_key(KIND_INDEX, grp_id, 0)));
+}
+
+std::shared_ptr<SpatialIndex> MetaCache::add_spatial_index(int grp_id, std::shared_ptr<SpatialIndex> index)
+{
+    size_t nbytes = index->bytes();
+    return std::static_pointer_cast<SpatialIndex>(add(make_key(KIND_SPATIAL, grp_id, 0), index, nbytes));
+}
+
+std::shared_ptr<SpatialIndex> MetaCache::get_spatial_index(int grp_id)
+{
+    return std::static_pointer_cast<SpatialIndex>(get(make_key(KIND_SPATIAL, grp_id, 0)));
+}
+
+std::shared_ptr<const region_group_t> MetaCache::add_region_group(int data_grp_id, int mask_id,
+                                                                  std::shared_ptr<const region_group_t> group)
+{
+    size_t nbytes = group->bytes();
+    return std::static_pointer_cast<const region_group_t>(add(make_key(KIND_REGION_GROUP, data_grp_id, mask_id),
+                                                              std::const_pointer_cast<region_group_t>(group), nbytes));
+}
+
+std::shared_ptr<const region_group_t> MetaCache::get_region_group(int data_grp_id, int mask_id)
+{
+    return std::static_pointer_cast<const region_group_t>(get(make_key(KIND_REGION_GROUP, data_grp_id, mask_id)));
+}
+
+void MetaCache::add_layout_grp(int var_grp_id, int slab_grp_id, int layout_grp_id)
+{
+    add(make_key(KIND_LAYOUT_GRP, var_grp_id, slab_grp_id), std::make_shared<int>(layout_grp_id), sizeof(int));
+}
+
+bool MetaCache::get_layout_grp(int var_grp_id, int slab_grp_id, int* layout_grp_id)
+{
+    auto grp = std::static_pointer_cast<int>(get(make_key(KIND_LAYOUT_GRP, var_grp_id, slab_grp_id)));
+    if (grp == nullptr)
+        return false;
+    *layout_grp_id = *grp;
+    return true;
 }
 
+void MetaCache::invalidate_file(int ncid)
+{
+    int file = ncid >> 16;
+    for (shard_t& shard : m_shards)
+    {
+        std::lock_guard<std::mutex> lock(shard.m_mutex);
+        for (auto it = shard.m_lru.begin(); it != shard.m_lru.end();)
+        {
+            if (it->m_key.m_file != file)
+            {
+                ++it;
+                continue;
+            }
+            shard.m_bytes -= it->m_bytes;
+            m_bytes -= it->m_bytes;
+            m_entries--;
+            shard.m_map.erase(it->m_key);
+            it = shard.m_lru.erase(it);
+        }
+    }
+}
+
+void MetaCache::set_capacity(size_t nbytes)
+{
+    m_capacity = nbytes;
+    evict_all(nbytes);
+}
 
-} // namespace raster
\ No newline at end of file
+void MetaCache::get_stats(raster_cache_stats_t& stats) const
+{
+    stats.hits = m_hits;
+    stats.misses = m_misses;
+    stats.evictions = m_evictions;
+    stats.entries = m_entries;
+    stats.bytes = m_bytes;
+    stats.capacity = m_capacity;
+}
+
+std::shared_ptr<MetaCache> meta_cache_of(int grp_id)
+{
+    return file_caches.of(grp_id);
+}
+
+std::shared_ptr<MetaCache> own_meta_cache_of(int grp_id)
+{
+    return file_caches.owned(grp_id);
+}
+
+void attach_meta_cache(int ncid, std::shared_ptr<MetaCache> cache)
+{
+    file_caches.attach(ncid, cache);
+}
+
+void detach_meta_cache(int ncid)
+{
+    file_caches.detach(ncid);
+}
+
+} // namespace raster
+
+int set_meta_cache_bytes(size_t nbytes)
+{
+    raster::meta_cache->set_capacity(nbytes);
+    return NC_NOERR;
+}
+
+int inq_meta_cache(raster_cache_stats_t* stats)
+{
+    if (stats == nullptr)
+        return NC_EINVAL;
+    raster::meta_cache->get_stats(*stats);
+    return NC_NOERR;
+}
+
+void invalidate_meta_cache(int ncid)
+{
+    raster::meta_cache_of(ncid)->invalidate_file(ncid);
+}
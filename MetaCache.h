@@ -1,24 +1,47 @@
 #ifndef __META_CACHE_H__
 #define __META_CACHE_H__
+#include <stdlib.h>
+#include <netcdf.h>
+#include "raster.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Metadata cache: decoded region metadata, layout indexes and spatial indexes of open files,
+// least recently used first out once their estimated size exceeds the budget, `META_CACHE_BYTES`
+// by default. Entries of a file are dropped when it is closed, as netCDF reuses its ids. The budget
+// and counters are those of the shared cache, a file opened as a `raster::File` has a cache of its
+// own, which `invalidate_meta_cache` acts on while it is open
+int set_meta_cache_bytes(size_t nbytes);
+int inq_meta_cache(raster_cache_stats_t* stats);
+void invalidate_meta_cache(int ncid);
+
+#ifdef __cplusplus
+}
 
-#include <iostream>
+#include <atomic>
+#include <cstdint>
+#include <list>
 #include <memory>
-#include <map>
-#include <netcdf.h>
+#include <mutex>
+#include <unordered_map>
 
 namespace raster
 {
 
-#define CACHE_DEFAULT_CAPACITY 128
+struct LayoutIndex;
+class SpatialIndex;
+struct region_group_t;
 
 struct CacheBlock
 {
-    CacheBlock() : m_nrows(0), m_ncols(0), m_relation(nullptr), m_data(nullptr) {};
-    CacheBlock(int nrows, int ncols, int nrelations, int* relation, size_t* data) : m_nrows(nrows), m_ncols(ncols), 
+    CacheBlock() : m_nrows(0), m_ncols(0), m_nrelations(0), m_relation(nullptr), m_data(nullptr) {};
+    CacheBlock(int nrows, int ncols, int nrelations, int* relation, size_t* data) : m_nrows(nrows), m_ncols(ncols),
                                                     m_nrelations(nrelations), m_relation(relation), m_data(data) {};
-    ~CacheBlock() 
+    ~CacheBlock()
     {
-        if (m_data) delete[] m_data; 
+        if (m_data) delete[] m_data;
         if (m_relation) delete[] m_relation;
     };
 
@@ -37,28 +60,115 @@ struct MixedBlockTable
     size_t* m_data;
 };
 
+// Entries are keyed by (kind, file, group, region), where the file is the upper 16 bits of a
+// netCDF-4 group id. The key space is split in shards, each an LRU list under its own lock, so
+// readers of different groups rarely wait on each other. The budget is shared by all shards: a new
+// entry evicts the oldest ones of its own shard first, then those of the others in turn, so the
+// order is only least recently used within a shard. Only entries over the whole budget are not kept.
+// `add_*` returns the cached entry, which is the one already there if another thread added it
+// first. Entries stay alive while a caller holds them, even once evicted or invalidated
 class MetaCache
 {
 public:
-    MetaCache(const int cache_size) : m_size(cache_size) {};
+    explicit MetaCache(size_t capacity_bytes);
     ~MetaCache() {};
-    void add_region(int varid, int mask_id, int nrows, int ncols, int nrelations, int* relation, size_t* data);
-    const std::shared_ptr<CacheBlock> get_region(int varid, int mask_id) const;
+    std::shared_ptr<CacheBlock> add_region(int varid, int mask_id, int nrows, int ncols, int nrelations, int* relation,
+                                           size_t* data);
+    std::shared_ptr<CacheBlock> get_region(int varid, int mask_id);
+
+    std::shared_ptr<MixedBlockTable> add_mixed_table(int varid, int nrows, int ncols, size_t* data);
+    std::shared_ptr<MixedBlockTable> get_mixed_table(int varid);
+
+    // decoded `_index_` of a layout group, all its regions at once
+    std::shared_ptr<LayoutIndex> add_index(int grp_id, std::shared_ptr<LayoutIndex> index);
+    std::shared_ptr<LayoutIndex> get_index(int grp_id);
 
-    void add_mixed_table(int varid, int nrows, int ncols, size_t* data);
-    const std::shared_ptr<MixedBlockTable> get_mixed_table(int varid) const;
+    // box index over all chunks of a layout group, built on the first hyperslab read
+    std::shared_ptr<SpatialIndex> add_spatial_index(int grp_id, std::shared_ptr<SpatialIndex> index);
+    std::shared_ptr<SpatialIndex> get_spatial_index(int grp_id);
+
+    // storage of the chunks of region `mask_id` in `data_grp_id`, the variable group or a slab
+    std::shared_ptr<const region_group_t> add_region_group(int data_grp_id, int mask_id,
+                                                           std::shared_ptr<const region_group_t> group);
+    std::shared_ptr<const region_group_t> get_region_group(int data_grp_id, int mask_id);
+
+    // layout group holding the region metadata of `var_grp_id`, or of its slab `slab_grp_id`
+    void add_layout_grp(int var_grp_id, int slab_grp_id, int layout_grp_id);
+    bool get_layout_grp(int var_grp_id, int slab_grp_id, int* layout_grp_id);
+
+    // drops all entries of the file `ncid`
+    void invalidate_file(int ncid);
+    // shrinks the cache right away if `nbytes` is below its size
+    void set_capacity(size_t nbytes);
+    void get_stats(raster_cache_stats_t& stats) const;
 
 private:
-    void evict();
+    enum entry_kind_t { KIND_REGION, KIND_MIXED_TABLE, KIND_INDEX, KIND_SPATIAL, KIND_REGION_GROUP, KIND_LAYOUT_GRP };
+
+    struct key_t
+    {
+        int m_kind;
+        int m_file;
+        int m_grp;
+        int m_region;
+        bool operator==(const key_t& other) const
+        {
+            return m_kind == other.m_kind && m_file == other.m_file && m_grp == other.m_grp && m_region == other.m_region;
+        }
+    };
+
+    struct key_hash_t
+    {
+        size_t operator()(const key_t& key) const;
+    };
+
+    struct entry_t
+    {
+        key_t                   m_key;
+        std::shared_ptr<void>   m_value;
+        size_t                  m_bytes;
+    };
+
+    // most recently used entry first
+    struct shard_t
+    {
+        std::mutex                                                              m_mutex;
+        std::list<entry_t>                                                      m_lru;
+        std::unordered_map<key_t, std::list<entry_t>::iterator, key_hash_t>     m_map;
+        size_t                                                                  m_bytes = 0;
+    };
+
+    static constexpr int NUM_SHARDS = 16;
+
+    static key_t make_key(entry_kind_t kind, int grp_id, int region);
+    shard_t& shard_of(const key_t& key);
+    std::shared_ptr<void> get(const key_t& key);
+    std::shared_ptr<void> add(const key_t& key, std::shared_ptr<void> value, size_t nbytes);
+    void evict(shard_t& shard, size_t capacity, size_t keep);
+    void evict_all(size_t capacity);
 
 private:
-    int m_size;
-    std::map<uint64_t, std::shared_ptr<CacheBlock> > m_region_cache; // key: region maskid, value: region metadata
-    std::map<int, std::shared_ptr<MixedBlockTable> > m_vartable_cache;
+    std::atomic<size_t>     m_capacity;
+    std::atomic<unsigned>   m_next_victim;      // shard evicted from next by `evict_all`
+    shard_t                 m_shards[NUM_SHARDS];
+    std::atomic<uint64_t>   m_hits;
+    std::atomic<uint64_t>   m_misses;
+    std::atomic<uint64_t>   m_evictions;
+    std::atomic<size_t>     m_entries;
+    std::atomic<size_t>     m_bytes;
 };
 
-extern std::unique_ptr<MetaCache> meta_cache;
+extern std::shared_ptr<MetaCache> meta_cache;
+
+// cache of the file of `grp_id`: its own one while attached, `meta_cache` otherwise
+std::shared_ptr<MetaCache> meta_cache_of(int grp_id);
+// the cache of its own of the file of `grp_id`, null if it is not attached
+std::shared_ptr<MetaCache> own_meta_cache_of(int grp_id);
+// gives the file `ncid` a cache of its own until detached, as a `raster::File` does while open
+void attach_meta_cache(int ncid, std::shared_ptr<MetaCache> cache);
+void detach_meta_cache(int ncid);
 
 } // namespace raster
+#endif
 
-#endif
\ No newline at end of file
+#endif
@@ -1,58 +1,957 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+
 #include "MetadataHandler.h"
 #include "IndexManager.h"
 #include "MeshBuilder.h"
 #include "MetaCache.h"
+#include "VarCompress.h"
 #include "config.h"
 
 using namespace raster;
 
+// Variables with the same mask share one layout group `_layout_<k>`, a sibling of the variable
+// groups, holding the 2D region metadata (chunk id, start_y, start_x, count_y, count_x) of all
+// regions in its `_index_` variable.
+// A variable points to its layout by name in its `_layout_` attribute. A layout is identified by
+// `_layout_hash_`, a hash of everything the partition depends on: the mask, its shape, the grid,
+// the merge limits and the mask it is partitioned from, if any.
+struct layout_params_t
+{
+    int     m_nx;
+    int     m_ny;
+    double  m_merge_threshold;
+    size_t  m_max_chunk_cells;
+    const struct region_hierarchy_t* m_hierarchy;   // null for a flat mask
+    const Mesh* m_base;         // a partitioned mask to partition from, see `Mesh::partition_from`
+    const int*  m_base_mask;    // its cells
+};
+
+// Nested regions, given as (child, parent) links of mask ids. The layout keeps them in its
+// `_index_`, next to the mask ids. A layout of
+// `m_level` > 0 is partitioned after replacing every mask id by its ancestor `m_level` links up,
+// so that a parent region is made of few large chunks.
+struct region_hierarchy_t
+{
+    std::vector<int>    m_children;
+    std::vector<int>    m_parents;
+    int                 m_level;
+};
+
+// the ancestor `level` links above `id`, or the topmost one if the hierarchy is shallower
+static int region_ancestor(const std::unordered_map<int, int>& parent_of, int id, int level)
+{
+    for (int i = 0; i < level; i++)
+    {
+        auto it = parent_of.find(id);
+        if (it == parent_of.end())
+            break;
+        id = it->second;
+    }
+    return id;
+}
+
+static uint64_t layout_hash(const int* mask, int rows, int cols, const layout_params_t& params)
+{
+    uint64_t hash = 14695981039346656037ULL; // FNV-1a
+    auto feed = [&](const void* ptr, size_t nbytes) {
+        const unsigned char* bytes = static_cast<const unsigned char*>(ptr);
+        for (size_t i = 0; i < nbytes; i++)
+            hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    };
+    int shape[4] = {rows, cols, params.m_nx, params.m_ny};
+    feed(shape, sizeof(shape));
+    if (params.m_merge_threshold != 1 || params.m_max_chunk_cells != 0) // keeps hashes of default layouts
+    {
+        unsigned long long max_cells = params.m_max_chunk_cells;
+        feed(&params.m_merge_threshold, sizeof(double));
+        feed(&max_cells, sizeof(max_cells));
+    }
+    if (params.m_hierarchy != nullptr)
+    {
+        feed(&params.m_hierarchy->m_level, sizeof(int));
+        feed(params.m_hierarchy->m_children.data(), sizeof(int) * params.m_hierarchy->m_children.size());
+        feed(params.m_hierarchy->m_parents.data(), sizeof(int) * params.m_hierarchy->m_parents.size());
+    }
+    feed(mask, sizeof(int) * (size_t)rows * cols);
+    if (params.m_base != nullptr)
+        feed(params.m_base_mask, sizeof(int) * (size_t)rows * cols);
+    return hash;
+}
+
+namespace raster
+{
+static int load_layout_index(int meta_grp_id, std::shared_ptr<LayoutIndex>& index);
+}
+
+// whether layout group `grp_id` was partitioned from `mask` with `params`. Hashes of different
+// masks rarely match, but may, so the attributes and the `_mask_` of the layout are compared
+static bool same_layout(int grp_id, int rows, int cols, const int* mask, const layout_params_t& params)
+{
+    int shape[2], grid[2], level, mask_id;
+    double merge_threshold;
+    unsigned long long max_cells;
+    if (nc_get_att_int(grp_id, NC_GLOBAL, "_layout_shape_", shape) != NC_NOERR || shape[0] != rows || shape[1] != cols)
+        return false;
+    if (nc_get_att_int(grp_id, NC_GLOBAL, "_layout_grid_", grid) != NC_NOERR || grid[0] != params.m_nx || grid[1] != params.m_ny)
+        return false;
+    if (nc_get_att_double(grp_id, NC_GLOBAL, "_layout_merge_threshold_", &merge_threshold) != NC_NOERR ||
+        merge_threshold != params.m_merge_threshold)
+        return false;
+    if (nc_get_att_ulonglong(grp_id, NC_GLOBAL, "_layout_max_cells_", &max_cells) != NC_NOERR ||
+        max_cells != params.m_max_chunk_cells)
+        return false;
+    bool nested = nc_get_att_int(grp_id, NC_GLOBAL, "_layout_level_", &level) == NC_NOERR;
+    if (nested != (params.m_hierarchy != nullptr))
+        return false;
+    if (nested)
+    {
+        std::shared_ptr<LayoutIndex> index;
+        if (raster::load_layout_index(grp_id, index) != NC_NOERR || level != params.m_hierarchy->m_level || index == nullptr || index->m_children != params.m_hierarchy->m_children ||
+            index->m_parents != params.m_hierarchy->m_parents)
+            return false;
+    }
+    std::vector<int> stored((size_t)rows * cols);
+    if (nc_inq_varid(grp_id, "_mask_", &mask_id) != NC_NOERR || nc_get_var_int(grp_id, mask_id, stored.data()) != NC_NOERR)
+        return false;
+    return memcmp(stored.data(), mask, sizeof(int) * stored.size()) == 0;
+}
+
+// returns the layout group in `parent_grp_id` with the given hash, partitioned from `mask` with
+// `params`, or -1
+static int find_layout(int parent_grp_id, uint64_t hash, int rows, int cols, const int* mask, const layout_params_t& params,
+                       int* nlayouts)
+{
+    int ngrps, status;
+    char name[NC_MAX_NAME + 1];
+    *nlayouts = 0;
+    status = nc_inq_grps(parent_grp_id, &ngrps, NULL);
+    std::vector<int> grp_ids(ngrps);
+    status = nc_inq_grps(parent_grp_id, &ngrps, grp_ids.data());
+    for (int grp_id : grp_ids)
+    {
+        unsigned long long layout_hash;
+        nc_inq_grpname(grp_id, name);
+        if (strncmp(name, "_layout_", 8) != 0)
+            continue;
+        (*nlayouts)++;
+        if (nc_get_att_ulonglong(grp_id, NC_GLOBAL, "_layout_hash_", &layout_hash) == NC_NOERR && layout_hash == hash &&
+            same_layout(grp_id, rows, cols, mask, params))
+            return grp_id;
+    }
+    return -1;
+}
+
+// partitions `mask` into the `_index_` of the layout, `mesh` is set to the partitioned mask
+static int write_layout_metadata(int layout_grp_id, int rows, int cols, int* mask, const layout_params_t& params,
+                                 std::shared_ptr<Mesh>& mesh)
+{
+    int status, index_id, index_dimid;
+    mesh = std::make_shared<Mesh>(mask, rows, cols, params.m_nx, params.m_ny, params.m_merge_threshold, params.m_max_chunk_cells);
+
+    const chunk_info_list& blist = params.m_base != nullptr ? mesh->partition_from(*params.m_base) : mesh->partition();
+    std::vector<int> mask_ids = mesh->get_all_mask_id();
+    std::vector<size_t> chunkshape = {(size_t)rows / params.m_nx, (size_t)cols / params.m_ny};
+    std::vector<Region> regions = construct_region_chunks(blist, mask_ids, 2, chunkshape);
+    std::vector<int> children, parents;
+    if (params.m_hierarchy != nullptr)
+    {
+        children = params.m_hierarchy->m_children;
+        parents = params.m_hierarchy->m_parents;
+    }
+
+    // all regions in one `_index_` variable, read back with a single call
+    auto index = std::make_shared<LayoutIndex>(build_layout_index(regions, children, parents, mask, cols));
+    std::vector<unsigned char> bytes = encode_layout_index(*index);
+    status = nc_def_dim(layout_grp_id, "_index_bytes_", bytes.size(), &index_dimid);
+    status = nc_def_var(layout_grp_id, "_index_", NC_UBYTE, 1, &index_dimid, &index_id);
+    if (status != NC_NOERR)
+        return status;
+    status = nc_put_var_ubyte(layout_grp_id, index_id, bytes.data());
+    meta_cache_of(layout_grp_id)->add_index(layout_grp_id, index);
+    return status;
+}
+
+// the mask itself is kept as `_mask_`, for what needs cells rather than chunks, e.g. region aggregates
+static int write_layout_mask(int layout_grp_id, int rows, int cols, const int* mask)
+{
+    int status, dimids[2], mask_id;
+    status = nc_def_dim(layout_grp_id, "_mask_rows_", rows, &dimids[0]);
+    status = nc_def_dim(layout_grp_id, "_mask_cols_", cols, &dimids[1]);
+    status = nc_def_var(layout_grp_id, "_mask_", NC_INT, 2, dimids, &mask_id);
+    if (status != NC_NOERR)
+        return status;
+    status = nc_def_var_deflate(layout_grp_id, mask_id, NC_SHUFFLE, 1, ZLEVEL_LOW);
+    return nc_put_var_int(layout_grp_id, mask_id, mask);
+}
+
+// finds the layout of `mask` among the siblings of `varid`, or partitions the mask into a new one,
+// then `partitioned` is set to the partitioned mask if given
+static int def_layout(int varid, int rows, int cols, const int* mask, layout_params_t params, std::string& layout_name,
+                      std::shared_ptr<Mesh>* partitioned=nullptr)
+{
+    int status, parent_grp_id, layout_grp_id, nlayouts;
+    std::shared_ptr<Mesh> mesh;
+
+    // the grid never divides the mask below one cell per chunk
+    params.m_nx = std::max(1, std::min(params.m_nx, rows));
+    params.m_ny = std::max(1, std::min(params.m_ny, cols));
+    uint64_t hash = layout_hash(mask, rows, cols, params);
+    status = nc_inq_grp_parent(varid, &parent_grp_id);
+    if (status != NC_NOERR)
+        return status;
+    layout_grp_id = find_layout(parent_grp_id, hash, rows, cols, mask, params, &nlayouts);
+    if (layout_grp_id < 0)
+    {
+        // first variable with this mask, partition it and keep the result for the others
+        int shape[2] = {rows, cols}, grid[2] = {params.m_nx, params.m_ny};
+        unsigned long long layout_hash = hash, max_cells = params.m_max_chunk_cells;
+        layout_name = "_layout_" + std::to_string(nlayouts);
+        status = nc_def_grp(parent_grp_id, layout_name.c_str(), &layout_grp_id);
+        if (status != NC_NOERR)
+            return status;
+        status = nc_put_att_ulonglong(layout_grp_id, NC_GLOBAL, "_layout_hash_", NC_UINT64, 1, &layout_hash);
+        status = nc_put_att_int(layout_grp_id, NC_GLOBAL, "_layout_shape_", NC_INT, 2, shape);
+        status = nc_put_att_int(layout_grp_id, NC_GLOBAL, "_layout_grid_", NC_INT, 2, grid);
+        status = nc_put_att_double(layout_grp_id, NC_GLOBAL, "_layout_merge_threshold_", NC_DOUBLE, 1, &params.m_merge_threshold);
+        status = nc_put_att_ulonglong(layout_grp_id, NC_GLOBAL, "_layout_max_cells_", NC_UINT64, 1, &max_cells);
+        status = write_layout_mask(layout_grp_id, rows, cols, mask);
+        if (status != NC_NOERR)
+            return status;
+        if (params.m_hierarchy == nullptr)
+        {
+            status = write_layout_metadata(layout_grp_id, rows, cols, const_cast<int*>(mask), params, mesh);
+            if (partitioned != nullptr)
+                *partitioned = mesh;
+            return status;
+        }
+
+        const region_hierarchy_t& hierarchy = *params.m_hierarchy;
+        std::unordered_map<int, int> parent_of;
+        for (size_t i = 0; i < hierarchy.m_children.size(); i++)
+            parent_of[hierarchy.m_children[i]] = hierarchy.m_parents[i];
+        std::vector<int> level_mask(mask, mask + (size_t)rows * cols);
+        if (hierarchy.m_level > 0)
+            for (auto& id : level_mask)
+                id = region_ancestor(parent_of, id, hierarchy.m_level);
+        status = nc_put_att_int(layout_grp_id, NC_GLOBAL, "_layout_level_", NC_INT, 1, &hierarchy.m_level);
+        status = write_layout_metadata(layout_grp_id, rows, cols, level_mask.data(), params, mesh);
+    }
+    else
+    {
+        char name[NC_MAX_NAME + 1];
+        status = nc_inq_grpname(layout_grp_id, name);
+        layout_name = name;
+    }
+    return status;
+}
+
+static int write_var_layout(int varid, int rows, int cols, int* mask, layout_params_t params)
+{
+    std::string layout_name;
+    int status = def_layout(varid, rows, cols, mask, params, layout_name);
+    if (status != NC_NOERR)
+        return status;
+    return nc_put_att_text(varid, NC_GLOBAL, "_layout_", layout_name.size(), layout_name.c_str());
+}
+
+// fraction of mask cells whose right or lower neighbour belongs to another region
+static double mask_fragmentation(const int* mask, int rows, int cols)
+{
+    size_t edges = 0;
+    for (int i = 0; i < rows; i++)
+    {
+        const int* row = &mask[(size_t)i * cols];
+        for (int j = 0; j < cols; j++)
+        {
+            if ((j + 1 < cols && row[j] != row[j + 1]) || (i + 1 < rows && row[j] != row[j + cols]))
+                edges++;
+        }
+    }
+    return double(edges) / (double(rows) * cols);
+}
+
+static size_t xtype_size(int xtype)
+{
+    switch (xtype)
+    {
+        case NC_CHAR: case NC_BYTE: case NC_UBYTE: return 1;
+        case NC_SHORT: case NC_USHORT: return 2;
+        case NC_DOUBLE: case NC_INT64: case NC_UINT64: return 8;
+        default: return 4;
+    }
+}
+
 int write_var_metadata(int varid, int ndims, size_t* dimlens, int* mask)
 {
-    using namespace raster;
+    layout_params_t params = {CHUNKSIZE_NX, CHUNKSIZE_NY, 1, 0};
+    return write_var_layout(varid, dimlens[ndims - 2], dimlens[ndims - 1], mask, params);
+}
+
+// grid and merge limits of a layout from the options of `raster_def_var_chunking_ext`, the
+// grid derived from `mask` where the options leave it to `target_bytes`
+static layout_params_t chunking_params(int ndims, size_t* dimlens, const int* mask, int xtype,
+                                       const raster_chunking_t* options)
+{
     int rows = dimlens[ndims - 2], cols = dimlens[ndims - 1];
+    size_t step_bytes = xtype_size(xtype);
+    for (int d = 0; d < ndims - 2; d++)
+        step_bytes *= std::max<size_t>(dimlens[d], 1); // a chunk covers all non-spatial dimensions
+
+    layout_params_t params = {};
+    params.m_nx = options->nx;
+    params.m_ny = options->ny;
+    params.m_merge_threshold = options->merge_threshold;
+    params.m_max_chunk_cells = std::max<size_t>(options->max_chunk_bytes / step_bytes, 1);
+    if (params.m_nx == 0 || params.m_ny == 0)
+    {
+        // square chunks of `target_bytes`, made smaller on fragmented masks, so that chunks
+        // mostly stay pure instead of mixing several regions
+        double side = std::sqrt(double(std::max<size_t>(options->target_bytes / step_bytes, 1)));
+        double fragmentation = mask_fragmentation(mask, rows, cols);
+        if (fragmentation > 0)
+            side = std::max(std::min(side, 2.0 / fragmentation), double(MIN_CHUNK_SIDE));
+        if (params.m_nx == 0)
+            params.m_nx = (int)std::ceil(rows / side);
+        if (params.m_ny == 0)
+            params.m_ny = (int)std::ceil(cols / side);
+    }
+    return params;
+}
+
+int write_var_metadata_hier(int varid, int ndims, size_t* dimlens, int* mask, int nlinks, const int* child_ids,
+                            const int* parent_ids, int level, int xtype, const raster_chunking_t* options)
+{
+    region_hierarchy_t hierarchy;
+    std::unordered_map<int, int> parent_of;
+    for (int i = 0; i < nlinks; i++)
+    {
+        if (child_ids[i] == REGION_MIXED_ID || parent_ids[i] == REGION_MIXED_ID || !parent_of.insert({child_ids[i], parent_ids[i]}).second)
+            return NC_EINVAL; // a region has one parent at most
+    }
+    for (int i = 0; i < nlinks; i++)
+    {
+        if (parent_of.count(region_ancestor(parent_of, child_ids[i], nlinks)))
+            return NC_EINVAL; // a cycle
+    }
+    hierarchy.m_children.assign(child_ids, child_ids + nlinks);
+    hierarchy.m_parents.assign(parent_ids, parent_ids + nlinks);
+    hierarchy.m_level = level;
+    layout_params_t params = {CHUNKSIZE_NX, CHUNKSIZE_NY, 1, 0};
+    if (options != nullptr)
+    {
+        // the grid is derived from the mask the layout partitions, that of the ancestors at `level`
+        int rows = dimlens[ndims - 2], cols = dimlens[ndims - 1];
+        std::vector<int> level_mask(mask, mask + (size_t)rows * cols);
+        for (auto& id : level_mask)
+            id = region_ancestor(parent_of, id, level);
+        params = chunking_params(ndims, dimlens, level_mask.data(), xtype, options);
+    }
+    params.m_hierarchy = &hierarchy;
+    return write_var_layout(varid, dimlens[ndims - 2], dimlens[ndims - 1], mask, params);
+}
+
+int write_var_metadata_ext(int varid, int ndims, size_t* dimlens, int* mask, int xtype, const raster_chunking_t* options)
+{
+    layout_params_t params = chunking_params(ndims, dimlens, mask, xtype, options);
+    return write_var_layout(varid, dimlens[ndims - 2], dimlens[ndims - 1], mask, params);
+}
+
+// A variable with a time-varying mask keeps one layout per epoch, a run of consecutive steps of
+// the leading dimension with the same mask. Epochs are recorded in `_epoch_ranges_` (start, count
+// pairs) and `_epoch_<k>_layout_`, and their data is written as slabs, one or more per epoch, whose
+// `_layout_` attribute names the layout of their epoch. Equal masks share one layout, whatever
+// variable or epoch they come from. A mask that differs from the last one partitioned in full in
+// at most `EPOCH_REPARTITION_FRACTION` of its cells is partitioned from it, only around the
+// changed cells.
+int write_var_metadata_epochs(int varid, int ndims, size_t* dimlens, int* mask)
+{
+    if (ndims < 3)
+        return NC_EINVAL;
+    int rows = dimlens[ndims - 2], cols = dimlens[ndims - 1], status = NC_NOERR;
+    size_t nsteps = dimlens[0], step_cells = (size_t)rows * cols;
+    std::vector<unsigned long long> ranges;
+    std::shared_ptr<Mesh> base;
+    const int* base_mask = nullptr;
+
+    for (size_t start = 0; start < nsteps; )
+    {
+        const int* step_mask = &mask[start * step_cells];
+        size_t count = 1;
+        while (start + count < nsteps && memcmp(step_mask, &mask[(start + count) * step_cells], step_cells * sizeof(int)) == 0)
+            count++;
+
+        layout_params_t params = {CHUNKSIZE_NX, CHUNKSIZE_NY, 1, 0};
+        if (base != nullptr)
+        {
+            size_t changed = 0;
+            for (size_t k = 0; k < step_cells; k++)
+                changed += step_mask[k] != base_mask[k];
+            if (changed > 0 && changed <= EPOCH_REPARTITION_FRACTION * step_cells)
+            {
+                params.m_base = base.get();
+                params.m_base_mask = base_mask;
+            }
+        }
+
+        std::shared_ptr<Mesh> partitioned;
+        std::string layout_name, attr_name = "_epoch_" + std::to_string(ranges.size() / 2) + "_layout_";
+        status = def_layout(varid, rows, cols, step_mask, params, layout_name, &partitioned);
+        if (status != NC_NOERR)
+            return status;
+        if (partitioned != nullptr && params.m_base == nullptr)
+        {
+            base = partitioned;
+            base_mask = step_mask;
+        }
+        status = nc_put_att_text(varid, NC_GLOBAL, attr_name.c_str(), layout_name.size(), layout_name.c_str());
+        ranges.push_back(start);
+        ranges.push_back(count);
+        start += count;
+    }
+    int nepochs = ranges.size() / 2;
+    status = nc_put_att_ulonglong(varid, NC_GLOBAL, "_epoch_ranges_", NC_UINT64, ranges.size(), ranges.data());
+    status = nc_put_att_int(varid, NC_GLOBAL, "_nepochs_", NC_INT, 1, &nepochs);
+    return status;
+}
+
+namespace raster
+{
+
+// reads the text attribute `_layout_` of `grp_id`, returns false if it has none
+static bool get_layout_name(int grp_id, char* name)
+{
+    size_t len;
+    if (nc_inq_attlen(grp_id, NC_GLOBAL, "_layout_", &len) != NC_NOERR || len > NC_MAX_NAME)
+        return false;
+    if (nc_get_att_text(grp_id, NC_GLOBAL, "_layout_", name) != NC_NOERR)
+        return false;
+    name[len] = '\0';
+    return true;
+}
+
+int get_meta_grp(int var_grp_id, int* meta_grp_id, int slab_grp_id)
+{
+    int status, parent_grp_id;
+    char name[NC_MAX_NAME + 1];
+    // kept for files with a cache of their own only
+    std::shared_ptr<MetaCache> cache = own_meta_cache_of(var_grp_id);
+    if (cache != nullptr && cache->get_layout_grp(var_grp_id, slab_grp_id, meta_grp_id))
+        return NC_NOERR;
+    *meta_grp_id = var_grp_id;
+    if (!(slab_grp_id >= 0 && get_layout_name(slab_grp_id, name)) && !get_layout_name(var_grp_id, name))
+        return NC_NOERR; // not kept, the variable may still be given a layout
+    status = nc_inq_grp_parent(var_grp_id, &parent_grp_id);
+    status = nc_inq_grp_ncid(parent_grp_id, name, meta_grp_id);
+    if (status == NC_NOERR && cache != nullptr)
+        cache->add_layout_grp(var_grp_id, slab_grp_id, *meta_grp_id);
+    return status;
+}
+
+int load_var_epochs(int var_grp_id, std::vector<epoch_t>& epochs)
+{
+    int status, nepochs, parent_grp_id;
+    epochs.clear();
+    if (nc_get_att_int(var_grp_id, NC_GLOBAL, "_nepochs_", &nepochs) != NC_NOERR)
+        return NC_NOERR; // a single mask for all steps
+    std::vector<unsigned long long> ranges(2 * nepochs);
+    status = nc_get_att_ulonglong(var_grp_id, NC_GLOBAL, "_epoch_ranges_", ranges.data());
+    status = nc_inq_grp_parent(var_grp_id, &parent_grp_id);
+    for (int i = 0; i < nepochs && status == NC_NOERR; i++)
+    {
+        std::string attr_name = "_epoch_" + std::to_string(i) + "_layout_";
+        char name[NC_MAX_NAME + 1] = {0};
+        epoch_t epoch;
+        epoch.m_start = ranges[2 * i];
+        epoch.m_count = ranges[2 * i + 1];
+        status = nc_get_att_text(var_grp_id, NC_GLOBAL, attr_name.c_str(), name);
+        epoch.m_layout = name;
+        if (status == NC_NOERR)
+            status = nc_inq_grp_ncid(parent_grp_id, name, &epoch.m_layout_grp_id);
+        epochs.push_back(epoch);
+    }
+    return status;
+}
+
+// `index` is set to the decoded `_index_` of `meta_grp_id`, or null for metadata written as one netCDF
+// variable per region. A truncated or corrupt index is NC_EINVAL
+static int load_layout_index(int meta_grp_id, std::shared_ptr<LayoutIndex>& index)
+{
+    index = meta_cache_of(meta_grp_id)->get_index(meta_grp_id);
     int status, index_id, index_dimid;
-    Mesh mesh(mask, rows, cols, CHUNKSIZE_NX, CHUNKSIZE_NY);
-
-    chunk_info_list blist = mesh.partition();
-    std::vector<int> mask_ids = mesh.get_all_mask_id();
-    std::vector<size_t> chunkshape(ndims);
-
-    for (int i = 0; i < ndims; i++) 
-        chunkshape[i] = dimlens[i];
-    chunkshape[ndims - 2] /= CHUNKSIZE_NX;
-    chunkshape[ndims - 1] /= CHUNKSIZE_NY;
-    std::vector<Region> regions = construct_region_chunks(blist, mask_ids, ndims, chunkshape);
-    std::vector<int> indices = mesh.get_all_mask_id();
-    status = nc_def_dim(varid, "_meta_region_maskid_", indices.size(), &index_dimid);
-    status = nc_def_var(varid, "_meta_region_maskid_", NC_INT, 1, &index_dimid, &index_id);
-    status = nc_put_var_int(varid, index_id, &indices[0]);
-
-    for (auto& region : regions)
-    {
-        int meta_id, meta_dimid[2], nrows, ncols, rblks;
-        int dims[2], metaid, relation_dimid;
-        char region_metaname[64];
-        size_t* meta = nullptr;
-        int* relation = nullptr;
-        
-        construct_region_meta(region, &nrows, &ncols, meta);
-        construct_region_relation(region, &rblks, relation);
-
-        sprintf(region_metaname, "_meta_region_%d_rows_", region.get_maskid());
-        status = nc_def_dim(varid, region_metaname, nrows, &dims[0]);
-        sprintf(region_metaname, "_meta_region_%d_cols_", region.get_maskid());
-        status = nc_def_dim(varid, region_metaname, ncols, &dims[1]);
-        sprintf(region_metaname, "_meta_region_%d_chunks_", region.get_maskid());
-        status = nc_def_var(varid, region_metaname, NC_UINT64, 2, dims, &metaid);
-        nc_put_var_ulonglong(varid, metaid, (unsigned long long*)meta);
-        if (region.get_maskid() != REGION_MIXED_ID)
-        {
-            sprintf(region_metaname, "_meta_region_%d_relations_", region.get_maskid());
-            nc_def_dim(varid, region_metaname, rblks, &relation_dimid);
-            nc_def_var(varid, region_metaname, NC_INT, 1, &relation_dimid, &metaid);
-            nc_put_var_int(varid, metaid, relation);
-        }
-        meta_cache->add_region(varid, region.get_maskid(), nrows, ncols, rblks, relation, meta);
+    size_t nbytes;
+    if (index != nullptr || nc_inq_varid(meta_grp_id, "_index_", &index_id) != NC_NOERR)
+        return NC_NOERR;
+    status = nc_inq_vardimid(meta_grp_id, index_id, &index_dimid);
+    if (status == NC_NOERR)
+        status = nc_inq_dimlen(meta_grp_id, index_dimid, &nbytes);
+    if (status != NC_NOERR)
+        return status;
+    std::vector<unsigned char> bytes(nbytes);
+    status = nc_get_var_ubyte(meta_grp_id, index_id, bytes.data());
+    if (status != NC_NOERR)
+        return status;
+    auto decoded = std::make_shared<LayoutIndex>();
+    try
+    {
+        decode_layout_index(bytes.data(), nbytes, *decoded);
+    }
+    catch (const std::exception&)
+    {
+        return NC_EINVAL; // counts of a corrupt index may also fail the allocations
     }
+    index = meta_cache_of(meta_grp_id)->add_index(meta_grp_id, decoded);
+    return NC_NOERR;
+}
+
+// region metadata of one region group in netCDF variables, as written before `_index_`
+static int load_region_vars(int meta_grp_id, int mask_id, std::shared_ptr<CacheBlock>& blkptr)
+{
+    int status = NC_NOERR;
+    blkptr = meta_cache_of(meta_grp_id)->get_region(meta_grp_id, mask_id);
+    if (blkptr != nullptr)
+        return status;
+
+    // cache miss, get data from file
+    int meta_id, meta_dimids[2], relation_dimid, *relation_chunks = nullptr;
+    size_t nrows, ncols, nrelations = 0;
+    uint64_t* meta_buffer;
+    char name_buffer[128];
+    sprintf(name_buffer, "_meta_region_%d_rows_", mask_id);
+    status = nc_inq_dimid(meta_grp_id, name_buffer, &meta_dimids[0]);
+    sprintf(name_buffer, "_meta_region_%d_cols_", mask_id);
+    if (status == NC_NOERR)
+        status = nc_inq_dimid(meta_grp_id, name_buffer, &meta_dimids[1]);
+    if (status != NC_NOERR) // invalid maskid
+        return status;
+    status = nc_inq_dimlen(meta_grp_id, meta_dimids[0], &nrows);
+    status = nc_inq_dimlen(meta_grp_id, meta_dimids[1], &ncols);
+    meta_buffer = new uint64_t[nrows * ncols + 1];
+    sprintf(name_buffer, "_meta_region_%d_chunks_", mask_id);
+    status = nc_inq_varid(meta_grp_id, name_buffer, &meta_id);
+    status = nc_get_var_ulonglong(meta_grp_id, meta_id, (unsigned long long*)meta_buffer);
+
+    sprintf(name_buffer, "_meta_region_%d_relations_", mask_id);
+    if (nc_inq_dimid(meta_grp_id, name_buffer, &relation_dimid) == NC_NOERR) // the mixed region has no relations
+    {
+        status = nc_inq_dimlen(meta_grp_id, relation_dimid, &nrelations);
+        relation_chunks = new int[nrelations];
+        status = nc_inq_varid(meta_grp_id, name_buffer, &meta_id);
+        status = nc_get_var_int(meta_grp_id, meta_id, relation_chunks);
+    }
+    // the cache takes the ownership of both buffers
+    blkptr = meta_cache_of(meta_grp_id)->add_region(meta_grp_id, mask_id, nrows, ncols, nrelations, relation_chunks, meta_buffer);
     return status;
 }
+
+int load_region_meta(int var_grp_id, int mask_id, size_t* data_shape, region_meta_t& meta, int slab_grp_id)
+{
+    int status, meta_grp_id, src_ncols;
+    const size_t* src_data;
+    status = get_meta_grp(var_grp_id, &meta_grp_id, slab_grp_id);
+    if (status != NC_NOERR)
+        return status;
+
+    status = load_layout_index(meta_grp_id, meta.m_index);
+    if (status != NC_NOERR)
+        return status;
+    if (meta.m_index != nullptr)
+    {
+        auto entry = meta.m_index->m_regions.find(mask_id);
+        if (entry == meta.m_index->m_regions.end())
+            return NC_EBADDIM; // invalid maskid, as for a missing `_meta_region_<id>_rows_`
+        meta.m_nrows = entry->second.m_nrows;
+        meta.m_nrelations = entry->second.m_nrelations;
+        meta.m_relation = meta.m_index->m_relation_chunks.data() + entry->second.m_relation_offset;
+        meta.m_relation_rows = meta.m_index->m_relation_rows.data() + entry->second.m_relation_offset;
+        src_ncols = meta.m_index->m_ncols;
+        src_data = meta.m_index->m_rows.data() + entry->second.m_row_offset;
+    }
+    else
+    {
+        status = load_region_vars(meta_grp_id, mask_id, meta.m_block);
+        if (status != NC_NOERR)
+            return status;
+        meta.m_nrows = meta.m_block->m_nrows;
+        meta.m_nrelations = meta.m_block->m_nrelations;
+        meta.m_relation = meta.m_block->m_relation;
+        meta.m_relation_rows = nullptr;
+        src_ncols = meta.m_block->m_ncols;
+        src_data = meta.m_block->m_data;
+    }
+    if (meta_grp_id == var_grp_id)
+    {
+        meta.m_ncols = src_ncols;
+        meta.m_data = const_cast<size_t*>(src_data);
+        return NC_NOERR;
+    }
+
+    // expand 2D layout rows to the dimensions of this variable
+    int ndims;
+    status = nc_get_att_int(var_grp_id, NC_GLOBAL, "_ndims_", &ndims);
+    meta.m_ncols = 2 * ndims + 1;
+    meta.m_expanded.resize((size_t)meta.m_nrows * meta.m_ncols);
+    for (int i = 0; i < meta.m_nrows; i++)
+    {
+        const size_t* src = &src_data[(size_t)i * src_ncols];
+        size_t* dest = &meta.m_expanded[(size_t)i * meta.m_ncols];
+        dest[0] = src[0];
+        for (int d = 0; d < ndims - 2; d++)
+        {
+            dest[1 + d] = 0;
+            dest[1 + ndims + d] = data_shape[d];
+        }
+        dest[ndims - 1] = src[1];
+        dest[ndims] = src[2];
+        dest[2 * ndims - 1] = src[3];
+        dest[2 * ndims] = src[4];
+    }
+    meta.m_data = meta.m_expanded.data();
+    return status;
+}
+
+static int read_region_ids(int meta_grp_id, std::vector<int>& mask_ids)
+{
+    int status, mask_dimid, mask_varid;
+    size_t num_regions;
+    std::shared_ptr<LayoutIndex> index;
+    status = load_layout_index(meta_grp_id, index);
+    if (status != NC_NOERR)
+        return status;
+    if (index != nullptr)
+    {
+        mask_ids = index->m_mask_ids;
+        return NC_NOERR;
+    }
+    status = nc_inq_dimid(meta_grp_id, "_meta_region_maskid_", &mask_dimid);
+    if (status != NC_NOERR)
+        return status;
+    status = nc_inq_dimlen(meta_grp_id, mask_dimid, &num_regions);
+    status = nc_inq_varid(meta_grp_id, "_meta_region_maskid_", &mask_varid);
+    mask_ids.resize(num_regions);
+    status = nc_get_var_int(meta_grp_id, mask_varid, mask_ids.data());
+    return status;
+}
+
+int resolve_region(int var_grp_id, int mask_id, std::vector<int>& region_ids, int slab_grp_id, std::vector<int>* cell_ids)
+{
+    int status, meta_grp_id;
+    region_ids.assign(1, mask_id);
+    if (cell_ids != nullptr)
+        cell_ids->clear();
+    status = get_meta_grp(var_grp_id, &meta_grp_id, slab_grp_id);
+    if (status != NC_NOERR || mask_id == REGION_MIXED_ID)
+        return status;
+    std::shared_ptr<LayoutIndex> index;
+    status = load_layout_index(meta_grp_id, index);
+    if (status != NC_NOERR || index == nullptr || index->m_children.empty())
+        return status; // a flat mask, or an unreadable index
+
+    const std::vector<int>& layout_ids = index->m_mask_ids;
+    std::unordered_map<int, int> parent_of;
+    for (size_t i = 0; i < index->m_children.size(); i++)
+        parent_of[index->m_children[i]] = index->m_parents[i];
+
+    // a region is the union of itself and its descendants in the layout
+    region_ids.clear();
+    for (int id : layout_ids)
+    {
+        for (int a = id; ; a = parent_of[a])
+        {
+            if (a == mask_id)
+            {
+                region_ids.push_back(id);
+                break;
+            }
+            if (!parent_of.count(a))
+                break;
+        }
+    }
+    if (!region_ids.empty())
+        return NC_NOERR;
+
+    // a child region of a layout built at a parent level is read through its ancestor
+    for (int a = mask_id; parent_of.count(a); )
+    {
+        a = parent_of[a];
+        if (index->m_regions.count(a))
+        {
+            region_ids.push_back(a);
+            if (cell_ids == nullptr)
+                return NC_NOERR;
+            cell_ids->push_back(mask_id);
+            for (auto& link : parent_of)
+            {
+                for (int b = link.first; parent_of.count(b) && b != a; b = parent_of[b])
+                {
+                    if (parent_of[b] == mask_id)
+                    {
+                        cell_ids->push_back(link.first);
+                        break;
+                    }
+                }
+            }
+            return NC_NOERR;
+        }
+    }
+    return NC_EBADDIM; // like an invalid mask id of a flat mask
+}
+
+int load_spatial_index(int var_grp_id, size_t* data_shape, std::shared_ptr<SpatialIndex>& sindex, int slab_grp_id)
+{
+    int status, meta_grp_id;
+    status = get_meta_grp(var_grp_id, &meta_grp_id, slab_grp_id);
+    if (status != NC_NOERR)
+        return status;
+    sindex = meta_cache_of(meta_grp_id)->get_spatial_index(meta_grp_id);
+    if (sindex != nullptr)
+        return status;
+
+    std::vector<int> mask_ids;
+    std::vector<SpatialIndex::entry_t> entries;
+    status = read_region_ids(meta_grp_id, mask_ids);
+    if (status != NC_NOERR)
+        return status;
+    mask_ids.push_back(REGION_MIXED_ID);
+    for (int mask_id : mask_ids)
+    {
+        region_meta_t meta;
+        status = load_region_meta(var_grp_id, mask_id, data_shape, meta, slab_grp_id);
+        if (status != NC_NOERR)
+            return status;
+        int ndims = (meta.m_ncols - 1) / 2;
+        for (int i = 0; i < meta.m_nrows; i++)
+        {
+            const size_t* row = &meta.m_data[(size_t)i * meta.m_ncols];
+            SpatialIndex::entry_t entry;
+            entry.m_region = mask_id;
+            entry.m_row = i;
+            for (int d = 0; d < 2; d++)
+            {
+                entry.m_start[d] = row[ndims - 1 + d];
+                entry.m_end[d] = row[ndims - 1 + d] + row[2 * ndims - 1 + d];
+            }
+            entries.push_back(entry);
+        }
+    }
+    sindex = std::make_shared<SpatialIndex>(std::move(entries));
+    sindex = meta_cache_of(meta_grp_id)->add_spatial_index(meta_grp_id, sindex);
+    return status;
+}
+
+int load_region_ids(int var_grp_id, std::vector<int>& mask_ids, int slab_grp_id)
+{
+    int status, meta_grp_id;
+    std::vector<epoch_t> epochs;
+    status = load_var_epochs(var_grp_id, epochs);
+    if (status != NC_NOERR)
+        return status;
+    if (slab_grp_id >= 0 || epochs.empty())
+    {
+        status = get_meta_grp(var_grp_id, &meta_grp_id, slab_grp_id);
+        return read_region_ids(meta_grp_id, mask_ids);
+    }
+
+    // regions of any epoch
+    std::set<int> all_ids;
+    for (auto& epoch : epochs)
+    {
+        std::vector<int> epoch_ids;
+        status = read_region_ids(epoch.m_layout_grp_id, epoch_ids);
+        if (status != NC_NOERR)
+            return status;
+        all_ids.insert(epoch_ids.begin(), epoch_ids.end());
+    }
+    mask_ids.assign(all_ids.begin(), all_ids.end());
+    return status;
+}
+
+int load_layout_mask(int var_grp_id, std::vector<int>& mask, size_t* rows, size_t* cols, int slab_grp_id,
+                     const size_t* start, const size_t* count)
+{
+    int status, meta_grp_id, mask_id, dimids[2];
+    status = get_meta_grp(var_grp_id, &meta_grp_id, slab_grp_id);
+    if (status != NC_NOERR)
+        return status;
+    status = nc_inq_varid(meta_grp_id, "_mask_", &mask_id);
+    if (status != NC_NOERR)
+        return status; // written before masks were kept
+    status = nc_inq_vardimid(meta_grp_id, mask_id, dimids);
+    status = nc_inq_dimlen(meta_grp_id, dimids[0], rows);
+    status = nc_inq_dimlen(meta_grp_id, dimids[1], cols);
+    if (start != nullptr)
+    {
+        if (start[0] + count[0] > *rows || start[1] + count[1] > *cols)
+            return NC_EINVALCOORDS;
+        mask.resize(count[0] * count[1]);
+        return nc_get_vara_int(meta_grp_id, mask_id, start, count, mask.data());
+    }
+    mask.resize(*rows * *cols);
+    return nc_get_var_int(meta_grp_id, mask_id, mask.data());
+}
+
+int load_region_links(int var_grp_id, std::vector<int>& children, std::vector<int>& parents, int slab_grp_id)
+{
+    int status, meta_grp_id;
+    std::shared_ptr<LayoutIndex> index;
+    children.clear();
+    parents.clear();
+    status = get_meta_grp(var_grp_id, &meta_grp_id, slab_grp_id);
+    if (status != NC_NOERR)
+        return status;
+    status = load_layout_index(meta_grp_id, index);
+    if (status == NC_NOERR && index != nullptr)
+    {
+        children = index->m_children;
+        parents = index->m_parents;
+    }
+    return status;
+}
+
+double get_fill_value(int var_grp_id)
+{
+    int xtype = NC_NAT;
+    double fill;
+    if (nc_get_att_double(var_grp_id, NC_GLOBAL, "_FillValue", &fill) == NC_NOERR)
+        return fill;
+    nc_get_att_int(var_grp_id, NC_GLOBAL, "_xtype_", &xtype);
+    switch (xtype)
+    {
+        case NC_CHAR: return NC_FILL_CHAR;
+        case NC_INT: return NC_FILL_INT;
+        case NC_FLOAT: return NC_FILL_FLOAT;
+        case NC_DOUBLE: return NC_FILL_DOUBLE;
+        default: return NAN;
+    }
+}
+
+int load_chunk_stats(int region_grp_id, std::vector<chunk_stats_t>& stats)
+{
+    int status, varid, dimids[2];
+    size_t nrows;
+    stats.clear();
+    if (nc_inq_varid(region_grp_id, "_chunk_stats_", &varid) != NC_NOERR)
+        return NC_NOERR; // written before chunk statistics were recorded
+    status = nc_inq_vardimid(region_grp_id, varid, dimids);
+    status = nc_inq_dimlen(region_grp_id, dimids[0], &nrows);
+    stats.resize(nrows);
+    status = nc_get_var_double(region_grp_id, varid, reinterpret_cast<double*>(stats.data()));
+    if (status != NC_NOERR)
+        stats.clear();
+    return status;
+}
+
+size_t region_group_t::bytes() const
+{
+    return sizeof(region_group_t) + m_part_table.size() * sizeof(uint64_t) + m_uniform_values.size()
+         + (m_part_rows.size() + m_uniform.size()) * (sizeof(int) + sizeof(size_t) + 2 * sizeof(void*))
+         + (m_chunk_table.size() + m_chunk_vars.size()) * (sizeof(int) + 2 * sizeof(size_t) + 2 * sizeof(void*));
+}
+
+// (chunk id, varid, blob size) of the `chunk_<id>` variables of a region group
+static int read_chunk_vars(int region_grp_id, std::unordered_map<int, std::pair<int, size_t> >& chunk_vars)
+{
+    int status, nvars = 0;
+    status = nc_inq_nvars(region_grp_id, &nvars);
+    for (int varid = 0; varid < nvars && status == NC_NOERR; varid++)
+    {
+        char name[NC_MAX_NAME + 1];
+        int chunk, len = 0, dimid;
+        size_t blob_size;
+        status = nc_inq_varname(region_grp_id, varid, name);
+        if (status != NC_NOERR || sscanf(name, "chunk_%d%n", &chunk, &len) != 1 || name[len] != '\0')
+            continue;
+        status = nc_inq_vardimid(region_grp_id, varid, &dimid);
+        if (status == NC_NOERR)
+            status = nc_inq_dimlen(region_grp_id, dimid, &blob_size);
+        chunk_vars[chunk] = {varid, blob_size};
+    }
+    return status;
+}
+
+int load_region_group(int data_grp_id, int mask_id, std::shared_ptr<const region_group_t>& group)
+{
+    std::shared_ptr<MetaCache> cache = own_meta_cache_of(data_grp_id);
+    group = (cache != nullptr) ? cache->get_region_group(data_grp_id, mask_id) : nullptr;
+    if (group != nullptr)
+        return NC_NOERR;
+
+    int status, table_id, table_dimids[2];
+    std::string region_name = "region_" + std::to_string(mask_id);
+    auto loaded = std::make_shared<region_group_t>();
+    region_group_t& g = *loaded;
+    status = nc_inq_grp_ncid(data_grp_id, region_name.c_str(), &g.m_grp_id);
+    if (status != NC_NOERR)
+        return status;
+    g.m_split = (nc_inq_att(g.m_grp_id, NC_GLOBAL, "_split_", NULL, NULL) == NC_NOERR);
+    g.m_encoded = (nc_inq_att(g.m_grp_id, NC_GLOBAL, "_codec_", NULL, NULL) == NC_NOERR);
+    if (g.m_split && nc_inq_varid(g.m_grp_id, "_part_table_", &table_id) == NC_NOERR)
+    {
+        size_t table_rows = 0;
+        status = nc_inq_vardimid(g.m_grp_id, table_id, table_dimids);
+        status = nc_inq_dimlen(g.m_grp_id, table_dimids[0], &table_rows);
+        g.m_part_table.resize(table_rows * 4);
+        status = nc_get_var_ulonglong(g.m_grp_id, table_id, (unsigned long long*)g.m_part_table.data());
+        if (status != NC_NOERR)
+            return status;
+        for (size_t r = table_rows; r-- > 0; )
+            g.m_part_rows[(int)g.m_part_table[r * 4]] = r;
+    }
+
+    // uniform chunks as attributes, or as variables when too many for the object header
+    size_t nuniform = 0, nbytes = 0;
+    std::vector<int> uniform_ids;
+    int uniform_varids[2], uniform_dimid;
+    if (nc_inq_attlen(g.m_grp_id, NC_GLOBAL, "_uniform_chunks_", &nuniform) == NC_NOERR && nuniform > 0)
+    {
+        uniform_ids.resize(nuniform);
+        status = nc_get_att_int(g.m_grp_id, NC_GLOBAL, "_uniform_chunks_", uniform_ids.data());
+        status = nc_inq_attlen(g.m_grp_id, NC_GLOBAL, "_uniform_values_", &nbytes);
+        g.m_uniform_values.resize(nbytes);
+        status = nc_get_att_ubyte(g.m_grp_id, NC_GLOBAL, "_uniform_values_", g.m_uniform_values.data());
+    }
+    else if (nc_inq_varid(g.m_grp_id, "_uniform_chunks_", &uniform_varids[0]) == NC_NOERR)
+    {
+        status = nc_inq_varid(g.m_grp_id, "_uniform_values_", &uniform_varids[1]);
+        status = nc_inq_vardimid(g.m_grp_id, uniform_varids[0], &uniform_dimid);
+        status = nc_inq_dimlen(g.m_grp_id, uniform_dimid, &nuniform);
+        status = nc_inq_vardimid(g.m_grp_id, uniform_varids[1], &uniform_dimid);
+        status = nc_inq_dimlen(g.m_grp_id, uniform_dimid, &nbytes);
+        uniform_ids.resize(nuniform);
+        g.m_uniform_values.resize(nbytes);
+        status = nc_get_var_int(g.m_grp_id, uniform_varids[0], uniform_ids.data());
+        if (status == NC_NOERR)
+            status = nc_get_var_ubyte(g.m_grp_id, uniform_varids[1], g.m_uniform_values.data());
+    }
+    if (status != NC_NOERR)
+        return status;
+    for (size_t i = 0; i < nuniform; i++)
+        g.m_uniform[uniform_ids[i]] = i;
+
+    g.m_data_id = -1;
+    if (nc_inq_varid(g.m_grp_id, "_chunk_table_", &table_id) == NC_NOERR)
+    {
+        size_t table_rows = 0;
+        status = nc_inq_vardimid(g.m_grp_id, table_id, table_dimids);
+        status = nc_inq_dimlen(g.m_grp_id, table_dimids[0], &table_rows);
+        std::vector<uint64_t> table(table_rows * 3);
+        status = nc_get_var_ulonglong(g.m_grp_id, table_id, (unsigned long long*)table.data());
+        for (size_t r = 0; r < table_rows; r++)
+            g.m_chunk_table[(int)table[r * 3]] = {table[r * 3 + 1], table[r * 3 + 2]};
+        status = nc_inq_varid(g.m_grp_id, "_data_", &g.m_data_id);
+    }
+    else if (cache != nullptr)
+        status = read_chunk_vars(g.m_grp_id, g.m_chunk_vars);
+    if (status != NC_NOERR)
+        return status;
+    // without a cache the group serves this read only, its chunk variables are looked up by name
+    group = (cache != nullptr) ? cache->add_region_group(data_grp_id, mask_id, loaded) : loaded;
+    return status;
+}
+
+} // namespace raster
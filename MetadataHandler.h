@@ -2,15 +2,144 @@
 #define __WRITE_META_H__
 #include <stdlib.h>
 #include <netcdf.h>
+#include "raster.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 int write_var_metadata(int varid, int ndims, size_t* dimlens, int* mask);
+int write_var_metadata_ext(int varid, int ndims, size_t* dimlens, int* mask, int xtype, const raster_chunking_t* options);
+int write_var_metadata_epochs(int varid, int ndims, size_t* dimlens, int* mask);
+int write_var_metadata_hier(int varid, int ndims, size_t* dimlens, int* mask, int nlinks, const int* child_ids,
+                            const int* parent_ids, int level, int xtype, const raster_chunking_t* options);
 
 #ifdef __cplusplus
 }
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "IndexManager.h"
+#include "MetaCache.h"
+
+namespace raster
+{
+
+// Region metadata of one variable, rows are (chunk id, start[ndims], count[ndims]).
+// Rows of a shared 2D layout are expanded to the variable's dimensions, where the non-spatial
+// dimensions are covered entirely
+struct region_meta_t
+{
+    int                             m_nrows;
+    int                             m_ncols;
+    size_t*                         m_data;
+    int                             m_nrelations;
+    int*                            m_relation;
+    int*                            m_relation_rows;    // rows of the related chunks in the mixed region, or null
+    std::shared_ptr<CacheBlock>     m_block;            // keeps cached rows alive
+    std::shared_ptr<LayoutIndex>    m_index;            // keeps the rows of an `_index_` alive
+    std::vector<size_t>             m_expanded;
+};
+
+// steps [m_start, m_start + m_count) of a variable with a time-varying mask, sharing one layout
+struct epoch_t
+{
+    size_t      m_start;
+    size_t      m_count;
+    std::string m_layout;
+    int         m_layout_grp_id;
+};
+
+// value range of one stored chunk, kept in the `_chunk_stats_` rows of its region group. NaNs and
+// fill values are counted, but not part of the range, m_min and m_max are NaN if nothing else is left
+struct chunk_stats_t
+{
+    double  m_chunk_id;
+    double  m_min;
+    double  m_max;
+    double  m_nnan;
+    double  m_nfill;
+};
+static_assert(sizeof(chunk_stats_t) == 5 * sizeof(double), "`_chunk_stats_` rows are stored as is");
+
+// aggregates of the cells of one region at one step of the leading dimension, kept in the
+// `_region_stats_` rows of the variable (or slab) group. NaNs and fill values are left out, m_min
+// and m_max are NaN if nothing else is left
+struct region_stats_t
+{
+    double  m_count;
+    double  m_sum;
+    double  m_sum_squares;
+    double  m_min;
+    double  m_max;
+};
+static_assert(sizeof(region_stats_t) == 5 * sizeof(double), "`_region_stats_` rows are stored as is");
+
+// Storage of the chunks of one region group, what reads need besides the region metadata. For a
+// file opened as a `raster::File` it is read once by `load_region_group` and kept in the meta cache
+// of the file, so repeated reads of the region go straight to the chunk data. Other files read it
+// on each read
+struct region_group_t
+{
+    int                                                     m_grp_id;
+    bool                                                    m_split;        // mixed chunks split by region
+    bool                                                    m_encoded;      // chunks start with a codec header
+    std::vector<uint64_t>                                   m_part_table;   // rows (chunk id, region id, offset, length)
+    std::unordered_map<int, size_t>                         m_part_rows;    // chunk id -> its first row in `m_part_table`
+    std::unordered_map<int, size_t>                         m_uniform;      // chunk id -> its index in `m_uniform_values`
+    std::vector<unsigned char>                              m_uniform_values;
+    int                                                     m_data_id;      // `_data_` of a packed region, or -1
+    std::unordered_map<int, std::pair<size_t, size_t> >     m_chunk_table;  // chunk id -> (offset, length) in `_data_`
+    std::unordered_map<int, std::pair<int, size_t> >        m_chunk_vars;   // chunk id -> (varid, blob size) of `chunk_<id>`
+
+    size_t bytes() const;
+};
+
+// group holding the region metadata of `var_grp_id`, which is its layout group, or the
+// variable group itself for variables defined before layouts were shared. A slab with its own
+// `_layout_` (an epoch of a time-varying mask) overrides the layout of the variable
+int get_meta_grp(int var_grp_id, int* meta_grp_id, int slab_grp_id=-1);
+
+// epochs of `var_grp_id`, empty if its mask does not vary over time
+int load_var_epochs(int var_grp_id, std::vector<epoch_t>& epochs);
+
+// region metadata of `mask_id` in `var_grp_id` (or in its slab `slab_grp_id`), read through the meta cache of its file
+int load_region_meta(int var_grp_id, int mask_id, size_t* data_shape, region_meta_t& meta, int slab_grp_id=-1);
+
+// all mask ids of `var_grp_id` (of all its epochs, or of its slab `slab_grp_id`), excluding `REGION_MIXED_ID`
+int load_region_ids(int var_grp_id, std::vector<int>& mask_ids, int slab_grp_id=-1);
+
+// region ids of the layout making up `mask_id`: itself, the descendants of a parent region, or
+// the ancestor of a region whose layout is built at a parent level. In that last case `cell_ids`
+// is set to the mask ids of the cells of `mask_id`, itself and its descendants, else it is cleared
+int resolve_region(int var_grp_id, int mask_id, std::vector<int>& region_ids, int slab_grp_id=-1,
+                   std::vector<int>* cell_ids=nullptr);
+
+// box index over the chunks of all regions of `var_grp_id` (or of its slab `slab_grp_id`), whose
+// entries refer to rows of `load_region_meta`
+int load_spatial_index(int var_grp_id, size_t* data_shape, std::shared_ptr<SpatialIndex>& sindex, int slab_grp_id=-1);
+
+// mask of the layout of `var_grp_id` (or of its slab `slab_grp_id`), NC_ENOTVAR for layouts
+// written before masks were kept. With `start` / `count`, `mask` holds that box of it only
+int load_layout_mask(int var_grp_id, std::vector<int>& mask, size_t* rows, size_t* cols, int slab_grp_id=-1,
+                     const size_t* start=nullptr, const size_t* count=nullptr);
+
+// (child, parent) links of the region hierarchy of the layout, empty for a flat mask
+int load_region_links(int var_grp_id, std::vector<int>& children, std::vector<int>& parents, int slab_grp_id=-1);
+
+// `_FillValue` of `var_grp_id` if set, otherwise the netCDF default fill value of its type
+double get_fill_value(int var_grp_id);
+
+// `_chunk_stats_` of a region group, in metadata order, empty if the writer did not record them
+int load_chunk_stats(int region_grp_id, std::vector<chunk_stats_t>& stats);
+
+// storage of region `mask_id` in `data_grp_id` (a variable group, or one of its slabs), read
+// through the meta cache of its file if it has one of its own; `m_chunk_vars` is empty otherwise
+int load_region_group(int data_grp_id, int mask_id, std::shared_ptr<const region_group_t>& group);
+
+} // namespace raster
 #endif
 
-#endif
\ No newline at end of file
+#endif
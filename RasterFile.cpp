@@ -0,0 +1,153 @@
+#include <stdexcept>
+
+#include "RasterFile.h"
+#include "AsyncWriter.h"
+#include "ChunkCache.h"
+#include "MetaCache.h"
+
+namespace raster
+{
+
+static void check(int status, const std::string& what)
+{
+    if (status != NC_NOERR)
+        throw std::runtime_error(what + ": " + nc_strerror(status));
+}
+
+template <typename T> static int xtype_of();
+template <> int xtype_of<int>() { return NC_INT; }
+template <> int xtype_of<float>() { return NC_FLOAT; }
+template <> int xtype_of<double>() { return NC_DOUBLE; }
+template <> int xtype_of<char>() { return NC_CHAR; }
+
+File::File(const std::string& path, int mode, const file_options_t& options) : m_ncid(-1)
+{
+    m_meta_cache = std::make_shared<MetaCache>(options.m_meta_cache_bytes);
+    m_chunk_cache = std::make_shared<ChunkCache>(0, RASTER_CACHE_LRU);
+    check(m_chunk_cache->configure(options.m_chunk_cache_bytes, options.m_chunk_cache_policy), "Invalid chunk cache policy");
+    check(nc_open(path.c_str(), mode, &m_ncid), "Cannot open " + path);
+    attach_meta_cache(m_ncid, m_meta_cache);
+    attach_chunk_cache(m_ncid, m_chunk_cache);
+}
+
+File::~File()
+{
+    try
+    {
+        close();
+    }
+    catch (std::exception&)
+    {
+        // nothing to report it to
+    }
+}
+
+void File::close()
+{
+    if (m_ncid < 0)
+        return;
+    int ncid = m_ncid;
+    // prefetches still queued load into the caches of the file, writes flushing on close go
+    // through the shared caches, which `raster_close` clears
+    drain_writes();
+    detach_meta_cache(ncid);
+    detach_chunk_cache(ncid);
+    m_ncid = -1;
+    m_meta_cache.reset();
+    m_chunk_cache.reset();
+    check(raster_close(ncid), "Error while closing the file");
+}
+
+void File::get_meta_cache_stats(raster_cache_stats_t& stats) const
+{
+    if (m_meta_cache == nullptr)
+        throw std::runtime_error("The file is closed");
+    m_meta_cache->get_stats(stats);
+}
+
+void File::get_chunk_cache_stats(raster_cache_stats_t& stats) const
+{
+    if (m_chunk_cache == nullptr)
+        throw std::runtime_error("The file is closed");
+    m_chunk_cache->get_stats(stats);
+}
+
+template <typename T>
+Variable<T> File::variable(const std::string& name) const
+{
+    int var_grp_id;
+    if (m_ncid < 0)
+        throw std::runtime_error("The file is closed");
+    check(raster_inq_varid(m_ncid, name.c_str(), &var_grp_id), "No variable " + name);
+    return Variable<T>(m_ncid, var_grp_id);
+}
+
+template <typename T>
+Variable<T>::Variable(int ncid, int var_grp_id) : m_ncid(ncid)
+{
+    m_desc.m_grp_id = var_grp_id;
+    refresh();
+}
+
+template <typename T>
+void Variable<T>::refresh()
+{
+    int ndims, xtype, status;
+    size_t dimlens[32];
+    check(get_var_dimlens(m_ncid, m_desc.m_grp_id, &ndims, dimlens), "Cannot read the shape of the variable");
+    check(nc_get_att_int(m_desc.m_grp_id, NC_GLOBAL, "_xtype_", &xtype), "Cannot read the type of the variable");
+    if (xtype != xtype_of<T>())
+        check(NC_EBADTYPE, "The variable is not of the type asked for");
+    status = describe_var(m_desc.m_grp_id, xtype, dimlens, m_desc);
+    check(status, "Cannot read the slabs of the variable");
+}
+
+// reads wait for pending asynchronous writes of the file, not for prefetches, then hold the io
+// lock while they run, as the C API does
+struct read_guard_t
+{
+    explicit read_guard_t(int ncid) { wait_file_writes(ncid); lock_io(); }
+    ~read_guard_t() { unlock_io(); }
+};
+
+template <typename T>
+void Variable<T>::get_region(int mask_id, T* data) const
+{
+    read_guard_t guard(m_ncid);
+    check(read_region<T>(m_desc, mask_id, data, true, 0, 0), "Cannot read region " + std::to_string(mask_id));
+}
+
+template <typename T>
+void Variable<T>::get_region_steps(int mask_id, size_t start, size_t count, T* data) const
+{
+    if (m_desc.m_ndims < 3 || count == 0)
+        check(NC_EINVAL, "Steps are read from variables with a leading dimension");
+    read_guard_t guard(m_ncid);
+    check(read_region<T>(m_desc, mask_id, data, true, start, count), "Cannot read region " + std::to_string(mask_id));
+}
+
+template <typename T>
+void Variable<T>::get_vara(const size_t* start, const size_t* count, T* data) const
+{
+    read_guard_t guard(m_ncid);
+    check(read_vara<T>(m_desc, start, count, data), "Cannot read the box");
+}
+
+template <typename T>
+void Variable<T>::prefetch_region(int mask_id) const
+{
+    std::vector<size_t> shape(m_desc.m_shape);
+    check(iprefetch_region(m_ncid, m_desc.m_grp_id, m_desc.m_xtype, mask_id, m_desc.m_ndims, shape.data(), nullptr),
+          "Cannot prefetch region " + std::to_string(mask_id));
+}
+
+template class Variable<int>;
+template class Variable<float>;
+template class Variable<double>;
+template class Variable<char>;
+template Variable<int> File::variable<int>(const std::string&) const;
+template Variable<float> File::variable<float>(const std::string&) const;
+template Variable<double> File::variable<double>(const std::string&) const;
+template Variable<char> File::variable<char>(const std::string&) const;
+
+} // namespace raster
@@ -0,0 +1,90 @@
+#ifndef __RASTER_FILE_H__
+#define __RASTER_FILE_H__
+#include <memory>
+#include <string>
+#include <vector>
+#include <netcdf.h>
+#include "raster.h"
+#include "RegionalRead.h"
+
+namespace raster
+{
+
+class MetaCache;
+class ChunkCache;
+template <typename T> class Variable;
+
+// budgets of the caches a `File` owns, on top of the shared caches, so each open file adds its own
+// budgets to the memory used. A zero chunk cache budget leaves it off
+struct file_options_t
+{
+    size_t  m_meta_cache_bytes;
+    size_t  m_chunk_cache_bytes;
+    int     m_chunk_cache_policy;   // `RASTER_CACHE_LRU` or `RASTER_CACHE_FIFO`
+};
+
+// An open file, closed as `raster_close` does when the object goes away. While it is open the file
+// has a metadata cache and a chunk cache of its own, which reads of its variables go through,
+// including those made through the C API, and which are released with it. Errors are thrown as
+// `std::runtime_error`
+class File
+{
+public:
+    File(const std::string& path, int mode, const file_options_t& options);
+    ~File();
+    File(const File&) = delete;
+    File& operator=(const File&) = delete;
+
+    int ncid() const { return m_ncid; }
+    bool is_open() const { return m_ncid >= 0; }
+
+    // variable `name`, described once; `T` must be its type
+    template <typename T>
+    Variable<T> variable(const std::string& name) const;
+
+    void get_meta_cache_stats(raster_cache_stats_t& stats) const;
+    void get_chunk_cache_stats(raster_cache_stats_t& stats) const;
+
+    // waits for pending writes, closes the file and releases its caches
+    void close();
+
+private:
+    int                         m_ncid;
+    std::shared_ptr<MetaCache>  m_meta_cache;
+    std::shared_ptr<ChunkCache> m_chunk_cache;
+};
+
+// A variable of an open `File`. Its shape, slabs and type are read when it is obtained, region
+// metadata and chunk locations once per region through the caches of the file, so a read only
+// touches the chunks it needs. It is valid while its file is open; after steps are appended to
+// it, `refresh` reads its shape again
+template <typename T>
+class Variable
+{
+public:
+    int id() const { return m_desc.m_grp_id; }
+    int ndims() const { return m_desc.m_ndims; }
+    const std::vector<size_t>& shape() const { return m_desc.m_shape; }
+
+    // region `mask_id` into `data`, shaped like the variable
+    void get_region(int mask_id, T* data) const;
+    // region `mask_id` over steps [start, start + count) of the leading dimension, `data` holds those steps only
+    void get_region_steps(int mask_id, size_t start, size_t count, T* data) const;
+    // the box [start, start + count) into `data`, which holds the box only
+    void get_vara(const size_t* start, const size_t* count, T* data) const;
+    // queues a load of region `mask_id` into the caches of the file on the background thread, as
+    // `raster_prefetch_region` does, and returns at once; its status is dropped
+    void prefetch_region(int mask_id) const;
+
+    void refresh();
+
+private:
+    friend class File;
+    Variable(int ncid, int var_grp_id);
+
+    int         m_ncid;
+    var_desc_t  m_desc;
+};
+
+} // namespace raster
+#endif
@@ -1,11 +1,22 @@
 #include <iostream>
+#include <cmath>
 #include <algorithm>
 #include <numeric>
 #include <vector>
+#include <set>
+#include <atomic>
+#include <map>
+#include <unordered_map>
 
 #include "RegionalRead.h"
+#include "AccessLog.h"
+#include "AsyncWriter.h"
+#include "ChunkCache.h"
+#include "ChunkCodec.h"
 #include "IndexManager.h"
 #include "MetaCache.h"
+#include "MetadataHandler.h"
+#include "config.h"
 
 // dest: user buffer(var); src: chunk buffer
 template <typename T>
@@ -25,7 +36,7 @@ static void memread_chk3d(T* dest, const T* src, size_t* start, size_t* varshape
         throw std::runtime_error("Memread_chk3d - Error: index out of range");
     for (size_t layer = 0; layer < chkshape[0]; layer++)
     {
-        memread_chk2d<T>(dest + layer * varshape[1] * varshape[2], src + layer * chkshape[1] * chkshape[2],
+        memread_chk2d<T>(dest + (layer + start[0]) * varshape[1] * varshape[2], src + layer * chkshape[1] * chkshape[2],
                         start + 1, varshape + 1, chkshape + 1);
     }
 }
@@ -38,180 +49,1381 @@ static void memread_chk4d(T* dest, const T* src, size_t* start, size_t* varshape
 
     for (size_t layer = 0; layer < chkshape[0]; layer++)
     {
-        memread_chk3d<T>(dest + layer * varshape[1] * varshape[2] * varshape[3], src + layer * chkshape[1] * chkshape[2] * chkshape[3], 
+        memread_chk3d<T>(dest + (layer + start[0]) * varshape[1] * varshape[2] * varshape[3], src + layer * chkshape[1] * chkshape[2] * chkshape[3], 
                         start + 1, varshape + 1, chkshape + 1);
     }
 }
 
+// dest: user buffer(var); value: the single value of a uniform chunk
 template <typename T>
-int do_read_region(int maskid, uint64_t* region_meta, int meta_rows, int meta_cols, T* data, 
-                   size_t* data_shape, int var_grp_id, int var_type, std::vector<int>&& indices)
+static void memfill_chk2d(T* dest, T value, size_t* start, size_t* varshape, size_t* chkshape)
 {
-    int ndims = (meta_cols - 1) / 2, status = NC_NOERR, region_grp_id;
-    std::string region_name = "region_" + std::to_string(maskid);
-    size_t indices_size = 0;
-    assert(meta_rows >= 0);
+    if (start[0] + chkshape[0] > varshape[0] || start[1] + chkshape[1] > varshape[1])
+        throw std::runtime_error("Memfill_chk2d - Error: index out of range");
 
-    // corner case: this region is empty
-    if (meta_rows == 0)
-        return status;
+    for (size_t i = 0; i < chkshape[0]; i++)
+    {
+        T* row = dest + (i + start[0]) * varshape[1] + start[1];
+        #pragma omp simd
+        for (size_t j = 0; j < chkshape[1]; j++)
+            row[j] = value;
+    }
+}
 
-    status = nc_inq_grp_ncid(var_grp_id, region_name.c_str(), &region_grp_id);
-    if (indices.size() == 0)
-    {
-        indices.resize(meta_rows);
-        for (int i = 0; i < meta_rows; i++) indices[i] = i;
-    }
-    indices_size = indices.size();
-    std::vector<unsigned char*> chkdatas(indices_size);
-    size_t poolsize = std::accumulate(&region_meta[ndims + 1], &region_meta[2 * ndims], 1, [&](size_t a, size_t b){ return a * b; } );
-    unsigned char* pool = (unsigned char*)malloc(poolsize * data_shape[ndims - 1] * sizeof(T));
-    for (int id = 0; id < indices.size(); id++)
-    {
-        int i = indices[id];
-        size_t* start = &region_meta[i * meta_cols + 1];
-        size_t* count = &region_meta[i * meta_cols + 1 + ndims];
-        
-        int chunk_id;
-        char buffer[128];
-        status = sprintf(buffer, "chunk_%d", (int)region_meta[i * meta_cols]);
-        status = nc_inq_varid(region_grp_id, buffer, &chunk_id);
-        status = nc_get_var_ubyte(region_grp_id, chunk_id, pool);
-    // }
-    
-    // // copy memory from chunks to user data buffer
-    // #pragma omp parallel for
-    // for (int id = 0; id < indices_size; id++)
-    // {
-    //     int i = indices[id];
-    //     size_t* start = &region_meta[i * meta_cols + 1];
-    //     size_t* count = &region_meta[i * meta_cols + 1 + ndims];
-        switch (ndims)
-        {
-            case 2: memread_chk2d<T>(data, reinterpret_cast<T*>(pool), start, data_shape, count); break;
-            case 3: memread_chk3d<T>(data, reinterpret_cast<T*>(pool), start, data_shape, count); break;
-            case 4: memread_chk4d<T>(data, reinterpret_cast<T*>(pool), start, data_shape, count); break;
-            default: throw std::runtime_error("Unsupported dimension: " + std::to_string(ndims));
-        }
-        // delete[] pool;
-    }
-    delete[] pool;
-    return status;
+template <typename T>
+static void memfill_chk3d(T* dest, T value, size_t* start, size_t* varshape, size_t* chkshape)
+{
+    if (start[0] + chkshape[0] > varshape[0])
+        throw std::runtime_error("Memfill_chk3d - Error: index out of range");
+    for (size_t layer = 0; layer < chkshape[0]; layer++)
+        memfill_chk2d<T>(dest + (layer + start[0]) * varshape[1] * varshape[2], value, start + 1, varshape + 1, chkshape + 1);
 }
 
 template <typename T>
-int read_region(int var_grp_id, int mask_id, T* data, size_t* data_shape, int var_type, bool relation_required=true)
+static void memfill_chk4d(T* dest, T value, size_t* start, size_t* varshape, size_t* chkshape)
 {
-    int status = NC_NOERR;
-    int* relation_chunks = nullptr; 
-    uint64_t* region_meta = nullptr;
-    size_t meta_rows, meta_cols, nrelations = 0;
-    auto region_chunks = raster::meta_cache->get_region(var_grp_id, mask_id);
+    if (start[0] + chkshape[0] > varshape[0])
+        throw std::runtime_error("Memfill_chk4d - Error: index out of range");
+    for (size_t layer = 0; layer < chkshape[0]; layer++)
+        memfill_chk3d<T>(dest + (layer + start[0]) * varshape[1] * varshape[2] * varshape[3], value, start + 1, varshape + 1, chkshape + 1);
+}
 
-    // 1st pass: read region chunks
-    if (region_chunks != nullptr) // cache hit
+template <typename T>
+static void fill_chunk(T* dest, T value, int ndims, size_t* start, size_t* data_shape, size_t* count)
+{
+    switch (ndims)
     {
-        region_meta = region_chunks->m_data;
-        meta_rows = region_chunks->m_nrows;
-        meta_cols = region_chunks->m_ncols;
-        nrelations = region_chunks->m_nrelations;
-        relation_chunks = region_chunks->m_relation;
+        case 2: memfill_chk2d<T>(dest, value, start, data_shape, count); break;
+        case 3: memfill_chk3d<T>(dest, value, start, data_shape, count); break;
+        case 4: memfill_chk4d<T>(dest, value, start, data_shape, count); break;
+        default: throw std::runtime_error("Unsupported dimension: " + std::to_string(ndims));
     }
+}
+
+template <typename T>
+static void scatter_chunk(T* dest, const T* chunk, int ndims, size_t* start, size_t* data_shape, size_t* count)
+{
+    switch (ndims)
+    {
+        case 2: memread_chk2d<T>(dest, chunk, start, data_shape, count); break;
+        case 3: memread_chk3d<T>(dest, chunk, start, data_shape, count); break;
+        case 4: memread_chk4d<T>(dest, chunk, start, data_shape, count); break;
+        default: throw std::runtime_error("Unsupported dimension: " + std::to_string(ndims));
+    }
+}
+
+// Cell predicate of `raster_get_region_where_*`, comparing a cell to `m_value` by `m_op`
+// (RASTER_PRED_*). NaNs and the fill value of the variable never match
+struct value_filter_t
+{
+    int     m_op;
+    double  m_value;
+    double  m_fill;
+
+    bool match(double value) const
+    {
+        if (value != value || value == m_fill)
+            return false;
+        switch (m_op)
+        {
+            case RASTER_PRED_LT: return value < m_value;
+            case RASTER_PRED_LE: return value <= m_value;
+            case RASTER_PRED_GT: return value > m_value;
+            case RASTER_PRED_GE: return value >= m_value;
+            case RASTER_PRED_EQ: return value == m_value;
+            default: return false;
+        }
+    }
+
+    // whether a chunk whose values lie in [lo, hi] may hold a matching cell, see `chunk_stats_t`
+    bool may_match(const raster::chunk_stats_t& stats) const
+    {
+        if (stats.m_min != stats.m_min)
+            return false; // nothing but NaNs and fill values
+        switch (m_op)
+        {
+            case RASTER_PRED_LT: return stats.m_min < m_value;
+            case RASTER_PRED_LE: return stats.m_min <= m_value;
+            case RASTER_PRED_GT: return stats.m_max > m_value;
+            case RASTER_PRED_GE: return stats.m_max >= m_value;
+            case RASTER_PRED_EQ: return stats.m_min <= m_value && m_value <= stats.m_max;
+            default: return false;
+        }
+    }
+};
+
+// copies `n` cells from `src`, or fills them with `value` if it is null, keeping only matching cells with a `filter`
+template <typename T>
+static inline void copy_cells(T* dest, const T* src, T value, size_t n, const value_filter_t* filter)
+{
+    if (filter != nullptr)
+    {
+        for (size_t k = 0; k < n; k++)
+        {
+            T cell = (src != nullptr) ? src[k] : value;
+            if (filter->match((double)cell))
+                dest[k] = cell;
+        }
+    }
+    else if (src != nullptr)
+        memcpy(dest, src, sizeof(T) * n);
     else
+        std::fill(dest, dest + n, value);
+}
+
+// Copies the part of a chunk at [chunk_start, chunk_start + chunk_count) lying in the box
+// [box_start, box_start + box_count) into `dest`, which holds the box only. A null `chunk` fills
+// that part with `value`, as for uniform chunks. With a `filter`, only matching cells are copied
+template <typename T>
+static void copy_chunk_box(T* dest, const T* chunk, T value, int ndims, const size_t* chunk_start, const size_t* chunk_count,
+                           const size_t* box_start, const size_t* box_count, const value_filter_t* filter = nullptr)
+{
+    std::vector<size_t> lo(ndims), hi(ndims), pos(ndims);
+    for (int d = 0; d < ndims; d++)
     {
-        int meta_id, relation_dimid, meta_dimids[2];
-        char buffer[128];
-        sprintf(buffer, "_meta_region_%d_rows_", mask_id);
-        status = nc_inq_dimid(var_grp_id, buffer, &meta_dimids[0]);
-        sprintf(buffer, "_meta_region_%d_cols_", mask_id);
-        status = nc_inq_dimid(var_grp_id, buffer, &meta_dimids[1]);
-        if (status != NC_NOERR) // we need to handle invalid maskid here
+        lo[d] = std::max(chunk_start[d], box_start[d]);
+        hi[d] = std::min(chunk_start[d] + chunk_count[d], box_start[d] + box_count[d]);
+        if (lo[d] >= hi[d])
+            return;
+    }
+    pos = lo;
+    size_t run = hi[ndims - 1] - lo[ndims - 1];
+    while (true)
+    {
+        size_t src = 0, dst = 0;
+        for (int d = 0; d < ndims; d++)
+        {
+            src = src * chunk_count[d] + (pos[d] - chunk_start[d]);
+            dst = dst * box_count[d] + (pos[d] - box_start[d]);
+        }
+        copy_cells<T>(dest + dst, (chunk != nullptr) ? chunk + src : nullptr, value, run, filter);
+
+        // next run along the fastest dimension
+        int d = ndims - 2;
+        while (d >= 0 && ++pos[d] == hi[d])
+        {
+            pos[d] = lo[d];
+            d--;
+        }
+        if (d < 0)
+            break;
+    }
+}
+
+// places the cells of one part of a split mixed chunk, stored layer by layer along its runs, into
+// the whole chunk
+template <typename T>
+static void unpack_part(T* chunk, const T* cells, size_t plane, size_t nlayers, const raster::LayoutIndex& parts,
+                        const raster::cell_part_t& part)
+{
+    const uint32_t* runs = &parts.m_runs[part.m_run_offset];
+    for (size_t layer = 0; layer < nlayers; layer++)
+    {
+        for (int r = 0; r < part.m_nruns; r++)
+        {
+            memcpy(chunk + layer * plane + runs[2 * r], cells, runs[2 * r + 1] * sizeof(T));
+            cells += runs[2 * r + 1];
+        }
+    }
+}
+
+// Copies the cells of one part of a split mixed chunk at [chunk_start, chunk_start + chunk_count),
+// stored layer by layer along its runs (null `cells` fills them with `value`), into the box
+// [box_start, box_start + box_count) held by `dest`. Cells of other regions are left untouched
+template <typename T>
+static void scatter_part(T* dest, const T* cells, T value, int ndims, const size_t* chunk_start, const size_t* chunk_count,
+                         const raster::LayoutIndex& parts, const raster::cell_part_t& part, const size_t* box_start,
+                         const size_t* box_count, const value_filter_t* filter)
+{
+    const uint32_t* runs = &parts.m_runs[part.m_run_offset];
+    size_t w = chunk_count[ndims - 1], nlayers = 1, src = 0;
+    size_t by = box_start[ndims - 2], bx = box_start[ndims - 1], bh = box_count[ndims - 2], bw = box_count[ndims - 1];
+    std::vector<size_t> layer_pos(ndims - 2, 0);
+    for (int d = 0; d < ndims - 2; d++)
+        nlayers *= chunk_count[d];
+    for (size_t layer = 0; layer < nlayers; layer++)
+    {
+        bool inside = true;
+        size_t base = 0;
+        for (int d = 0; d < ndims - 2; d++)
+        {
+            size_t pos = chunk_start[d] + layer_pos[d];
+            inside = inside && pos >= box_start[d] && pos < box_start[d] + box_count[d];
+            base = base * box_count[d] + (pos - box_start[d]);
+        }
+        for (int r = 0; inside && r < part.m_nruns; r++)
+        {
+            size_t y = chunk_start[ndims - 2] + runs[2 * r] / w, x = chunk_start[ndims - 1] + runs[2 * r] % w;
+            size_t lo = std::max(x, bx), hi = std::min(x + runs[2 * r + 1], bx + bw);
+            if (y >= by && y < by + bh && lo < hi)
+                copy_cells<T>(dest + (base * bh + (y - by)) * bw + (lo - bx), (cells != nullptr) ? cells + src + (lo - x) : nullptr,
+                              value, hi - lo, filter);
+            src += runs[2 * r + 1];
+        }
+        if (!inside)
+            src += part.m_ncells;
+
+        // next layer
+        for (int d = ndims - 3; d >= 0 && ++layer_pos[d] == chunk_count[d]; d--)
+            layer_pos[d] = 0;
+    }
+}
+
+struct packed_extent_t
+{
+    size_t m_offset, m_length, m_pos;
+};
+
+// one chunk, or one part of a split chunk, of a read batch: its bytes read from the file, or its
+// decoded bytes found in the chunk cache
+struct piece_t
+{
+    const unsigned char*        m_blob;
+    size_t                      m_size;
+    raster::ChunkCache::value_t m_decoded;
+    raster::chunk_key_t         m_key;
+    bool                        m_load;     // read here, and put into the chunk cache once decoded
+};
+
+// Reads packed chunks from `_data_`. Chunks lying next to each other in the file (up to
+// `PACKED_COALESCE_GAP` bytes apart) are fetched with a single `nc_get_vara_ubyte` call.
+static int read_packed_extents(int region_grp_id, int data_id, std::vector<packed_extent_t>& extents,
+                               std::vector<std::vector<unsigned char> >& buffers, std::vector<piece_t>& pieces)
+{
+    int status = NC_NOERR;
+    std::sort(extents.begin(), extents.end(), [](auto& l, auto& r) { return l.m_offset < r.m_offset; });
+    size_t first = 0;
+    while (first < extents.size() && status == NC_NOERR)
+    {
+        size_t last = first + 1;
+        size_t run_start = extents[first].m_offset, run_end = run_start + extents[first].m_length;
+        while (last < extents.size() && extents[last].m_offset <= run_end + PACKED_COALESCE_GAP)
+        {
+            run_end = std::max(run_end, extents[last].m_offset + extents[last].m_length);
+            last++;
+        }
+        size_t count = run_end - run_start;
+        buffers.emplace_back(count);
+        status = nc_get_vara_ubyte(region_grp_id, data_id, &run_start, &count, buffers.back().data());
+        for (size_t e = first; e < last; e++)
+        {
+            pieces[extents[e].m_pos].m_blob = buffers.back().data() + extents[e].m_offset - run_start;
+            pieces[extents[e].m_pos].m_size = extents[e].m_length;
+        }
+        first = last;
+    }
+    return status;
+}
+
+// Looks up the pieces `parts` (-1 for a whole chunk) of one chunk in the chunk cache and appends
+// them to `pieces`, those to read with `m_load`. A piece another reader is loading is waited for,
+// unless this reader holds loads of its own (`holds_loads`), as both could then wait on each
+// other: nothing is appended and false is returned, the chunk is left to the next batch
+static bool acquire_pieces(raster::ChunkCache* chunk_cache, int region_grp_id, int chunk, const std::vector<int>& parts,
+                           bool holds_loads, std::vector<piece_t>& pieces)
+{
+    size_t first = pieces.size();
+    for (size_t k = 0; k < parts.size(); )
+    {
+        raster::chunk_key_t key{region_grp_id, chunk, parts[k]};
+        raster::ChunkCache::lookup_t found = chunk_cache->acquire(key);
+        if (found.m_value != nullptr || found.m_load)
+        {
+            pieces.push_back({nullptr, 0, found.m_value, key, found.m_load});
+            k++;
+            continue;
+        }
+        // give back the loads taken for this chunk before waiting, and start it over
+        for (size_t b = first; b < pieces.size(); b++)
+            if (pieces[b].m_load)
+                chunk_cache->cancel(pieces[b].m_key);
+        pieces.resize(first);
+        if (holds_loads)
+            return false;
+        found.m_pending.wait();
+        k = 0;
+    }
+    return true;
+}
+
+// the io lock let go of by a prefetch until the end of the scope, see `yield_io_begin`
+struct io_yield_t
+{
+    io_yield_t() { yield_io_begin(); }
+    ~io_yield_t() { yield_io_end(); }
+};
+
+// One region of a pass of `do_read_regions`: the chunks `m_indices` (all if empty) of its
+// `m_nrows` metadata rows. Mixed chunks split by region are located through `m_parts`, the index
+// of the layout; with `m_part_regions`, only the cells of these regions are read
+struct region_rows_t
+{
+    int                         m_maskid;
+    uint64_t*                   m_meta;
+    int                         m_nrows;
+    std::vector<int>            m_indices;
+    const raster::LayoutIndex*  m_parts;
+    const std::set<int>*        m_part_regions;
+};
+
+// Reads the chunks of `regions` into `data`, shaped `data_shape`, in one pass: batches take chunks
+// of any of the regions. With `box_start` / `box_count`, `data` holds that box only and receives
+// the parts of chunks inside it. With a `filter`, chunks whose `_chunk_stats_` range cannot match
+// are not read, and only matching cells of the others are copied. A null `data` only loads the
+// chunks into the chunk cache, and reads nothing if it is off
+template <typename T>
+int do_read_regions(std::vector<region_rows_t>& regions, int meta_cols, T* data, size_t* data_shape, int var_grp_id,
+                    const size_t* box_start = nullptr, const size_t* box_count = nullptr,
+                    const value_filter_t* filter = nullptr)
+{
+    int ndims = (meta_cols - 1) / 2, status = NC_NOERR;
+    std::shared_ptr<raster::ChunkCache> chunk_cache = raster::chunk_cache_of(var_grp_id);
+    bool cached = chunk_cache->enabled();
+
+    // a region and how its chunks are stored, read once per region group
+    struct source_t
+    {
+        const region_rows_t*                            m_region;
+        std::shared_ptr<const raster::region_group_t>   m_group;
+        const std::set<int>*                            m_part_regions; // null unless its chunks are split
+
+        bool selected(size_t p) const
+        {
+            return m_part_regions == nullptr || m_part_regions->count(m_region->m_parts->m_parts[p].m_region) > 0;
+        }
+    };
+    std::vector<source_t> sources;
+    std::vector<std::pair<size_t, int> > entries;   // (source, metadata row) of the chunks to read
+    bool by_cell = filter != nullptr;               // cells are copied run by run rather than chunk by chunk
+    for (region_rows_t& region : regions)
+    {
+        assert(region.m_nrows >= 0);
+        // corner case: this region is empty
+        if (region.m_nrows == 0)
+            continue;
+        source_t source{&region, nullptr, nullptr};
+        status = raster::load_region_group(var_grp_id, region.m_maskid, source.m_group);
+        if (status != NC_NOERR)
+            return status;
+        if (data == nullptr && !cached)
+            continue;
+        std::vector<int>& indices = region.m_indices;
+        if (indices.size() == 0)
+        {
+            indices.resize(region.m_nrows);
+            for (int i = 0; i < region.m_nrows; i++) indices[i] = i;
+        }
+        if (source.m_group->m_split)
+        {
+            if (region.m_parts == nullptr || region.m_parts->m_part_offsets.size() != (size_t)region.m_nrows + 1)
+                return NC_EINVAL; // the cells of the parts are unknown
+            source.m_part_regions = region.m_part_regions;
+        }
+        if (filter != nullptr)
+        {
+            std::vector<raster::chunk_stats_t> stats;
+            status = raster::load_chunk_stats(source.m_group->m_grp_id, stats);
+            if (status != NC_NOERR)
+                return status;
+            if (stats.size() == (size_t)region.m_nrows)
+            {
+                indices.erase(std::remove_if(indices.begin(), indices.end(), [&](int i) {
+                    return stats[i].m_chunk_id == (double)region.m_meta[i * meta_cols] && !filter->may_match(stats[i]);
+                }), indices.end());
+            }
+        }
+        by_cell = by_cell || source.m_part_regions != nullptr;
+        for (int i : indices)
+            entries.emplace_back(sources.size(), i);
+        sources.push_back(source);
+    }
+    // filtered cells, and the cells of a part, are copied run by run, the whole variable is the box
+    std::vector<size_t> origin;
+    if (by_cell && box_start == nullptr)
+    {
+        origin.assign(ndims, 0);
+        box_start = origin.data();
+        box_count = data_shape;
+    }
+    size_t nentries = entries.size();
+
+    // uniform chunks have no variable, their values are kept in the region attributes
+    auto uniform_value = [&](const raster::region_group_t& group, int chunk, T& value) -> bool
+    {
+        auto uniform = group.m_uniform.find(chunk);
+        if (uniform == group.m_uniform.end() || (uniform->second + 1) * sizeof(T) > group.m_uniform_values.size())
+            return false;
+        memcpy(&value, &group.m_uniform_values[uniform->second * sizeof(T)], sizeof(T));
+        return true;
+    };
+
+    std::vector<std::vector<unsigned char> > buffers;   // bytes read from the file
+    std::vector<piece_t> pieces;                        // chunks, or parts of split chunks
+    std::vector<size_t> first_piece;                    // pieces of batch entry k: [first_piece[k], first_piece[k + 1])
+    std::atomic<bool> failed(false);
+    std::string error_msg;
+    size_t batch_start = 0;
+
+    // loads still held when the read fails are given back, for their waiters to load them
+    struct load_guard_t
+    {
+        raster::ChunkCache* m_cache;
+        std::vector<piece_t>& m_pieces;
+        ~load_guard_t()
+        {
+            for (auto& piece : m_pieces)
+                if (piece.m_load)
+                    m_cache->cancel(piece.m_key);
+        }
+    } load_guard{chunk_cache.get(), pieces};
+
+    // Chunks are read in batches of about `READ_BATCH_BYTES`. netCDF calls stay on this thread,
+    // while decoding and copying chunks into the user buffer runs on all threads. With the chunk
+    // cache on, only the pieces it misses are read, and decoded ones are put into it
+    while (batch_start < nentries && status == NC_NOERR)
+    {
+        size_t batch_end = batch_start, batch_bytes = 0;
+        bool holds_loads = false;
+        std::map<size_t, std::vector<packed_extent_t> > extents;   // by source
+        buffers.clear();
+        pieces.clear();
+        first_piece.assign(1, 0);
+        while (batch_end < nentries && batch_bytes < READ_BATCH_BYTES)
+        {
+            const source_t& source = sources[entries[batch_end].first];
+            const region_rows_t& region = *source.m_region;
+            const raster::region_group_t& group = *source.m_group;
+            int region_grp_id = group.m_grp_id, data_id = group.m_data_id;
+            int row = entries[batch_end].second;
+            int chunk = (int)region.m_meta[row * meta_cols];
+            int chunk_id, chunk_dimid;
+            size_t blob_size, first = pieces.size();
+            char buffer[128];
+            T value;
+            if (uniform_value(group, chunk, value))
+            {
+                batch_end++;
+                first_piece.push_back(pieces.size());
+                continue; // no I/O for uniform chunks
+            }
+
+            // parts to read and their (offset, length) in the chunk blob, or the whole blob. Split
+            // mixed chunks keep the blobs of their parts back to back, located by the `_part_table_`
+            // rows (chunk id, region id, offset, length), in the order of the parts in the layout index
+            std::vector<int> wanted;
+            std::vector<std::pair<size_t, size_t> > ranges;
+            bool whole = true;
+            std::unordered_map<int, std::pair<size_t, size_t> >::const_iterator packed;
+            if (group.m_split)
+            {
+                auto loc = group.m_part_rows.find(chunk);
+                if (loc == group.m_part_rows.end())
+                    return NC_ENOTVAR;
+                for (size_t p = region.m_parts->m_part_offsets[row], r = loc->second; p < region.m_parts->m_part_offsets[row + 1]; p++, r++)
+                {
+                    if (source.selected(p))
+                    {
+                        wanted.push_back((int)p);
+                        ranges.emplace_back(group.m_part_table[r * 4 + 2], group.m_part_table[r * 4 + 3]);
+                    }
+                    else
+                        whole = false;
+                }
+            }
+            else
+                wanted.push_back(-1);
+            // packed regions keep all their chunks in `_data_`, located by the `_chunk_table_` rows
+            if (data_id >= 0)
+            {
+                packed = group.m_chunk_table.find(chunk);
+                if (packed == group.m_chunk_table.end())
+                    return NC_ENOTVAR;
+                if (!group.m_split)
+                    ranges.emplace_back(0, packed->second.second);
+            }
+
+            if (cached)
+            {
+                if (!acquire_pieces(chunk_cache.get(), region_grp_id, chunk, wanted, holds_loads, pieces))
+                    break;
+                holds_loads = holds_loads || std::any_of(pieces.begin() + first, pieces.end(), [](const piece_t& piece) { return piece.m_load; });
+            }
+            else
+                for (int part : wanted)
+                    pieces.push_back({nullptr, 0, nullptr, raster::chunk_key_t{region_grp_id, chunk, part}, false});
+            batch_end++;
+            size_t nread = std::count_if(pieces.begin() + first, pieces.end(), [](const piece_t& piece) { return piece.m_decoded == nullptr; });
+            if (nread == 0)
+            {
+                first_piece.push_back(pieces.size());
+                continue; // all pieces cached
+            }
+
+            if (data_id >= 0)
+            {
+                for (size_t b = first; b < pieces.size(); b++)
+                {
+                    if (pieces[b].m_decoded != nullptr)
+                        continue;
+                    auto& range = ranges[b - first];
+                    extents[entries[batch_end - 1].first].push_back({packed->second.first + range.first, range.second, b});
+                    batch_bytes += range.second;
+                }
+                first_piece.push_back(pieces.size());
+                continue;
+            }
+            auto chunk_var = group.m_chunk_vars.find(chunk);
+            if (chunk_var != group.m_chunk_vars.end())
+            {
+                chunk_id = chunk_var->second.first;
+                blob_size = chunk_var->second.second;
+            }
+            else
+            {
+                // not there when the region group was loaded
+                sprintf(buffer, "chunk_%d", chunk);
+                status = nc_inq_varid(region_grp_id, buffer, &chunk_id);
+                if (status == NC_NOERR)
+                    status = nc_inq_vardimid(region_grp_id, chunk_id, &chunk_dimid);
+                if (status == NC_NOERR)
+                    status = nc_inq_dimlen(region_grp_id, chunk_dimid, &blob_size);
+                if (status != NC_NOERR)
+                    return status;
+            }
+            if (!group.m_split)
+                ranges.emplace_back(0, blob_size);
+            if (whole && nread == pieces.size() - first)
+            {
+                buffers.emplace_back(blob_size);
+                status = nc_get_var_ubyte(region_grp_id, chunk_id, buffers.back().data());
+                for (size_t b = first; b < pieces.size(); b++)
+                {
+                    pieces[b].m_blob = buffers.back().data() + ranges[b - first].first;
+                    pieces[b].m_size = ranges[b - first].second;
+                }
+                batch_bytes += blob_size;
+            }
+            else
+            {
+                // only the parts of the regions read, and not cached
+                for (size_t b = first; b < pieces.size(); b++)
+                {
+                    if (pieces[b].m_decoded != nullptr)
+                        continue;
+                    auto& range = ranges[b - first];
+                    buffers.emplace_back(range.second);
+                    status = nc_get_vara_ubyte(region_grp_id, chunk_id, &range.first, &range.second, buffers.back().data());
+                    pieces[b].m_blob = buffers.back().data();
+                    pieces[b].m_size = range.second;
+                    batch_bytes += range.second;
+                }
+            }
+            first_piece.push_back(pieces.size());
+        }
+        for (auto& kv : extents)
+        {
+            if (status == NC_NOERR)
+                status = read_packed_extents(sources[kv.first].m_group->m_grp_id, sources[kv.first].m_group->m_data_id,
+                                             kv.second, buffers, pieces);
+        }
+        if (status != NC_NOERR)
             return status;
 
-        status = nc_inq_dimlen(var_grp_id, meta_dimids[0], &meta_rows);
-        status = nc_inq_dimlen(var_grp_id, meta_dimids[1], &meta_cols);
-        region_meta = new uint64_t[meta_rows * meta_cols];
-        sprintf(buffer, "_meta_region_%d_chunks_", mask_id);
-        status = nc_inq_varid(var_grp_id, buffer, &meta_id);
-        status = nc_get_var_ulonglong(var_grp_id, meta_id, (unsigned long long*)region_meta);
+        // decoded cells of piece `b`, `nbytes` long, decoded into `scratch` unless they go to the cache.
+        // Split chunks and encoded chunks go through the codec (`decode`), others are copied as read
+        auto decoded_piece = [&](size_t b, size_t nbytes, bool decode, std::vector<T>& scratch) -> const T*
+        {
+            piece_t& piece = pieces[b];
+            if (piece.m_decoded != nullptr)
+                return reinterpret_cast<const T*>(piece.m_decoded->data());
+            if (!piece.m_load)
+            {
+                if (!decode)
+                    return reinterpret_cast<const T*>(piece.m_blob);
+                scratch.resize(nbytes / sizeof(T));
+                raster::decode_chunk(piece.m_blob, piece.m_size, reinterpret_cast<unsigned char*>(scratch.data()), nbytes);
+                return scratch.data();
+            }
+            auto value = std::make_shared<std::vector<unsigned char> >(nbytes);
+            if (decode)
+                raster::decode_chunk(piece.m_blob, piece.m_size, value->data(), nbytes);
+            else
+                memcpy(value->data(), piece.m_blob, std::min(nbytes, piece.m_size));
+            chunk_cache->put(piece.m_key, value);
+            piece.m_decoded = value;
+            piece.m_load = false;
+            return reinterpret_cast<const T*>(value->data());
+        };
 
-        if (mask_id != raster::REGION_MIXED_ID)
+        // a prefetch lets go of the io lock while it decodes, for synchronous reads to call netCDF
+        io_yield_t yield;
+        #pragma omp parallel for schedule(dynamic)
+        for (size_t id = batch_start; id < batch_end; id++)
         {
-            sprintf(buffer, "_meta_region_%d_relations_", mask_id);
-            status = nc_inq_dimid(var_grp_id, buffer, &relation_dimid);
-            status = nc_inq_dimlen(var_grp_id, relation_dimid, &nrelations);
-            relation_chunks = new int[nrelations];
-            status = nc_inq_varid(var_grp_id, buffer, &meta_id);
-            status = nc_get_var_int(var_grp_id, meta_id, relation_chunks);            
-        } 
+            static thread_local std::vector<T> pool, cells;
+            const source_t& source = sources[entries[id].first];
+            const raster::region_group_t& group = *source.m_group;
+            const raster::LayoutIndex* parts = source.m_region->m_parts;
+            const std::set<int>* part_regions = source.m_part_regions;
+            int i = entries[id].second;
+            uint64_t* region_meta = source.m_region->m_meta;
+            size_t* start = &region_meta[i * meta_cols + 1];
+            size_t* count = &region_meta[i * meta_cols + 1 + ndims];
+            size_t first = first_piece[id - batch_start];
+            bool decode = group.m_split || group.m_encoded;
+            try
+            {
+                size_t chunksize = std::accumulate(&count[0], &count[ndims], 1, [&](size_t a, size_t b){ return a * b; } );
+                size_t plane = count[ndims - 2] * count[ndims - 1];
+                T uniform;
+                if (uniform_value(group, (int)region_meta[i * meta_cols], uniform))
+                {
+                    if (data == nullptr)
+                        continue;
+                    if (part_regions != nullptr)
+                    {
+                        for (size_t p = parts->m_part_offsets[i]; p < parts->m_part_offsets[i + 1]; p++)
+                            if (source.selected(p))
+                                scatter_part<T>(data, nullptr, uniform, ndims, start, count, *parts, parts->m_parts[p],
+                                                box_start, box_count, filter);
+                    }
+                    else if (box_start != nullptr)
+                        copy_chunk_box<T>(data, nullptr, uniform, ndims, start, count, box_start, box_count, filter);
+                    else
+                        fill_chunk<T>(data, uniform, ndims, start, data_shape, count);
+                    continue;
+                }
 
-        raster::meta_cache->add_region(var_grp_id, mask_id, meta_rows, meta_cols, nrelations, relation_chunks, region_meta);  
+                const T* chunk = nullptr;
+                if (group.m_split)
+                {
+                    // decode the parts read, then copy their cells, or rebuild the whole chunk
+                    size_t b = first;
+                    pool.resize(chunksize);
+                    for (size_t p = parts->m_part_offsets[i]; p < parts->m_part_offsets[i + 1]; p++)
+                    {
+                        if (!source.selected(p))
+                            continue;
+                        const raster::cell_part_t& part = parts->m_parts[p];
+                        const T* part_cells = decoded_piece(b, part.m_ncells * (chunksize / plane) * sizeof(T), decode, cells);
+                        b++;
+                        if (data == nullptr)
+                            continue;
+                        if (part_regions != nullptr)
+                            scatter_part<T>(data, part_cells, T(), ndims, start, count, *parts, part, box_start, box_count, filter);
+                        else
+                            unpack_part<T>(pool.data(), part_cells, plane, chunksize / plane, *parts, part);
+                    }
+                    if (part_regions != nullptr || data == nullptr)
+                        continue;
+                    chunk = pool.data();
+                }
+                else
+                    chunk = decoded_piece(first, chunksize * sizeof(T), decode, pool);
+                if (data == nullptr)
+                    continue;
+                if (box_start != nullptr)
+                    copy_chunk_box<T>(data, chunk, T(), ndims, start, count, box_start, box_count, filter);
+                else
+                    scatter_chunk<T>(data, chunk, ndims, start, data_shape, count);
+            }
+            catch (std::exception& e)
+            {
+                #pragma omp critical (raster_read_error)
+                error_msg = e.what();
+                failed.store(true);
+            }
+        }
+        if (failed.load())
+        {
+            // given back before the io lock is taken again, a reader holding it may wait for them
+            for (auto& piece : pieces)
+                if (piece.m_load)
+                {
+                    chunk_cache->cancel(piece.m_key);
+                    piece.m_load = false;
+                }
+            throw std::runtime_error(error_msg);
+        }
+        batch_start = batch_end;
     }
-    status = do_read_region<T>(mask_id, region_meta, meta_rows, meta_cols, data, data_shape, var_grp_id, var_type, std::vector<int>(0));
+    return status;
+}
+
+// Reads the chunks `indices` (all if empty) of a region into `data`, see `do_read_regions`
+template <typename T>
+int do_read_region(int maskid, uint64_t* region_meta, int meta_rows, int meta_cols, T* data, 
+                   size_t* data_shape, int var_grp_id, int var_type, std::vector<int>&& indices,
+                   const size_t* box_start = nullptr, const size_t* box_count = nullptr,
+                   const value_filter_t* filter = nullptr, const raster::LayoutIndex* parts = nullptr,
+                   const std::set<int>* part_regions = nullptr)
+{
+    std::vector<region_rows_t> regions = {{maskid, region_meta, meta_rows, std::move(indices), parts, part_regions}};
+    return do_read_regions<T>(regions, meta_cols, data, data_shape, var_grp_id, box_start, box_count, filter);
+}
 
-    // 2nd pass: read related chunks from relation table
-    if (relation_required)
+using raster::slab_t;
+
+static std::vector<slab_t> get_var_slabs(int var_grp_id)
+{
+    int nslabs = 0, status;
+    std::vector<slab_t> slabs;
+    if (nc_get_att_int(var_grp_id, NC_GLOBAL, "_nslabs_", &nslabs) != NC_NOERR)
+        return {{var_grp_id, 0, 0}};
+    for (int i = 0; i < nslabs; i++)
     {
-        auto mixed_table = raster::meta_cache->get_mixed_table(var_grp_id);
-        size_t mixed_rows, mixed_cols;
-        uint64_t* mixed_data;
-        if (mixed_table != nullptr) // cache hit
+        char name_buffer[64];
+        unsigned long long range[2];
+        slab_t slab;
+        sprintf(name_buffer, "slab_%d", i);
+        status = nc_inq_grp_ncid(var_grp_id, name_buffer, &slab.m_grp_id);
+        status = nc_get_att_ulonglong(slab.m_grp_id, NC_GLOBAL, "_slab_range_", range);
+        if (status != NC_NOERR)
+            throw std::runtime_error("Invalid slab " + std::to_string(i) + ": " + nc_strerror(status));
+        slab.m_start = range[0];
+        slab.m_count = range[1];
+        slabs.push_back(slab);
+    }
+    return slabs;
+}
+
+int raster::describe_var(int var_grp_id, int var_type, const size_t* data_shape, var_desc_t& var)
+{
+    int status = nc_get_att_int(var_grp_id, NC_GLOBAL, "_ndims_", &var.m_ndims);
+    if (status != NC_NOERR)
+        return status;
+    var.m_grp_id = var_grp_id;
+    var.m_xtype = var_type;
+    var.m_shape.assign(data_shape, data_shape + var.m_ndims);
+    var.m_slabs = get_var_slabs(var_grp_id);
+    for (auto& slab : var.m_slabs)
+        if (slab.m_grp_id == var_grp_id)
+            slab.m_count = (var.m_ndims > 2) ? data_shape[0] : 1; // regions kept in the variable group cover all steps
+    return status;
+}
+
+// The chunks of `region_ids` in one slab, and the mixed chunks related to them, as the regions of
+// one `do_read_regions` pass. `metas`, `slab_metas` and `part_regions` hold what `reads` points to
+struct region_reads_t
+{
+    std::vector<raster::region_meta_t>      m_metas;
+    std::vector<std::vector<size_t> >       m_slab_metas;
+    std::set<int>                           m_part_regions;
+    std::vector<region_rows_t>              m_reads;
+};
+
+static int collect_region_rows(int var_grp_id, const slab_t& slab, const std::vector<int>& region_ids, size_t* slab_shape,
+                               bool relation_required, region_reads_t& out)
+{
+    int status = NC_NOERR, slab_grp_id = (slab.m_grp_id == var_grp_id) ? -1 : slab.m_grp_id;
+    std::set<int> related_chunks, related_rows;
+    bool indexed = true; // rows in the mixed region come precomputed with an `_index_`
+    std::vector<raster::region_meta_t>& metas = out.m_metas;
+    metas.assign(region_ids.size() + 1, raster::region_meta_t());
+    out.m_slab_metas.assign(region_ids.size() + 1, {});
+    out.m_part_regions = std::set<int>(region_ids.begin(), region_ids.end());
+    out.m_reads.clear();
+
+    // the chunks of all regions, rebased to the slab if it has its own layout
+    auto slab_rows = [&](size_t k) -> uint64_t* {
+        if (slab_grp_id < 0)
+            return metas[k].m_data;
+        out.m_slab_metas[k] = raster::rebase_region_meta(metas[k].m_data, metas[k].m_nrows, metas[k].m_ncols, 0, slab.m_count);
+        return out.m_slab_metas[k].data();
+    };
+    for (size_t k = 0; k < region_ids.size(); k++)
+    {
+        raster::region_meta_t& region = metas[k];
+        status = raster::load_region_meta(var_grp_id, region_ids[k], slab_shape, region, slab_grp_id);
+        if (status != NC_NOERR) // we need to handle invalid maskid here
+            return status;
+        out.m_reads.push_back({region_ids[k], slab_rows(k), region.m_nrows, {}, region.m_index.get(), nullptr});
+        related_chunks.insert(region.m_relation, region.m_relation + region.m_nrelations);
+        if (region.m_relation_rows != nullptr)
+            related_rows.insert(region.m_relation_rows, region.m_relation_rows + region.m_nrelations);
+        else
+            indexed = false;
+    }
+
+    // related chunks from the relation table, in the same pass
+    if (relation_required && !related_chunks.empty())
+    {
+        raster::region_meta_t& mixed = metas.back();
+        status = raster::load_region_meta(var_grp_id, raster::REGION_MIXED_ID, slab_shape, mixed, slab_grp_id);
+        if (status != NC_NOERR)
+            return status;
+        std::vector<int> relation_indices(related_rows.begin(), related_rows.end());
+        if (!indexed)
+        {
+            relation_indices.clear();
+            for (int i = 0; i < mixed.m_nrows; i++)
+                if (related_chunks.count((int)mixed.m_data[i * mixed.m_ncols]))
+                    relation_indices.push_back(i);
+        }
+        // of split mixed chunks, only the cells of the regions read
+        if (!relation_indices.empty())
+            out.m_reads.push_back({raster::REGION_MIXED_ID, slab_rows(metas.size() - 1), mixed.m_nrows,
+                                   std::move(relation_indices), mixed.m_index.get(), &out.m_part_regions});
+    }
+    return status;
+}
+
+// Reads the cells of `cell_ids` out of the chunks of `region_ids`, their ancestors in a layout built
+// at a parent level. The `_mask_` of the layout is read over the footprint of these chunks only, to
+// find the box of the cells; the chunks crossing that box are read into a staging buffer of the box,
+// and only the cells of `cell_ids` are copied out of it
+template <typename T>
+static int read_region_cells(int var_grp_id, const slab_t& slab, const std::vector<int>& region_ids,
+                             const std::vector<int>& cell_ids, T* data, size_t* slab_shape, bool relation_required,
+                             const value_filter_t* filter)
+{
+    int status, slab_grp_id = (slab.m_grp_id == var_grp_id) ? -1 : slab.m_grp_id;
+    // an ancestor is read with its descendants in the layout, as any region
+    std::set<int> expanded;
+    for (int region_id : region_ids)
+    {
+        std::vector<int> ids;
+        status = raster::resolve_region(var_grp_id, region_id, ids, slab_grp_id);
+        if (status != NC_NOERR)
+            return status;
+        expanded.insert(ids.begin(), ids.end());
+    }
+    region_reads_t ancestors;
+    status = collect_region_rows(var_grp_id, slab, std::vector<int>(expanded.begin(), expanded.end()), slab_shape,
+                                 relation_required, ancestors);
+    if (status != NC_NOERR)
+        return status;
+    std::vector<region_rows_t>& reads = ancestors.m_reads;
+    if (reads.empty())
+        return NC_NOERR;
+    int meta_cols = ancestors.m_metas[0].m_ncols, ndims = (meta_cols - 1) / 2;
+    auto footprint = [&](const region_rows_t& region, int i, size_t* lo, size_t* hi) {
+        const uint64_t* row = &region.m_meta[(size_t)i * meta_cols];
+        for (int d = 0; d < 2; d++)
         {
-            mixed_rows = mixed_table->m_nrows;
-            mixed_cols = mixed_table->m_ncols;
-            mixed_data = mixed_table->m_data;
+            lo[d] = row[1 + ndims - 2 + d];
+            hi[d] = lo[d] + row[1 + 2 * ndims - 2 + d];
         }
+    };
+    auto for_rows = [&](region_rows_t& region, auto&& f) {
+        if (region.m_indices.empty())
+            for (int i = 0; i < region.m_nrows; i++)
+                f(i);
         else
+            for (int i : region.m_indices)
+                f(i);
+    };
+
+    // the mask under the chunks of the ancestors, then the box of the cells
+    size_t area_lo[2] = {SIZE_MAX, SIZE_MAX}, area_hi[2] = {0, 0}, rows, cols;
+    for (region_rows_t& region : reads)
+        for_rows(region, [&](int i) {
+            size_t lo[2], hi[2];
+            footprint(region, i, lo, hi);
+            for (int d = 0; d < 2; d++)
+            {
+                area_lo[d] = std::min(area_lo[d], lo[d]);
+                area_hi[d] = std::max(area_hi[d], hi[d]);
+            }
+        });
+    if (area_lo[0] >= area_hi[0] || area_lo[1] >= area_hi[1])
+        return NC_NOERR;
+    size_t area_count[2] = {area_hi[0] - area_lo[0], area_hi[1] - area_lo[1]};
+    std::vector<int> mask;
+    status = raster::load_layout_mask(var_grp_id, mask, &rows, &cols, slab_grp_id, area_lo, area_count);
+    if (status != NC_NOERR)
+        return status;
+    if (slab_shape[ndims - 2] != rows || slab_shape[ndims - 1] != cols)
+        return NC_EINVAL;
+    std::set<int> ids(cell_ids.begin(), cell_ids.end());
+    std::vector<size_t> box_start(ndims, 0), box_count(slab_shape, slab_shape + ndims);
+    size_t cell_lo[2] = {SIZE_MAX, SIZE_MAX}, cell_hi[2] = {0, 0};
+    for (size_t y = 0; y < area_count[0]; y++)
+        for (size_t x = 0; x < area_count[1]; x++)
+            if (ids.count(mask[y * area_count[1] + x]))
+            {
+                cell_lo[0] = std::min(cell_lo[0], y);
+                cell_hi[0] = std::max(cell_hi[0], y + 1);
+                cell_lo[1] = std::min(cell_lo[1], x);
+                cell_hi[1] = std::max(cell_hi[1], x + 1);
+            }
+    if (cell_lo[0] >= cell_hi[0])
+        return NC_NOERR; // no cell of the region in this layout
+    for (int d = 0; d < 2; d++)
+    {
+        box_start[ndims - 2 + d] = area_lo[d] + cell_lo[d];
+        box_count[ndims - 2 + d] = cell_hi[d] - cell_lo[d];
+    }
+
+    // chunks crossing the box, read into it; cells a `filter` rejects keep the values of `data`
+    for (region_rows_t& region : reads)
+    {
+        std::vector<int> inside;
+        for_rows(region, [&](int i) {
+            size_t lo[2], hi[2];
+            footprint(region, i, lo, hi);
+            if (lo[0] < box_start[ndims - 2] + box_count[ndims - 2] && hi[0] > box_start[ndims - 2] &&
+                lo[1] < box_start[ndims - 1] + box_count[ndims - 1] && hi[1] > box_start[ndims - 1])
+                inside.push_back(i);
+        });
+        region.m_nrows = inside.empty() ? 0 : region.m_nrows;
+        region.m_indices = std::move(inside);
+    }
+    size_t bh = box_count[ndims - 2], bw = box_count[ndims - 1], nlayers = 1;
+    for (int d = 0; d < ndims - 2; d++)
+        nlayers *= slab_shape[d];
+    std::vector<T> staging(nlayers * bh * bw);
+    #pragma omp parallel for
+    for (size_t layer = 0; layer < nlayers; layer++)
+        for (size_t y = 0; y < bh; y++)
+            memcpy(&staging[(layer * bh + y) * bw], &data[(layer * rows + box_start[ndims - 2] + y) * cols + box_start[ndims - 1]],
+                   bw * sizeof(T));
+    status = do_read_regions<T>(reads, meta_cols, staging.data(), slab_shape, slab.m_grp_id, box_start.data(), box_count.data(),
+                                filter);
+    if (status != NC_NOERR)
+        return status;
+
+    // the cells of the region in the box
+    std::vector<size_t> cells;
+    for (size_t y = 0; y < bh; y++)
+        for (size_t x = 0; x < bw; x++)
         {
-            char buffer[128];
-            int mixed_varid, mixed_dimids[2];
-            sprintf(buffer, "_meta_region_%d_rows_", raster::REGION_MIXED_ID);
-            status = nc_inq_dimid(var_grp_id, buffer, &mixed_dimids[0]);
-            sprintf(buffer, "_meta_region_%d_cols_", raster::REGION_MIXED_ID);
-            status = nc_inq_dimid(var_grp_id, buffer, &mixed_dimids[1]);
-            if (status != NC_NOERR) // we need to handle invalid maskid here
-                return status;
+            size_t ay = box_start[ndims - 2] - area_lo[0] + y, ax = box_start[ndims - 1] - area_lo[1] + x;
+            if (ids.count(mask[ay * area_count[1] + ax]))
+                cells.push_back(y * bw + x);
+        }
+    #pragma omp parallel for
+    for (size_t layer = 0; layer < nlayers; layer++)
+        for (size_t k : cells)
+            data[(layer * rows + box_start[ndims - 2] + k / bw) * cols + box_start[ndims - 1] + k % bw] = staging[layer * bh * bw + k];
+    return NC_NOERR;
+}
+
+// Reads region `mask_id` of one slab into `data`, which holds the steps of that slab only. A parent
+// region of a hierarchy reads the chunks of all its descendants and the mixed chunks they share in
+// one pass, the shared ones only once, and of those split by region, only the cells of the regions
+// read. A child region of a layout built at a parent level is read through the chunks of its
+// ancestor, keeping its own cells only. A slab of a time-varying mask is partitioned by the layout
+// of its epoch, which may lack the region
+template <typename T>
+static int read_region_slab(int var_grp_id, const slab_t& slab, int mask_id, T* data, size_t* slab_shape,
+                            int var_type, bool relation_required, const value_filter_t* filter)
+{
+    int status = NC_NOERR, slab_grp_id = (slab.m_grp_id == var_grp_id) ? -1 : slab.m_grp_id;
+    std::vector<int> region_ids, cell_ids;
+    status = raster::resolve_region(var_grp_id, mask_id, region_ids, slab_grp_id, &cell_ids);
+    if (status != NC_NOERR)
+        return status;
+    if (!cell_ids.empty() && data != nullptr)
+        return read_region_cells<T>(var_grp_id, slab, region_ids, cell_ids, data, slab_shape, relation_required, filter);
+
+    region_reads_t regions;
+    status = collect_region_rows(var_grp_id, slab, region_ids, slab_shape, relation_required, regions);
+    if (status != NC_NOERR)
+        return status;
+    return do_read_regions<T>(regions.m_reads, regions.m_metas[0].m_ncols, data, slab_shape, slab.m_grp_id, nullptr, nullptr,
+                              filter);
+}
+
+// Reads region `mask_id` over steps [step_start, step_start + step_count) of the leading dimension
+// into `data`, which holds those steps only; `var.m_shape` is the shape of the whole variable and
+// a zero `step_count` reads all steps. Only slabs overlapping the steps are read, and a slab
+// partially inside them is read through a staging buffer. With a `filter`, cells that do not match
+// keep the values `data` holds
+template <typename T>
+int read_region(const raster::var_desc_t& var, int mask_id, T* data, bool relation_required=true, size_t step_start=0,
+                size_t step_count=0, const value_filter_t* filter=nullptr)
+{
+    int status = NC_NOERR, ndims = var.m_ndims, var_grp_id = var.m_grp_id;
+    const size_t* data_shape = var.m_shape.data();
+    size_t nsteps = (ndims > 2) ? data_shape[0] : 1;
+    size_t step_end = (step_count == 0) ? nsteps : step_start + step_count;
+    if (step_start >= step_end || step_end > nsteps)
+        return NC_EINVALCOORDS;
+    size_t step_size = std::accumulate(&data_shape[ndims > 2 ? 1 : 0], &data_shape[ndims], 1, [&](size_t a, size_t b){ return a * b; } );
+
+    std::vector<size_t> access_start(ndims, 0), access_count(data_shape, data_shape + ndims);
+    if (ndims > 2)
+    {
+        access_start[0] = step_start;
+        access_count[0] = step_end - step_start;
+    }
+    raster::AccessScope access(relation_required ? "region" : nullptr, var_grp_id, mask_id, ndims, access_start.data(),
+                               access_count.data());
+
+    bool found = false;
+    for (const slab_t& slab : var.m_slabs)
+    {
+        size_t lo = std::max(slab.m_start, step_start), hi = std::min(slab.m_start + slab.m_count, step_end);
+        if (lo >= hi)
+            continue;
+
+        std::vector<size_t> slab_shape(data_shape, data_shape + ndims);
+        std::vector<T> staging;
+        T* dest = data + (lo - step_start) * step_size;
+        if (ndims > 2)
+            slab_shape[0] = slab.m_count;
+        if (lo != slab.m_start || hi != slab.m_start + slab.m_count)
+        {
+            staging.resize(slab.m_count * step_size);
+            memcpy(&staging[(lo - slab.m_start) * step_size], dest, (hi - lo) * step_size * sizeof(T));
+            dest = staging.data();
+        }
+
+        status = read_region_slab<T>(var_grp_id, slab, mask_id, dest, slab_shape.data(), var.m_xtype, relation_required, filter);
+        if (status == NC_EBADDIM && slab.m_grp_id != var_grp_id)
+            continue; // the layout of this slab has no such region
+        if (status != NC_NOERR)
+            return status;
+        found = true;
+        if (!staging.empty())
+            memcpy(data + (lo - step_start) * step_size, &staging[(lo - slab.m_start) * step_size], (hi - lo) * step_size * sizeof(T));
+    }
+    return found ? NC_NOERR : NC_EBADDIM;
+}
+
+template <typename T>
+int read_region(int var_grp_id, int mask_id, T* data, size_t* data_shape, int var_type, bool relation_required=true,
+                size_t step_start=0, size_t step_count=0, const value_filter_t* filter=nullptr)
+{
+    raster::var_desc_t var;
+    int status = raster::describe_var(var_grp_id, var_type, data_shape, var);
+    if (status != NC_NOERR)
+        return status;
+    return ::read_region<T>(var, mask_id, data, relation_required, step_start, step_count, filter);
+}
+
+// Loads what a read of region `mask_id` needs into the caches: the metadata of its regions, and
+// with the chunk cache on, its chunks decoded, over all slabs of the variable
+template <typename T>
+static int prefetch_region(const raster::var_desc_t& var, int mask_id)
+{
+    int status = NC_NOERR, var_grp_id = var.m_grp_id;
+    bool found = false;
+    for (const slab_t& slab : var.m_slabs)
+    {
+        std::vector<size_t> slab_shape(var.m_shape);
+        if (var.m_ndims > 2)
+            slab_shape[0] = slab.m_count;
+        status = read_region_slab<T>(var_grp_id, slab, mask_id, nullptr, slab_shape.data(), var.m_xtype, true, nullptr);
+        if (status == NC_EBADDIM && slab.m_grp_id != var_grp_id)
+            continue; // the layout of this slab has no such region
+        if (status != NC_NOERR)
+            return status;
+        found = true;
+    }
+    return found ? NC_NOERR : NC_EBADDIM;
+}
+
+// Reads the box [start, start + count) of the variable into `data`, which holds the box only.
+// Only chunks intersecting the box are read, found through the spatial index of each slab
+template <typename T>
+int read_vara(const raster::var_desc_t& var, const size_t* start, const size_t* count, T* data)
+{
+    int status = NC_NOERR, ndims = var.m_ndims, var_grp_id = var.m_grp_id;
+    std::vector<size_t> shape(var.m_shape);
+    size_t* data_shape = shape.data();
+    bool empty = false;
+    for (int d = 0; d < ndims; d++)
+    {
+        if (start[d] > data_shape[d])
+            return NC_EINVALCOORDS;
+        if (start[d] + count[d] > data_shape[d])
+            return NC_EEDGE;
+        empty |= (count[d] == 0);
+    }
+    if (empty) // every dimension is checked first, as `nc_get_vara` does
+        return NC_NOERR;
+    raster::AccessScope access("vara", var_grp_id, -1, ndims, start, count);
+
+    for (const slab_t& slab : var.m_slabs)
+    {
+        int slab_grp_id = (slab.m_grp_id == var_grp_id) ? -1 : slab.m_grp_id;
+        if (ndims > 2 && (slab.m_start >= start[0] + count[0] || start[0] >= slab.m_start + slab.m_count))
+            continue;
+        std::vector<size_t> slab_shape(data_shape, data_shape + ndims);
+        if (ndims > 2)
+            slab_shape[0] = slab.m_count;
+
+        std::shared_ptr<raster::SpatialIndex> sindex;
+        std::vector<const raster::SpatialIndex::entry_t*> hits;
+        status = raster::load_spatial_index(var_grp_id, slab_shape.data(), sindex, slab_grp_id);
+        if (status != NC_NOERR)
+            return status;
+        sindex->query(&start[ndims - 2], &count[ndims - 2], hits);
 
-            status = nc_inq_dimlen(var_grp_id, mixed_dimids[0], &mixed_rows);
-            status = nc_inq_dimlen(var_grp_id, mixed_dimids[1], &mixed_cols);
-            mixed_data = new uint64_t[mixed_rows * mixed_cols];
-            sprintf(buffer, "_meta_region_%d_chunks_", raster::REGION_MIXED_ID);
-            status = nc_inq_varid(var_grp_id, buffer, &mixed_varid);
-            status = nc_get_var_ulonglong(var_grp_id, mixed_varid, (unsigned long long*)mixed_data);
-
-            raster::meta_cache->add_mixed_table(var_grp_id, mixed_rows, mixed_cols, mixed_data);
-        }
-        std::vector<int> relation_indices(nrelations);
-        std::vector<int> all_mixed_chunks(mixed_rows);
-        for (int i = 0; i < mixed_rows; i++)
-            all_mixed_chunks[i] = mixed_data[i * mixed_cols];
-        
-        for (int i = 0; i < nrelations; i++)
-            relation_indices[i] = std::find(all_mixed_chunks.begin(), all_mixed_chunks.end(), relation_chunks[i])\
-                                  - all_mixed_chunks.begin();
-        
-        status = do_read_region<T>(raster::REGION_MIXED_ID, mixed_data, mixed_rows, mixed_cols, data, data_shape, 
-                                   var_grp_id, var_type, std::move(relation_indices));
+        // intersecting chunks, grouped by region
+        std::map<int, std::vector<int> > region_rows;
+        for (auto hit : hits)
+            region_rows[hit->m_region].push_back(hit->m_row);
+        for (auto& kv : region_rows)
+        {
+            raster::region_meta_t region;
+            std::vector<size_t> slab_meta;
+            std::vector<int> rows;
+            status = raster::load_region_meta(var_grp_id, kv.first, slab_shape.data(), region, slab_grp_id);
+            if (status != NC_NOERR)
+                return status;
+            uint64_t* meta_buffer = region.m_data;
+            if (slab_grp_id >= 0)
+            {
+                // chunks of a slab are placed at its steps of the whole variable
+                slab_meta = raster::rebase_region_meta(region.m_data, region.m_nrows, region.m_ncols, slab.m_start, slab.m_count);
+                meta_buffer = slab_meta.data();
+            }
+            for (int row : kv.second)
+            {
+                // the spatial index does not see non-spatial dimensions
+                const size_t* chunk_start = &meta_buffer[(size_t)row * region.m_ncols + 1];
+                const size_t* chunk_count = chunk_start + ndims;
+                bool overlaps = true;
+                for (int d = 0; d < ndims - 2; d++)
+                    overlaps = overlaps && chunk_start[d] < start[d] + count[d] && start[d] < chunk_start[d] + chunk_count[d];
+                if (overlaps)
+                    rows.push_back(row);
+            }
+            if (rows.empty())
+                continue;
+            status = do_read_region<T>(kv.first, meta_buffer, region.m_nrows, region.m_ncols, data, data_shape,
+                                       slab.m_grp_id, var.m_xtype, std::move(rows), start, count, nullptr, region.m_index.get());
+            if (status != NC_NOERR)
+                return status;
+        }
     }
     return status;
 }
 
+template <typename T>
+int read_vara(int var_grp_id, const size_t* start, const size_t* count, T* data, size_t* data_shape, int var_type)
+{
+    raster::var_desc_t var;
+    int status = raster::describe_var(var_grp_id, var_type, data_shape, var);
+    if (status != NC_NOERR)
+        return status;
+    return ::read_vara<T>(var, start, count, data);
+}
+
+template <typename T>
+int raster::read_region(const var_desc_t& var, int mask_id, T* data, bool relation_required, size_t step_start,
+                        size_t step_count)
+{
+    return ::read_region<T>(var, mask_id, data, relation_required, step_start, step_count);
+}
+
+template <typename T>
+int raster::read_vara(const var_desc_t& var, const size_t* start, const size_t* count, T* data)
+{
+    return ::read_vara<T>(var, start, count, data);
+}
+
+template int raster::read_region<int>(const var_desc_t&, int, int*, bool, size_t, size_t);
+template int raster::read_region<float>(const var_desc_t&, int, float*, bool, size_t, size_t);
+template int raster::read_region<double>(const var_desc_t&, int, double*, bool, size_t, size_t);
+template int raster::read_region<char>(const var_desc_t&, int, char*, bool, size_t, size_t);
+template int raster::read_vara<int>(const var_desc_t&, const size_t*, const size_t*, int*);
+template int raster::read_vara<float>(const var_desc_t&, const size_t*, const size_t*, float*);
+template int raster::read_vara<double>(const var_desc_t&, const size_t*, const size_t*, double*);
+template int raster::read_vara<char>(const var_desc_t&, const size_t*, const size_t*, char*);
+
 int read_region_int(int ncid, int varid, int* data, size_t* dimlens, int mask_id, int relation_required)
 {
-    return read_region<int>(varid, mask_id, data, dimlens, NC_INT, relation_required == 1 ? true : false);
+    return raster::catch_status([&] {
+        return read_region<int>(varid, mask_id, data, dimlens, NC_INT, relation_required == 1 ? true : false);
+    });
 }
 
 int read_region_float(int ncid, int varid, float* data, size_t* dimlens, int mask_id, int relation_required)
 {
-    return read_region<float>(varid, mask_id, data, dimlens, NC_FLOAT, relation_required == 1 ? true : false);
+    return raster::catch_status([&] {
+        return read_region<float>(varid, mask_id, data, dimlens, NC_FLOAT, relation_required == 1 ? true : false);
+    });
 }
 
 int read_region_double(int ncid, int varid, double* data, size_t* dimlens, int mask_id, int relation_required)
 {
-    return read_region<double>(varid, mask_id, data, dimlens, NC_DOUBLE, relation_required == 1 ? true : false);
+    return raster::catch_status([&] {
+        return read_region<double>(varid, mask_id, data, dimlens, NC_DOUBLE, relation_required == 1 ? true : false);
+    });
 }
 
 int read_region_char(int ncid, int varid, char* data, size_t* dimlens, int mask_id, int relation_required)
 {
-    return read_region<char>(varid, mask_id, data, dimlens, NC_CHAR, relation_required == 1 ? true : false);
+    return raster::catch_status([&] {
+        return read_region<char>(varid, mask_id, data, dimlens, NC_CHAR, relation_required == 1 ? true : false);
+    });
+}
+
+int read_region_steps_int(int ncid, int varid, int* data, size_t* dimlens, int mask_id, size_t start, size_t count)
+{
+    return raster::catch_status([&] {
+        return read_region<int>(varid, mask_id, data, dimlens, NC_INT, true, start, count);
+    });
+}
+
+int read_region_steps_float(int ncid, int varid, float* data, size_t* dimlens, int mask_id, size_t start, size_t count)
+{
+    return raster::catch_status([&] {
+        return read_region<float>(varid, mask_id, data, dimlens, NC_FLOAT, true, start, count);
+    });
+}
+
+int read_region_steps_double(int ncid, int varid, double* data, size_t* dimlens, int mask_id, size_t start, size_t count)
+{
+    return raster::catch_status([&] {
+        return read_region<double>(varid, mask_id, data, dimlens, NC_DOUBLE, true, start, count);
+    });
+}
+
+int read_region_steps_char(int ncid, int varid, char* data, size_t* dimlens, int mask_id, size_t start, size_t count)
+{
+    return raster::catch_status([&] {
+        return read_region<char>(varid, mask_id, data, dimlens, NC_CHAR, true, start, count);
+    });
+}
+
+// Aggregates of region `mask_id` at steps [step_start, step_start + step_count) of the leading
+// dimension, one entry per step, taken from `_region_stats_` of the slabs holding these steps.
+// No chunk is read. Steps of a slab whose layout lacks the region have no cells
+static int load_region_stats(int var_grp_id, int mask_id, size_t step_start, size_t step_count, raster_region_stats_t* stats,
+                             size_t* data_shape)
+{
+    int status = NC_NOERR, ndims;
+    status = nc_get_att_int(var_grp_id, NC_GLOBAL, "_ndims_", &ndims);
+    if (status != NC_NOERR)
+        return status;
+    size_t nsteps = (ndims > 2) ? data_shape[0] : 1, step_end = step_start + step_count;
+    if (step_count == 0 || step_end > nsteps)
+        return NC_EINVALCOORDS;
+    for (size_t k = 0; k < step_count; k++)
+        stats[k] = {0, 0, 0, NAN, NAN};
+
+    bool found = false;
+    for (auto& slab : get_var_slabs(var_grp_id))
+    {
+        if (slab.m_grp_id == var_grp_id)
+            slab.m_count = nsteps;
+        size_t lo = std::max(slab.m_start, step_start), hi = std::min(slab.m_start + slab.m_count, step_end);
+        if (lo >= hi)
+            continue;
+
+        int stats_id;
+        size_t nregions = 0;
+        status = nc_inq_varid(slab.m_grp_id, "_region_stats_", &stats_id);
+        if (status == NC_NOERR)
+            status = nc_inq_attlen(slab.m_grp_id, NC_GLOBAL, "_region_stats_ids_", &nregions);
+        if (status != NC_NOERR)
+            return status; // written before region aggregates were kept
+        std::vector<int> ids(nregions);
+        status = nc_get_att_int(slab.m_grp_id, NC_GLOBAL, "_region_stats_ids_", ids.data());
+        auto it = std::lower_bound(ids.begin(), ids.end(), mask_id);
+        if (it == ids.end() || *it != mask_id)
+            continue; // the layout of this slab has no such region
+        found = true;
+
+        size_t start[3] = {(size_t)(it - ids.begin()), lo - slab.m_start, 0};
+        size_t count[3] = {1, hi - lo, sizeof(raster::region_stats_t) / sizeof(double)};
+        std::vector<raster::region_stats_t> rows(hi - lo);
+        status = nc_get_vara_double(slab.m_grp_id, stats_id, start, count, reinterpret_cast<double*>(rows.data()));
+        if (status != NC_NOERR)
+            return status;
+        for (size_t k = 0; k < rows.size(); k++)
+            stats[lo - step_start + k] = {(size_t)rows[k].m_count, rows[k].m_sum, rows[k].m_sum_squares, rows[k].m_min, rows[k].m_max};
+    }
+    return found ? NC_NOERR : NC_EBADDIM;
+}
+
+int read_region_stats(int var_grp_id, int mask_id, size_t step_start, size_t step_count, raster_region_stats_t* stats,
+                      size_t* data_shape)
+{
+    return raster::catch_status([&] {
+        return load_region_stats(var_grp_id, mask_id, step_start, step_count, stats, data_shape);
+    });
+}
+
+template <typename T>
+static int read_region_where(int var_grp_id, int mask_id, T* data, size_t* data_shape, int var_type, int op, double value)
+{
+    if (op < RASTER_PRED_LT || op > RASTER_PRED_EQ)
+        return NC_EINVAL;
+    value_filter_t filter = {op, value, raster::get_fill_value(var_grp_id)};
+    return read_region<T>(var_grp_id, mask_id, data, data_shape, var_type, true, 0, 0, &filter);
+}
+
+int read_region_where_int(int ncid, int varid, int* data, size_t* dimlens, int mask_id, int op, double value)
+{
+    return raster::catch_status([&] {
+        return read_region_where<int>(varid, mask_id, data, dimlens, NC_INT, op, value);
+    });
+}
+
+int read_region_where_float(int ncid, int varid, float* data, size_t* dimlens, int mask_id, int op, double value)
+{
+    return raster::catch_status([&] {
+        return read_region_where<float>(varid, mask_id, data, dimlens, NC_FLOAT, op, value);
+    });
+}
+
+int read_region_where_double(int ncid, int varid, double* data, size_t* dimlens, int mask_id, int op, double value)
+{
+    return raster::catch_status([&] {
+        return read_region_where<double>(varid, mask_id, data, dimlens, NC_DOUBLE, op, value);
+    });
+}
+
+int read_region_where_char(int ncid, int varid, char* data, size_t* dimlens, int mask_id, int op, double value)
+{
+    return raster::catch_status([&] {
+        return read_region_where<char>(varid, mask_id, data, dimlens, NC_CHAR, op, value);
+    });
+}
+
+int raster::prefetch_region(const var_desc_t& var, int mask_id)
+{
+    switch (var.m_xtype)
+    {
+        case NC_INT: return ::prefetch_region<int>(var, mask_id);
+        case NC_FLOAT: return ::prefetch_region<float>(var, mask_id);
+        case NC_DOUBLE: return ::prefetch_region<double>(var, mask_id);
+        case NC_CHAR: return ::prefetch_region<char>(var, mask_id);
+        default: return NC_EBADTYPE;
+    }
+}
+
+int prefetch_region_var(int var_grp_id, int mask_id, nc_type xtype, size_t* dimlens)
+{
+    return raster::catch_status([&] {
+        raster::var_desc_t var;
+        int status = raster::describe_var(var_grp_id, xtype, dimlens, var);
+        if (status != NC_NOERR)
+            return status;
+        return raster::prefetch_region(var, mask_id);
+    });
+}
+
+int read_vara_int(int ncid, int varid, const size_t* start, const size_t* count, int* data, size_t* dimlens)
+{
+    return raster::catch_status([&] {
+        return read_vara<int>(varid, start, count, data, dimlens, NC_INT);
+    });
+}
+
+int read_vara_float(int ncid, int varid, const size_t* start, const size_t* count, float* data, size_t* dimlens)
+{
+    return raster::catch_status([&] {
+        return read_vara<float>(varid, start, count, data, dimlens, NC_FLOAT);
+    });
+}
+
+int read_vara_double(int ncid, int varid, const size_t* start, const size_t* count, double* data, size_t* dimlens)
+{
+    return raster::catch_status([&] {
+        return read_vara<double>(varid, start, count, data, dimlens, NC_DOUBLE);
+    });
+}
+
+int read_vara_char(int ncid, int varid, const size_t* start, const size_t* count, char* data, size_t* dimlens)
+{
+    return raster::catch_status([&] {
+        return read_vara<char>(varid, start, count, data, dimlens, NC_CHAR);
+    });
 }
@@ -9,13 +9,92 @@ extern "C" {
 #include <netcdf.h>
 #include <stdint.h>
 #include <assert.h>
+#include "raster.h"
 
 int read_region_int(int ncid, int varid, int* data, size_t* dimlens, int mask_id, int relation_require);
 int read_region_float(int ncid, int varid, float* data, size_t* dimlens, int mask_id, int relation_required);
 int read_region_double(int ncid, int varid, double* data, size_t* dimlens, int mask_id, int relation_required);
 int read_region_char(int ncid, int varid, char* data, size_t* dimlens, int mask_id, int relation_required);
 
+int read_region_steps_int(int ncid, int varid, int* data, size_t* dimlens, int mask_id, size_t start, size_t count);
+int read_region_steps_float(int ncid, int varid, float* data, size_t* dimlens, int mask_id, size_t start, size_t count);
+int read_region_steps_double(int ncid, int varid, double* data, size_t* dimlens, int mask_id, size_t start, size_t count);
+int read_region_steps_char(int ncid, int varid, char* data, size_t* dimlens, int mask_id, size_t start, size_t count);
+
+int read_region_where_int(int ncid, int varid, int* data, size_t* dimlens, int mask_id, int op, double value);
+int read_region_where_float(int ncid, int varid, float* data, size_t* dimlens, int mask_id, int op, double value);
+int read_region_where_double(int ncid, int varid, double* data, size_t* dimlens, int mask_id, int op, double value);
+int read_region_where_char(int ncid, int varid, char* data, size_t* dimlens, int mask_id, int op, double value);
+
+int read_region_stats(int var_grp_id, int mask_id, size_t step_start, size_t step_count, raster_region_stats_t* stats,
+                      size_t* data_shape);
+
+// loads the metadata of region `mask_id`, and its chunks if the chunk cache is on, into the caches
+int prefetch_region_var(int var_grp_id, int mask_id, nc_type xtype, size_t* dimlens);
+
+int read_vara_int(int ncid, int varid, const size_t* start, const size_t* count, int* data, size_t* dimlens);
+int read_vara_float(int ncid, int varid, const size_t* start, const size_t* count, float* data, size_t* dimlens);
+int read_vara_double(int ncid, int varid, const size_t* start, const size_t* count, double* data, size_t* dimlens);
+int read_vara_char(int ncid, int varid, const size_t* start, const size_t* count, char* data, size_t* dimlens);
+
 #ifdef __cplusplus
 }
+
+#include <vector>
+#include <new>
+#include <stdexcept>
+
+namespace raster
+{
+
+// A variable written by `raster_put_var_*` keeps its region groups in the variable group, an
+// appended one keeps them in `slab_<k>` groups, each covering a range of the leading dimension
+struct slab_t
+{
+    int     m_grp_id;
+    size_t  m_start;
+    size_t  m_count;
+};
+
+// what reads of a variable need to know about it, its shape and its slabs
+struct var_desc_t
+{
+    int                 m_grp_id;
+    int                 m_ndims;
+    int                 m_xtype;
+    std::vector<size_t> m_shape;
+    std::vector<slab_t> m_slabs;
+};
+
+// describes `var_grp_id`, of type `var_type` and shaped `data_shape`, reading its attributes
+int describe_var(int var_grp_id, int var_type, const size_t* data_shape, var_desc_t& var);
+
+// reads of an already described variable, `T` must match its `m_xtype`
+template <typename T>
+int read_region(const var_desc_t& var, int mask_id, T* data, bool relation_required, size_t step_start, size_t step_count);
+template <typename T>
+int read_vara(const var_desc_t& var, const size_t* start, const size_t* count, T* data);
+int prefetch_region(const var_desc_t& var, int mask_id);
+
+// status of `read()`, or of the exception it throws, e.g. on a corrupt chunk or index: the C callers
+// hold the io lock until the read returns, nothing may unwind past them
+template <typename F>
+int catch_status(F&& read)
+{
+    try
+    {
+        return read();
+    }
+    catch (const std::bad_alloc&)
+    {
+        return NC_ENOMEM;
+    }
+    catch (const std::exception&)
+    {
+        return NC_EIO;
+    }
+}
+
+} // namespace raster
 #endif
 #endif
\ No newline at end of file
@@ -9,5 +9,8 @@
 #define ZLEVEL_NOZIP    0
 
 #define ZIP_DETECT_NSAMPLES 10
+#define ZIP_DETECT_MAX_BYTES (1 << 20)     // only the leading bytes of a sample chunk are compressed
+#define ZIP_IO_BANDWIDTH_MBPS 200.0        // assumed storage bandwidth when weighing compression time
+#define ZIP_MAX_RATIO 0.8                  // regions compressing worse than this are stored raw
 
 #endif // __ZIPLEVEL_H__
\ No newline at end of file
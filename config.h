@@ -4,5 +4,19 @@
 #define MAX_VARNAME_LEN 256
 #define CHUNKSIZE_NX 20
 #define CHUNKSIZE_NY 20
+#define TARGET_CHUNK_BYTES (4 << 20)
+#define MAX_CHUNK_BYTES (64 << 20)
+#define MIN_CHUNK_SIDE 8
+#define WRITE_PIPELINE_DEPTH 4
+#define READ_BATCH_BYTES (256 << 20)
+#define PACKED_CHUNK_BYTES (1 << 20)
+#define PACKED_COALESCE_GAP (64 << 10)
+#define APPEND_DEFAULT_STEPS 1
+#define WRITE_BUFFER_BYTES (1UL << 30)
+#define META_CACHE_BYTES (256UL << 20)
+#define CHUNK_CACHE_BYTES 0
+#define EPOCH_REPARTITION_FRACTION 0.1
+#define UNIFORM_ATT_BYTES (32 << 10)
+#define REGION_STATS_BLOCK_ROWS 64
 
 #endif
\ No newline at end of file
@@ -3,17 +3,130 @@
 #include "ChunkDataWriter.h"
 #include "RegionalRead.h"
 #include "ChunkDataReader.h"
+#include "AsyncWriter.h"
+#include "AccessLog.h"
+#include "MetaCache.h"
+#include "ChunkCache.h"
 
-int get_var_dimlens(int ncid, int varid, int* ndims, size_t* dimlens)
+static int inq_vardimid(int ncid, int varid, int* dimidsp);
+
+static int read_var_dimlens(int ncid, int varid, int* ndims, size_t* dimlens)
 {
     int status = NC_NOERR, dimids[32];
     status = nc_get_att_int(varid, NC_GLOBAL, "_ndims_", ndims);
-    status = raster_inq_vardimid(ncid, varid, dimids);
+    status = inq_vardimid(ncid, varid, dimids);
     for (int i = 0; i < *ndims; i++)
         nc_inq_dimlen(ncid, dimids[i], &dimlens[i]);
+    // appended variables only hold the steps written so far
+    unsigned long long nsteps;
+    if (nc_get_att_ulonglong(varid, NC_GLOBAL, "_nsteps_", &nsteps) == NC_NOERR)
+        dimlens[0] = nsteps;
     return status;
 }
 
+// Synchronous calls first wait for pending asynchronous writes, netCDF is not thread-safe
+int get_var_dimlens(int ncid, int varid, int* ndims, size_t* dimlens)
+{
+    drain_writes();
+    return read_var_dimlens(ncid, varid, ndims, dimlens);
+}
+
+// Synchronous reads wait for pending asynchronous writes of their file only, not for prefetches,
+// then hold the io lock until `end_read`: a prefetch only lets go of it while it decodes chunks
+static int begin_read(int ncid, int varid, int* ndims, size_t* dimlens)
+{
+    wait_file_writes(ncid);
+    lock_io();
+    return read_var_dimlens(ncid, varid, ndims, dimlens);
+}
+
+static void end_read(void)
+{
+    unlock_io();
+}
+
+// the background writer may be calling netCDF, so shapes for asynchronous writes are read under its lock
+static int read_var_dimlens_async(int ncid, int varid, int* ndims, size_t* dimlens)
+{
+    int status;
+    lock_io();
+    status = read_var_dimlens(ncid, varid, ndims, dimlens);
+    unlock_io();
+    return status;
+}
+
+// Files whose variables were looked up or defined, by file id (the upper 16 bits of their ids),
+// with their paths. netCDF hands the id of a closed file to the next one opened, so a file closed
+// by `nc_close` rather than `raster_close` leaves what was cached for it under ids of another file.
+// A file id met with another path, or not met before, drops all that is kept for it, staged steps
+// included. A file opened again at the same path keeps them, they are written to it on its next flush
+typedef struct bound_file_t
+{
+    int                     file;
+    char*                   path;
+    struct bound_file_t*    next;
+} bound_file_t;
+
+static bound_file_t* bound_files = NULL;
+
+static void bind_file(int ncid)
+{
+    size_t len;
+    char* path;
+    bound_file_t* it;
+    if (nc_inq_path(ncid, &len, NULL) != NC_NOERR || (path = (char*)malloc(len + 1)) == NULL)
+        return;
+    nc_inq_path(ncid, NULL, path);
+    path[len] = '\0';
+    for (it = bound_files; it != NULL && it->file != (ncid >> 16); it = it->next)
+        ;
+    if (it != NULL && strcmp(it->path, path) == 0)
+    {
+        free(path);
+        return;
+    }
+    if (it == NULL)
+    {
+        if ((it = (bound_file_t*)malloc(sizeof(bound_file_t))) == NULL)
+        {
+            free(path);
+            return;
+        }
+        it->file = ncid >> 16;
+        it->next = bound_files;
+        bound_files = it;
+    }
+    else
+        free(it->path);
+    it->path = path;
+    invalidate_meta_cache(ncid);
+    invalidate_chunk_cache(ncid);
+    // steps staged for the file closed by `nc_close` are lost with it
+    discard_file(ncid);
+}
+
+static void unbind_file(int ncid)
+{
+    bound_file_t** it = &bound_files;
+    while (*it != NULL && (*it)->file != (ncid >> 16))
+        it = &(*it)->next;
+    if (*it == NULL)
+        return;
+    bound_file_t* found = *it;
+    *it = found->next;
+    free(found->path);
+    free(found);
+}
+
+// an append covers whole steps: every dimension but the leading one is written entirely
+static int check_append(int ndims, const size_t* dimlens, const size_t* startp, const size_t* countp)
+{
+    for (int i = 1; i < ndims; i++)
+        if (startp[i] != 0 || countp[i] != dimlens[i])
+            return NC_EINVAL;
+    return NC_NOERR;
+}
+
 // This function creates a nc_group for this variable.
 // (1) Create a group with nc_grp_id
 // (2) Record number of dims of this var, as an attribute of the created group
@@ -22,6 +135,11 @@ int get_var_dimlens(int ncid, int varid, int* ndims, size_t* dimlens)
 int raster_def_var(int ncid, const char* name, nc_type xtype, int ndims, int* dimidp, int* varidp)
 {
     int status = NC_NOERR, var_grp_id;
+    drain_writes();
+    bind_file(ncid);
+    // a file closed by `nc_close` and created again at the same path gives its variables the same ids
+    invalidate_meta_cache(ncid);
+    invalidate_chunk_cache(ncid);
     status = nc_def_grp(ncid, name, &var_grp_id);
     status = nc_put_att_int(var_grp_id, NC_GLOBAL, "_ndims_", NC_INT, 1, &ndims);
     status = nc_put_att_int(var_grp_id, NC_GLOBAL, "_xtype_", NC_INT, 1, &xtype);
@@ -55,12 +173,140 @@ int raster_def_var_chunking(int ncid, int varid, int* mask)
     return status;
 }
 
+// This function defines variable chunking structure by given mask, with a grid chosen at runtime:
+// explicit `options->nx` / `options->ny`, or derived from `options->target_bytes`, the element
+// size, the non-spatial dimensions and the fragmentation of the mask. Merged chunks stay below
+// `options->max_chunk_bytes`. `options` may be NULL for all defaults
+int raster_def_var_chunking_ext(int ncid, int varid, int* mask, const raster_chunking_t* options)
+{
+    int ndims, xtype, status = NC_NOERR;
+    size_t dimlens[32];
+    raster_chunking_t opts;
+    memset(&opts, 0, sizeof(opts));
+    if (options != NULL)
+        opts = *options;
+    if (opts.nx < 0 || opts.ny < 0 || opts.merge_threshold < 0)
+        return NC_EINVAL;
+    opts.target_bytes = (opts.target_bytes == 0) ? TARGET_CHUNK_BYTES : opts.target_bytes;
+    opts.max_chunk_bytes = (opts.max_chunk_bytes == 0) ? MAX_CHUNK_BYTES : opts.max_chunk_bytes;
+    opts.merge_threshold = (opts.merge_threshold == 0) ? 1 : opts.merge_threshold;
+    status = get_var_dimlens(ncid, varid, &ndims, dimlens);
+    status = nc_get_att_int(varid, NC_GLOBAL, "_xtype_", &xtype);
+    status = write_var_metadata_ext(varid, ndims, dimlens, mask, xtype, &opts);
+    return status;
+}
+
+// This function defines variable chunking structure by a mask of nested regions, where region
+// `child_ids[i]` lies in region `parent_ids[i]`. `raster_get_region_*` then also accepts a parent id,
+// reading all its descendants in one pass with their shared mixed chunks read once. With `level` > 0
+// the partition is built from the ancestors `level` links up, so a parent region is made of a few
+// large chunks; a child region is then read through the chunks of that ancestor, and only its own
+// cells are copied out
+int raster_def_var_chunking_hier(int ncid, int varid, int* mask, int nlinks, const int* child_ids, const int* parent_ids,
+                                 int level)
+{
+    return raster_def_var_chunking_hier_ext(ncid, varid, mask, nlinks, child_ids, parent_ids, level, NULL);
+}
+
+// As `raster_def_var_chunking_hier`, with the grid and merge limits of `raster_def_var_chunking_ext`.
+// A grid left to `target_bytes` is derived from the mask of the ancestors at `level`. Null
+// `options` keep the default grid and merge threshold of hierarchies
+int raster_def_var_chunking_hier_ext(int ncid, int varid, int* mask, int nlinks, const int* child_ids,
+                                     const int* parent_ids, int level, const raster_chunking_t* options)
+{
+    int ndims, xtype = NC_NAT, status = NC_NOERR;
+    size_t dimlens[32];
+    raster_chunking_t opts;
+    if (nlinks < 0 || level < 0 || (nlinks > 0 && (child_ids == NULL || parent_ids == NULL)))
+        return NC_EINVAL;
+    if (options != NULL)
+    {
+        opts = *options;
+        if (opts.nx < 0 || opts.ny < 0 || opts.merge_threshold < 0)
+            return NC_EINVAL;
+        opts.target_bytes = (opts.target_bytes == 0) ? TARGET_CHUNK_BYTES : opts.target_bytes;
+        opts.max_chunk_bytes = (opts.max_chunk_bytes == 0) ? MAX_CHUNK_BYTES : opts.max_chunk_bytes;
+        opts.merge_threshold = (opts.merge_threshold == 0) ? 1 : opts.merge_threshold;
+    }
+    status = get_var_dimlens(ncid, varid, &ndims, dimlens);
+    if (status != NC_NOERR)
+        return status;
+    if (options != NULL && (status = nc_get_att_int(varid, NC_GLOBAL, "_xtype_", &xtype)) != NC_NOERR)
+        return status;
+    status = write_var_metadata_hier(varid, ndims, dimlens, mask, nlinks, child_ids, parent_ids, level, xtype,
+                                     (options != NULL) ? &opts : NULL);
+    return status;
+}
+
+// This function defines variable chunking structure by a time-varying mask, shaped like the
+// leading dimension and the two spatial dimensions of `varid`. Runs of steps with the same mask
+// share one layout, and equal masks share it across runs and variables. Steps are written by
+// `raster_put_var_*` or `raster_put_vara_*`, and read per step range by `raster_get_region_steps_*`
+int raster_def_var_chunking_steps(int ncid, int varid, int* mask)
+{
+    int ndims, status = NC_NOERR;
+    size_t dimlens[32];
+    status = get_var_dimlens(ncid, varid, &ndims, dimlens);
+    if (status != NC_NOERR)
+        return status;
+    status = write_var_metadata_epochs(varid, ndims, dimlens, mask);
+    return status;
+}
+
+// This function selects how chunks of `varid` are stored in each region group,
+// `RASTER_STORAGE_CHUNKED` (default) or `RASTER_STORAGE_PACKED`.
+// It must be called before `raster_put_var_*`
+int raster_def_var_storage(int ncid, int varid, int storage)
+{
+    (void) ncid;
+    if (storage != RASTER_STORAGE_CHUNKED && storage != RASTER_STORAGE_PACKED)
+        return NC_EINVAL;
+    drain_writes();
+    return nc_put_att_int(varid, NC_GLOBAL, "_storage_", NC_INT, 1, &storage);
+}
+
+// This function lets `raster_put_vara_*` stage `nsteps_per_flush` steps of the leading dimension
+// before writing them as one slab, i.e. chunks span `nsteps_per_flush` steps. Default is 1.
+// It must be called before the first `raster_put_vara_*` of this session
+int raster_def_var_append(int ncid, int varid, int nsteps_per_flush)
+{
+    (void) ncid;
+    if (nsteps_per_flush < 1)
+        return NC_EINVAL;
+    drain_writes();
+    return nc_put_att_int(varid, NC_GLOBAL, "_append_steps_", NC_INT, 1, &nsteps_per_flush);
+}
+
+// This function sets the fill value of `varid`, stored as its `_FillValue`: cells holding it are left out
+// of the chunk value ranges, the region aggregates and the filtered reads. Without it the netCDF default
+// fill value of the type is used. It must be called before `raster_put_var_*`
+int raster_def_var_fill(int ncid, int varid, double fill)
+{
+    (void) ncid;
+    drain_writes();
+    return nc_put_att_double(varid, NC_GLOBAL, "_FillValue", NC_DOUBLE, 1, &fill);
+}
+
+// This function sets how region `maskid` of `varid` is compressed, overriding the codec detection:
+// `RASTER_CODEC_NONE` for hot regions, `RASTER_CODEC_MAX` for cold ones. It applies to later writes
+int raster_def_region_codec(int ncid, int varid, int maskid, int policy)
+{
+    char name[64];
+    (void) ncid;
+    if (policy != RASTER_CODEC_AUTO && policy != RASTER_CODEC_NONE && policy != RASTER_CODEC_MAX)
+        return NC_EINVAL;
+    drain_writes();
+    sprintf(name, "_region_codec_%d_", maskid);
+    return nc_put_att_int(varid, NC_GLOBAL, name, NC_INT, 1, &policy);
+}
+
 // This function inquires number of dimensions in `varid`
 // This varid should actually be a GROUP ID
 // In our organization, `_ndims_` is an attribute written in this group as metadata 
 int raster_inq_varndims(int ncid, int varid, int* ndimsp)
 {
     (void) ncid; // ncid is acutally unused
+    drain_writes();
     return nc_get_att_int(varid, NC_GLOBAL, "_ndims_", ndimsp);
 }
 
@@ -68,6 +314,12 @@ int raster_inq_varndims(int ncid, int varid, int* ndimsp)
 // (1) Read attributes `_dims_` to get dimension names related to this variable
 // (2) Inquire these dimensions from parent group (root group) which id is `ncid`
 int raster_inq_vardimid(int ncid, int varid, int* dimidsp)
+{
+    drain_writes();
+    return inq_vardimid(ncid, varid, dimidsp);
+}
+
+static int inq_vardimid(int ncid, int varid, int* dimidsp)
 {
     int status = NC_NOERR, ndims;
     status = nc_get_att_int(varid, NC_GLOBAL, "_ndims_", &ndims);
@@ -85,6 +337,8 @@ int raster_inq_vardimid(int ncid, int varid, int* dimidsp)
 // Notice that this variable is a GROUP, so we use group id instead of varid
 int raster_inq_varid(int ncid, const char* varname, int* varidp)
 {
+    drain_writes();
+    bind_file(ncid);
     return nc_inq_grp_ncid(ncid, varname, varidp);
 }
 
@@ -128,6 +382,304 @@ int raster_put_var_char(int ncid, int varid, const char* data)
     return status;
 }
 
+// These functions append steps [startp[0], startp[0] + countp[0]) of the leading dimension to `varid`,
+// where startp[0] must be the number of steps appended before, and the other dimensions must be
+// given entirely. Steps are written with the partition from `raster_def_var_chunking`, once
+// `raster_def_var_append` steps are staged, or on `raster_sync_var` / `raster_close`
+int raster_put_vara_int(int ncid, int varid, const size_t* startp, const size_t* countp, const int* data)
+{
+    int status, ndims; 
+    size_t dimlens[32];
+    status = get_var_dimlens(ncid, varid, &ndims, dimlens);
+    if ((status = check_append(ndims, dimlens, startp, countp)) != NC_NOERR)
+        return status;
+    status = append_var_int(ncid, varid, data, startp[0], countp[0], ndims, dimlens);
+    return status;
+}
+
+int raster_put_vara_float(int ncid, int varid, const size_t* startp, const size_t* countp, const float* data)
+{
+    int status, ndims; 
+    size_t dimlens[32];
+    status = get_var_dimlens(ncid, varid, &ndims, dimlens);
+    if ((status = check_append(ndims, dimlens, startp, countp)) != NC_NOERR)
+        return status;
+    status = append_var_float(ncid, varid, data, startp[0], countp[0], ndims, dimlens);
+    return status;
+}
+
+int raster_put_vara_double(int ncid, int varid, const size_t* startp, const size_t* countp, const double* data)
+{
+    int status, ndims; 
+    size_t dimlens[32];
+    status = get_var_dimlens(ncid, varid, &ndims, dimlens);
+    if ((status = check_append(ndims, dimlens, startp, countp)) != NC_NOERR)
+        return status;
+    status = append_var_double(ncid, varid, data, startp[0], countp[0], ndims, dimlens);
+    return status;
+}
+
+int raster_put_vara_char(int ncid, int varid, const size_t* startp, const size_t* countp, const char* data)
+{
+    int status, ndims; 
+    size_t dimlens[32];
+    status = get_var_dimlens(ncid, varid, &ndims, dimlens);
+    if ((status = check_append(ndims, dimlens, startp, countp)) != NC_NOERR)
+        return status;
+    status = append_var_char(ncid, varid, data, startp[0], countp[0], ndims, dimlens);
+    return status;
+}
+
+// This function converts the netCDF variable `in_varid` of file `in_ncid` into `varid`, without
+// holding the whole variable in memory: at most `max_bytes` of steps along the leading dimension
+// are read with `nc_get_vara_*`, then appended as one slab. Both variables must have the same shape.
+// The `_FillValue` of `in_varid`, else its `missing_value`, becomes the fill value of `varid`
+int raster_put_var_from_nc(int ncid, int varid, int in_ncid, int in_varid, size_t max_bytes)
+{
+    int status, ndims, in_ndims, xtype, in_dimids[32];
+    size_t dimlens[32], in_dimlens[32], elemsize, step_bytes = 1, nsteps, start[32] = {0}, count[32];
+    double fill;
+    void* buffer;
+    status = get_var_dimlens(ncid, varid, &ndims, dimlens);
+    status = nc_get_att_int(varid, NC_GLOBAL, "_xtype_", &xtype);
+    if ((status = nc_inq_varndims(in_ncid, in_varid, &in_ndims)) != NC_NOERR)
+        return status;
+    status = nc_inq_vardimid(in_ncid, in_varid, in_dimids);
+    for (int i = 0; i < in_ndims; i++)
+        status = nc_inq_dimlen(in_ncid, in_dimids[i], &in_dimlens[i]);
+    if (ndims != in_ndims || ndims < 3)
+        return NC_EINVAL;
+    for (int i = 1; i < ndims; i++)
+    {
+        if (dimlens[i] != in_dimlens[i])
+            return NC_EINVAL;
+        step_bytes *= dimlens[i];
+    }
+    switch (xtype)
+    {
+        case NC_INT: elemsize = sizeof(int); break;
+        case NC_FLOAT: elemsize = sizeof(float); break;
+        case NC_DOUBLE: elemsize = sizeof(double); break;
+        case NC_CHAR: elemsize = sizeof(char); break;
+        default: return NC_EBADTYPE;
+    }
+    step_bytes *= elemsize;
+    nsteps = max_bytes / step_bytes;
+    nsteps = (nsteps < 1) ? 1 : nsteps;
+    nsteps = (nsteps > in_dimlens[0]) ? in_dimlens[0] : nsteps;
+    if (nc_get_att_double(in_ncid, in_varid, "_FillValue", &fill) == NC_NOERR ||
+        nc_get_att_double(in_ncid, in_varid, "missing_value", &fill) == NC_NOERR)
+        if ((status = raster_def_var_fill(ncid, varid, fill)) != NC_NOERR)
+            return status;
+    if ((status = raster_def_var_append(ncid, varid, (int)nsteps)) != NC_NOERR)
+        return status;
+    if ((buffer = malloc(nsteps * step_bytes)) == NULL)
+        return NC_ENOMEM;
+
+    memcpy(count, in_dimlens, sizeof(size_t) * ndims);
+    for (start[0] = 0; start[0] < in_dimlens[0] && status == NC_NOERR; start[0] += count[0])
+    {
+        count[0] = (in_dimlens[0] - start[0] < nsteps) ? in_dimlens[0] - start[0] : nsteps;
+        switch (xtype)
+        {
+        case NC_INT:
+            if ((status = nc_get_vara_int(in_ncid, in_varid, start, count, (int*)buffer)) == NC_NOERR)
+                status = raster_put_vara_int(ncid, varid, start, count, (const int*)buffer);
+            break;
+        case NC_FLOAT:
+            if ((status = nc_get_vara_float(in_ncid, in_varid, start, count, (float*)buffer)) == NC_NOERR)
+                status = raster_put_vara_float(ncid, varid, start, count, (const float*)buffer);
+            break;
+        case NC_DOUBLE:
+            if ((status = nc_get_vara_double(in_ncid, in_varid, start, count, (double*)buffer)) == NC_NOERR)
+                status = raster_put_vara_double(ncid, varid, start, count, (const double*)buffer);
+            break;
+        case NC_CHAR:
+            if ((status = nc_get_vara_text(in_ncid, in_varid, start, count, (char*)buffer)) == NC_NOERR)
+                status = raster_put_vara_char(ncid, varid, start, count, (const char*)buffer);
+            break;
+        }
+    }
+    if (status == NC_NOERR)
+        status = raster_sync_var(ncid, varid);
+    free(buffer);
+    return status;
+}
+
+// This function writes the staged steps of `varid` as a (possibly short) slab
+int raster_sync_var(int ncid, int varid)
+{
+    drain_writes();
+    return flush_var(ncid, varid);
+}
+
+// This function writes the staged steps of all variables of `ncid`, then closes the file and drops
+// what is cached for it. Files read or written through `raster_*` must be closed by it
+int raster_close(int ncid)
+{
+    int status, ret;
+    drain_writes();
+    status = wait_all_writes(ncid);
+    ret = flush_file(ncid);
+    status = (status != NC_NOERR) ? status : ret;
+    ret = nc_close(ncid);
+    // its group ids are reused by the next file opened
+    unbind_file(ncid);
+    invalidate_meta_cache(ncid);
+    invalidate_chunk_cache(ncid);
+    return (status != NC_NOERR) ? status : ret;
+}
+
+
+// These functions are the asynchronous `raster_put_var_*` / `raster_put_vara_*`, they return once
+// `data` is copied into a staging buffer, which a background thread writes to the file.
+// The call blocks while staging buffers exceed the budget set by `raster_set_write_buffer`.
+// `*requestp` identifies the write for `raster_wait`. Synchronous calls wait for pending writes
+int raster_iput_var_int(int ncid, int varid, const int* data, int* requestp)
+{
+    int status, ndims; 
+    size_t dimlens[32];
+    status = read_var_dimlens_async(ncid, varid, &ndims, dimlens);
+    status = iwrite_var(ncid, varid, NC_INT, data, ndims, dimlens, requestp);
+    return status;
+}
+
+int raster_iput_var_float(int ncid, int varid, const float* data, int* requestp)
+{
+    int status, ndims; 
+    size_t dimlens[32];
+    status = read_var_dimlens_async(ncid, varid, &ndims, dimlens);
+    status = iwrite_var(ncid, varid, NC_FLOAT, data, ndims, dimlens, requestp);
+    return status;
+}
+
+int raster_iput_var_double(int ncid, int varid, const double* data, int* requestp)
+{
+    int status, ndims; 
+    size_t dimlens[32];
+    status = read_var_dimlens_async(ncid, varid, &ndims, dimlens);
+    status = iwrite_var(ncid, varid, NC_DOUBLE, data, ndims, dimlens, requestp);
+    return status;
+}
+
+int raster_iput_var_char(int ncid, int varid, const char* data, int* requestp)
+{
+    int status, ndims; 
+    size_t dimlens[32];
+    status = read_var_dimlens_async(ncid, varid, &ndims, dimlens);
+    status = iwrite_var(ncid, varid, NC_CHAR, data, ndims, dimlens, requestp);
+    return status;
+}
+
+int raster_iput_vara_int(int ncid, int varid, const size_t* startp, const size_t* countp, const int* data, int* requestp)
+{
+    int status, ndims; 
+    size_t dimlens[32];
+    status = read_var_dimlens_async(ncid, varid, &ndims, dimlens);
+    if ((status = check_append(ndims, dimlens, startp, countp)) != NC_NOERR)
+        return status;
+    status = iappend_var(ncid, varid, NC_INT, data, startp[0], countp[0], ndims, dimlens, requestp);
+    return status;
+}
+
+int raster_iput_vara_float(int ncid, int varid, const size_t* startp, const size_t* countp, const float* data, int* requestp)
+{
+    int status, ndims; 
+    size_t dimlens[32];
+    status = read_var_dimlens_async(ncid, varid, &ndims, dimlens);
+    if ((status = check_append(ndims, dimlens, startp, countp)) != NC_NOERR)
+        return status;
+    status = iappend_var(ncid, varid, NC_FLOAT, data, startp[0], countp[0], ndims, dimlens, requestp);
+    return status;
+}
+
+int raster_iput_vara_double(int ncid, int varid, const size_t* startp, const size_t* countp, const double* data, int* requestp)
+{
+    int status, ndims; 
+    size_t dimlens[32];
+    status = read_var_dimlens_async(ncid, varid, &ndims, dimlens);
+    if ((status = check_append(ndims, dimlens, startp, countp)) != NC_NOERR)
+        return status;
+    status = iappend_var(ncid, varid, NC_DOUBLE, data, startp[0], countp[0], ndims, dimlens, requestp);
+    return status;
+}
+
+int raster_iput_vara_char(int ncid, int varid, const size_t* startp, const size_t* countp, const char* data, int* requestp)
+{
+    int status, ndims; 
+    size_t dimlens[32];
+    status = read_var_dimlens_async(ncid, varid, &ndims, dimlens);
+    if ((status = check_append(ndims, dimlens, startp, countp)) != NC_NOERR)
+        return status;
+    status = iappend_var(ncid, varid, NC_CHAR, data, startp[0], countp[0], ndims, dimlens, requestp);
+    return status;
+}
+
+// This function blocks until the asynchronous write `request` is done, and returns its status
+int raster_wait(int ncid, int request)
+{
+    (void) ncid;
+    return wait_write(request);
+}
+
+// This function queues a read of region `maskid` of `varid` on the background thread and returns
+// at once. It loads the region metadata, and its decoded chunks only with the chunk cache on
+// (`raster_set_chunk_cache`); with it off, the default, a later read still reads every chunk.
+// Reads do not wait for queued prefetches: they take turns with a running one on netCDF calls,
+// which lets go while it decodes. Chunks it already loaded are served from memory, those it is
+// loading are waited for, and the others are read as usual. `*requestp` identifies it for
+// `raster_wait`, a NULL `requestp` drops its status. Chunks over the cache budget are not kept
+int raster_prefetch_region(int ncid, int varid, int maskid, int* requestp)
+{
+    int status, ndims, xtype;
+    size_t dimlens[32];
+    status = read_var_dimlens_async(ncid, varid, &ndims, dimlens);
+    if (status != NC_NOERR)
+        return status;
+    lock_io();
+    status = nc_get_att_int(varid, NC_GLOBAL, "_xtype_", &xtype);
+    unlock_io();
+    if (status != NC_NOERR)
+        return status;
+    return iprefetch_region(ncid, varid, xtype, maskid, ndims, dimlens, requestp);
+}
+
+// This function blocks until all asynchronous writes to `ncid` are done, and returns the first error
+int raster_wait_all(int ncid)
+{
+    return wait_all_writes(ncid);
+}
+
+// This function bounds the bytes held by staging buffers of asynchronous writes, default is
+// `WRITE_BUFFER_BYTES`. Twice the size of one write lets a write overlap the next computation
+int raster_set_write_buffer(size_t nbytes)
+{
+    return set_write_budget(nbytes);
+}
+
+// These functions set the budget of the metadata cache in bytes, `META_CACHE_BYTES` by default,
+// and return its counters. Entries over a smaller budget are evicted right away
+int raster_set_meta_cache(size_t nbytes)
+{
+    return set_meta_cache_bytes(nbytes);
+}
+
+int raster_inq_meta_cache(raster_cache_stats_t* stats)
+{
+    return inq_meta_cache(stats);
+}
+
+// These functions set the budget in bytes and the eviction policy (RASTER_CACHE_*) of the cache of
+// decoded chunks, and return its counters. It is off by default, a zero budget turns it off again
+int raster_set_chunk_cache(size_t nbytes, int policy)
+{
+    return set_chunk_cache(nbytes, policy);
+}
+
+int raster_inq_chunk_cache(raster_cache_stats_t* stats)
+{
+    return inq_chunk_cache(stats);
+}
 
 // These functions reads data to the given variable `varid`, region = `maskid` 
 // It invokes `read_region_*` function in `read_region.h`, which 
@@ -136,8 +688,9 @@ int raster_get_region_int(int ncid, int varid, int maskid, int* data)
 {
     int status, ndims; 
     size_t dimlens[32];
-    status = get_var_dimlens(ncid, varid, &ndims, dimlens);
+    status = begin_read(ncid, varid, &ndims, dimlens);
     status = read_region_int(ncid, varid, data, dimlens, maskid, 1);
+    end_read();
     return status;
 }
 
@@ -145,8 +698,9 @@ int raster_get_region_float(int ncid, int varid, int maskid, float* data)
 {
     int status, ndims; 
     size_t dimlens[32];
-    status = get_var_dimlens(ncid, varid, &ndims, dimlens);
+    status = begin_read(ncid, varid, &ndims, dimlens);
     status = read_region_float(ncid, varid, data, dimlens, maskid, 1);
+    end_read();
     return status;
 }
 
@@ -154,8 +708,9 @@ int raster_get_region_double(int ncid, int varid, int maskid, double* data)
 {
     int status, ndims; 
     size_t dimlens[32];
-    status = get_var_dimlens(ncid, varid, &ndims, dimlens);
+    status = begin_read(ncid, varid, &ndims, dimlens);
     status = read_region_double(ncid, varid, data, dimlens, maskid, 1);
+    end_read();
     return status;
 }
 
@@ -163,8 +718,134 @@ int raster_get_region_char(int ncid, int varid, int maskid, char* data)
 {
     int status, ndims; 
     size_t dimlens[32];
-    status = get_var_dimlens(ncid, varid, &ndims, dimlens);
+    status = begin_read(ncid, varid, &ndims, dimlens);
     status = read_region_char(ncid, varid, data, dimlens, maskid, 1);
+    end_read();
+    return status;
+}
+
+// This function starts logging reads of regions and variables to `path`, see AccessLog.h for
+// the format. NULL stops logging. The `RASTER_ACCESS_LOG` environment variable sets it at startup
+int raster_set_access_log(const char* path)
+{
+    return set_access_log(path);
+}
+
+// These functions read region `maskid` over steps [start, start + count) of the leading dimension,
+// `data` holds those `count` steps only. Slabs outside the steps are not read
+int raster_get_region_steps_int(int ncid, int varid, int maskid, size_t start, size_t count, int* data)
+{
+    int status, ndims; 
+    size_t dimlens[32];
+    status = begin_read(ncid, varid, &ndims, dimlens);
+    if (ndims < 3 || count == 0)
+    {
+        end_read();
+        return NC_EINVAL;
+    }
+    status = read_region_steps_int(ncid, varid, data, dimlens, maskid, start, count);
+    end_read();
+    return status;
+}
+
+int raster_get_region_steps_float(int ncid, int varid, int maskid, size_t start, size_t count, float* data)
+{
+    int status, ndims; 
+    size_t dimlens[32];
+    status = begin_read(ncid, varid, &ndims, dimlens);
+    if (ndims < 3 || count == 0)
+    {
+        end_read();
+        return NC_EINVAL;
+    }
+    status = read_region_steps_float(ncid, varid, data, dimlens, maskid, start, count);
+    end_read();
+    return status;
+}
+
+int raster_get_region_steps_double(int ncid, int varid, int maskid, size_t start, size_t count, double* data)
+{
+    int status, ndims; 
+    size_t dimlens[32];
+    status = begin_read(ncid, varid, &ndims, dimlens);
+    if (ndims < 3 || count == 0)
+    {
+        end_read();
+        return NC_EINVAL;
+    }
+    status = read_region_steps_double(ncid, varid, data, dimlens, maskid, start, count);
+    end_read();
+    return status;
+}
+
+int raster_get_region_steps_char(int ncid, int varid, int maskid, size_t start, size_t count, char* data)
+{
+    int status, ndims; 
+    size_t dimlens[32];
+    status = begin_read(ncid, varid, &ndims, dimlens);
+    if (ndims < 3 || count == 0)
+    {
+        end_read();
+        return NC_EINVAL;
+    }
+    status = read_region_steps_char(ncid, varid, data, dimlens, maskid, start, count);
+    end_read();
+    return status;
+}
+
+// These functions read the cells of region `maskid` satisfying `op` (RASTER_PRED_*) against `value`,
+// other cells of `data` are left as they are. Chunks whose value range recorded by the writer
+// cannot satisfy the predicate are not read. NaNs and fill values never match
+int raster_get_region_where_int(int ncid, int varid, int maskid, int op, double value, int* data)
+{
+    int status, ndims; 
+    size_t dimlens[32];
+    status = begin_read(ncid, varid, &ndims, dimlens);
+    status = read_region_where_int(ncid, varid, data, dimlens, maskid, op, value);
+    end_read();
+    return status;
+}
+
+int raster_get_region_where_float(int ncid, int varid, int maskid, int op, double value, float* data)
+{
+    int status, ndims; 
+    size_t dimlens[32];
+    status = begin_read(ncid, varid, &ndims, dimlens);
+    status = read_region_where_float(ncid, varid, data, dimlens, maskid, op, value);
+    end_read();
+    return status;
+}
+
+int raster_get_region_where_double(int ncid, int varid, int maskid, int op, double value, double* data)
+{
+    int status, ndims; 
+    size_t dimlens[32];
+    status = begin_read(ncid, varid, &ndims, dimlens);
+    status = read_region_where_double(ncid, varid, data, dimlens, maskid, op, value);
+    end_read();
+    return status;
+}
+
+int raster_get_region_where_char(int ncid, int varid, int maskid, int op, double value, char* data)
+{
+    int status, ndims; 
+    size_t dimlens[32];
+    status = begin_read(ncid, varid, &ndims, dimlens);
+    status = read_region_where_char(ncid, varid, data, dimlens, maskid, op, value);
+    end_read();
+    return status;
+}
+
+// This function returns the aggregates of region `maskid` at steps [start, start + count) of the
+// leading dimension, one `raster_region_stats_t` per step; a 2D variable has the single step 0.
+// They are computed from the mask while the variable is written, so no chunk is read
+int raster_get_region_stats(int ncid, int varid, int maskid, size_t start, size_t count, raster_region_stats_t* stats)
+{
+    int status, ndims; 
+    size_t dimlens[32];
+    status = begin_read(ncid, varid, &ndims, dimlens);
+    status = read_region_stats(varid, maskid, start, count, stats, dimlens);
+    end_read();
     return status;
 }
 
@@ -172,8 +853,9 @@ int raster_get_var_int(int ncid, int varid, int* data)
 {
     int status, ndims; 
     size_t dimlens[32];
-    status = get_var_dimlens(ncid, varid, &ndims, dimlens);
+    status = begin_read(ncid, varid, &ndims, dimlens);
     status = read_var_int(ncid, varid, data, dimlens);
+    end_read();
     return status;
 }
 
@@ -181,8 +863,9 @@ int raster_get_var_float(int ncid, int varid, float* data)
 {
     int status, ndims; 
     size_t dimlens[32];
-    status = get_var_dimlens(ncid, varid, &ndims, dimlens);
+    status = begin_read(ncid, varid, &ndims, dimlens);
     status = read_var_float(ncid, varid, data, dimlens);
+    end_read();
     return status;
 }
 
@@ -190,8 +873,9 @@ int raster_get_var_double(int ncid, int varid, double* data)
 {
     int status, ndims; 
     size_t dimlens[32];
-    status = get_var_dimlens(ncid, varid, &ndims, dimlens);
+    status = begin_read(ncid, varid, &ndims, dimlens);
     status = read_var_double(ncid, varid, data, dimlens);
+    end_read();
     return status;
 }
 
@@ -199,31 +883,51 @@ int raster_get_var_char(int ncid, int varid, char* data)
 {
     int status, ndims; 
     size_t dimlens[32];
-    status = get_var_dimlens(ncid, varid, &ndims, dimlens);
+    status = begin_read(ncid, varid, &ndims, dimlens);
     status = read_var_char(ncid, varid, data, dimlens);
+    end_read();
     return status;
 }
 
+// These functions read the box [startp, startp + countp) of `varid` into `data`, which holds the box
+// only. Chunks intersecting the box are found by a spatial index over all regions, built on the
+// first call, and only their parts inside the box are copied
 int raster_get_vara_int(int ncid, int varid, size_t* startp, size_t* countp, int* data)
 {
-    int status = NC_NOERR;
+    int status, ndims; 
+    size_t dimlens[32];
+    status = begin_read(ncid, varid, &ndims, dimlens);
+    status = read_vara_int(ncid, varid, startp, countp, data, dimlens);
+    end_read();
     return status;
 }
 
 int raster_get_vara_float(int ncid, int varid, size_t* startp, size_t* countp, float* data)
 {
-    int status = NC_NOERR;
+    int status, ndims; 
+    size_t dimlens[32];
+    status = begin_read(ncid, varid, &ndims, dimlens);
+    status = read_vara_float(ncid, varid, startp, countp, data, dimlens);
+    end_read();
     return status;
 }
 
 int raster_get_vara_double(int ncid, int varid, size_t* startp, size_t* countp, double* data)
 {
-    int status = NC_NOERR;
+    int status, ndims; 
+    size_t dimlens[32];
+    status = begin_read(ncid, varid, &ndims, dimlens);
+    status = read_vara_double(ncid, varid, startp, countp, data, dimlens);
+    end_read();
     return status;
 }
 
 int raster_get_vara_char(int ncid, int varid, size_t* startp, size_t* countp, char* data)
 {
-    int status = NC_NOERR;
+    int status, ndims; 
+    size_t dimlens[32];
+    status = begin_read(ncid, varid, &ndims, dimlens);
+    status = read_vara_char(ncid, varid, startp, countp, data, dimlens);
+    end_read();
     return status;
 }
\ No newline at end of file
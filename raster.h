@@ -10,8 +10,70 @@ extern "C" {
 #include <stdlib.h>
 #include "config.h"
 
+// storage of the chunks in a region group
+#define RASTER_STORAGE_CHUNKED  0   // one netCDF variable per chunk
+#define RASTER_STORAGE_PACKED   1   // all chunks in one variable, located by an offset table
+
+// codec policies of `raster_def_region_codec`
+#define RASTER_CODEC_AUTO       0   // chosen from sampled chunks of the region
+#define RASTER_CODEC_NONE       1   // stored raw, for regions read often
+#define RASTER_CODEC_MAX        2   // the strongest codec of this build, for regions rarely read
+
+// predicates of `raster_get_region_where_*`, comparing each cell to a value
+#define RASTER_PRED_LT          0
+#define RASTER_PRED_LE          1
+#define RASTER_PRED_GT          2
+#define RASTER_PRED_GE          3
+#define RASTER_PRED_EQ          4
+
+// eviction policies of `raster_set_chunk_cache`
+#define RASTER_CACHE_LRU        0   // least recently read chunk first
+#define RASTER_CACHE_FIFO       1   // oldest chunk first, for scans reading each chunk once
+
+// options of `raster_def_var_chunking_ext`, zero fields take their defaults
+typedef struct raster_chunking_t
+{
+    int     nx;                 // grid divisions along rows, 0 derives it from `target_bytes` and the mask
+    int     ny;                 // grid divisions along columns, 0 derives it from `target_bytes` and the mask
+    size_t  target_bytes;       // bytes of a grid chunk before merging, default `TARGET_CHUNK_BYTES`
+    size_t  max_chunk_bytes;    // merged chunks never exceed it, default `MAX_CHUNK_BYTES`
+    double  merge_threshold;    // chunks wider than this fraction of the columns are not merged, default 1
+} raster_chunking_t;
+
+// aggregates of `raster_get_region_stats` over the cells of a region at one step of the leading
+// dimension, NaNs and fill values left out. `min` and `max` are NaN if `count` is zero
+typedef struct raster_region_stats_t
+{
+    size_t  count;
+    double  sum;
+    double  sum_squares;
+    double  min;
+    double  max;
+} raster_region_stats_t;
+
+// counters of the metadata and chunk caches, see `raster_inq_meta_cache` / `raster_inq_chunk_cache`
+typedef struct raster_cache_stats_t
+{
+    unsigned long long  hits;
+    unsigned long long  misses;
+    unsigned long long  evictions;
+    size_t              entries;
+    size_t              bytes;          // estimated size of the cached entries
+    size_t              capacity;
+} raster_cache_stats_t;
+
 int get_var_dimlens(int ncid, int varid, int* ndims, size_t* dimlens);
 int raster_def_var_chunking(int ncid, int varid, int* mask);
+int raster_def_var_chunking_ext(int ncid, int varid, int* mask, const raster_chunking_t* options);
+int raster_def_var_chunking_steps(int ncid, int varid, int* mask);
+int raster_def_var_chunking_hier(int ncid, int varid, int* mask, int nlinks, const int* child_ids, const int* parent_ids,
+                                 int level);
+int raster_def_var_chunking_hier_ext(int ncid, int varid, int* mask, int nlinks, const int* child_ids,
+                                     const int* parent_ids, int level, const raster_chunking_t* options);
+int raster_def_var_storage(int ncid, int varid, int storage);
+int raster_def_var_append(int ncid, int varid, int nsteps_per_flush);
+int raster_def_region_codec(int ncid, int varid, int maskid, int policy);
+int raster_def_var_fill(int ncid, int varid, double fill);
 int raster_def_var(int ncid, const char* name, nc_type xtype, int ndims, int* dimidp, int* varidp);
 
 int raster_inq_varid(int ncid, const char* varname, int* varidp);
@@ -23,11 +85,53 @@ int raster_put_var_float(int ncid, int varid, const float* data);
 int raster_put_var_double(int ncid, int varid, const double* data);
 int raster_put_var_char(int ncid, int varid, const char* data);
 
+int raster_put_vara_int(int ncid, int varid, const size_t* startp, const size_t* countp, const int* data);
+int raster_put_vara_float(int ncid, int varid, const size_t* startp, const size_t* countp, const float* data);
+int raster_put_vara_double(int ncid, int varid, const size_t* startp, const size_t* countp, const double* data);
+int raster_put_vara_char(int ncid, int varid, const size_t* startp, const size_t* countp, const char* data);
+int raster_sync_var(int ncid, int varid);
+int raster_put_var_from_nc(int ncid, int varid, int in_ncid, int in_varid, size_t max_bytes);
+
+int raster_iput_var_int(int ncid, int varid, const int* data, int* requestp);
+int raster_iput_var_float(int ncid, int varid, const float* data, int* requestp);
+int raster_iput_var_double(int ncid, int varid, const double* data, int* requestp);
+int raster_iput_var_char(int ncid, int varid, const char* data, int* requestp);
+int raster_iput_vara_int(int ncid, int varid, const size_t* startp, const size_t* countp, const int* data, int* requestp);
+int raster_iput_vara_float(int ncid, int varid, const size_t* startp, const size_t* countp, const float* data, int* requestp);
+int raster_iput_vara_double(int ncid, int varid, const size_t* startp, const size_t* countp, const double* data, int* requestp);
+int raster_iput_vara_char(int ncid, int varid, const size_t* startp, const size_t* countp, const char* data, int* requestp);
+int raster_prefetch_region(int ncid, int varid, int maskid, int* requestp);
+int raster_wait(int ncid, int request);
+int raster_wait_all(int ncid);
+int raster_set_write_buffer(size_t nbytes);
+// Files read or written through these functions are closed by `raster_close`, not `nc_close`, which
+// would lose staged steps. netCDF gives the ids of a closed file to the next one opened, what is
+// cached for them is dropped when a reused id is met with another path
+int raster_close(int ncid);
+
+int raster_set_access_log(const char* path);
+int raster_set_meta_cache(size_t nbytes);
+int raster_inq_meta_cache(raster_cache_stats_t* stats);
+int raster_set_chunk_cache(size_t nbytes, int policy);
+int raster_inq_chunk_cache(raster_cache_stats_t* stats);
+
 int raster_get_region_int(int ncid, int varid, int maskid, int* data);
 int raster_get_region_float(int ncid, int varid, int maskid, float* data);
 int raster_get_region_double(int ncid, int varid, int maskid, double* data);
 int raster_get_region_char(int ncid, int varid, int maskid, char* data);
 
+int raster_get_region_steps_int(int ncid, int varid, int maskid, size_t start, size_t count, int* data);
+int raster_get_region_steps_float(int ncid, int varid, int maskid, size_t start, size_t count, float* data);
+int raster_get_region_steps_double(int ncid, int varid, int maskid, size_t start, size_t count, double* data);
+int raster_get_region_steps_char(int ncid, int varid, int maskid, size_t start, size_t count, char* data);
+
+int raster_get_region_where_int(int ncid, int varid, int maskid, int op, double value, int* data);
+int raster_get_region_where_float(int ncid, int varid, int maskid, int op, double value, float* data);
+int raster_get_region_where_double(int ncid, int varid, int maskid, int op, double value, double* data);
+int raster_get_region_where_char(int ncid, int varid, int maskid, int op, double value, char* data);
+
+int raster_get_region_stats(int ncid, int varid, int maskid, size_t start, size_t count, raster_region_stats_t* stats);
+
 int raster_get_var_int(int ncid, int varid, int* data);
 int raster_get_var_float(int ncid, int varid, float* data);
 int raster_get_var_double(int ncid, int varid, double* data);
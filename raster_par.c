@@ -0,0 +1,41 @@
+#include "raster_par.h"
+#include "ChunkDataWriter.h"
+
+// These functions write the given variable `varid` from all ranks of `comm` collectively.
+// Region groups and chunk variables are defined by all ranks, each rank encodes and writes
+// a disjoint set of chunks, balanced by chunk size
+int raster_put_var_par_int(int ncid, int varid, MPI_Comm comm, const int* data)
+{
+    int status, ndims; 
+    size_t dimlens[32];
+    status = get_var_dimlens(ncid, varid, &ndims, dimlens);
+    status = write_var_par_int(ncid, varid, comm, data, dimlens);
+    return status;
+}
+
+int raster_put_var_par_float(int ncid, int varid, MPI_Comm comm, const float* data)
+{
+    int status, ndims; 
+    size_t dimlens[32];
+    status = get_var_dimlens(ncid, varid, &ndims, dimlens);
+    status = write_var_par_float(ncid, varid, comm, data, dimlens);
+    return status;
+}
+
+int raster_put_var_par_double(int ncid, int varid, MPI_Comm comm, const double* data)
+{
+    int status, ndims; 
+    size_t dimlens[32];
+    status = get_var_dimlens(ncid, varid, &ndims, dimlens);
+    status = write_var_par_double(ncid, varid, comm, data, dimlens);
+    return status;
+}
+
+int raster_put_var_par_char(int ncid, int varid, MPI_Comm comm, const char* data)
+{
+    int status, ndims; 
+    size_t dimlens[32];
+    status = get_var_dimlens(ncid, varid, &ndims, dimlens);
+    status = write_var_par_char(ncid, varid, comm, data, dimlens);
+    return status;
+}
@@ -0,0 +1,25 @@
+#ifndef __NC_REGION_PAR_H__
+#define __NC_REGION_PAR_H__
+#include <mpi.h>
+#include <netcdf_par.h>
+#include "raster.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Parallel writes into one file created by `nc_create_par`. All ranks of `comm` call every
+// define (`raster_def_var`, `raster_def_var_chunking`, ...) with the same arguments, then
+// `raster_put_var_par_*` collectively, each with the whole variable in `data`.
+// There is no per-rank hyperslab: a chunk covers every step of its cells, so the rank that writes
+// it needs all of them, and rank 0 computes the region statistics from `data`. Every rank thus
+// holds the whole variable in memory; the ranks split the gather, compression and I/O of the chunks
+int raster_put_var_par_int(int ncid, int varid, MPI_Comm comm, const int* data);
+int raster_put_var_par_float(int ncid, int varid, MPI_Comm comm, const float* data);
+int raster_put_var_par_double(int ncid, int varid, MPI_Comm comm, const double* data);
+int raster_put_var_par_char(int ncid, int varid, MPI_Comm comm, const char* data);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
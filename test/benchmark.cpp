@@ -51,7 +51,7 @@ int main(int argc, char **argv)
     auto t1 = high_resolution_clock::now();
     status = nc_get_var(ncid, varid, buffer); ERR;
     auto t2 = high_resolution_clock::now();
-    status = nc_close(ncid); ERR;
+    status = raster_close(ncid); ERR;
     printf("Time_netCDF_Read=%fs\n", duration_cast<microseconds>(t2 - t1).count() / 1000000.0);
     MPI_Barrier(MPI_COMM_WORLD);
 
@@ -66,7 +66,7 @@ int main(int argc, char **argv)
     auto t3 = high_resolution_clock::now();
     status = raster_get_var_float(ncid, varid, buffer); ERR;
     auto t4 = high_resolution_clock::now();
-    status = nc_close(ncid); ERR;
+    status = raster_close(ncid); ERR;
     printf("Time_RASTER_Read=%fs\n", duration_cast<microseconds>(t4 - t3).count() / 1000000.0);
     MPI_Barrier(MPI_COMM_WORLD);
 
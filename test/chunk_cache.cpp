@@ -0,0 +1,168 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <netcdf.h>
+#include <mpi.h>
+#include "../raster.h"
+#include "../ChunkCache.h"
+#include "test_files.h"
+#define ERR do{if (status != NC_NOERR){ fprintf(stderr, "Error: at line %d, %s\n", __LINE__, nc_strerror(status)); exit(status);} } while(0);
+#define CHECK(cond, what) do{if (!(cond)){ fprintf(stderr, "Failed: %s\n", what); exit(1);} } while(0);
+
+// Checks the cache of decoded chunks: region reads served from it match reads through a cold
+// cache, also once the file is closed and opened again, or another file gets its id, and while the
+// next region is prefetched. Then the eviction policies and the coalescing of loads of the cache itself
+static const test_grid_t GRID = {2, 120, 160, 20, 30, 3, 6, 0};
+static const int NY = GRID.m_ny, NX = GRID.m_nx, NREGIONS = GRID.m_nregions;
+
+// every region of `path` read twice, the second read is served from the cache, both as written
+static void check_file(const std::string& path, int shift, float base, bool expect_hits)
+{
+    int status, ncid, varid;
+    raster_cache_stats_t before, after;
+    status = nc_open(path.c_str(), NC_NOWRITE, &ncid); ERR;
+    status = raster_inq_varid(ncid, "v", &varid); ERR;
+    status = raster_inq_chunk_cache(&before); ERR;
+    for (int m = 1; m <= NREGIONS; m++)
+    {
+        std::vector<float> cold(2 * NY * NX, -1), warm(2 * NY * NX, -1);
+        status = raster_get_region_float(ncid, varid, m, cold.data()); ERR;
+        status = raster_get_region_float(ncid, varid, m, warm.data()); ERR;
+        CHECK(cold == warm, "warm read differs from cold read");
+        size_t ncells = 0;
+        for (size_t k = 0; k < cold.size(); k++)
+        {
+            int i = (k % (NY * NX)) / NX, j = k % NX;
+            CHECK(cold[k] == -1 || cold[k] == test_value_of(GRID, base, k), "read a cell of another file");
+            ncells += (test_region_of(GRID, i, j, shift) == m && cold[k] == test_value_of(GRID, base, k));
+        }
+        CHECK(ncells > 0, "region read nothing");
+    }
+    status = raster_inq_chunk_cache(&after); ERR;
+    CHECK(!expect_hits || after.hits > before.hits, "no read was served from the cache");
+    status = raster_close(ncid); ERR;
+}
+
+// region m read while m + 1 is prefetched, the read does not wait for the prefetch to be done
+static void check_pipeline(const std::string& path)
+{
+    int status, ncid, varid;
+    std::vector<std::vector<float> > cold(NREGIONS + 1, std::vector<float>(2 * NY * NX, -1));
+    status = nc_open(path.c_str(), NC_NOWRITE, &ncid); ERR;
+    status = raster_inq_varid(ncid, "v", &varid); ERR;
+    for (int m = 1; m <= NREGIONS; m++)
+    {
+        status = raster_get_region_float(ncid, varid, m, cold[m].data()); ERR;
+    }
+    status = raster_close(ncid); ERR;
+    status = nc_open(path.c_str(), NC_NOWRITE, &ncid); ERR;
+    status = raster_inq_varid(ncid, "v", &varid); ERR;
+    status = raster_prefetch_region(ncid, varid, 1, NULL); ERR;
+    for (int m = 1; m <= NREGIONS; m++)
+    {
+        std::vector<float> out(2 * NY * NX, -1);
+        if (m < NREGIONS)
+        {
+            status = raster_prefetch_region(ncid, varid, m + 1, NULL); ERR;
+        }
+        status = raster_get_region_float(ncid, varid, m, out.data()); ERR;
+        CHECK(out == cold[m], "read under a prefetch differs from cold read");
+    }
+    status = raster_close(ncid); ERR;
+}
+
+static raster::ChunkCache::value_t chunk_of(size_t nbytes)
+{
+    return std::make_shared<const std::vector<unsigned char> >(nbytes, 1);
+}
+
+static void load(raster::ChunkCache& cache, int chunk)
+{
+    raster::chunk_key_t key{1 << 16, chunk, -1};
+    raster::ChunkCache::lookup_t res = cache.acquire(key);
+    if (res.m_load)
+        cache.put(key, chunk_of(1000));
+}
+
+static bool cached(raster::ChunkCache& cache, int chunk)
+{
+    raster::chunk_key_t key{1 << 16, chunk, -1};
+    raster::ChunkCache::lookup_t res = cache.acquire(key);
+    if (res.m_load)
+        cache.cancel(key);
+    return res.m_value != nullptr;
+}
+
+// room for two chunks: after loading 0, 1, reading 0 again and loading 2, LRU keeps 0 and FIFO keeps 1
+static void check_policies()
+{
+    for (int policy : {RASTER_CACHE_LRU, RASTER_CACHE_FIFO})
+    {
+        raster::ChunkCache cache(2 * 1000 + 2 * 200, policy);
+        load(cache, 0);
+        load(cache, 1);
+        CHECK(cached(cache, 0), "chunk evicted under budget");
+        load(cache, 2);
+        CHECK(cached(cache, 2), "new chunk not kept");
+        if (policy == RASTER_CACHE_LRU)
+            CHECK(cached(cache, 0) && !cached(cache, 1), "LRU did not evict the least recently read chunk");
+        if (policy == RASTER_CACHE_FIFO)
+            CHECK(!cached(cache, 0) && cached(cache, 1), "FIFO did not evict the oldest chunk");
+    }
+}
+
+// one reader loads a chunk, the others wait for that load instead of loading it as well
+static void check_coalescing()
+{
+    raster::ChunkCache cache(1 << 20, RASTER_CACHE_LRU);
+    raster::chunk_key_t key{1 << 16, 7, -1};
+    raster::ChunkCache::lookup_t first = cache.acquire(key);
+    CHECK(first.m_load, "first reader not told to load");
+    std::vector<std::thread> readers;
+    std::vector<int> nloads(4, 0), ngot(4, 0);
+    for (int t = 0; t < 4; t++)
+        readers.emplace_back([&, t]() {
+            raster::ChunkCache::lookup_t res = cache.acquire(key);
+            nloads[t] = res.m_load;
+            ngot[t] = res.m_pending.valid() && res.m_pending.get() != nullptr;
+        });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    cache.put(key, chunk_of(100));
+    for (auto& reader : readers)
+        reader.join();
+    for (int t = 0; t < 4; t++)
+        CHECK(nloads[t] == 0 && ngot[t] == 1, "a waiting reader loaded the chunk again");
+    raster_cache_stats_t stats;
+    cache.get_stats(stats);
+    CHECK(stats.entries == 1, "coalesced load not kept");
+}
+
+int main(int argc, char **argv)
+{
+    MPI_Init(&argc, &argv);
+    if(argc <= 1)
+    {
+        std::cerr << "Usage: ./chunk_cache <OUTPUT_PREFIX>\n";
+        std::cerr << " It writes two small files OUTPUT_PREFIX_a.nc, OUTPUT_PREFIX_b.nc and checks reads through the chunk cache\n";
+        return 1;
+    };
+    std::string a = std::string(argv[1]) + "_a.nc", b = std::string(argv[1]) + "_b.nc";
+    int status;
+    status = raster_set_chunk_cache(64 << 20, RASTER_CACHE_LRU); ERR;
+    status = write_test_file(a, GRID, 0, 0); ERR;
+    status = write_test_file(b, GRID, 7, 100000); ERR;
+    check_file(a, 0, 0, true);
+    // opened again, the cache was dropped on close and is filled again
+    check_file(a, 0, 0, true);
+    // `b` gets the id `a` had
+    check_file(b, 7, 100000, true);
+    check_pipeline(a);
+    check_policies();
+    check_coalescing();
+    status = raster_set_chunk_cache(0, RASTER_CACHE_LRU); ERR;
+    printf("chunk cache: OK\n");
+
+    MPI_Finalize();
+    return 0;
+}
@@ -0,0 +1,166 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <random>
+#include <cstring>
+#include <cmath>
+#include <stdexcept>
+#include <mpi.h>
+#include "../ChunkCodec.h"
+#define CHECK(cond, what) do{if (!(cond)){ fprintf(stderr, "Failed: %s\n", what); exit(1);} } while(0);
+
+// Encodes and decodes chunks with every codec the zip level detector tries, the strongest codec
+// and no codec, over constant, random, smooth and repeating inputs of sizes from 1 byte up, with
+// element sizes that do and do not divide them. Blobs are also decoded from an odd address, as
+// netCDF buffers may hold them, and truncated or damaged blobs must be rejected.
+static const size_t SIZES[] = {1, 2, 3, 4, 5, 7, 16, 255, 1001, 4096, 65537, 300000};
+static const int ELEMSIZES[] = {1, 2, 3, 4, 5, 8};
+
+static std::vector<unsigned char> make_input(const std::string& kind, size_t nbytes, std::mt19937& rng)
+{
+    std::vector<unsigned char> data(nbytes);
+    if (kind == "constant")
+        std::fill(data.begin(), data.end(), (unsigned char)0x5a);
+    else if (kind == "random")
+        for (size_t k = 0; k < nbytes; k++)
+            data[k] = (unsigned char)rng();
+    else if (kind == "smooth")
+    {
+        // float field, so that shuffling groups the slowly changing high bytes
+        for (size_t k = 0; k + sizeof(float) <= nbytes; k += sizeof(float))
+        {
+            float v = 280.0f + 10.0f * std::sin(k * 0.0005f);
+            memcpy(&data[k], &v, sizeof(float));
+        }
+    }
+    else
+    {
+        // random blocks repeated at distances below and above the RLZ window
+        size_t period = (nbytes / 3) | 1;
+        for (size_t k = 0; k < nbytes; k++)
+            data[k] = k < period ? (unsigned char)rng() : data[k - period];
+    }
+    return data;
+}
+
+static std::string name_of(const raster::codec_t& codec)
+{
+    return std::to_string((int)codec.m_codec) + "/" + std::to_string(codec.m_filter) + "/" + std::to_string(codec.m_level);
+}
+
+static bool rejected(const std::vector<unsigned char>& blob, size_t capacity)
+{
+    std::vector<unsigned char> out(capacity);
+    try
+    {
+        raster::decode_chunk(blob.data(), blob.size(), out.data(), capacity);
+    }
+    catch (const std::runtime_error&)
+    {
+        return true;
+    }
+    return false;
+}
+
+static void round_trip(const raster::codec_t& codec, const std::vector<unsigned char>& data, int elemsize,
+                       const std::string& what)
+{
+    std::vector<unsigned char> blob, out(data.size() + 1, 0xee), shifted;
+    raster::encode_chunk(data.data(), data.size(), elemsize, codec, blob);
+    CHECK(blob.size() >= sizeof(raster::codec_header_t), ("short blob, " + what).c_str());
+    CHECK(blob.size() <= sizeof(raster::codec_header_t) + data.size(), ("blob larger than its input, " + what).c_str());
+    CHECK(raster::decoded_size(blob.data(), blob.size()) == data.size(), ("decoded size, " + what).c_str());
+
+    // decoded from an odd address, the byte past the chunk is left alone
+    shifted.resize(blob.size() + 1);
+    memcpy(shifted.data() + 1, blob.data(), blob.size());
+    size_t n = raster::decode_chunk(shifted.data() + 1, blob.size(), out.data(), data.size());
+    CHECK(n == data.size(), ("decoded byte count, " + what).c_str());
+    CHECK(std::equal(data.begin(), data.end(), out.begin()), ("decoded bytes, " + what).c_str());
+    CHECK(out[data.size()] == 0xee, ("write past the chunk, " + what).c_str());
+
+    // truncated blobs, a blob missing its header, a foreign magic, a newer version, a short buffer
+    std::vector<unsigned char> bad(blob.begin(), blob.end() - 1);
+    CHECK(rejected(bad, data.size()), ("truncated blob accepted, " + what).c_str());
+    bad.assign(blob.begin(), blob.begin() + sizeof(raster::codec_header_t) - 1);
+    CHECK(rejected(bad, data.size()), ("blob without header accepted, " + what).c_str());
+    bad = blob;
+    bad[0] ^= 0xff;
+    CHECK(rejected(bad, data.size()), ("bad magic accepted, " + what).c_str());
+    bad = blob;
+    bad[1] = CODEC_VERSION + 1;
+    CHECK(rejected(bad, data.size()), ("newer version accepted, " + what).c_str());
+    CHECK(rejected(blob, data.size() - 1), ("short output buffer accepted, " + what).c_str());
+}
+
+// a damaged payload must throw or decode to the stored size, never write past the buffer
+static void damage(const raster::codec_t& codec, const std::vector<unsigned char>& data, int elemsize, std::mt19937& rng)
+{
+    std::vector<unsigned char> blob, out(data.size() + 64);
+    raster::encode_chunk(data.data(), data.size(), elemsize, codec, blob);
+    if (blob.size() == sizeof(raster::codec_header_t))
+        return;
+    for (int trial = 0; trial < 50; trial++)
+    {
+        std::vector<unsigned char> bad = blob;
+        size_t pos = sizeof(raster::codec_header_t) + rng() % (blob.size() - sizeof(raster::codec_header_t));
+        bad[pos] ^= (unsigned char)(1 + rng() % 255);
+        std::fill(out.begin(), out.end(), 0xee);
+        try
+        {
+            size_t n = raster::decode_chunk(bad.data(), bad.size(), out.data(), data.size());
+            CHECK(n == data.size(), "damaged blob decoded to another size");
+        }
+        catch (const std::runtime_error&)
+        {
+        }
+        for (size_t k = data.size(); k < out.size(); k++)
+            CHECK(out[k] == 0xee, "damaged blob written past the chunk");
+    }
+}
+
+int main(int argc, char **argv)
+{
+    MPI_Init(&argc, &argv);
+    if (argc > 1)
+    {
+        std::cerr << "Usage: ./codec\n";
+        std::cerr << " It round-trips chunks through every codec of this build and checks that damaged blobs are rejected\n";
+        return 1;
+    };
+    std::vector<raster::codec_t> codecs = raster::codec_candidates();
+    codecs.push_back(raster::strongest_codec());
+    codecs.push_back(raster::codec_t());
+    codecs.push_back(raster::codec_t(raster::CODEC::RLZ, CODEC_FILTER_NONE, 0));
+    for (const raster::codec_t& codec : codecs)
+        CHECK(raster::codec_available(codec.m_codec), "candidate codec is not available");
+
+    std::mt19937 rng(12345);
+    size_t checks = 0, raw = 0, encoded = 0;
+    for (const std::string kind : {"constant", "random", "smooth", "repeat"})
+        for (size_t nbytes : SIZES)
+            for (int elemsize : ELEMSIZES)
+            {
+                std::vector<unsigned char> data = make_input(kind, nbytes, rng);
+                for (const raster::codec_t& codec : codecs)
+                {
+                    std::string what = kind + " " + std::to_string(nbytes) + " bytes, elemsize " + std::to_string(elemsize) +
+                                       ", codec " + name_of(codec);
+                    round_trip(codec, data, elemsize, what);
+                    checks++;
+                    if (nbytes == 4096 && elemsize == 4)
+                    {
+                        damage(codec, data, elemsize, rng);
+                        std::vector<unsigned char> blob;
+                        raster::encode_chunk(data.data(), data.size(), elemsize, codec, blob);
+                        raw += nbytes;
+                        encoded += blob.size();
+                    }
+                }
+            }
+    printf("%zu round trips, 4096-byte chunks encoded to %.1f%% of their size\n", checks, 100.0 * encoded / raw);
+    printf("codec: OK\n");
+
+    MPI_Finalize();
+    return 0;
+}
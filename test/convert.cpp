@@ -61,7 +61,7 @@ int main(int argc, char **argv)
     float* buffer = new float[bufsize];
     // read data
     status = nc_get_var_float(ncid, varid, buffer); ERR;
-    status = nc_close(ncid); ERR;
+    status = raster_close(ncid); ERR;
     if (rank == 0)
     {
         printf("Data dim: %d, data shape = ( ", ndims);
@@ -87,7 +87,7 @@ int main(int argc, char **argv)
     // status = nc_def_var_chunking(ncid, varid, NC_CHUNKED, chunksize); ERR;
     auto t3 = high_resolution_clock::now();
     status = nc_put_var_float(ncid, varid, buffer); ERR;
-    nc_close(ncid); ERR;
+    status = raster_close(ncid); ERR;
     int fd2 = open(ofn2.c_str(), O_RDONLY);
     fsync(fd2);
     close(fd2);
@@ -113,7 +113,7 @@ int main(int argc, char **argv)
     status = raster_def_var_chunking(ncid, varid, maskbuffer); ERR;
     auto t1 = high_resolution_clock::now();
     status = raster_put_var_float(ncid, varid, buffer); ERR;
-    nc_close(ncid); ERR;
+    status = raster_close(ncid); ERR;
     int fd1 = open(ofn1.c_str(), O_RDONLY);
     fsync(fd1);
     close(fd1);
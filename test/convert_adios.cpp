@@ -64,7 +64,7 @@ int main(int argc, char **argv)
     float* buffer = new float[bufsize];
     // read data
     status = nc_get_var_float(ncid, varid, buffer); ERR;
-    status = nc_close(ncid); ERR;
+    status = raster_close(ncid); ERR;
     if (rank == 0)
     {
         printf("Data dim: %d, data shape = ( ", ndims);
@@ -0,0 +1,79 @@
+#include <iostream>
+#include <string>
+#include <numeric>
+#include <chrono>
+#include <netcdf.h>
+#include <assert.h>
+#include <mpi.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "../raster.h"
+#define ERR do{if (status != NC_NOERR){ fprintf(stderr, "Error: at line %d, %s\n", __LINE__, nc_strerror(status)); exit(status);} } while(0);
+using namespace std::chrono;
+
+// Out-of-core version of convert.cpp: VARNAME is never loaded as a whole, it is read and
+// written in slabs along its leading dimension, each slab holding at most MAX_MB megabytes
+int main(int argc, char **argv)
+{
+    MPI_Init(&argc, &argv);
+    if(argc <= 5)
+    {
+        std::cerr << "Usage: ./convert_slab <INPUT_FILENAME> <OUTPUT_FILENAME> <MASKNAME> <VARNAME> <MAX_MB>\n";
+        std::cerr << " It writes VARNAME in INPUT_FILE to OUTPUT_FILE, according to MASK, MAX_MB of VARNAME at a time\n";
+        return 1;
+    };
+    std::string infile = argv[1], outfile = argv[2], mask = argv[3], varname = argv[4];
+    size_t max_bytes = std::atol(argv[5]) << 20;
+    int status, in_ncid, ncid, varid, in_varid, ndims, vartype, dimids[5];
+    size_t dimlens[5];
+    char* dimnames[5] = {(char*)"x", (char*)"y", (char*)"z", (char*)"w", (char*)"h"};
+
+    // read mask
+    status = nc_open(infile.c_str(), NC_NETCDF4 | NC_NOWRITE, &in_ncid); ERR;
+    status = nc_inq_varid(in_ncid, mask.c_str(), &varid); ERR;
+    status = nc_inq_varndims(in_ncid, varid, &ndims); ERR;
+    status = nc_inq_vardimid(in_ncid, varid, dimids); ERR;
+    status = nc_inq_vartype(in_ncid, varid, &vartype); ERR;
+    for (int i = 0; i < ndims; i++)
+        status = nc_inq_dimlen(in_ncid, dimids[i], &dimlens[i]);
+    size_t masksize = std::accumulate(&dimlens[0], &dimlens[ndims], 1, [](size_t a, size_t b){ return a * b; });
+    int* maskbuffer = new int[masksize];
+    status = nc_get_var(in_ncid, varid, maskbuffer); ERR;
+    if (vartype == NC_FLOAT)
+    {
+        for (int i = 0; i < masksize; i++)
+            maskbuffer[i] = int(*((float*)(maskbuffer + i)));
+    }
+    printf("Mask dim: %d, mask shape = ( %ld %ld ), total = %ld\n", ndims, dimlens[ndims-2], dimlens[ndims-1], masksize);
+
+    // shape of data
+    status = nc_inq_varid(in_ncid, varname.c_str(), &in_varid); ERR;
+    status = nc_inq_varndims(in_ncid, in_varid, &ndims); ERR;
+    status = nc_inq_vardimid(in_ncid, in_varid, dimids); ERR;
+    for (int i = 0; i < ndims; i++)
+        status = nc_inq_dimlen(in_ncid, dimids[i], &dimlens[i]);
+    printf("Data dim: %d, data shape = ( ", ndims);
+    for (int i = 0; i < ndims; i++) printf("%ld ", dimlens[i]);
+    printf("), at most %ld MB per slab\n", max_bytes >> 20);
+
+    // convert
+    status = nc_create(outfile.c_str(), NC_NETCDF4 | NC_CLOBBER, &ncid); ERR;
+    for (int i = 0; i < ndims; i++)
+        status = nc_def_dim(ncid, dimnames[i], dimlens[i], &dimids[i]);
+    status = raster_def_var(ncid, varname.c_str(), NC_FLOAT, ndims, dimids, &varid); ERR;
+    status = raster_def_var_chunking(ncid, varid, maskbuffer); ERR;
+    delete[] maskbuffer;
+    auto t1 = high_resolution_clock::now();
+    status = raster_put_var_from_nc(ncid, varid, in_ncid, in_varid, max_bytes); ERR;
+    status = raster_close(ncid); ERR;
+    int fd = open(outfile.c_str(), O_RDONLY);
+    fsync(fd);
+    close(fd);
+    auto t2 = high_resolution_clock::now();
+    printf("Time_RASTER=%fs\n", duration_cast<microseconds>(t2 - t1).count() / 1000000.0);
+    printf("RASTER: done\n");
+    status = nc_close(in_ncid); ERR;
+
+    MPI_Finalize();
+    return status;
+}
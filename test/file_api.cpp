@@ -0,0 +1,129 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <netcdf.h>
+#include <mpi.h>
+#include "../raster.h"
+#include "../RasterFile.h"
+#include "test_files.h"
+#define ERR do{if (status != NC_NOERR){ fprintf(stderr, "Error: at line %d, %s\n", __LINE__, nc_strerror(status)); exit(status);} } while(0);
+#define CHECK(cond, what) do{if (!(cond)){ fprintf(stderr, "Failed: %s\n", what); exit(1);} } while(0);
+
+// Checks that reads through `raster::File` / `raster::Variable<T>` match those of the C API, with
+// two files open at once, each with caches of its own, and that boxes read either way hold the
+// values written, also across chunk and region borders, and are refused when out of range
+static const test_grid_t GRID = {3, 90, 120, 15, 30, 4, 8, 1000};
+static const int NT = GRID.m_nt, NY = GRID.m_ny, NX = GRID.m_nx, NREGIONS = GRID.m_nregions;
+
+// boxes (start, count): inside one region, across region borders (every 15 rows, every 30 columns
+// shifted), across the chunk grid, a single cell at the corner, whole rows and columns, everything
+static size_t BOXES[][6] = {
+    {1, 10, 20, 2, 40, 50}, {0, 14, 28, 3, 2, 4}, {0, 3, 0, 1, 60, 7}, {2, NY - 1, NX - 1, 1, 1, 1},
+    {0, 44, 0, NT, 1, NX}, {1, 0, 59, 1, NY, 3}, {0, 0, 0, NT, NY, NX}};
+// out of range: a start past the end, a count past the end, a zero count next to a start past the end
+static size_t BAD_BOXES[][6] = {
+    {0, NY + 1, 0, 1, 1, 1}, {0, 80, 0, 1, 11, 1}, {NT, 0, 0, 1, 1, 1}, {0, 0, NX + 1, 0, 1, 0}};
+static const int BAD_STATUS[] = {NC_EINVALCOORDS, NC_EEDGE, NC_EEDGE, NC_EINVALCOORDS};
+
+static void check_box(const std::vector<float>& out, const size_t* box, float base, const char* what)
+{
+    const size_t* start = box, *count = box + 3;
+    for (size_t t = 0; t < count[0]; t++)
+        for (size_t i = 0; i < count[1]; i++)
+            for (size_t j = 0; j < count[2]; j++)
+            {
+                size_t k = ((start[0] + t) * NY + start[1] + i) * NX + start[2] + j;
+                CHECK(out[(t * count[1] + i) * count[2] + j] == test_value_of(GRID, base, k), what);
+            }
+}
+
+// every region and the steps [1, 3) of `path` through the C API
+static void read_reference(const std::string& path, std::vector<std::vector<float> >& regions,
+                           std::vector<std::vector<float> >& steps)
+{
+    int status, ncid, varid;
+    status = nc_open(path.c_str(), NC_NOWRITE, &ncid); ERR;
+    status = raster_inq_varid(ncid, "v", &varid); ERR;
+    regions.assign(NREGIONS + 1, std::vector<float>(NT * NY * NX, -1));
+    steps.assign(NREGIONS + 1, std::vector<float>(2 * NY * NX, -1));
+    for (int m = 1; m <= NREGIONS; m++)
+    {
+        status = raster_get_region_float(ncid, varid, m, regions[m].data()); ERR;
+        status = raster_get_region_steps_float(ncid, varid, m, 1, 2, steps[m].data()); ERR;
+    }
+    status = raster_close(ncid); ERR;
+}
+
+int main(int argc, char **argv)
+{
+    MPI_Init(&argc, &argv);
+    if(argc <= 1)
+    {
+        std::cerr << "Usage: ./file_api <OUTPUT_PREFIX>\n";
+        std::cerr << " It writes two small files OUTPUT_PREFIX_a.nc, OUTPUT_PREFIX_b.nc and reads them through raster::File\n";
+        return 1;
+    };
+    std::string paths[2] = {std::string(argv[1]) + "_a.nc", std::string(argv[1]) + "_b.nc"};
+    std::vector<std::vector<float> > regions[2], steps[2];
+    float bases[2] = {0, 5000};
+    int status;
+    for (int f = 0; f < 2; f++)
+    {
+        status = write_test_file(paths[f], GRID, f == 0 ? 0 : 11, bases[f]); ERR;
+    }
+    for (int f = 0; f < 2; f++)
+        read_reference(paths[f], regions[f], steps[f]);
+
+    {
+        raster::file_options_t options = {8 << 20, 16 << 20, RASTER_CACHE_LRU};
+        raster::File a(paths[0], NC_NOWRITE, options), b(paths[1], NC_NOWRITE, options);
+        raster::File* files[2] = {&a, &b};
+        // interleaved, so that the caches of both files are in use at once
+        for (int pass = 0; pass < 2; pass++)
+            for (int m = 1; m <= NREGIONS; m++)
+                for (int f = 0; f < 2; f++)
+                {
+                    raster::Variable<float> var = files[f]->variable<float>("v");
+                    std::vector<float> out(NT * NY * NX, -1), out_steps(2 * NY * NX, -1), out_c(NT * NY * NX, -1);
+                    var.get_region(m, out.data());
+                    CHECK(out == regions[f][m], "region read differs from the C API");
+                    var.get_region_steps(m, 1, 2, out_steps.data());
+                    CHECK(out_steps == steps[f][m], "step read differs from the C API");
+                    // the C API on an open `File` reads through its caches
+                    int status = raster_get_region_float(files[f]->ncid(), var.id(), m, out_c.data()); ERR;
+                    CHECK(out_c == regions[f][m], "C read of an open File differs");
+                }
+        for (int f = 0; f < 2; f++)
+        {
+            raster::Variable<float> var = files[f]->variable<float>("v");
+            for (size_t* box : BOXES)
+            {
+                std::vector<float> out(box[3] * box[4] * box[5], -1), out_c(out.size(), -1);
+                var.get_vara(box, box + 3, out.data());
+                check_box(out, box, bases[f], "box read differs from the values written");
+                int status = raster_get_vara_float(files[f]->ncid(), var.id(), box, box + 3, out_c.data()); ERR;
+                check_box(out_c, box, bases[f], "C box read of an open File differs from the values written");
+            }
+            for (size_t k = 0; k < sizeof(BAD_BOXES) / sizeof(BAD_BOXES[0]); k++)
+            {
+                std::vector<float> out(NT * NY * NX, -1);
+                CHECK(raster_get_vara_float(files[f]->ncid(), var.id(), BAD_BOXES[k], BAD_BOXES[k] + 3, out.data()) == BAD_STATUS[k],
+                      "out of range box not refused with its status");
+                bool thrown = false;
+                try { var.get_vara(BAD_BOXES[k], BAD_BOXES[k] + 3, out.data()); } catch (std::runtime_error&) { thrown = true; }
+                CHECK(thrown, "out of range box read through a Variable");
+            }
+        }
+        raster_cache_stats_t stats;
+        a.get_chunk_cache_stats(stats);
+        CHECK(stats.hits > 0 && stats.bytes <= stats.capacity, "chunk cache of the file unused or over budget");
+        bool thrown = false;
+        try { a.variable<double>("v"); } catch (std::runtime_error&) { thrown = true; }
+        CHECK(thrown, "a variable read as another type");
+    }
+    printf("file api: OK\n");
+
+    MPI_Finalize();
+    return 0;
+}
@@ -0,0 +1,108 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <netcdf.h>
+#include <mpi.h>
+#include "../MeshBuilder.h"
+#include "../IndexManager.h"
+#define ERR do{if (status != NC_NOERR){ fprintf(stderr, "Error: at line %d, %s\n", __LINE__, nc_strerror(status)); exit(status);} } while(0);
+#define CHECK(cond, what) do{if (!(cond)){ fprintf(stderr, "Failed: %s\n", what); exit(1);} } while(0);
+using namespace std::chrono;
+
+// Measures the `_index_` of a layout against the metadata it replaced, one netCDF variable of
+// uint64 rows per region plus one of int relations, and checks that the index decodes back to
+// what was encoded. The cells of the mixed chunks, which the old metadata did not have, are
+// counted apart. The time is that of `raster::decode_layout_index` alone, averaged over
+// DECODE_REPEATS runs, as the netCDF read of `_index_` is a single call either way.
+static const int DECODE_REPEATS = 20;
+
+static double decode_ms(const std::vector<unsigned char>& bytes)
+{
+    auto t0 = high_resolution_clock::now();
+    for (int k = 0; k < DECODE_REPEATS; k++)
+    {
+        raster::LayoutIndex index;
+        raster::decode_layout_index(bytes.data(), bytes.size(), index);
+    }
+    auto t1 = high_resolution_clock::now();
+    return duration_cast<duration<double, std::milli> >(t1 - t0).count() / DECODE_REPEATS;
+}
+
+int main(int argc, char **argv)
+{
+    MPI_Init(&argc, &argv);
+    if(argc <= 2)
+    {
+        std::cerr << "Usage: ./layout_index <INPUT_FILENAME> <MASKNAME> [<GRID_ROWS> <GRID_COLS>]\n";
+        std::cerr << " It partitions MASK of INPUT_FILE, default grid 64x64, and prints the size and decode time of its layout index\n";
+        return 1;
+    };
+    std::string infile = argv[1], maskname = argv[2];
+    int grid[2] = {64, 64};
+    if (argc > 4)
+    {
+        grid[0] = atoi(argv[3]);
+        grid[1] = atoi(argv[4]);
+    }
+    int status, ncid, varid, ndims, dimids[5];
+    size_t dimlens[5];
+
+    status = nc_open(infile.c_str(), NC_NOWRITE, &ncid); ERR;
+    status = nc_inq_varid(ncid, maskname.c_str(), &varid); ERR;
+    status = nc_inq_varndims(ncid, varid, &ndims); ERR;
+    status = nc_inq_vardimid(ncid, varid, dimids); ERR;
+    for (int i = 0; i < ndims; i++)
+        status = nc_inq_dimlen(ncid, dimids[i], &dimlens[i]);
+    int rows = dimlens[ndims - 2], cols = dimlens[ndims - 1];
+    std::vector<int> mask((size_t)rows * cols);
+    status = nc_get_var_int(ncid, varid, mask.data()); ERR;
+    status = nc_close(ncid); ERR;
+
+    raster::Mesh mesh(mask.data(), rows, cols, grid[0], grid[1]);
+    const raster::chunk_info_list& chunks = mesh.partition();
+    std::vector<int> mask_ids = mesh.get_all_mask_id();
+    std::vector<size_t> chunkshape = {(size_t)rows / grid[0], (size_t)cols / grid[1]};
+    std::vector<raster::Region> regions = raster::construct_region_chunks(chunks, mask_ids, 2, chunkshape);
+
+    // the metadata as written before `_index_`: mask ids, then per region its rows and relations
+    size_t legacy_bytes = regions.size() * sizeof(int), legacy_vars = 1, nrows_total = 0;
+    for (raster::Region& region : regions)
+    {
+        int nrows, ncols, nrelations;
+        size_t* metadata;
+        int* relations;
+        raster::construct_region_meta(region, &nrows, &ncols, metadata);
+        legacy_bytes += (size_t)nrows * ncols * sizeof(uint64_t);
+        legacy_vars++;
+        nrows_total += nrows;
+        delete[] metadata;
+        if (region.get_maskid() == raster::REGION_MIXED_ID)
+            continue;
+        raster::construct_region_relation(region, &nrelations, relations);
+        legacy_bytes += (size_t)nrelations * sizeof(int);
+        legacy_vars++;
+        delete[] relations;
+    }
+
+    raster::LayoutIndex index = raster::build_layout_index(regions, {}, {}, mask.data(), cols);
+    std::vector<unsigned char> bytes = raster::encode_layout_index(index);
+    raster::LayoutIndex decoded;
+    raster::decode_layout_index(bytes.data(), bytes.size(), decoded);
+    CHECK(decoded.m_mask_ids == index.m_mask_ids && decoded.m_rows == index.m_rows &&
+          decoded.m_relation_chunks == index.m_relation_chunks && decoded.m_relation_rows == index.m_relation_rows &&
+          decoded.m_part_offsets == index.m_part_offsets && decoded.m_runs == index.m_runs,
+          "decoded index differs from the encoded one");
+    // the same content as the per-region variables, without the cells of the mixed chunks
+    std::vector<unsigned char> chunk_bytes = raster::encode_layout_index(raster::build_layout_index(regions, {}, {}));
+    CHECK(chunk_bytes.size() < legacy_bytes, "index larger than the per-region variables");
+
+    printf("%zu regions, %zu rows, grid %dx%d: index %zu bytes in 1 variable, decode %.3f ms; per-region metadata %zu bytes "
+           "in %zu variables\n", mask_ids.size(), nrows_total, grid[0], grid[1], chunk_bytes.size(), decode_ms(chunk_bytes),
+           legacy_bytes, legacy_vars);
+    printf("with the cells of mixed chunks: index %zu bytes, decode %.3f ms\n", bytes.size(), decode_ms(bytes));
+    printf("layout index: OK\n");
+
+    MPI_Finalize();
+    return 0;
+}
@@ -111,7 +111,7 @@ int main(int argc, char **argv)
     auto t1 = high_resolution_clock::now();
     status = nc_get_vara_float(ncid, varid, start, count, buffer); ERR;
     auto t2 = high_resolution_clock::now();
-    status = nc_close(ncid); ERR;
+    status = raster_close(ncid); ERR;
     printf("Time_netCDF_Read=%fs\n", duration_cast<microseconds>(t2 - t1).count() / 1000000.0);
     MPI_Barrier(MPI_COMM_WORLD);
     // delete[] start; delete[] count;
@@ -127,7 +127,7 @@ int main(int argc, char **argv)
         status = raster_get_region_float(ncid, varid, region_id, buffer); ERR;
     }    
     auto t4 = high_resolution_clock::now();
-    status = nc_close(ncid); ERR;
+    status = raster_close(ncid); ERR;
     printf("Time_RASTER_Read=%fs\n", duration_cast<microseconds>(t4 - t3).count() / 1000000.0);
     // MPI_Barrier(MPI_COMM_WORLD);
 
@@ -0,0 +1,367 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+#include <set>
+#include <array>
+#include <memory>
+#include <numeric>
+#include <chrono>
+#include <netcdf.h>
+#include <mpi.h>
+#include "../MeshBuilder.h"
+#define ERR do{if (status != NC_NOERR){ fprintf(stderr, "Error: at line %d, %s\n", __LINE__, nc_strerror(status)); exit(status);} } while(0);
+using namespace std::chrono;
+
+// Checks that `raster::Mesh::partition` gives exactly the chunks of the partition it replaced:
+// rows of `std::list` of chunks, each with a `std::map` histogram filled cell by cell, kept below
+// as the baseline. Both run on a mask read from a file, with its own ids and with sparse ids, over
+// several grids and merge limits, and the chunk counts are compared with those of horizontal merges
+// alone on an unsnapped grid. `raster::Mesh::partition_from` is checked on a changed copy of
+// the mask: its chunks must cover the mask once, with histograms counted from the cells
+namespace baseline
+{
+
+struct chunk_t
+{
+    int m_start_row, m_start_col, m_size_row, m_size_col;
+    std::map<int, int> m_hist;
+    raster::BLOCK_TYPE m_type;
+
+    int major() const
+    {
+        auto max = *std::max_element(m_hist.begin(), m_hist.end(), [](auto& l, auto& r) { return l.second < r.second; });
+        if (double(max.second) / double(m_size_row * m_size_col) < raster::RASTER_chunk_t::REGION_MAJOR_THRESHOLD)
+            return raster::RASTER_chunk_t::REGION_NO_MAJOR;
+        return max.first;
+    }
+    void set_type()
+    {
+        auto max = *std::max_element(m_hist.begin(), m_hist.end(), [](auto& l, auto& r) { return l.second < r.second; });
+        double share = double(max.second) / double(m_size_row * m_size_col);
+        m_type = (share == 1.0) ? raster::BLOCK_TYPE::PURE
+               : (share > raster::RASTER_chunk_t::REGION_MAJOR_THRESHOLD) ? raster::BLOCK_TYPE::MAJOR : raster::BLOCK_TYPE::MIXED;
+    }
+    std::vector<int> keys() const
+    {
+        std::vector<int> ret;
+        for (auto& kv : m_hist)
+            ret.push_back(kv.first);
+        return ret;
+    }
+};
+
+using rows_t = std::vector<std::list<std::shared_ptr<chunk_t> > >;
+
+struct mesh_t
+{
+    const int* m_mask;
+    int m_nrows, m_ncols, m_rows_in_grid, m_cols_in_grid;
+    double m_merge_threshold;
+    size_t m_max_chunk_cells;
+    bool m_horizontal_only = false; // the partition before vertical merges and snapped grid lines
+
+    void snap_cuts(std::vector<int>& cuts, const std::set<int>& edges, int tolerance) const
+    {
+        for (size_t k = 1; k + 1 < cuts.size(); k++)
+        {
+            int best = cuts[k];
+            for (auto it = edges.lower_bound(cuts[k] - tolerance); it != edges.end() && *it <= cuts[k] + tolerance; it++)
+            {
+                if (best == cuts[k] || std::abs(*it - cuts[k]) < std::abs(best - cuts[k]))
+                    best = *it;
+                if (best == cuts[k])
+                    break;
+            }
+            if (best > cuts[k - 1] && best < cuts[k + 1])
+                cuts[k] = best;
+        }
+    }
+
+    void grid_cuts(std::vector<int>& row_cuts, std::vector<int>& col_cuts) const
+    {
+        int row_length = m_nrows / m_rows_in_grid, col_length = m_ncols / m_cols_in_grid;
+        for (int i = 0; i * row_length < m_nrows; i++)
+            row_cuts.push_back(i * row_length);
+        row_cuts.push_back(m_nrows);
+        for (int j = 0; j < m_cols_in_grid; j++)
+            col_cuts.push_back(j * col_length);
+        col_cuts.push_back(m_ncols);
+        std::map<int, std::array<int, 4> > boxes;
+        for (int i = 0; i < m_nrows; i++)
+            for (int j = 0; j < m_ncols; j++)
+            {
+                auto it = boxes.find(m_mask[i * m_ncols + j]);
+                if (it == boxes.end())
+                    boxes.insert({m_mask[i * m_ncols + j], {i, j, i + 1, j + 1}});
+                else
+                {
+                    auto& box = it->second;
+                    box[0] = std::min(box[0], i);
+                    box[1] = std::min(box[1], j);
+                    box[2] = std::max(box[2], i + 1);
+                    box[3] = std::max(box[3], j + 1);
+                }
+            }
+        std::set<int> row_edges, col_edges;
+        for (auto& kv : boxes)
+        {
+            row_edges.insert(kv.second[0]);
+            row_edges.insert(kv.second[2]);
+            col_edges.insert(kv.second[1]);
+            col_edges.insert(kv.second[3]);
+        }
+        if (m_horizontal_only)
+            return;
+        snap_cuts(row_cuts, row_edges, row_length / 4);
+        snap_cuts(col_cuts, col_edges, col_length / 4);
+    }
+
+    bool can_merge(const chunk_t& a, const chunk_t& b, size_t merged_cells) const
+    {
+        if (m_max_chunk_cells > 0 && merged_cells > m_max_chunk_cells)
+            return false;
+        if (a.m_type == raster::BLOCK_TYPE::MIXED && a.keys() != b.keys())
+            return false;
+        if (a.major() != b.major())
+            return false;
+        std::set<int> keys;
+        for (auto& kv : a.m_hist)
+            keys.insert(kv.first);
+        for (auto& kv : b.m_hist)
+            keys.insert(kv.first);
+        return keys.size() < 3;
+    }
+
+    static void absorb(chunk_t& a, const chunk_t& b)
+    {
+        for (auto& kv : b.m_hist)
+            a.m_hist[kv.first] += kv.second;
+        a.set_type();
+    }
+
+    void merge_chunks(std::list<std::shared_ptr<chunk_t> >& row) const
+    {
+        for (auto& r : row)
+        {
+            for (int i = 0; i < r->m_size_row; i++)
+                for (int j = 0; j < r->m_size_col; j++)
+                    r->m_hist[m_mask[(i + r->m_start_row) * m_ncols + j + r->m_start_col]]++;
+            r->set_type();
+        }
+        auto curr = row.begin();
+        auto last = --row.end();
+        while (curr != last && curr != row.end())
+        {
+            auto next = std::next(curr);
+            if ((*curr)->m_size_col > m_ncols * m_merge_threshold ||
+                !can_merge(**curr, **next, size_t((*curr)->m_size_col + (*next)->m_size_col) * (*curr)->m_size_row))
+            {
+                curr++;
+                continue;
+            }
+            (*curr)->m_size_col += (*next)->m_size_col;
+            absorb(**curr, **next);
+            row.erase(next);
+            last = --row.end();
+        }
+    }
+
+    void merge_rows(rows_t& rows) const
+    {
+        std::map<std::pair<int, int>, std::shared_ptr<chunk_t> > above;
+        for (auto& row : rows)
+        {
+            std::map<std::pair<int, int>, std::shared_ptr<chunk_t> > bottom;
+            for (auto it = row.begin(); it != row.end(); )
+            {
+                auto chunk = *it;
+                auto key = std::make_pair(chunk->m_start_col, chunk->m_size_col);
+                auto top = above.find(key);
+                if (top != above.end() && top->second->m_size_row <= m_nrows * m_merge_threshold &&
+                    can_merge(*top->second, *chunk, size_t(top->second->m_size_row + chunk->m_size_row) * chunk->m_size_col))
+                {
+                    top->second->m_size_row += chunk->m_size_row;
+                    absorb(*top->second, *chunk);
+                    bottom[key] = top->second;
+                    it = row.erase(it);
+                    continue;
+                }
+                bottom[key] = chunk;
+                it++;
+            }
+            above.swap(bottom);
+        }
+    }
+
+    rows_t partition() const
+    {
+        rows_t rows;
+        std::vector<int> row_cuts, col_cuts;
+        grid_cuts(row_cuts, col_cuts);
+        for (size_t i = 0; i + 1 < row_cuts.size(); i++)
+        {
+            std::list<std::shared_ptr<chunk_t> > row;
+            for (size_t j = 0; j + 1 < col_cuts.size(); j++)
+                row.emplace_back(new chunk_t{row_cuts[i], col_cuts[j], row_cuts[i + 1] - row_cuts[i], col_cuts[j + 1] - col_cuts[j]});
+            merge_chunks(row);
+            rows.push_back(row);
+        }
+        if (!m_horizontal_only)
+            merge_rows(rows);
+        return rows;
+    }
+};
+
+} // namespace baseline
+
+// true if both partitions have the same chunks in the same order, with the same histograms
+static bool same_partition(const baseline::rows_t& expected, const raster::chunk_info_list& got)
+{
+    size_t k = 0;
+    for (auto& row : expected)
+        for (auto& chunk : row)
+        {
+            if (k >= got.m_chunks.size())
+                return false;
+            const raster::RASTER_chunk_t& other = got.m_chunks[k++];
+            if (chunk->m_start_row != other.m_start_row || chunk->m_start_col != other.m_start_col ||
+                chunk->m_size_row != other.m_size_row || chunk->m_size_col != other.m_size_col ||
+                chunk->m_type != other.m_type || chunk->major() != other.m_major ||
+                chunk->m_hist.size() != other.m_hist_size ||
+                !std::equal(chunk->m_hist.begin(), chunk->m_hist.end(), got.hist_begin(other),
+                            [](auto& l, auto& r) { return l.first == r.first && l.second == r.second; }))
+                return false;
+        }
+    return k == got.m_chunks.size();
+}
+
+// true if the chunks of `got` cover the `rows` x `cols` mask once, each with the histogram of its cells
+static bool valid_partition(const int* mask, int rows, int cols, const raster::chunk_info_list& got)
+{
+    std::vector<char> covered((size_t)rows * cols, 0);
+    for (const raster::RASTER_chunk_t& chunk : got.m_chunks)
+    {
+        std::map<int, int> hist;
+        for (int i = chunk.m_start_row; i < chunk.m_start_row + chunk.m_size_row; i++)
+            for (int j = chunk.m_start_col; j < chunk.m_start_col + chunk.m_size_col; j++)
+            {
+                if (i >= rows || j >= cols || covered[(size_t)i * cols + j]++)
+                    return false;
+                hist[mask[(size_t)i * cols + j]]++;
+            }
+        if (hist.size() != chunk.m_hist_size ||
+            !std::equal(hist.begin(), hist.end(), got.hist_begin(chunk),
+                        [](auto& l, auto& r) { return l.first == r.first && l.second == r.second; }))
+            return false;
+    }
+    return std::find(covered.begin(), covered.end(), 0) == covered.end();
+}
+
+int main(int argc, char **argv)
+{
+    MPI_Init(&argc, &argv);
+    if(argc <= 2)
+    {
+        std::cerr << "Usage: ./mesh_partition <INPUT_FILENAME> <MASKNAME>\n";
+        std::cerr << " It partitions MASK of INPUT_FILE with raster::Mesh and with the baseline partition, and compares them\n";
+        return 1;
+    };
+    std::string infile = argv[1], maskname = argv[2];
+    int status, ncid, varid, ndims, vartype, dimids[5], failures = 0;
+    size_t dimlens[5];
+
+    status = nc_open(infile.c_str(), NC_NOWRITE, &ncid); ERR;
+    status = nc_inq_varid(ncid, maskname.c_str(), &varid); ERR;
+    status = nc_inq_varndims(ncid, varid, &ndims); ERR;
+    status = nc_inq_vardimid(ncid, varid, dimids); ERR;
+    status = nc_inq_vartype(ncid, varid, &vartype); ERR;
+    for (int i = 0; i < ndims; i++)
+        status = nc_inq_dimlen(ncid, dimids[i], &dimlens[i]);
+    int rows = dimlens[ndims - 2], cols = dimlens[ndims - 1];
+    std::vector<int> mask((size_t)rows * cols);
+    if (vartype == NC_FLOAT || vartype == NC_DOUBLE)
+    {
+        std::vector<double> values(mask.size());
+        status = nc_get_var_double(ncid, varid, values.data()); ERR;
+        for (size_t k = 0; k < mask.size(); k++)
+            mask[k] = int(values[k]);
+    }
+    else
+    {
+        status = nc_get_var_int(ncid, varid, mask.data()); ERR;
+    }
+    status = nc_close(ncid); ERR;
+
+    // the same regions with ids spread over the whole int range, remapped by search rather than a table
+    std::vector<int> sparse(mask.size());
+    for (size_t k = 0; k < mask.size(); k++)
+        sparse[k] = int((long long)mask[k] * 7919 % 2000000000) - 1000000000;
+
+    int grids[4][2] = {{20, 20}, {8, 8}, {64, 64}, {std::min(rows, 180), std::min(cols, 120)}};
+    for (std::vector<int>* cells : {&mask, &sparse})
+        for (auto& grid : grids)
+            for (double threshold : {1.0, 0.3})
+                for (size_t max_cells : {(size_t)0, (size_t)rows * cols / 400 + 1})
+                {
+                    baseline::mesh_t reference{cells->data(), rows, cols, grid[0], grid[1], threshold, max_cells};
+                    auto t0 = high_resolution_clock::now();
+                    baseline::rows_t expected = reference.partition();
+                    auto t1 = high_resolution_clock::now();
+                    raster::Mesh mesh(cells->data(), rows, cols, grid[0], grid[1], threshold, max_cells);
+                    const raster::chunk_info_list& got = mesh.partition();
+                    auto t2 = high_resolution_clock::now();
+                    bool same = same_partition(expected, got);
+                    failures += !same;
+                    printf("%s ids, grid %dx%d, threshold %.1f, max cells %zu: %zu chunks, baseline %.3f s, mesh %.3f s, %s\n",
+                           cells == &mask ? "mask" : "sparse", grid[0], grid[1], threshold, max_cells, got.m_chunks.size(),
+                           duration_cast<duration<double> >(t1 - t0).count(), duration_cast<duration<double> >(t2 - t1).count(),
+                           same ? "same" : "DIFFERENT");
+                }
+
+    // chunks saved by the vertical merges and the grid lines snapped to region edges
+    for (auto& grid : grids)
+    {
+        baseline::mesh_t horizontal{mask.data(), rows, cols, grid[0], grid[1], 1.0, 0, true};
+        size_t before = 0;
+        for (auto& row : horizontal.partition())
+            before += row.size();
+        raster::Mesh mesh(mask.data(), rows, cols, grid[0], grid[1]);
+        size_t after = mesh.partition().m_chunks.size();
+        failures += after > before;
+        printf("grid %dx%d: %zu chunks, %zu with horizontal merges alone%s\n", grid[0], grid[1], after, before,
+               after > before ? ", MORE" : "");
+    }
+
+    // a region grows over a tenth of the rows, the rest of the mask keeps its chunks
+    std::vector<int> changed(mask);
+    for (int i = rows / 3; i < rows / 3 + rows / 10; i++)
+        for (int j = cols / 4; j < cols / 2; j++)
+            changed[(size_t)i * cols + j] = mask[(size_t)(rows / 3) * cols + cols / 4];
+    for (auto& grid : grids)
+    {
+        raster::Mesh base(mask.data(), rows, cols, grid[0], grid[1]);
+        size_t base_chunks = base.partition().m_chunks.size();
+        auto t0 = high_resolution_clock::now();
+        raster::Mesh full(changed.data(), rows, cols, grid[0], grid[1]);
+        size_t full_chunks = full.partition().m_chunks.size();
+        auto t1 = high_resolution_clock::now();
+        raster::Mesh mesh(changed.data(), rows, cols, grid[0], grid[1]);
+        const raster::chunk_info_list& got = mesh.partition_from(base);
+        auto t2 = high_resolution_clock::now();
+        bool valid = valid_partition(changed.data(), rows, cols, got);
+        failures += !valid;
+        printf("changed mask, grid %dx%d: %zu chunks, base %zu, full %zu, full %.3f s, from base %.3f s, %s\n",
+               grid[0], grid[1], got.m_chunks.size(), base_chunks, full_chunks,
+               duration_cast<duration<double> >(t1 - t0).count(), duration_cast<duration<double> >(t2 - t1).count(),
+               valid ? "valid" : "INVALID");
+    }
+    if (failures == 0)
+        printf("mesh partition: OK\n");
+    else
+        printf("mesh partition: %d partitions differ\n", failures);
+
+    MPI_Finalize();
+    return failures != 0;
+}
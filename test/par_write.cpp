@@ -0,0 +1,120 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cmath>
+#include <netcdf.h>
+#include <mpi.h>
+#include "../raster.h"
+#include "../raster_par.h"
+#define ERR do{if (status != NC_NOERR){ fprintf(stderr, "Error: at line %d, %s\n", __LINE__, nc_strerror(status)); exit(status);} } while(0);
+#define CHECK(cond, what) do{if (!(cond)){ fprintf(stderr, "Failed: %s\n", what); exit(1);} } while(0);
+
+// Checks that a file written by `raster_put_var_par_*` on every rank of MPI_COMM_WORLD reads back
+// identical to the same variable written serially, in chunked and packed storage
+static const int NT = 3, NY = 97, NX = 131;
+static const int REGIONS[] = {1, 2, 3, 5, 6, 7};
+static const int NREGIONS = sizeof(REGIONS) / sizeof(REGIONS[0]);
+
+static void make_input(std::vector<int>& mask, std::vector<float>& data)
+{
+    mask.resize(NY * NX);
+    for (int i = 0; i < NY; i++)
+        for (int j = 0; j < NX; j++)
+        {
+            int r = (i < NY / 3) ? 1 : (j < NX / 2 ? 2 : 3);
+            if (j > NX - NX / 4)
+                r = 0;
+            if (i >= NY * 7 / 10 && i < NY * 85 / 100 && j >= NX / 10 && j < NX * 4 / 10)
+                r = 5 + (j / 2) % 3;
+            mask[i * NX + j] = r;
+        }
+    data.resize((size_t)NT * NY * NX);
+    for (size_t k = 0; k < data.size(); k++)
+        data[k] = mask[k % (NY * NX)] == 0 ? -999.0f : std::sin(k * 0.001f) * 10;
+}
+
+// defines "v" in a new file; `par` creates it with `nc_create_par` on MPI_COMM_WORLD
+static void define_file(const std::string& path, bool par, int storage, std::vector<int>& mask,
+                        int* ncid, int* varid)
+{
+    int status, dimids[3];
+    if (par)
+        status = nc_create_par(path.c_str(), NC_NETCDF4 | NC_CLOBBER | NC_MPIIO, MPI_COMM_WORLD, MPI_INFO_NULL, ncid);
+    else
+        status = nc_create(path.c_str(), NC_NETCDF4 | NC_CLOBBER, ncid);
+    ERR;
+    status = nc_def_dim(*ncid, "t", NT, &dimids[0]); ERR;
+    status = nc_def_dim(*ncid, "y", NY, &dimids[1]); ERR;
+    status = nc_def_dim(*ncid, "x", NX, &dimids[2]); ERR;
+    status = raster_def_var(*ncid, "v", NC_FLOAT, 3, dimids, varid); ERR;
+    status = raster_def_var_chunking(*ncid, *varid, mask.data()); ERR;
+    status = raster_def_var_storage(*ncid, *varid, storage); ERR;
+}
+
+// the whole variable, then every region, of `path`
+static void read_file(const std::string& path, std::vector<float>& whole, std::vector<std::vector<float> >& regions)
+{
+    int status, ncid, varid;
+    status = nc_open(path.c_str(), NC_NOWRITE, &ncid); ERR;
+    status = raster_inq_varid(ncid, "v", &varid); ERR;
+    whole.assign((size_t)NT * NY * NX, -1);
+    status = raster_get_var_float(ncid, varid, whole.data()); ERR;
+    regions.assign(NREGIONS, std::vector<float>((size_t)NT * NY * NX, -1));
+    for (int r = 0; r < NREGIONS; r++)
+    {
+        status = raster_get_region_float(ncid, varid, REGIONS[r], regions[r].data()); ERR;
+    }
+    status = raster_close(ncid); ERR;
+}
+
+int main(int argc, char **argv)
+{
+    MPI_Init(&argc, &argv);
+    if(argc <= 1)
+    {
+        std::cerr << "Usage: mpirun -np <N> ./par_write <OUTPUT_PREFIX>\n";
+        std::cerr << " It writes OUTPUT_PREFIX_serial.nc on rank 0 and OUTPUT_PREFIX_par.nc on all ranks, then compares them\n";
+        return 1;
+    };
+    int rank, nranks;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &nranks);
+    std::string serial = std::string(argv[1]) + "_serial.nc", par = std::string(argv[1]) + "_par.nc";
+    std::vector<int> mask;
+    std::vector<float> data;
+    make_input(mask, data);
+
+    const int storages[2] = {RASTER_STORAGE_CHUNKED, RASTER_STORAGE_PACKED};
+    for (int s = 0; s < 2; s++)
+    {
+        int status, ncid, varid;
+        if (rank == 0)
+        {
+            define_file(serial, false, storages[s], mask, &ncid, &varid);
+            status = raster_put_var_float(ncid, varid, data.data()); ERR;
+            status = raster_close(ncid); ERR;
+        }
+        define_file(par, true, storages[s], mask, &ncid, &varid);
+        status = raster_put_var_par_float(ncid, varid, MPI_COMM_WORLD, data.data()); ERR;
+        status = raster_close(ncid); ERR;
+        MPI_Barrier(MPI_COMM_WORLD);
+
+        if (rank == 0)
+        {
+            std::vector<float> whole[2];
+            std::vector<std::vector<float> > regions[2];
+            read_file(serial, whole[0], regions[0]);
+            read_file(par, whole[1], regions[1]);
+            CHECK(whole[0] == data, "serial write does not read back its input");
+            CHECK(whole[1] == whole[0], "parallel write differs from the serial one");
+            for (int r = 0; r < NREGIONS; r++)
+                CHECK(regions[1][r] == regions[0][r], "region read of the parallel write differs from the serial one");
+        }
+        MPI_Barrier(MPI_COMM_WORLD);
+    }
+    if (rank == 0)
+        printf("par write: OK (%d ranks)\n", nranks);
+
+    MPI_Finalize();
+    return 0;
+}
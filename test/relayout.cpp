@@ -0,0 +1,416 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <numeric>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <climits>
+#include <stdlib.h>
+#include <netcdf.h>
+#include <assert.h>
+#include <mpi.h>
+#include "../raster.h"
+#define ERR do{if (status != NC_NOERR){ fprintf(stderr, "Error: at line %d, %s\n", __LINE__, nc_strerror(status)); exit(status);} } while(0);
+using namespace std::chrono;
+
+#define HOT_FRACTION            0.8     // hot regions serve this fraction of all region reads
+#define COACCESS_FRACTION       0.5     // regions read one after the other at least this often share chunks
+#define COACCESS_MIN_READS      2
+#define REPLAY_CACHE_BYTES      (256 << 20)
+
+// one line of the access log written with RASTER_ACCESS_LOG, see AccessLog.h
+struct access_t
+{
+    std::string         op;
+    std::string         var;
+    int                 mask_id;
+    std::vector<size_t> start, count;
+    double              seconds;
+    std::string         file;       // the path of the file read, see `file_key`
+};
+
+// reads are profiled per variable of one file
+typedef std::pair<std::string, std::string> var_key_t;
+
+struct var_profile_t
+{
+    size_t                          var_reads = 0;
+    size_t                          region_reads = 0;
+    std::map<int, size_t>           region_hits;
+    std::map<std::pair<int, int>, size_t> coaccess;     // regions read one after the other
+};
+
+// the same file opened through different paths gets one key, its canonical path if it exists
+static std::string file_key(const std::string& path)
+{
+    char resolved[PATH_MAX];
+    return realpath(path.c_str(), resolved) != NULL ? std::string(resolved) : path;
+}
+
+static std::vector<access_t> read_access_log(const std::string& path)
+{
+    std::vector<access_t> log;
+    std::ifstream in(path);
+    std::string line;
+    while (std::getline(in, line))
+    {
+        std::istringstream fields(line);
+        access_t a;
+        int ndims;
+        if (!(fields >> a.op >> a.var >> a.mask_id >> ndims))
+            continue;
+        a.start.resize(ndims);
+        a.count.resize(ndims);
+        for (auto& v : a.start) fields >> v;
+        for (auto& v : a.count) fields >> v;
+        if (!(fields >> a.seconds) || !std::getline(fields >> std::ws, a.file))
+            continue;
+        a.file = file_key(a.file);
+        log.push_back(a);
+    }
+    return log;
+}
+
+static std::map<var_key_t, var_profile_t> profile(const std::vector<access_t>& log)
+{
+    std::map<var_key_t, var_profile_t> profiles;
+    std::map<var_key_t, int> last_region;
+    for (auto& a : log)
+    {
+        var_key_t key(a.file, a.var);
+        var_profile_t& p = profiles[key];
+        if (a.op != "region")
+        {
+            p.var_reads++;
+            last_region.erase(key);
+            continue;
+        }
+        p.region_reads++;
+        p.region_hits[a.mask_id]++;
+        auto last = last_region.find(key);
+        if (last != last_region.end() && last->second != a.mask_id)
+            p.coaccess[std::minmax(last->second, a.mask_id)]++;
+        last_region[key] = a.mask_id;
+    }
+    return profiles;
+}
+
+// Regions `a` and `b` are linked when they are read one after the other at least
+// `COACCESS_MIN_READS` times, and in `COACCESS_FRACTION` of the reads of the more read one. Each group of linked regions gets a parent
+// id above all mask ids, returned as (child, parent) links
+static void coaccess_links(const var_profile_t& p, const std::set<int>& mask_ids, std::vector<int>& children,
+                           std::vector<int>& parents)
+{
+    std::map<int, int> leader;
+    std::function<int(int)> find = [&](int id) {
+        auto it = leader.find(id);
+        if (it == leader.end())
+            return leader[id] = id;
+        return it->second == id ? id : it->second = find(it->second);
+    };
+    for (auto& kv : p.coaccess)
+    {
+        size_t reads = std::max(p.region_hits.at(kv.first.first), p.region_hits.at(kv.first.second));
+        if (kv.second >= COACCESS_MIN_READS && kv.second >= COACCESS_FRACTION * reads)
+            leader[find(kv.first.first)] = find(kv.first.second);
+    }
+    int next_id = mask_ids.empty() ? 1 : *mask_ids.rbegin() + 1;
+    std::map<int, int> group_parent;
+    for (auto& kv : leader)
+    {
+        int root = find(kv.first);
+        if (!group_parent.count(root))
+        {
+            if (next_id == 65535) // the id of mixed chunks
+                next_id++;
+            group_parent[root] = next_id++;
+        }
+        children.push_back(kv.first);
+        parents.push_back(group_parent[root]);
+    }
+}
+
+// rows and columns a region spans in the mask, half-open
+struct extent_t
+{
+    int y0 = INT_MAX, y1 = 0, x0 = INT_MAX, x1 = 0;
+};
+
+static std::map<int, extent_t> region_extents(const std::vector<int>& mask, int rows, int cols)
+{
+    std::map<int, extent_t> extents;
+    for (int i = 0; i < rows; i++)
+        for (int j = 0; j < cols; j++)
+        {
+            extent_t& e = extents[mask[(size_t)i * cols + j]];
+            e.y0 = std::min(e.y0, i);
+            e.y1 = std::max(e.y1, i + 1);
+            e.x0 = std::min(e.x0, j);
+            e.x1 = std::max(e.x1, j + 1);
+        }
+    return extents;
+}
+
+// Chunks merged beyond what a read spans make it fetch cells it does not need. Each logged read
+// of `var` spans a fraction of the rows or of the columns, the larger one: the extent of its
+// region, its box, or all of them for a whole-variable read. The merge threshold is the median
+// of these fractions, or 0, the default, if it is 1
+static double merge_threshold(const std::vector<access_t>& log, const var_key_t& var,
+                              const std::map<int, extent_t>& extents, int rows, int cols)
+{
+    std::vector<double> spans;
+    for (auto& a : log)
+    {
+        if (a.file != var.first || a.var != var.second)
+            continue;
+        double span = 1;
+        auto e = extents.find(a.mask_id);
+        if (a.op == "region" && e != extents.end())
+            span = std::max(double(e->second.y1 - e->second.y0) / rows, double(e->second.x1 - e->second.x0) / cols);
+        else if (a.op == "vara" && a.count.size() >= 2)
+            span = std::max(double(a.count[a.count.size() - 2]) / rows, double(a.count.back()) / cols);
+        spans.push_back(std::min(span, 1.0));
+    }
+    if (spans.empty())
+        return 0;
+    std::nth_element(spans.begin(), spans.begin() + spans.size() / 2, spans.end());
+    double median = spans[spans.size() / 2];
+    return median < 1 ? median : 0;
+}
+
+// reads with the same call as the logged one, returns its time
+static double replay(int ncid, int varid, int xtype, const access_t& a, std::vector<char>& buffer)
+{
+    int status = NC_NOERR;
+    size_t* start = const_cast<size_t*>(a.start.data()), *count = const_cast<size_t*>(a.count.data());
+    auto t1 = high_resolution_clock::now();
+    switch (xtype)
+    {
+        case NC_INT:
+            status = (a.op == "region") ? raster_get_region_int(ncid, varid, a.mask_id, (int*)buffer.data()) :
+                     (a.op == "vara") ? raster_get_vara_int(ncid, varid, start, count, (int*)buffer.data()) :
+                                        raster_get_var_int(ncid, varid, (int*)buffer.data()); break;
+        case NC_FLOAT:
+            status = (a.op == "region") ? raster_get_region_float(ncid, varid, a.mask_id, (float*)buffer.data()) :
+                     (a.op == "vara") ? raster_get_vara_float(ncid, varid, start, count, (float*)buffer.data()) :
+                                        raster_get_var_float(ncid, varid, (float*)buffer.data()); break;
+        case NC_DOUBLE:
+            status = (a.op == "region") ? raster_get_region_double(ncid, varid, a.mask_id, (double*)buffer.data()) :
+                     (a.op == "vara") ? raster_get_vara_double(ncid, varid, start, count, (double*)buffer.data()) :
+                                        raster_get_var_double(ncid, varid, (double*)buffer.data()); break;
+        default:
+            status = (a.op == "region") ? raster_get_region_char(ncid, varid, a.mask_id, buffer.data()) :
+                     (a.op == "vara") ? raster_get_vara_char(ncid, varid, start, count, buffer.data()) :
+                                        raster_get_var_char(ncid, varid, buffer.data()); break;
+    }
+    auto t2 = high_resolution_clock::now();
+    ERR;
+    return duration_cast<microseconds>(t2 - t1).count() / 1000000.0;
+}
+
+static size_t xtype_size(int xtype)
+{
+    return (xtype == NC_DOUBLE) ? 8 : (xtype == NC_CHAR) ? 1 : 4;
+}
+
+// Rewrites a RASTER file for the reads of it recorded in an access log, reads of other files are
+// left out: regions serving most region reads are stored uncompressed, regions never read get the
+// strongest codec, chunks are merged no wider than most logged reads span, and variables mostly
+// read by region are packed into one dataset per region. Regions often read one after the other
+// become children of one parent region, and the layout is built at the parent level, so that they
+// share chunks; each is still read on its own. The logged reads are then replayed on both files,
+// with a chunk cache for the chunks shared by consecutive reads.
+int main(int argc, char **argv)
+{
+    MPI_Init(&argc, &argv);
+    if(argc <= 5)
+    {
+        std::cerr << "Usage: ./relayout <ACCESS_LOG> <INPUT_RASTER> <MASK_NETCDF> <MASKNAME> <OUTPUT_RASTER>\n";
+        std::cerr << " It rewrites INPUT_RASTER to OUTPUT_RASTER according to the reads recorded in ACCESS_LOG\n";
+        return 1;
+    };
+    std::string logfile = argv[1], infile = argv[2], maskfile = argv[3], mask = argv[4], outfile = argv[5];
+    int status, mask_ncid, in_ncid, ncid, varid, ndims, vartype, dimids[5];
+    size_t dimlens[5];
+
+    raster_set_access_log(NULL); // the replay below must not extend the log
+    std::vector<access_t> log = read_access_log(logfile);
+    std::map<var_key_t, var_profile_t> profiles = profile(log);
+    std::string in_file = file_key(infile);
+    size_t nreads = std::count_if(log.begin(), log.end(), [&](const access_t& a){ return a.file == in_file; });
+    printf("Access log: %ld reads of %ld variables, %ld of them of %s\n", log.size(), profiles.size(), nreads,
+           infile.c_str());
+
+    // read mask
+    status = nc_open(maskfile.c_str(), NC_NETCDF4 | NC_NOWRITE, &mask_ncid); ERR;
+    status = nc_inq_varid(mask_ncid, mask.c_str(), &varid); ERR;
+    status = nc_inq_varndims(mask_ncid, varid, &ndims); ERR;
+    status = nc_inq_vardimid(mask_ncid, varid, dimids); ERR;
+    status = nc_inq_vartype(mask_ncid, varid, &vartype); ERR;
+    for (int i = 0; i < ndims; i++)
+        status = nc_inq_dimlen(mask_ncid, dimids[i], &dimlens[i]);
+    size_t masksize = std::accumulate(&dimlens[0], &dimlens[ndims], 1, [](size_t a, size_t b){ return a * b; });
+    std::vector<int> maskbuffer(masksize);
+    status = nc_get_var(mask_ncid, varid, maskbuffer.data()); ERR;
+    if (vartype == NC_FLOAT)
+    {
+        for (size_t i = 0; i < masksize; i++)
+            maskbuffer[i] = int(*((float*)(&maskbuffer[i])));
+    }
+    status = raster_close(mask_ncid); ERR;
+    std::set<int> mask_ids(maskbuffer.begin(), maskbuffer.end());
+    int mask_rows = dimlens[ndims - 2], mask_cols = dimlens[ndims - 1];
+    std::map<int, extent_t> extents = region_extents(maskbuffer, mask_rows, mask_cols);
+
+    // copy dimensions
+    int ndimids, ngrps;
+    char name[NC_MAX_NAME + 1];
+    status = nc_open(infile.c_str(), NC_NETCDF4 | NC_NOWRITE, &in_ncid); ERR;
+    status = nc_create(outfile.c_str(), NC_NETCDF4 | NC_CLOBBER, &ncid); ERR;
+    status = nc_inq_dimids(in_ncid, &ndimids, NULL, 0); ERR;
+    std::vector<int> in_dimids(ndimids);
+    status = nc_inq_dimids(in_ncid, &ndimids, in_dimids.data(), 0); ERR;
+    for (int dimid : in_dimids)
+    {
+        size_t len;
+        int out_dimid;
+        status = nc_inq_dim(in_ncid, dimid, name, &len); ERR;
+        status = nc_def_dim(ncid, name, len, &out_dimid); ERR;
+    }
+
+    // rewrite variables, groups with `_ndims_` are RASTER variables
+    status = nc_inq_grps(in_ncid, &ngrps, NULL); ERR;
+    std::vector<int> grps(ngrps);
+    status = nc_inq_grps(in_ncid, &ngrps, grps.data()); ERR;
+    for (int in_varid : grps)
+    {
+        int xtype, out_varid;
+        if (nc_get_att_int(in_varid, NC_GLOBAL, "_ndims_", &ndims) != NC_NOERR)
+            continue;
+        status = nc_inq_grpname(in_varid, name); ERR;
+        status = nc_get_att_int(in_varid, NC_GLOBAL, "_xtype_", &xtype); ERR;
+        status = get_var_dimlens(in_ncid, in_varid, &ndims, dimlens); ERR;
+        status = raster_inq_vardimid(in_ncid, in_varid, dimids); ERR;
+        for (int i = 0; i < ndims; i++)
+        {
+            char dimname[NC_MAX_NAME + 1];
+            status = nc_inq_dimname(in_ncid, dimids[i], dimname); ERR;
+            status = nc_inq_dimid(ncid, dimname, &dimids[i]); ERR;
+        }
+        size_t bufsize = std::accumulate(&dimlens[0], &dimlens[ndims], 1, [](size_t a, size_t b){ return a * b; });
+        std::vector<char> buffer(bufsize * xtype_size(xtype));
+        var_key_t key(in_file, name);
+        var_profile_t& p = profiles[key];
+
+        raster_chunking_t options = {CHUNKSIZE_NX, CHUNKSIZE_NY, 0, 0, 0};
+        bool by_region = p.region_reads > p.var_reads;
+        options.merge_threshold = merge_threshold(log, key, extents, mask_rows, mask_cols);
+        std::vector<int> children, parents;
+        coaccess_links(p, mask_ids, children, parents);
+        status = raster_def_var(ncid, name, xtype, ndims, dimids, &out_varid); ERR;
+        if (children.empty())
+        {
+            status = raster_def_var_chunking_ext(ncid, out_varid, maskbuffer.data(), &options); ERR;
+        }
+        else
+        {
+            status = raster_def_var_chunking_hier_ext(ncid, out_varid, maskbuffer.data(), children.size(), children.data(),
+                                                      parents.data(), 1, &options); ERR;
+        }
+        if (by_region)
+        {
+            status = raster_def_var_storage(ncid, out_varid, RASTER_STORAGE_PACKED); ERR;
+        }
+
+        // hot regions serve `HOT_FRACTION` of region reads, cold ones are never read
+        std::vector<std::pair<size_t, int> > hits;
+        for (auto& kv : p.region_hits)
+            hits.push_back({kv.second, kv.first});
+        std::sort(hits.rbegin(), hits.rend());
+        std::set<int> hot;
+        size_t served = 0;
+        for (auto& h : hits)
+        {
+            if (served >= HOT_FRACTION * p.region_reads)
+                break;
+            hot.insert(h.second);
+            served += h.first;
+        }
+        size_t ncold = 0;
+        for (int id : mask_ids)
+        {
+            int policy = hot.count(id) ? RASTER_CODEC_NONE : (p.region_hits.count(id) || p.var_reads) ? RASTER_CODEC_AUTO : RASTER_CODEC_MAX;
+            ncold += (policy == RASTER_CODEC_MAX);
+            status = raster_def_region_codec(ncid, out_varid, id, policy); ERR;
+        }
+        // the chunks of a parent region are read for any of its children
+        std::map<int, int> parent_policy;
+        for (size_t i = 0; i < children.size(); i++)
+        {
+            int policy = hot.count(children[i]) ? RASTER_CODEC_NONE : RASTER_CODEC_AUTO;
+            auto it = parent_policy.insert({parents[i], policy}).first;
+            if (policy == RASTER_CODEC_NONE)
+                it->second = policy;
+        }
+        for (auto& kv : parent_policy)
+        {
+            status = raster_def_region_codec(ncid, out_varid, kv.first, kv.second); ERR;
+        }
+        if (p.region_reads > 0) // mixed chunks (region 65535) are read along with every region
+        {
+            status = raster_def_region_codec(ncid, out_varid, 65535, RASTER_CODEC_NONE); ERR;
+        }
+        printf("%s: %ld region reads, %ld variable reads, %ld hot regions, %ld cold regions, merge threshold %g%s\n", name,
+               p.region_reads, p.var_reads, hot.size(), ncold, options.merge_threshold == 0 ? 1 : options.merge_threshold,
+               by_region ? ", packed" : "");
+        for (size_t i = 0; i < children.size(); i++)
+            printf("  region %d shares the chunks of parent %d\n", children[i], parents[i]);
+
+        switch (xtype)
+        {
+            case NC_INT:
+                status = raster_get_var_int(in_ncid, in_varid, (int*)buffer.data()); ERR;
+                status = raster_put_var_int(ncid, out_varid, (int*)buffer.data()); ERR; break;
+            case NC_FLOAT:
+                status = raster_get_var_float(in_ncid, in_varid, (float*)buffer.data()); ERR;
+                status = raster_put_var_float(ncid, out_varid, (float*)buffer.data()); ERR; break;
+            case NC_DOUBLE:
+                status = raster_get_var_double(in_ncid, in_varid, (double*)buffer.data()); ERR;
+                status = raster_put_var_double(ncid, out_varid, (double*)buffer.data()); ERR; break;
+            default:
+                status = raster_get_var_char(in_ncid, in_varid, buffer.data()); ERR;
+                status = raster_put_var_char(ncid, out_varid, buffer.data()); ERR; break;
+        }
+    }
+    status = raster_close(ncid); ERR;
+
+    // replay the workload on both files
+    double before = 0, after = 0;
+    status = raster_set_chunk_cache(REPLAY_CACHE_BYTES, RASTER_CACHE_LRU); ERR;
+    status = nc_open(outfile.c_str(), NC_NETCDF4 | NC_NOWRITE, &ncid); ERR;
+    for (auto& a : log)
+    {
+        int in_var, out_var, xtype;
+        if (a.file != in_file || raster_inq_varid(in_ncid, a.var.c_str(), &in_var) != NC_NOERR)
+            continue;
+        status = raster_inq_varid(ncid, a.var.c_str(), &out_var); ERR;
+        status = nc_get_att_int(in_var, NC_GLOBAL, "_xtype_", &xtype); ERR;
+        status = get_var_dimlens(in_ncid, in_var, &ndims, dimlens); ERR;
+        size_t bufsize = std::accumulate(&dimlens[0], &dimlens[ndims], 1, [](size_t a, size_t b){ return a * b; });
+        std::vector<char> buffer(bufsize * xtype_size(xtype));
+        before += replay(in_ncid, in_var, xtype, a, buffer);
+        after += replay(ncid, out_var, xtype, a, buffer);
+    }
+    printf("Time_Replay_Before=%fs\n", before);
+    printf("Time_Replay_After=%fs\n", after);
+    status = raster_close(ncid); ERR;
+    status = raster_close(in_ncid); ERR;
+
+    MPI_Finalize();
+    return status;
+}
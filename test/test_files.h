@@ -0,0 +1,55 @@
+#ifndef __TEST_FILES_H__
+#define __TEST_FILES_H__
+#include <string>
+#include <vector>
+#include <netcdf.h>
+#include "../raster.h"
+
+// Small files the drivers of test/ write for themselves: one float variable `v` shaped
+// (m_nt, m_ny, m_nx), chunked by a mask of `m_nregions` regions in blocks of `m_region_rows` x
+// `m_region_cols` cells, numbered `m_row_blocks` per row of blocks. A file shifts the blocks by some
+// columns, so that files differ in layout
+struct test_grid_t
+{
+    int     m_nt, m_ny, m_nx;
+    int     m_region_rows, m_region_cols, m_row_blocks, m_nregions;
+    size_t  m_period;       // values repeat every `m_period` cells, 0 for never
+};
+
+inline int test_region_of(const test_grid_t& grid, int i, int j, int shift)
+{
+    return 1 + ((i / grid.m_region_rows) * grid.m_row_blocks + (j + shift) / grid.m_region_cols) % grid.m_nregions;
+}
+
+// the value written to cell `k` of `v`, in row-major order
+inline float test_value_of(const test_grid_t& grid, float base, size_t k)
+{
+    return base + (grid.m_period ? k % grid.m_period : k);
+}
+
+inline int write_test_file(const std::string& path, const test_grid_t& grid, int shift, float base)
+{
+    int status, ncid, varid, dimids[3];
+    std::vector<int> mask((size_t)grid.m_ny * grid.m_nx);
+    std::vector<float> data((size_t)grid.m_nt * grid.m_ny * grid.m_nx);
+    for (int i = 0; i < grid.m_ny; i++)
+        for (int j = 0; j < grid.m_nx; j++)
+            mask[(size_t)i * grid.m_nx + j] = test_region_of(grid, i, j, shift);
+    for (size_t k = 0; k < data.size(); k++)
+        data[k] = test_value_of(grid, base, k);
+    if ((status = nc_create(path.c_str(), NC_NETCDF4 | NC_CLOBBER, &ncid)) != NC_NOERR)
+        return status;
+    if ((status = nc_def_dim(ncid, "t", grid.m_nt, &dimids[0])) != NC_NOERR ||
+        (status = nc_def_dim(ncid, "y", grid.m_ny, &dimids[1])) != NC_NOERR ||
+        (status = nc_def_dim(ncid, "x", grid.m_nx, &dimids[2])) != NC_NOERR ||
+        (status = raster_def_var(ncid, "v", NC_FLOAT, 3, dimids, &varid)) != NC_NOERR ||
+        (status = raster_def_var_chunking(ncid, varid, mask.data())) != NC_NOERR ||
+        (status = raster_put_var_float(ncid, varid, data.data())) != NC_NOERR)
+    {
+        raster_close(ncid);
+        return status;
+    }
+    return raster_close(ncid);
+}
+
+#endif // __TEST_FILES_H__
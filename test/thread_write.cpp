@@ -0,0 +1,179 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <cmath>
+#include <omp.h>
+#include <netcdf.h>
+#include <mpi.h>
+#include "../raster.h"
+#include "test_files.h"
+#define ERR do{if (status != NC_NOERR){ fprintf(stderr, "Error: at line %d, %s\n", __LINE__, nc_strerror(status)); exit(status);} } while(0);
+#define CHECK(cond, what) do{if (!(cond)){ fprintf(stderr, "Failed: %s\n", what); exit(1);} } while(0);
+
+// Checks that a variable written on one OpenMP thread and on several is stored byte for byte the
+// same: every group, attribute and variable of the file, chunk blobs included, in chunked and packed
+// storage, with the codec of every region fixed by `raster_def_region_codec` as the zip level
+// detector samples chunks
+static const test_grid_t GRID = {4, 150, 200, 25, 40, 5, 9, 0};
+static const int MIXED_ID = 65535;
+
+static void write_file(const std::string& path, int nthreads, int storage, int policy, const std::vector<float>& data)
+{
+    int status, ncid, varid, dimids[3];
+    std::vector<int> mask(GRID.m_ny * GRID.m_nx);
+    for (int i = 0; i < GRID.m_ny; i++)
+        for (int j = 0; j < GRID.m_nx; j++)
+            mask[i * GRID.m_nx + j] = test_region_of(GRID, i, j, 0);
+    status = nc_create(path.c_str(), NC_NETCDF4 | NC_CLOBBER, &ncid); ERR;
+    status = nc_def_dim(ncid, "t", GRID.m_nt, &dimids[0]); ERR;
+    status = nc_def_dim(ncid, "y", GRID.m_ny, &dimids[1]); ERR;
+    status = nc_def_dim(ncid, "x", GRID.m_nx, &dimids[2]); ERR;
+    status = raster_def_var(ncid, "v", NC_FLOAT, 3, dimids, &varid); ERR;
+    status = raster_def_var_chunking(ncid, varid, mask.data()); ERR;
+    status = raster_def_var_storage(ncid, varid, storage); ERR;
+    for (int m = 1; m <= GRID.m_nregions; m++)
+    {
+        status = raster_def_region_codec(ncid, varid, m, policy); ERR;
+    }
+    status = raster_def_region_codec(ncid, varid, MIXED_ID, policy); ERR;
+    omp_set_num_threads(nthreads);
+    status = raster_put_var_float(ncid, varid, const_cast<float*>(data.data())); ERR;
+    status = raster_close(ncid); ERR;
+}
+
+static size_t type_size(int grp_id, nc_type xtype)
+{
+    size_t size;
+    int status = nc_inq_type(grp_id, xtype, NULL, &size); ERR;
+    return size;
+}
+
+// the child groups of `grp_id` by name
+static std::map<std::string, int> child_groups(int grp_id)
+{
+    int status, ngrps;
+    char name[NC_MAX_NAME + 1];
+    status = nc_inq_grps(grp_id, &ngrps, NULL); ERR;
+    std::vector<int> ids(ngrps);
+    status = nc_inq_grps(grp_id, &ngrps, ids.data()); ERR;
+    std::map<std::string, int> children;
+    for (int id : ids)
+    {
+        status = nc_inq_grpname(id, name); ERR;
+        children[name] = id;
+    }
+    return children;
+}
+
+// compares the attributes, variables and child groups of `a` and `b`, returns the bytes compared
+static size_t compare_groups(int a, int b, const std::string& where)
+{
+    int status, natts_a, natts_b, nvars_a, nvars_b;
+    char name[NC_MAX_NAME + 1];
+    size_t compared = 0;
+    status = nc_inq_natts(a, &natts_a); ERR;
+    status = nc_inq_natts(b, &natts_b); ERR;
+    CHECK(natts_a == natts_b, ("attribute count of " + where).c_str());
+    for (int k = 0; k < natts_a; k++)
+    {
+        nc_type type_a, type_b;
+        size_t len_a, len_b;
+        status = nc_inq_attname(a, NC_GLOBAL, k, name); ERR;
+        status = nc_inq_att(a, NC_GLOBAL, name, &type_a, &len_a); ERR;
+        status = nc_inq_att(b, NC_GLOBAL, name, &type_b, &len_b);
+        CHECK(status == NC_NOERR && type_a == type_b && len_a == len_b, ("attribute " + where + "/" + name).c_str());
+        if (type_a == NC_STRING)
+            continue;
+        std::vector<unsigned char> va(len_a * type_size(a, type_a)), vb(va.size());
+        status = nc_get_att(a, NC_GLOBAL, name, va.data()); ERR;
+        status = nc_get_att(b, NC_GLOBAL, name, vb.data()); ERR;
+        CHECK(va == vb, ("attribute " + where + "/" + name).c_str());
+        compared += va.size();
+    }
+
+    status = nc_inq_nvars(a, &nvars_a); ERR;
+    status = nc_inq_nvars(b, &nvars_b); ERR;
+    CHECK(nvars_a == nvars_b, ("variable count of " + where).c_str());
+    for (int v = 0; v < nvars_a; v++)
+    {
+        int vb, ndims_a, ndims_b, dimids_a[NC_MAX_VAR_DIMS], dimids_b[NC_MAX_VAR_DIMS];
+        nc_type type_a, type_b;
+        status = nc_inq_varname(a, v, name); ERR;
+        status = nc_inq_varid(b, name, &vb);
+        CHECK(status == NC_NOERR, ("variable " + where + "/" + name).c_str());
+        status = nc_inq_vartype(a, v, &type_a); ERR;
+        status = nc_inq_vartype(b, vb, &type_b); ERR;
+        status = nc_inq_varndims(a, v, &ndims_a); ERR;
+        status = nc_inq_varndims(b, vb, &ndims_b); ERR;
+        CHECK(type_a == type_b && ndims_a == ndims_b, ("variable " + where + "/" + name).c_str());
+        status = nc_inq_vardimid(a, v, dimids_a); ERR;
+        status = nc_inq_vardimid(b, vb, dimids_b); ERR;
+        size_t nbytes = type_size(a, type_a);
+        for (int d = 0; d < ndims_a; d++)
+        {
+            size_t len_a, len_b;
+            status = nc_inq_dimlen(a, dimids_a[d], &len_a); ERR;
+            status = nc_inq_dimlen(b, dimids_b[d], &len_b); ERR;
+            CHECK(len_a == len_b, ("shape of " + where + "/" + name).c_str());
+            nbytes *= len_a;
+        }
+        std::vector<unsigned char> va(nbytes), vb_data(nbytes);
+        status = nc_get_var(a, v, va.data()); ERR;
+        status = nc_get_var(b, vb, vb_data.data()); ERR;
+        CHECK(va == vb_data, ("bytes of " + where + "/" + name).c_str());
+        compared += nbytes;
+    }
+
+    std::map<std::string, int> children_a = child_groups(a), children_b = child_groups(b);
+    CHECK(children_a.size() == children_b.size(), ("groups of " + where).c_str());
+    for (auto& child : children_a)
+    {
+        auto other = children_b.find(child.first);
+        CHECK(other != children_b.end(), ("group " + where + "/" + child.first).c_str());
+        compared += compare_groups(child.second, other->second, where + "/" + child.first);
+    }
+    return compared;
+}
+
+int main(int argc, char **argv)
+{
+    MPI_Init(&argc, &argv);
+    if(argc <= 1)
+    {
+        std::cerr << "Usage: ./thread_write <OUTPUT_PREFIX> [<NTHREADS>]\n";
+        std::cerr << " It writes one variable with 1 and NTHREADS OpenMP threads, default at least 4, and compares the files\n";
+        return 1;
+    };
+    std::string prefix = argv[1];
+    int nthreads = (argc > 2) ? atoi(argv[2]) : std::max(4, omp_get_max_threads());
+    int status;
+    std::vector<float> data((size_t)GRID.m_nt * GRID.m_ny * GRID.m_nx);
+    for (size_t k = 0; k < data.size(); k++)
+        data[k] = std::round(std::sin(k * 0.0007f) * 1000) / 100;
+
+    for (int storage : {RASTER_STORAGE_CHUNKED, RASTER_STORAGE_PACKED})
+        for (int policy : {RASTER_CODEC_NONE, RASTER_CODEC_MAX})
+        {
+            std::string name = prefix + "_" + std::to_string(storage) + "_" + std::to_string(policy);
+            write_file(name + "_1.nc", 1, storage, policy, data);
+            write_file(name + "_n.nc", nthreads, storage, policy, data);
+
+            int ncid_1, ncid_n, varid_1, varid_n;
+            status = nc_open((name + "_1.nc").c_str(), NC_NOWRITE, &ncid_1); ERR;
+            status = nc_open((name + "_n.nc").c_str(), NC_NOWRITE, &ncid_n); ERR;
+            status = raster_inq_varid(ncid_1, "v", &varid_1); ERR;
+            status = raster_inq_varid(ncid_n, "v", &varid_n); ERR;
+            size_t compared = compare_groups(ncid_1, ncid_n, "");
+            std::vector<float> out(data.size(), -1);
+            status = raster_get_var_float(ncid_n, varid_n, out.data()); ERR;
+            CHECK(out == data, "variable written on several threads reads back differently");
+            status = raster_close(ncid_1); ERR;
+            status = raster_close(ncid_n); ERR;
+            printf("storage %d, codec policy %d: %zu bytes equal on 1 and %d threads\n", storage, policy, compared, nthreads);
+        }
+    printf("thread write: OK\n");
+
+    MPI_Finalize();
+    return 0;
+}